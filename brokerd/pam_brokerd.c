@@ -0,0 +1,230 @@
+/*
+ * pam_brokerd: run the PAM transactions of short lived programs
+ *
+ * The stacks of the services are parsed and their modules loaded once,
+ * at startup and again on SIGHUP.  Every connection is served by a
+ * child process that takes the credentials of the peer, see
+ * pam_broker_serve(3), so it starts with everything loaded and does not
+ * share any state with other transactions.
+ */
+
+#include "config.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <security/pam_appl.h>
+#include <security/pam_ext.h>
+
+#define MAX_UIDS 64
+
+static volatile sig_atomic_t reload;
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr,
+		"Usage: %s [-s socket] [-u uid]... [service...]\n", progname);
+}
+
+static void
+hangup(int sig)
+{
+	(void) sig;
+	reload = 1;
+}
+
+static void
+preload(const char *service)
+{
+	int retval = pam_stack_cache_preload(service, NULL);
+
+	if (retval != PAM_SUCCESS)
+		syslog(LOG_WARNING, "cannot load service %s: %s",
+		       service, pam_strerror(NULL, retval));
+}
+
+/* Load the given services, or all of /etc/pam.d */
+static void
+preload_services(char **services, int n)
+{
+	struct dirent *d;
+	DIR *dir;
+	int i;
+
+	pam_stack_cache_flush();
+
+	if (n > 0) {
+		for (i = 0; i < n; i++)
+			preload(services[i]);
+		return;
+	}
+
+	if ((dir = opendir("/etc/pam.d")) == NULL) {
+		syslog(LOG_ERR, "cannot open /etc/pam.d: %m");
+		return;
+	}
+	while ((d = readdir(dir)) != NULL) {
+		if (d->d_name[0] == '.' || d->d_type == DT_DIR)
+			continue;
+		preload(d->d_name);
+	}
+	closedir(dir);
+}
+
+static int
+listen_on(const char *path)
+{
+	struct sockaddr_un sa;
+	int fd;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		fprintf(stderr, "pam_brokerd: socket path too long: %s\n",
+			path);
+		return -1;
+	}
+	strcpy(sa.sun_path, path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+		perror("pam_brokerd: socket");
+		return -1;
+	}
+	if (unlink(path) != 0 && errno != ENOENT) {
+		fprintf(stderr, "pam_brokerd: cannot remove %s: %s\n",
+			path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	/* the peers are checked when they connect */
+	if (bind(fd, (struct sockaddr *) &sa, sizeof(sa)) != 0
+	    || chmod(path, 0666) != 0 || listen(fd, SOMAXCONN) != 0) {
+		fprintf(stderr, "pam_brokerd: cannot listen on %s: %s\n",
+			path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int
+allowed(int fd, const uid_t *uids, int nuids)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	int i;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+		return 0;
+	if (cred.uid == 0)
+		return 1;
+	for (i = 0; i < nuids; i++) {
+		if (uids[i] == cred.uid)
+			return 1;
+	}
+	syslog(LOG_NOTICE, "refusing process %ld of uid %ld",
+	       (long) cred.pid, (long) cred.uid);
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *path = PAM_BROKER_SOCKET;
+	uid_t uids[MAX_UIDS];
+	int nuids = 0, opt, lfd, fd;
+	struct sigaction sa;
+	unsigned long uid;
+	char *end;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "s:u:h")) != -1) {
+		switch (opt) {
+		case 's':
+			path = optarg;
+			break;
+		case 'u':
+			if (nuids == MAX_UIDS) {
+				fprintf(stderr, "pam_brokerd: at most %d uids\n",
+					MAX_UIDS);
+				return 1;
+			}
+			errno = 0;
+			uid = strtoul(optarg, &end, 10);
+			if (*optarg < '0' || *optarg > '9' || *end != '\0'
+			    || errno != 0 || uid != (uid_t) uid
+			    || (uid_t) uid == (uid_t) -1) {
+				usage(argv[0]);
+				return 1;
+			}
+			uids[nuids++] = uid;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	openlog("pam_brokerd", LOG_PID, LOG_AUTHPRIV);
+
+	pam_stack_cache_enable(1);
+	preload_services(argv + optind, argc - optind);
+
+	if ((lfd = listen_on(path)) < 0)
+		return 1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_IGN;
+	sa.sa_flags = SA_NOCLDWAIT;
+	sigaction(SIGCHLD, &sa, NULL);
+	sa.sa_handler = hangup;
+	sa.sa_flags = 0;
+	sigaction(SIGHUP, &sa, NULL);
+
+	for (;;) {
+		if (reload) {
+			reload = 0;
+			syslog(LOG_INFO, "loading the services again");
+			preload_services(argv + optind, argc - optind);
+		}
+
+		if ((fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+			if (errno != EINTR && errno != ECONNABORTED)
+				syslog(LOG_ERR, "accept: %m");
+			continue;
+		}
+
+		if (!allowed(fd, uids, nuids)) {
+			close(fd);
+			continue;
+		}
+
+		if ((pid = fork()) == 0) {
+			/* the modules wait for their own children */
+			memset(&sa, 0, sizeof(sa));
+			sa.sa_handler = SIG_DFL;
+			sigaction(SIGCHLD, &sa, NULL);
+			sigaction(SIGHUP, &sa, NULL);
+			close(lfd);
+			exit(pam_broker_serve(fd) == PAM_SUCCESS ? 0 : 1);
+		}
+		if (pid < 0)
+			syslog(LOG_ERR, "fork: %m");
+		close(fd);
+	}
+}
@@ -0,0 +1,64 @@
+/*
+ * pam_conf_compile: write the compiled image of a pam.d directory
+ *
+ * libpam takes the configuration of a service from the image as long
+ * as none of the files it was compiled from has changed, so this only
+ * needs to be run again to get the speed back after an edit.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <security/pam_appl.h>
+#include <security/pam_ext.h>
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [-d confdir]\n", progname);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *confdir = NULL;
+	int opt, retval;
+
+	while ((opt = getopt(argc, argv, "d:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			confdir = optarg;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	retval = pam_conf_image_write(confdir);
+	if (retval == PAM_SYSTEM_ERR) {
+		fprintf(stderr, "%s: cannot write the image of %s: %s\n",
+			argv[0], confdir ? confdir : "/etc/pam.d",
+			strerror(errno));
+		return 1;
+	}
+	if (retval != PAM_SUCCESS) {
+		fprintf(stderr, "%s: %s\n", argv[0],
+			pam_strerror(NULL, retval));
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,50 @@
+/*
+ * Static probe points for perf, bpftrace and systemtap.
+ *
+ * They are compiled in with --enable-usdt only.  A probe nobody is
+ * attached to costs a nop instruction, its arguments are values at
+ * hand anyway.  The provider is "libpam" for the library and the module
+ * name for the modules:
+ *
+ *   libpam:dispatch__entry   (service, function, flags)
+ *   libpam:dispatch__return  (service, function, retval)
+ *   libpam:module__entry     (service, function, module)
+ *   libpam:module__return    (service, function, module, retval)
+ *   libpam:conv__entry       (number of messages, style of the first)
+ *   libpam:conv__return      (retval)
+ *   libpam:config__entry     (service)
+ *   libpam:config__return    (service, retval)
+ *   pam_unix:helper__fork    (helper)
+ *   pam_unix:helper__exec    (helper), once it has been started
+ *   pam_unix:helper__wait    (helper, pid, wait status)
+ *
+ * "function" is 1 for authenticate, 2 setcred, 3 acct_mgmt,
+ * 4 open_session, 5 close_session and 6 chauthtok.
+ */
+
+#ifndef PAM_PROBES_H
+#define PAM_PROBES_H
+
+#ifdef ENABLE_USDT
+
+# include <sys/sdt.h>
+
+# define PAM_PROBE1(provider, name, a1) \
+	DTRACE_PROBE1(provider, name, a1)
+# define PAM_PROBE2(provider, name, a1, a2) \
+	DTRACE_PROBE2(provider, name, a1, a2)
+# define PAM_PROBE3(provider, name, a1, a2, a3) \
+	DTRACE_PROBE3(provider, name, a1, a2, a3)
+# define PAM_PROBE4(provider, name, a1, a2, a3, a4) \
+	DTRACE_PROBE4(provider, name, a1, a2, a3, a4)
+
+#else
+
+# define PAM_PROBE1(provider, name, a1)			do { } while (0)
+# define PAM_PROBE2(provider, name, a1, a2)		do { } while (0)
+# define PAM_PROBE3(provider, name, a1, a2, a3)		do { } while (0)
+# define PAM_PROBE4(provider, name, a1, a2, a3, a4)	do { } while (0)
+
+#endif /* ENABLE_USDT */
+
+#endif /* PAM_PROBES_H */
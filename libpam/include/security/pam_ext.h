@@ -58,6 +58,9 @@ pam_vsyslog (const pam_handle_t *pamh, int priority,
 extern void PAM_FORMAT((printf, 3, 4)) PAM_NONNULL((3))
 pam_syslog (const pam_handle_t *pamh, int priority, const char *fmt, ...);
 
+extern int
+pam_syslog_async (int enable);
+
 extern int PAM_FORMAT((printf, 4, 0)) PAM_NONNULL((1,4))
 pam_vprompt (pam_handle_t *pamh, int style, char **response,
 	     const char *fmt, va_list args);
@@ -84,6 +87,105 @@ extern int PAM_NONNULL((1,2))
 pam_get_authtok_verify (pam_handle_t *pamh, const char **authtok,
 			const char *prompt);
 
+extern int PAM_NONNULL((1))
+pam_reset (pam_handle_t *pamh, const char *user, int pam_status);
+
+extern int PAM_NONNULL((1,3,4))
+pam_authenticate_start (pam_handle_t *pamh, int flags, int *num_msg,
+			const struct pam_message ***msg);
+
+extern int PAM_NONNULL((1,3,4))
+pam_authenticate_continue (pam_handle_t *pamh, struct pam_response *resp,
+			   int *num_msg, const struct pam_message ***msg);
+
+struct timespec;
+
+extern int PAM_NONNULL((1))
+pam_fail_delay_defer (pam_handle_t *pamh, int defer);
+
+extern int PAM_NONNULL((1,2))
+pam_fail_delay_deadline (const pam_handle_t *pamh, struct timespec *deadline);
+
+#define PAM_STACK_CACHE_SHARED 2   /* handles share the cached handlers */
+
+extern int
+pam_stack_cache_enable (int enable);
+
+extern void
+pam_stack_cache_flush (void);
+
+extern int
+pam_stack_cache_reload (void);
+
+extern int PAM_NONNULL((1))
+pam_stack_cache_preload (const char *service, const char *confdir);
+
+struct pam_nss_cache_stats {
+	unsigned long entries;       /* entries in the cache now */
+	unsigned long hits;          /* entries found */
+	unsigned long negative_hits; /* names found to be unknown */
+	unsigned long misses;        /* lookups passed on to NSS */
+	unsigned long expired;       /* entries dropped after their TTL */
+	unsigned long evicted;       /* entries dropped to make room */
+	unsigned long invalidated;   /* entries dropped after a file changed */
+};
+
+extern int
+pam_nss_cache_enable (unsigned int max_entries, unsigned int ttl,
+		      unsigned int negative_ttl);
+
+extern void
+pam_nss_cache_flush (void);
+
+extern int
+pam_nss_cache_stats (struct pam_nss_cache_stats *stats);
+
+#define PAM_MODULE_STATS_BUCKETS 24
+
+struct pam_module_stats {
+	const char *service;         /* PAM_SERVICE of the handle */
+	const char *function;        /* "authenticate", "acct_mgmt", ... */
+	const char *module;          /* file name without ".so" */
+	unsigned long calls;
+	unsigned long long total_usec;
+	unsigned long long max_usec;
+	/* calls that took less than 1 usec, 1-2 usec, 2-4 usec, ...,
+	   the last one counts all longer calls */
+	unsigned long histogram[PAM_MODULE_STATS_BUCKETS];
+	unsigned long retval[_PAM_RETURN_VALUES];   /* calls by result */
+};
+
+extern int
+pam_module_stats_enable (int enable);
+
+extern void
+pam_module_stats_reset (void);
+
+extern int PAM_NONNULL((1))
+pam_module_stats_walk (int (*fn)(const struct pam_module_stats *stats,
+				 void *arg),
+		       void *arg);
+
+extern int
+pam_module_stats_dump (const char *path, unsigned int interval);
+
+#define PAM_AUDIT_REUSE_FD  0x1   /* one audit socket for the process */
+#define PAM_AUDIT_COALESCE  0x2   /* write the events of a call together */
+
+extern int
+pam_audit_mode (int flags);
+
+extern int
+pam_conf_image_write (const char *confdir);
+
+#define PAM_BROKER_SOCKET "/run/pam_broker.socket"
+
+extern int
+pam_broker_enable (int enable, const char *path);
+
+extern int
+pam_broker_serve (int fd);
+
 #ifdef __cplusplus
 }
 #endif
@@ -8,6 +8,9 @@
  *
  * A number of these functions reserve space in a pam_[sg]et_data item.
  * In all cases, the name of the item is prefixed with "pam_modutil_*".
+ * The passwd, group and shadow entries returned by pam_modutil_get*()
+ * belong to the PAM handle and are shared by all modules asking for the
+ * same entry; they must not be modified and are freed by pam_end().
  *
  * On systems that simply can't support thread safe programming, these
  * functions don't support it either - sorry.
@@ -147,6 +150,33 @@ pam_modutil_sanitize_helper_fds(pam_handle_t *pamh,
 				enum pam_modutil_redirect_fd redirect_stdout,
 				enum pam_modutil_redirect_fd redirect_stderr);
 
+/* how pam_modutil_spawn_helper() sets up the helper */
+struct pam_modutil_spawn_attr {
+	int stdfd[3];		/* to become stdin, stdout, stderr, or -1 */
+	enum pam_modutil_redirect_fd redirect[3];	/* for those that are -1 */
+	unsigned int flags;	/* PAM_MODUTIL_SPAWN_* */
+	uid_t uid;		/* with PAM_MODUTIL_SPAWN_IDS */
+	gid_t gid;
+};
+
+#define PAM_MODUTIL_SPAWN_EUID    0x1	/* set the real uid to the effective one */
+#define PAM_MODUTIL_SPAWN_IDS     0x2	/* switch to uid and gid, with no groups */
+#define PAM_MODUTIL_SPAWN_SETSID  0x4	/* start a new session */
+
+/*
+ * run a helper without copying the caller, returns its pid, -1 if no
+ * process could be started, or -2 if it could not run the helper
+ */
+extern pid_t PAM_NONNULL((1,2,3,4,5))
+pam_modutil_spawn_helper(pam_handle_t *pamh, const char *path,
+			 char *const argv[], char *const envp[],
+			 const struct pam_modutil_spawn_attr *attr);
+
+/* find the line of a user in a passwd file, /etc/passwd if file_name is NULL */
+extern int PAM_NONNULL((1,2))
+pam_modutil_search_passwd(pam_handle_t *pamh, const char *user_name,
+			  const char *file_name, char *buf, size_t size);
+
 /* lookup a value for key in login.defs file or similar key value format */
 extern char * PAM_NONNULL((1,2,3))
 pam_modutil_search_key(pam_handle_t *pamh,
@@ -17,6 +17,9 @@ int pam_acct_mgmt(pam_handle_t *pamh, int flags)
 	return PAM_SYSTEM_ERR;
     }
 
+    if ((retval = _pam_broker_call(pamh, PAM_ACCOUNT, flags)) != PAM_IGNORE)
+	return retval;
+
     retval = _pam_dispatch(pamh, flags, PAM_ACCOUNT);
 
     return retval;
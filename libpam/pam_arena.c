@@ -0,0 +1,168 @@
+/*
+ * pam_arena.c
+ *
+ * The strings and records of a transaction (items, environment
+ * variables, module data entries) are small and all live until the
+ * transaction ends.  Instead of calling malloc() for each of them, they
+ * are carved out of a few larger chunks owned by the handle, which are
+ * wiped and given back together by pam_end(), or wiped and reused by
+ * pam_reset().
+ *
+ * Memory of a single allocation is only reused if it was the last one
+ * handed out; everything else stays until the transaction ends.  Since
+ * all of it is overwritten then, secrets like PAM_AUTHTOK do not
+ * survive in freed memory even if a caller forgot to wipe them.
+ */
+
+#include "pam_private.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PAM_ARENA_MIN_CHUNK   1024
+#define PAM_ARENA_MAX_CHUNK   16384
+#define PAM_ARENA_ALIGN       (sizeof(void *) > sizeof(double) ? \
+			       sizeof(void *) : sizeof(double))
+
+struct pam_arena_chunk {
+    struct pam_arena_chunk *next;     /* older chunk */
+    size_t size;                      /* bytes in data[] */
+    size_t used;
+    size_t last;                      /* offset of the last allocation */
+    union {
+	void *p;
+	double d;
+    } data[];
+};
+
+static void _pam_arena_wipe(struct pam_arena_chunk *chunk)
+{
+    /* the compiler must not drop this because the memory is freed */
+    volatile unsigned char *p = (volatile unsigned char *) chunk->data;
+    size_t i;
+
+    for (i = 0; i < chunk->used; i++)
+	p[i] = 0;
+    chunk->used = chunk->last = 0;
+}
+
+static int _pam_arena_owns(const struct pam_arena_chunk *chunk,
+			   const void *p)
+{
+    uintptr_t u = (uintptr_t) p, base = (uintptr_t) chunk->data;
+
+    return u >= base && u < base + chunk->size;
+}
+
+void *_pam_arena_alloc(pam_handle_t *pamh, size_t size)
+{
+    struct pam_arena *arena = &pamh->arena;
+    struct pam_arena_chunk *chunk = arena->chunk;
+    size_t want, offset;
+
+    size = (size + PAM_ARENA_ALIGN - 1) & ~(PAM_ARENA_ALIGN - 1);
+    if (size == 0)
+	size = PAM_ARENA_ALIGN;
+
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+	want = chunk ? chunk->size * 2 : PAM_ARENA_MIN_CHUNK;
+	if (want > PAM_ARENA_MAX_CHUNK)
+	    want = PAM_ARENA_MAX_CHUNK;
+	if (want < size)
+	    want = size;
+	if ((chunk = malloc(sizeof(*chunk) + want)) == NULL) {
+	    pam_syslog(pamh, LOG_CRIT, "_pam_arena_alloc: out of memory");
+	    return NULL;
+	}
+	chunk->size = want;
+	chunk->used = chunk->last = 0;
+	chunk->next = arena->chunk;
+	arena->chunk = chunk;
+    }
+
+    offset = chunk->used;
+    chunk->last = offset;
+    chunk->used += size;
+
+    return (char *) chunk->data + offset;
+}
+
+char *_pam_arena_strdup(pam_handle_t *pamh, const char *s)
+{
+    char *new;
+    size_t len;
+
+    if (s == NULL)
+	return NULL;
+
+    len = strlen(s) + 1;
+    if ((new = _pam_arena_alloc(pamh, len)) != NULL)
+	memcpy(new, s, len);
+
+    return new;
+}
+
+char *_pam_arena_memdup(pam_handle_t *pamh, const char *s, int len)
+{
+    char *new;
+
+    if (s == NULL || len <= 0)
+	return NULL;
+
+    if ((new = _pam_arena_alloc(pamh, len)) != NULL)
+	memcpy(new, s, len);
+
+    return new;
+}
+
+void _pam_arena_free(pam_handle_t *pamh, void *p)
+{
+    struct pam_arena_chunk *chunk;
+
+    if (p == NULL)
+	return;
+
+    for (chunk = pamh->arena.chunk; chunk != NULL; chunk = chunk->next) {
+	if (_pam_arena_owns(chunk, p)) {
+	    /* the most recent allocation can be handed out again */
+	    if ((char *) p == (char *) chunk->data + chunk->last
+		&& chunk == pamh->arena.chunk) {
+		memset(p, 0, chunk->used - chunk->last);
+		chunk->used = chunk->last;
+	    }
+	    return;
+	}
+    }
+
+    free(p);
+}
+
+void _pam_arena_clear(pam_handle_t *pamh)
+{
+    struct pam_arena *arena = &pamh->arena;
+    struct pam_arena_chunk *chunk, *next;
+
+    if ((chunk = arena->chunk) == NULL)
+	return;
+
+    /* keep the newest, that is the largest chunk */
+    _pam_arena_wipe(chunk);
+    next = chunk->next;
+    chunk->next = NULL;
+
+    while ((chunk = next) != NULL) {
+	next = chunk->next;
+	_pam_arena_wipe(chunk);
+	free(chunk);
+    }
+}
+
+void _pam_arena_release(pam_handle_t *pamh)
+{
+    _pam_arena_clear(pamh);
+    if (pamh->arena.chunk != NULL) {
+	free(pamh->arena.chunk);
+	pamh->arena.chunk = NULL;
+    }
+}
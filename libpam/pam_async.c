@@ -0,0 +1,227 @@
+/*
+ * pam_async.c -- authentication driven by the application's event loop
+ *
+ * An application that must not block in its conversation function can
+ * already return PAM_CONV_AGAIN from it and call pam_authenticate()
+ * again later: modules that support this return PAM_INCOMPLETE, and
+ * _pam_dispatch() resumes the stack at the module that gave up.  The
+ * functions here do the bookkeeping for it.  While the transaction is
+ * running, the handle uses a conversation function of its own that
+ * keeps the messages a module asks for and returns PAM_CONV_AGAIN.  The
+ * application gets the messages back with PAM_INCOMPLETE, and passes
+ * the answers in when it continues; the module asks again and gets them.
+ */
+
+#include "pam_private.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define PAM_ASYNC_IDLE     0    /* no conversation pending */
+#define PAM_ASYNC_WAITING  1    /* messages handed to the application */
+#define PAM_ASYNC_ANSWERED 2    /* the answers are there */
+
+struct pam_async {
+    struct pam_conv conv;       /* installed while running */
+    struct pam_conv *app_conv;  /* the one of the application */
+    int flags;
+    int state;
+    int num_msg;
+    struct pam_message *msg;    /* copies of the pending messages */
+    const struct pam_message **msgp;
+    char **text;                /* their texts */
+    struct pam_response *resp;  /* answers, owned by the module later */
+};
+
+static void _pam_async_drop_msg(struct pam_async *async)
+{
+    int i;
+
+    for (i = 0; i < async->num_msg; i++) {
+	_pam_overwrite(async->text[i]);
+	_pam_drop(async->text[i]);
+    }
+    _pam_drop(async->msg);
+    _pam_drop(async->msgp);
+    _pam_drop(async->text);
+    async->num_msg = 0;
+}
+
+static void _pam_async_drop_resp(struct pam_async *async, int num_resp)
+{
+    if (async->resp != NULL) {
+	_pam_drop_reply(async->resp, num_resp);
+	async->resp = NULL;
+    }
+}
+
+static int _pam_async_conv(int num_msg, const struct pam_message **msg,
+			   struct pam_response **resp, void *appdata_ptr)
+{
+    pam_handle_t *pamh = appdata_ptr;
+    struct pam_async *async = pamh->async;
+    int i;
+
+    if (async->state == PAM_ASYNC_ANSWERED) {
+	if (num_msg == async->num_msg) {
+	    D(("handing the answers to the module"));
+	    *resp = async->resp;
+	    async->resp = NULL;
+	    _pam_async_drop_msg(async);
+	    async->state = PAM_ASYNC_IDLE;
+	    return PAM_SUCCESS;
+	}
+	/* the module asks something else; the answers do not fit */
+	_pam_async_drop_resp(async, async->num_msg);
+	async->state = PAM_ASYNC_IDLE;
+    }
+
+    if (async->state == PAM_ASYNC_WAITING)
+	return PAM_CONV_AGAIN;
+
+    _pam_async_drop_msg(async);
+    if (num_msg <= 0 || num_msg > PAM_MAX_NUM_MSG)
+	return PAM_CONV_ERR;
+
+    async->msg = calloc(num_msg, sizeof(*async->msg));
+    async->msgp = calloc(num_msg, sizeof(*async->msgp));
+    async->text = calloc(num_msg, sizeof(*async->text));
+    async->num_msg = num_msg;
+    if (async->msg == NULL || async->msgp == NULL || async->text == NULL) {
+	async->num_msg = 0;
+	_pam_async_drop_msg(async);
+	return PAM_BUF_ERR;
+    }
+    for (i = 0; i < num_msg; i++) {
+	if ((async->text[i] = _pam_strdup(msg[i]->msg)) == NULL
+	    && msg[i]->msg != NULL) {
+	    _pam_async_drop_msg(async);
+	    return PAM_BUF_ERR;
+	}
+	async->msg[i].msg_style = msg[i]->msg_style;
+	async->msg[i].msg = async->text[i];
+	async->msgp[i] = &async->msg[i];
+    }
+    async->state = PAM_ASYNC_WAITING;
+
+    D(("deferring %d messages", num_msg));
+    return PAM_CONV_AGAIN;
+}
+
+/* pam_set_item(PAM_CONV) replaces the conversation of the application */
+void _pam_async_set_conv(pam_handle_t *pamh, struct pam_conv *conv)
+{
+    struct pam_conv **app_conv;
+
+    app_conv = pamh->async ? &pamh->async->app_conv
+			   : &pamh->pam_conversation;
+    _pam_drop(*app_conv);
+    *app_conv = conv;
+}
+
+/* Put the conversation of the application back */
+void _pam_async_end(pam_handle_t *pamh)
+{
+    struct pam_async *async = pamh->async;
+
+    if (async == NULL)
+	return;
+
+    pamh->pam_conversation = async->app_conv;
+    _pam_async_drop_resp(async, async->num_msg);
+    _pam_async_drop_msg(async);
+    _pam_drop(pamh->async);
+}
+
+static int _pam_async_run(pam_handle_t *pamh, int *num_msg,
+			  const struct pam_message ***msg)
+{
+    struct pam_async *async = pamh->async;
+    int retval;
+
+    retval = pam_authenticate(pamh, async->flags);
+
+    if (retval == PAM_INCOMPLETE && async->state == PAM_ASYNC_WAITING) {
+	*num_msg = async->num_msg;
+	*msg = async->msgp;
+	return PAM_INCOMPLETE;
+    }
+
+    if (retval == PAM_INCOMPLETE) {
+	/* a module gave up for a reason of its own; try again later */
+	*num_msg = 0;
+	*msg = NULL;
+	return PAM_INCOMPLETE;
+    }
+
+    _pam_async_end(pamh);
+    *num_msg = 0;
+    *msg = NULL;
+
+    return retval;
+}
+
+int pam_authenticate_start(pam_handle_t *pamh, int flags, int *num_msg,
+			   const struct pam_message ***msg)
+{
+    D(("called"));
+
+    IF_NO_PAMH("pam_authenticate_start", pamh, PAM_SYSTEM_ERR);
+
+    if (__PAM_FROM_MODULE(pamh)) {
+	D(("called from module!?"));
+	return PAM_SYSTEM_ERR;
+    }
+
+    if (num_msg == NULL || msg == NULL || pamh->async != NULL
+	|| pamh->former.choice != PAM_NOT_STACKED) {
+	pam_syslog(pamh, LOG_ERR,
+		   "pam_authenticate_start: another call is in progress");
+	return PAM_SYSTEM_ERR;
+    }
+
+    if ((pamh->async = calloc(1, sizeof(*pamh->async))) == NULL) {
+	pam_syslog(pamh, LOG_CRIT, "pam_authenticate_start: out of memory");
+	return PAM_BUF_ERR;
+    }
+
+    pamh->async->flags = flags;
+    pamh->async->conv.conv = _pam_async_conv;
+    pamh->async->conv.appdata_ptr = pamh;
+    pamh->async->app_conv = pamh->pam_conversation;
+    pamh->pam_conversation = &pamh->async->conv;
+
+    return _pam_async_run(pamh, num_msg, msg);
+}
+
+int pam_authenticate_continue(pam_handle_t *pamh, struct pam_response *resp,
+			      int *num_msg, const struct pam_message ***msg)
+{
+    struct pam_async *async;
+
+    D(("called"));
+
+    IF_NO_PAMH("pam_authenticate_continue", pamh, PAM_SYSTEM_ERR);
+
+    if (__PAM_FROM_MODULE(pamh)) {
+	D(("called from module!?"));
+	return PAM_SYSTEM_ERR;
+    }
+
+    if ((async = pamh->async) == NULL || num_msg == NULL || msg == NULL) {
+	pam_syslog(pamh, LOG_ERR,
+		   "pam_authenticate_continue: no call to continue");
+	return PAM_SYSTEM_ERR;
+    }
+
+    if (async->state == PAM_ASYNC_WAITING) {
+	async->resp = resp;
+	async->state = PAM_ASYNC_ANSWERED;
+    } else if (resp != NULL) {
+	pam_syslog(pamh, LOG_ERR,
+		   "pam_authenticate_continue: answers without messages");
+	return PAM_SYSTEM_ERR;
+    }
+
+    return _pam_async_run(pamh, num_msg, msg);
+}
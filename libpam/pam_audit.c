@@ -20,29 +20,49 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <pthread.h>
 
 #define PAMAUDIT_LOGGED 1
 
+/*
+ * By default every event opens a netlink socket of its own, which
+ * costs a socket(), a close() and the setup in the kernel, several
+ * times per login.  With PAM_AUDIT_REUSE_FD one socket is kept for the
+ * process; the lock makes sure that the acknowledgement of a message is
+ * read by the thread that sent it.  A child process does not use the
+ * socket of its parent, and a socket that failed is replaced.  With
+ * PAM_AUDIT_COALESCE the events of a PAM function, those of its modules
+ * and its own, are kept in the handle and written in one go before it
+ * returns.
+ */
+
+static struct {
+  pthread_mutex_t lock;
+  int flags;
+  int fd;          /* -1 if not open, -2 if the kernel has no audit */
+  pid_t pid;       /* process the socket belongs to */
+} _pam_audit = { PTHREAD_MUTEX_INITIALIZER, 0, -1, 0 };
+
+struct pam_audit_event {
+  struct pam_audit_event *next;
+  int type;
+  int success;
+  const char *user;
+  const char *rhost;
+  const char *tty;
+  char message[];  /* followed by the strings user points to */
+};
+
 static int
 _pam_audit_writelog(pam_handle_t *pamh, int audit_fd, int type,
-	const char *message, const char *grantors, int retval)
+	const char *message, const char *user, const char *rhost,
+	const char *tty, int success)
 {
   static int old_errno = -1;
-  int rc = -ENOMEM;
-  char *buf;
-  const char *grantors_field = " grantors=";
-
-  if (grantors == NULL) {
-      grantors = "";
-      grantors_field = "";
-  }
+  int rc;
 
-  if (asprintf(&buf, "PAM:%s%s%s", message, grantors_field, grantors) >= 0) {
-      rc = audit_log_acct_message(audit_fd, type, NULL, buf,
-	(retval != PAM_USER_UNKNOWN && pamh->user) ? pamh->user : "?",
-	-1, pamh->rhost, NULL, pamh->tty, retval == PAM_SUCCESS);
-      free(buf);
-  }
+  rc = audit_log_acct_message(audit_fd, type, NULL, message,
+	user, -1, rhost, NULL, tty, success);
 
   /* libaudit sets errno to his own negative error code. This can be
      an official errno number, but must not. It can also be a audit
@@ -50,8 +70,6 @@ _pam_audit_writelog(pam_handle_t *pamh, int audit_fd, int type,
      best to fix it. */
   errno = -rc;
 
-  pamh->audit_state |= PAMAUDIT_LOGGED;
-
   if (rc < 0) {
       if (rc == -EPERM)
           return 0;
@@ -85,19 +103,204 @@ _pam_audit_open(pam_handle_t *pamh)
   return audit_fd;
 }
 
+/*
+ * Get a socket for one or more events.  Returns -1 on failure and -2
+ * without audit in the kernel; _pam_audit_release() must follow.
+ */
+static int
+_pam_audit_acquire(pam_handle_t *pamh, int *shared)
+{
+  int audit_fd;
+
+  pthread_mutex_lock(&_pam_audit.lock);
+  if (!(_pam_audit.flags & PAM_AUDIT_REUSE_FD)) {
+    pthread_mutex_unlock(&_pam_audit.lock);
+    *shared = 0;
+    return _pam_audit_open(pamh);
+  }
+
+  if (_pam_audit.pid != getpid()) {
+    /* the replies on the socket of the parent are not ours */
+    if (_pam_audit.fd >= 0)
+      audit_close(_pam_audit.fd);
+    if (_pam_audit.fd != -2)
+      _pam_audit.fd = -1;
+    _pam_audit.pid = getpid();
+  }
+  if (_pam_audit.fd == -1)
+    _pam_audit.fd = _pam_audit_open(pamh);
+
+  audit_fd = _pam_audit.fd;
+  if (audit_fd < 0) {
+    pthread_mutex_unlock(&_pam_audit.lock);
+    *shared = 0;
+  } else {
+    *shared = 1;
+  }
+  return audit_fd;
+}
+
+static void
+_pam_audit_release(int audit_fd, int shared)
+{
+  if (shared)
+    pthread_mutex_unlock(&_pam_audit.lock);
+  else if (audit_fd >= 0)
+    audit_close(audit_fd);
+}
+
+/* Write an event, on a shared socket that failed again on a new one */
+static int
+_pam_audit_write(pam_handle_t *pamh, int *audit_fd, int shared, int type,
+	const char *message, const char *user, const char *rhost,
+	const char *tty, int success)
+{
+  int rc;
+
+  rc = _pam_audit_writelog(pamh, *audit_fd, type, message,
+			   user, rhost, tty, success);
+  if (rc < 0 && shared) {
+    audit_close(*audit_fd);
+    _pam_audit.fd = _pam_audit_open(pamh);
+    if (_pam_audit.fd < 0) {
+      /* keep the lock until _pam_audit_release() */
+      *audit_fd = -1;
+      return rc;
+    }
+    *audit_fd = _pam_audit.fd;
+    rc = _pam_audit_writelog(pamh, *audit_fd, type, message,
+			     user, rhost, tty, success);
+  }
+  return rc;
+}
+
+/* Keep an event for _pam_audit_flush(); returns -1 if out of memory */
+static int
+_pam_audit_queue(pam_handle_t *pamh, int type, const char *message,
+	const char *user, int success)
+{
+  struct pam_audit_event *event, **last;
+  size_t message_len, user_len, rhost_len, tty_len;
+  char *p;
+
+  message_len = strlen(message) + 1;
+  user_len = strlen(user) + 1;
+  rhost_len = pamh->rhost ? strlen(pamh->rhost) + 1 : 0;
+  tty_len = pamh->tty ? strlen(pamh->tty) + 1 : 0;
+
+  event = _pam_arena_alloc(pamh, sizeof(*event) + message_len + user_len
+			   + rhost_len + tty_len);
+  if (event == NULL)
+    return -1;
+
+  event->next = NULL;
+  event->type = type;
+  event->success = success;
+  p = mempcpy(event->message, message, message_len);
+  event->user = p;
+  p = mempcpy(p, user, user_len);
+  event->rhost = rhost_len ? memcpy(p, pamh->rhost, rhost_len) : NULL;
+  p += rhost_len;
+  event->tty = tty_len ? memcpy(p, pamh->tty, tty_len) : NULL;
+
+  for (last = &pamh->audit_events; *last != NULL; last = &(*last)->next)
+    ;
+  *last = event;
+
+  return 0;
+}
+
+/*
+ * Write the events kept by _pam_audit_queue().  Returns -1 if one of
+ * them could not be written.
+ */
+static int
+_pam_audit_flush(pam_handle_t *pamh)
+{
+  struct pam_audit_event *event;
+  int audit_fd, shared, rc = 0;
+
+  if (pamh->audit_events == NULL)
+    return 0;
+
+  audit_fd = _pam_audit_acquire(pamh, &shared);
+  if (audit_fd == -1)
+    rc = -1;
+  while ((event = pamh->audit_events) != NULL) {
+    pamh->audit_events = event->next;
+    if (audit_fd >= 0
+	&& _pam_audit_write(pamh, &audit_fd, shared, event->type,
+			    event->message, event->user, event->rhost,
+			    event->tty, event->success) < 0)
+      rc = -1;
+    _pam_arena_free(pamh, event);
+  }
+  _pam_audit_release(audit_fd, shared);
+
+  return rc;
+}
+
+/*
+ * Log or queue an event.  Returns -1 if it could not be logged.
+ */
 static int
-_pam_list_grantors(struct handler *hlist, int retval, char **list)
+_pam_audit_log(pam_handle_t *pamh, int type, const char *message,
+	const char *grantors, int retval)
+{
+  const char *grantors_field = " grantors=";
+  const char *user;
+  char *buf;
+  int audit_fd, shared, rc;
+
+  if (grantors == NULL) {
+      grantors = "";
+      grantors_field = "";
+  }
+  user = (retval != PAM_USER_UNKNOWN && pamh->user) ? pamh->user : "?";
+
+  if (asprintf(&buf, "PAM:%s%s%s", message, grantors_field, grantors) < 0) {
+      errno = ENOMEM;
+      pam_syslog (pamh, LOG_CRIT, "audit_log_acct_message() failed: %m");
+      return -1;
+  }
+
+  pamh->audit_state |= PAMAUDIT_LOGGED;
+
+  if ((_pam_audit.flags & PAM_AUDIT_COALESCE)
+      && _pam_audit_queue(pamh, type, buf, user,
+			  retval == PAM_SUCCESS) == 0) {
+      free(buf);
+      return 0;
+  }
+
+  /* the events before this one go first */
+  (void) _pam_audit_flush(pamh);
+
+  if ((audit_fd = _pam_audit_acquire(pamh, &shared)) < 0) {
+      free(buf);
+      return audit_fd == -2 ? 0 : -1;
+  }
+  rc = _pam_audit_write(pamh, &audit_fd, shared, type, buf, user,
+			pamh->rhost, pamh->tty, retval == PAM_SUCCESS);
+  _pam_audit_release(audit_fd, shared);
+  free(buf);
+
+  return rc < 0 ? -1 : 0;
+}
+
+static int
+_pam_list_grantors(const struct handler_chain *chain, int retval, char **list)
 {
   *list = NULL;
 
-  if (retval == PAM_SUCCESS) {
-    struct handler *h;
+  if (retval == PAM_SUCCESS && chain != NULL) {
     char *p = NULL;
     size_t len = 0;
+    int i;
 
-    for (h = hlist; h != NULL; h = h->next) {
-      if (h->grantor) {
-        len += strlen(h->mod_name) + 1;
+    for (i = 0; i < chain->count; i++) {
+      if (chain->state[i].grantor) {
+        len += strlen(chain->handlers[i].mod_name) + 1;
       }
     }
 
@@ -110,15 +313,15 @@ _pam_list_grantors(struct handler *hlist, int retval, char **list)
       return -1;
     }
 
-    for (h = hlist; h != NULL; h = h->next) {
-      if (h->grantor) {
+    for (i = 0; i < chain->count; i++) {
+      if (chain->state[i].grantor) {
         if (p == NULL) {
           p = *list;
         } else {
           p = stpcpy(p, ",");
         }
 
-        p = stpcpy(p, h->mod_name);
+        p = stpcpy(p, chain->handlers[i].mod_name);
       }
     }
   }
@@ -127,19 +330,13 @@ _pam_list_grantors(struct handler *hlist, int retval, char **list)
 }
 
 int
-_pam_auditlog(pam_handle_t *pamh, int action, int retval, int flags, struct handler *h)
+_pam_auditlog(pam_handle_t *pamh, int action, int retval, int flags,
+	      const struct handler_chain *chain)
 {
   const char *message;
   int type;
-  int audit_fd;
   char *grantors;
 
-  if ((audit_fd=_pam_audit_open(pamh)) == -1) {
-    return PAM_SYSTEM_ERR;
-  } else if (audit_fd == -2) {
-    return retval;
-  }
-
   switch (action) {
   case PAM_AUTHENTICATE:
     message = "authentication";
@@ -183,19 +380,22 @@ _pam_auditlog(pam_handle_t *pamh, int action, int retval, int flags, struct hand
     retval = PAM_SYSTEM_ERR;
   }
 
-  if (_pam_list_grantors(h, retval, &grantors) < 0) {
+  if (_pam_list_grantors(chain, retval, &grantors) < 0) {
     /* allocation failure */
     pam_syslog(pamh, LOG_CRIT, "_pam_list_grantors() failed: %m");
     retval = PAM_SYSTEM_ERR;
   }
 
-  if (_pam_audit_writelog(pamh, audit_fd, type, message,
+  if (_pam_audit_log(pamh, type, message,
       grantors ? grantors : "?", retval) < 0)
     retval = PAM_SYSTEM_ERR;
 
+  /* the PAM function fails if its events, kept or not, are not written */
+  if (_pam_audit_flush(pamh) < 0)
+    retval = PAM_SYSTEM_ERR;
+
   free(grantors);
 
-  audit_close(audit_fd);
   return retval;
 }
 
@@ -210,6 +410,8 @@ _pam_audit_end(pam_handle_t *pamh, int status UNUSED)
     _pam_auditlog(pamh, _PAM_ACTION_DONE, PAM_USER_UNKNOWN, 0, NULL);
   }
 
+  (void) _pam_audit_flush(pamh);
+
   return 0;
 }
 
@@ -217,20 +419,28 @@ int
 pam_modutil_audit_write(pam_handle_t *pamh, int type,
     const char *message, int retval)
 {
-  int audit_fd;
-  int rc;
+  return _pam_audit_log(pamh, type, message, NULL, retval) < 0 ?
+    PAM_SYSTEM_ERR : PAM_SUCCESS;
+}
 
-  if ((audit_fd=_pam_audit_open(pamh)) == -1) {
-    return PAM_SYSTEM_ERR;
-  } else if (audit_fd == -2) {
-    return retval;
-  }
+int
+pam_audit_mode(int flags)
+{
+  D(("called: %d", flags));
 
-  rc = _pam_audit_writelog(pamh, audit_fd, type, message, NULL, retval);
+  if (flags & ~(PAM_AUDIT_REUSE_FD | PAM_AUDIT_COALESCE))
+    return PAM_SYSTEM_ERR;
 
-  audit_close(audit_fd);
+  pthread_mutex_lock(&_pam_audit.lock);
+  _pam_audit.flags = flags;
+  if (!(flags & PAM_AUDIT_REUSE_FD)) {
+    if (_pam_audit.fd >= 0 && _pam_audit.pid == getpid())
+      audit_close(_pam_audit.fd);
+    _pam_audit.fd = -1;
+  }
+  pthread_mutex_unlock(&_pam_audit.lock);
 
-  return rc < 0 ? PAM_SYSTEM_ERR : PAM_SUCCESS;
+  return PAM_SUCCESS;
 }
 
 #else
@@ -239,4 +449,11 @@ int pam_modutil_audit_write(pam_handle_t *pamh UNUSED, int type UNUSED,
 {
   return PAM_SUCCESS;
 }
+
+int pam_audit_mode(int flags)
+{
+  if (flags & ~(PAM_AUDIT_REUSE_FD | PAM_AUDIT_COALESCE))
+    return PAM_SYSTEM_ERR;
+  return PAM_SUCCESS;
+}
 #endif /* HAVE_LIBAUDIT */
@@ -24,6 +24,9 @@ int pam_authenticate(pam_handle_t *pamh, int flags)
 	return PAM_SYSTEM_ERR;
     }
 
+    if ((retval = _pam_broker_call(pamh, PAM_AUTHENTICATE, flags)) != PAM_IGNORE)
+	return retval;
+
     if (pamh->former.choice == PAM_NOT_STACKED) {
 	_pam_sanitize(pamh);
 	_pam_start_timer(pamh);    /* we try to make the time for a failure
@@ -0,0 +1,1146 @@
+/* pam_broker.c -- run the stacks of a handle in a broker process */
+
+/*
+ * A short lived program like su or cron parses the configuration of its
+ * service and loads the modules every time it runs.  pam_brokerd keeps
+ * them loaded and runs the transactions of such programs instead: after
+ * pam_broker_enable(), pam_start() connects to the socket of the broker
+ * and pam_authenticate(), pam_acct_mgmt() and pam_chauthtok() send the
+ * items of the handle, relay the conversation and take the result, the
+ * user and the environment set by the modules, back.  pam_setcred() and
+ * the session functions change the calling process and keep running the
+ * local stack.
+ *
+ * The data a module keeps with pam_set_data() stays in the broker.  The
+ * result names the modules that keep some, and _pam_dispatch() calls
+ * the setcred and session functions of those modules in the broker, so
+ * that they find it; the other modules of these stacks run locally.
+ *
+ * The broker serves every connection in a child process with the
+ * credentials of its peer, see pam_broker_serve(), so that modules see
+ * the same real and effective ids as in the program itself.  If there
+ * is no broker, or it does not know the service, the handle simply works
+ * on its own.  A broker lost during a call fails the call.
+ */
+
+#include "pam_private.h"
+
+#include <errno.h>
+#include <grp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define PAM_BROKER_MAX_MSG   (1 << 20)
+#define PAM_BROKER_NULL      UINT32_MAX   /* a NULL string */
+
+/* client to broker */
+#define PAM_BROKER_START       1   /* service, user, confdir */
+#define PAM_BROKER_CALL        2   /* choice, flags, items */
+#define PAM_BROKER_CONV_REPLY  3   /* retval, responses */
+#define PAM_BROKER_RESET       4   /* status */
+#define PAM_BROKER_END         5   /* status */
+#define PAM_BROKER_MODULE      8   /* choice, flags, depth, module */
+
+/* broker to client */
+#define PAM_BROKER_CONV        6   /* messages */
+#define PAM_BROKER_RESULT      7   /* retval, user, tokens, environment,
+				      modules with data */
+
+/* a binary prompt starts with its size, see pam_client.h */
+#define PAM_BROKER_BP_MIN_SIZE 5
+
+static struct {
+    pthread_mutex_t lock;
+    char *path;                  /* of the socket, NULL while disabled */
+} _pam_broker = { PTHREAD_MUTEX_INITIALIZER, NULL };
+
+/* the items a call takes along */
+static const int _pam_broker_items[] = {
+    PAM_SERVICE, PAM_USER, PAM_USER_PROMPT, PAM_TTY, PAM_RUSER, PAM_RHOST,
+    PAM_XDISPLAY, PAM_AUTHTOK_TYPE
+};
+#define PAM_BROKER_NITEMS (sizeof(_pam_broker_items) / sizeof(int))
+
+/*
+ * A message is a type, a length and the payload, made of 32 bit
+ * integers and strings that are sent with their length and the
+ * terminating NUL.  Binary prompts and their answers are sent with
+ * their length only.  The first message of the client carries its
+ * credentials.
+ */
+struct pam_broker_msg {
+    uint32_t type;
+    char *data;                  /* the 8 byte header, then the payload */
+    size_t len;                  /* of the payload */
+    size_t allocated;
+    size_t pos;                  /* next payload byte to read */
+    int failed;
+};
+
+#define HDR_LEN 8
+
+static void _pam_broker_msg_init(struct pam_broker_msg *m, uint32_t type)
+{
+    memset(m, 0, sizeof(*m));
+    m->type = type;
+}
+
+/* the payload may hold passwords */
+static void _pam_broker_msg_free(struct pam_broker_msg *m)
+{
+    if (m->data != NULL) {
+	_pam_overwrite_n(m->data, m->allocated);
+	free(m->data);
+    }
+    memset(m, 0, sizeof(*m));
+}
+
+static void _pam_broker_put(struct pam_broker_msg *m, const void *p,
+			    size_t n)
+{
+    if (m->failed)
+	return;
+
+    if (HDR_LEN + m->len + n > m->allocated) {
+	size_t size = 2 * m->allocated + HDR_LEN + n + 128;
+	char *tmp;
+
+	if (m->len + n > PAM_BROKER_MAX_MSG || (tmp = malloc(size)) == NULL) {
+	    m->failed = 1;
+	    return;
+	}
+	if (m->data != NULL) {
+	    memcpy(tmp, m->data, HDR_LEN + m->len);
+	    _pam_overwrite_n(m->data, m->allocated);
+	    free(m->data);
+	}
+	m->data = tmp;
+	m->allocated = size;
+    }
+
+    memcpy(m->data + HDR_LEN + m->len, p, n);
+    m->len += n;
+}
+
+static void _pam_broker_put_int(struct pam_broker_msg *m, int value)
+{
+    int32_t v = value;
+
+    _pam_broker_put(m, &v, sizeof(v));
+}
+
+static void _pam_broker_put_str(struct pam_broker_msg *m, const char *s)
+{
+    uint32_t n = (s != NULL) ? strlen(s) + 1 : PAM_BROKER_NULL;
+
+    _pam_broker_put(m, &n, sizeof(n));
+    if (s != NULL)
+	_pam_broker_put(m, s, n);
+}
+
+static void _pam_broker_put_bin(struct pam_broker_msg *m, const void *p,
+				uint32_t n)
+{
+    if (p == NULL)
+	n = PAM_BROKER_NULL;
+    _pam_broker_put(m, &n, sizeof(n));
+    if (p != NULL)
+	_pam_broker_put(m, p, n);
+}
+
+static uint32_t _pam_broker_bp_size(const void *p)
+{
+    const unsigned char *c = p;
+
+    return ((uint32_t) c[0] << 24) | ((uint32_t) c[1] << 16)
+	| ((uint32_t) c[2] << 8) | c[3];
+}
+
+/* A string, or a binary prompt or answer if binary is set */
+static void _pam_broker_put_text(struct pam_broker_msg *m, const char *s,
+				 int binary)
+{
+    if (!binary || s == NULL)
+	_pam_broker_put_str(m, s);
+    else if (_pam_broker_bp_size(s) < PAM_BROKER_BP_MIN_SIZE)
+	m->failed = 1;
+    else
+	_pam_broker_put_bin(m, s, _pam_broker_bp_size(s));
+}
+
+static int _pam_broker_get_int(struct pam_broker_msg *m, int *value)
+{
+    int32_t v;
+
+    if (m->len - m->pos < sizeof(v))
+	return -1;
+    memcpy(&v, m->data + HDR_LEN + m->pos, sizeof(v));
+    m->pos += sizeof(v);
+    *value = v;
+
+    return 0;
+}
+
+/* *s points into the message */
+static int _pam_broker_get_str(struct pam_broker_msg *m, const char **s)
+{
+    const char *p;
+    uint32_t n;
+
+    if (m->len - m->pos < sizeof(n))
+	return -1;
+    memcpy(&n, m->data + HDR_LEN + m->pos, sizeof(n));
+    m->pos += sizeof(n);
+
+    if (n == PAM_BROKER_NULL) {
+	*s = NULL;
+	return 0;
+    }
+    if (n == 0 || n > m->len - m->pos)
+	return -1;
+    p = m->data + HDR_LEN + m->pos;
+    if (p[n - 1] != '\0')
+	return -1;
+    m->pos += n;
+    *s = p;
+
+    return 0;
+}
+
+/* *s points into the message and holds *n bytes */
+static int _pam_broker_get_text(struct pam_broker_msg *m, const char **s,
+				size_t *n, int binary)
+{
+    uint32_t len;
+
+    if (!binary) {
+	if (_pam_broker_get_str(m, s) != 0)
+	    return -1;
+	*n = (*s != NULL) ? strlen(*s) + 1 : 0;
+	return 0;
+    }
+
+    if (m->len - m->pos < sizeof(len))
+	return -1;
+    memcpy(&len, m->data + HDR_LEN + m->pos, sizeof(len));
+    m->pos += sizeof(len);
+
+    if (len == PAM_BROKER_NULL) {
+	*s = NULL;
+	*n = 0;
+	return 0;
+    }
+    if (len < PAM_BROKER_BP_MIN_SIZE || len > m->len - m->pos
+	|| _pam_broker_bp_size(m->data + HDR_LEN + m->pos) != len)
+	return -1;
+    *s = m->data + HDR_LEN + m->pos;
+    *n = len;
+    m->pos += len;
+
+    return 0;
+}
+
+static int _pam_broker_io(int fd, char *buf, size_t n, int out)
+{
+    ssize_t r;
+
+    while (n > 0) {
+	r = out ? send(fd, buf, n, MSG_NOSIGNAL) : read(fd, buf, n);
+	if (r < 0 && errno == EINTR)
+	    continue;
+	if (r <= 0)
+	    return -1;
+	buf += r;
+	n -= r;
+    }
+
+    return 0;
+}
+
+/* Fill in the header */
+static int _pam_broker_seal(struct pam_broker_msg *m)
+{
+    uint32_t hdr[2];
+
+    if (m->data == NULL)
+	_pam_broker_put(m, "", 0);
+    if (m->failed)
+	return -1;
+
+    hdr[0] = m->type;
+    hdr[1] = m->len;
+    memcpy(m->data, hdr, HDR_LEN);
+
+    return 0;
+}
+
+static int _pam_broker_send(int fd, struct pam_broker_msg *m)
+{
+    if (_pam_broker_seal(m) != 0)
+	return -1;
+
+    return _pam_broker_io(fd, m->data, HDR_LEN + m->len, 1);
+}
+
+/* Send m with the pid and the real ids of the process */
+static int _pam_broker_send_creds(int fd, struct pam_broker_msg *m)
+{
+    union {
+	struct cmsghdr align;
+	char buf[CMSG_SPACE(sizeof(struct ucred))];
+    } ctl;
+    struct ucred cred;
+    struct cmsghdr *cmsg;
+    struct msghdr mh;
+    struct iovec iov;
+    ssize_t r;
+
+    if (_pam_broker_seal(m) != 0)
+	return -1;
+
+    cred.pid = getpid();
+    cred.uid = getuid();
+    cred.gid = getgid();
+
+    memset(&ctl, 0, sizeof(ctl));
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = m->data;
+    iov.iov_len = HDR_LEN + m->len;
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = ctl.buf;
+    mh.msg_controllen = sizeof(ctl.buf);
+    cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_CREDENTIALS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(cred));
+    memcpy(CMSG_DATA(cmsg), &cred, sizeof(cred));
+
+    while ((r = sendmsg(fd, &mh, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+	;
+    if (r < 0)
+	return -1;
+
+    return _pam_broker_io(fd, m->data + r, HDR_LEN + m->len - r, 1);
+}
+
+static int _pam_broker_recv_payload(int fd, struct pam_broker_msg *m,
+				    const uint32_t *hdr)
+{
+    if (hdr[1] > PAM_BROKER_MAX_MSG
+	|| (m->data = malloc(HDR_LEN + hdr[1])) == NULL)
+	return -1;
+    m->allocated = HDR_LEN + hdr[1];
+    m->type = hdr[0];
+    m->len = hdr[1];
+    memcpy(m->data, hdr, HDR_LEN);
+
+    return _pam_broker_io(fd, m->data + HDR_LEN, m->len, 0);
+}
+
+static int _pam_broker_recv(int fd, struct pam_broker_msg *m)
+{
+    uint32_t hdr[2];
+
+    _pam_broker_msg_init(m, 0);
+    if (_pam_broker_io(fd, (char *) hdr, HDR_LEN, 0) != 0)
+	return -1;
+
+    return _pam_broker_recv_payload(fd, m, hdr);
+}
+
+/*
+ * Receive the first message and the credentials sent with it.  *have
+ * is only set if there were some, the kernel checked them then.
+ */
+static int _pam_broker_recv_creds(int fd, struct pam_broker_msg *m,
+				  struct ucred *cred, int *have)
+{
+    union {
+	struct cmsghdr align;
+	char buf[CMSG_SPACE(sizeof(struct ucred))];
+    } ctl;
+    struct cmsghdr *cmsg;
+    struct msghdr mh;
+    struct iovec iov;
+    uint32_t hdr[2];
+    ssize_t r;
+
+    _pam_broker_msg_init(m, 0);
+    *have = 0;
+
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = hdr;
+    iov.iov_len = HDR_LEN;
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = ctl.buf;
+    mh.msg_controllen = sizeof(ctl.buf);
+    while ((r = recvmsg(fd, &mh, MSG_WAITALL)) < 0 && errno == EINTR)
+	;
+    if (r <= 0)
+	return -1;
+
+    for (cmsg = CMSG_FIRSTHDR(&mh); cmsg != NULL;
+	 cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+	if (cmsg->cmsg_level == SOL_SOCKET
+	    && cmsg->cmsg_type == SCM_CREDENTIALS
+	    && cmsg->cmsg_len == CMSG_LEN(sizeof(*cred))) {
+	    memcpy(cred, CMSG_DATA(cmsg), sizeof(*cred));
+	    *have = 1;
+	}
+    }
+
+    if ((size_t) r < HDR_LEN
+	&& _pam_broker_io(fd, (char *) hdr + r, HDR_LEN - r, 0) != 0)
+	return -1;
+
+    return _pam_broker_recv_payload(fd, m, hdr);
+}
+
+static int _pam_broker_streq(const char *a, const char *b)
+{
+    if (a == NULL || b == NULL)
+	return a == b;
+    return !strcmp(a, b);
+}
+
+/* client */
+
+int pam_broker_enable(int enable, const char *path)
+{
+    struct sockaddr_un sa;
+    char *tmp = NULL, *old;
+
+    D(("called: %d %s", enable, path));
+
+    if (enable) {
+	if (path == NULL)
+	    path = PAM_BROKER_SOCKET;
+	if (strlen(path) >= sizeof(sa.sun_path))
+	    return PAM_SYSTEM_ERR;
+	if ((tmp = _pam_strdup(path)) == NULL)
+	    return PAM_BUF_ERR;
+    }
+
+    pthread_mutex_lock(&_pam_broker.lock);
+    old = _pam_broker.path;
+    _pam_broker.path = tmp;
+    pthread_mutex_unlock(&_pam_broker.lock);
+
+    free(old);
+
+    return PAM_SUCCESS;
+}
+
+/*
+ * Called by pam_start(): ask the broker, if there is one, to start a
+ * transaction for the service of pamh.
+ */
+void _pam_broker_start(pam_handle_t *pamh)
+{
+    struct sockaddr_un sa;
+    struct pam_broker_msg m;
+    int fd, retval;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    pthread_mutex_lock(&_pam_broker.lock);
+    if (_pam_broker.path != NULL)
+	strcpy(sa.sun_path, _pam_broker.path);
+    pthread_mutex_unlock(&_pam_broker.lock);
+    if (sa.sun_path[0] == '\0')
+	return;
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+	return;
+    if (connect(fd, (struct sockaddr *) &sa, sizeof(sa)) != 0) {
+	D(("no broker at %s", sa.sun_path));
+	close(fd);
+	return;
+    }
+
+    _pam_broker_msg_init(&m, PAM_BROKER_START);
+    _pam_broker_put_str(&m, pamh->service_name);
+    _pam_broker_put_str(&m, pamh->user);
+    _pam_broker_put_str(&m, pamh->confdir);
+    if (_pam_broker_send_creds(fd, &m) != 0) {
+	_pam_broker_msg_free(&m);
+	goto fail;
+    }
+    _pam_broker_msg_free(&m);
+
+    if (_pam_broker_recv(fd, &m) != 0 || m.type != PAM_BROKER_RESULT
+	|| _pam_broker_get_int(&m, &retval) != 0) {
+	_pam_broker_msg_free(&m);
+	goto fail;
+    }
+    _pam_broker_msg_free(&m);
+
+    if (retval != PAM_SUCCESS) {
+	D(("the broker cannot start %s: %d", pamh->service_name, retval));
+	close(fd);
+	return;
+    }
+
+    pamh->broker_fd = fd;
+    return;
+
+fail:
+    /* the broker also hangs up on processes it does not serve */
+    pam_syslog(pamh, LOG_DEBUG, "cannot start a transaction in the broker");
+    close(fd);
+}
+
+/* Run the conversation function of pamh for the broker */
+static int _pam_broker_converse(pam_handle_t *pamh, struct pam_broker_msg *m)
+{
+    struct pam_message *msgs = NULL;
+    const struct pam_message **pmsgs = NULL;
+    struct pam_response *resp = NULL;
+    struct pam_broker_msg reply;
+    int n, i, style, retval = -1;
+    const char *text;
+    size_t len;
+
+    if (_pam_broker_get_int(m, &n) != 0 || n <= 0 || n > PAM_MAX_NUM_MSG
+	|| (msgs = calloc(n, sizeof(*msgs))) == NULL
+	|| (pmsgs = calloc(n, sizeof(*pmsgs))) == NULL)
+	goto out;
+
+    for (i = 0; i < n; i++) {
+	if (_pam_broker_get_int(m, &style) != 0
+	    || _pam_broker_get_text(m, &text, &len,
+				    style == PAM_BINARY_PROMPT) != 0)
+	    goto out;
+	msgs[i].msg_style = style;
+	msgs[i].msg = text;
+	pmsgs[i] = &msgs[i];
+    }
+
+    retval = pamh->pam_conversation->conv(n, pmsgs, &resp,
+					  pamh->pam_conversation->appdata_ptr);
+
+    _pam_broker_msg_init(&reply, PAM_BROKER_CONV_REPLY);
+    _pam_broker_put_int(&reply, retval);
+    _pam_broker_put_int(&reply, resp != NULL ? n : 0);
+    for (i = 0; resp != NULL && i < n; i++) {
+	_pam_broker_put_text(&reply, resp[i].resp,
+			     msgs[i].msg_style == PAM_BINARY_PROMPT);
+	_pam_broker_put_int(&reply, resp[i].resp_retcode);
+    }
+    retval = _pam_broker_send(pamh->broker_fd, &reply);
+    _pam_broker_msg_free(&reply);
+    if (resp != NULL)
+	_pam_drop_reply(resp, n);
+
+out:
+    free(pmsgs);
+    free(msgs);
+    return retval;
+}
+
+/* Set an item only the modules may set, also from within a stack */
+static int _pam_broker_set_token(pam_handle_t *pamh, int type,
+				 const char *value, const char *old)
+{
+    int caller_is = pamh->caller_is, retval;
+
+    if (_pam_broker_streq(value, old))
+	return PAM_SUCCESS;
+
+    __PAM_TO_MODULE(pamh);
+    retval = pam_set_item(pamh, type, value);
+    pamh->caller_is = caller_is;
+
+    return retval;
+}
+
+/* Note the modules with data in the broker as "a\0b\0\0" */
+static int _pam_broker_modules(pam_handle_t *pamh, struct pam_broker_msg *m)
+{
+    const char *name;
+    char *list = NULL;
+    size_t len = 0;
+    int n, i;
+
+    if (_pam_broker_get_int(m, &n) != 0 || n < 0)
+	return -1;
+
+    for (i = 0; i < n; i++) {
+	char *tmp;
+	size_t size;
+
+	if (_pam_broker_get_str(m, &name) != 0 || name == NULL
+	    || *name == '\0')
+	    goto fail;
+	size = strlen(name) + 1;
+	if ((tmp = realloc(list, len + size + 1)) == NULL)
+	    goto fail;
+	list = tmp;
+	memcpy(list + len, name, size);
+	len += size;
+    }
+
+    _pam_arena_drop(pamh, pamh->broker_modules);
+    if (list != NULL) {
+	list[len++] = '\0';
+	pamh->broker_modules = _pam_arena_memdup(pamh, list, len);
+	free(list);
+	if (pamh->broker_modules == NULL)
+	    return -1;
+    }
+    return 0;
+
+fail:
+    free(list);
+    return -1;
+}
+
+/*
+ * Take over the user, the authentication tokens and the environment the
+ * modules in the broker set, and the modules that keep data there
+ */
+static int _pam_broker_result(pam_handle_t *pamh, struct pam_broker_msg *m)
+{
+    const char *user, *authtok, *oldauthtok, *var;
+    int n, i;
+
+    if (_pam_broker_get_str(m, &user) != 0
+	|| _pam_broker_get_str(m, &authtok) != 0
+	|| _pam_broker_get_str(m, &oldauthtok) != 0
+	|| _pam_broker_get_int(m, &n) != 0)
+	return -1;
+
+    if (!_pam_broker_streq(user, pamh->user)
+	&& pam_set_item(pamh, PAM_USER, user) != PAM_SUCCESS)
+	return -1;
+    if (_pam_broker_set_token(pamh, PAM_AUTHTOK, authtok,
+			      pamh->authtok) != PAM_SUCCESS
+	|| _pam_broker_set_token(pamh, PAM_OLDAUTHTOK, oldauthtok,
+				 pamh->oldauthtok) != PAM_SUCCESS)
+	return -1;
+
+    for (i = 0; i < n; i++) {
+	if (_pam_broker_get_str(m, &var) != 0 || var == NULL
+	    || pam_putenv(pamh, var) != PAM_SUCCESS)
+	    return -1;
+    }
+
+    return _pam_broker_modules(pamh, m);
+}
+
+/* Relay the conversation of the broker until the result comes */
+static int _pam_broker_await(pam_handle_t *pamh, int *retval)
+{
+    struct pam_broker_msg m;
+
+    for (;;) {
+	if (_pam_broker_recv(pamh->broker_fd, &m) != 0)
+	    break;
+	if (m.type == PAM_BROKER_CONV) {
+	    if (_pam_broker_converse(pamh, &m) != 0)
+		break;
+	    _pam_broker_msg_free(&m);
+	    continue;
+	}
+	if (m.type != PAM_BROKER_RESULT
+	    || _pam_broker_get_int(&m, retval) != 0
+	    || _pam_broker_result(pamh, &m) != 0)
+	    break;
+	_pam_broker_msg_free(&m);
+	return 0;
+    }
+
+    _pam_broker_msg_free(&m);
+    pam_syslog(pamh, LOG_ERR, "lost the connection to the broker");
+    close(pamh->broker_fd);
+    pamh->broker_fd = -1;
+    return -1;
+}
+
+/*
+ * Called by pam_authenticate(), pam_acct_mgmt() and pam_chauthtok():
+ * run the stack in the broker.  Returns PAM_IGNORE if the handle has no
+ * broker, the call could not be sent to it, or the handle has to wait
+ * for the fail delay itself; the local stack is run then.
+ */
+int _pam_broker_call(pam_handle_t *pamh, int choice, int flags)
+{
+    struct pam_broker_msg m;
+    const void *item;
+    size_t i;
+    int retval;
+
+    if (pamh->broker_fd < 0)
+	return PAM_IGNORE;
+
+    /*
+     * The fail delay would be waited for in the broker, which knows
+     * neither the PAM_FAIL_DELAY function nor pam_fail_delay_defer(),
+     * so such a handle authenticates on its own.
+     */
+    if (choice == PAM_AUTHENTICATE
+	&& (pamh->fail_delay.delay_fn_ptr != NULL || pamh->fail_delay.defer))
+	return PAM_IGNORE;
+
+    _pam_broker_msg_init(&m, PAM_BROKER_CALL);
+    _pam_broker_put_int(&m, choice);
+    _pam_broker_put_int(&m, flags);
+    _pam_broker_put_int(&m, PAM_BROKER_NITEMS);
+    for (i = 0; i < PAM_BROKER_NITEMS; i++) {
+	if (pam_get_item(pamh, _pam_broker_items[i], &item) != PAM_SUCCESS)
+	    item = NULL;
+	_pam_broker_put_int(&m, _pam_broker_items[i]);
+	_pam_broker_put_str(&m, item);
+    }
+    retval = _pam_broker_send(pamh->broker_fd, &m);
+    _pam_broker_msg_free(&m);
+    if (retval != 0) {
+	pam_syslog(pamh, LOG_ERR, "lost the connection to the broker");
+	close(pamh->broker_fd);
+	pamh->broker_fd = -1;
+	return PAM_IGNORE;
+    }
+
+    /*
+     * The modules in the broker may have done something already, so the
+     * stack is not run again here
+     */
+    if (_pam_broker_await(pamh, &retval) != 0)
+	return PAM_SYSTEM_ERR;
+    return retval;
+}
+
+int _pam_broker_holds(const pam_handle_t *pamh, const char *mod_name)
+{
+    const char *p;
+
+    if (pamh->broker_modules == NULL || mod_name == NULL)
+	return 0;
+
+    for (p = pamh->broker_modules; *p != '\0'; p += strlen(p) + 1) {
+	if (strcmp(p, mod_name) == 0)
+	    return 1;
+    }
+    return 0;
+}
+
+/*
+ * Called by _pam_dispatch() for a module that keeps its data in the
+ * broker.  Without the broker the data is gone, so the module fails.
+ */
+int _pam_broker_module(pam_handle_t *pamh, int flags, int depth,
+		       const char *mod_name)
+{
+    struct pam_broker_msg m;
+    int retval;
+
+    if (pamh->broker_fd < 0) {
+	pam_syslog(pamh, LOG_ERR, "the data of %s was lost with the broker",
+		   mod_name);
+	return PAM_SYSTEM_ERR;
+    }
+
+    _pam_broker_msg_init(&m, PAM_BROKER_MODULE);
+    _pam_broker_put_int(&m, pamh->choice);
+    _pam_broker_put_int(&m, flags);
+    _pam_broker_put_int(&m, depth);
+    _pam_broker_put_str(&m, mod_name);
+    retval = _pam_broker_send(pamh->broker_fd, &m);
+    _pam_broker_msg_free(&m);
+    if (retval != 0) {
+	pam_syslog(pamh, LOG_ERR, "lost the connection to the broker");
+	close(pamh->broker_fd);
+	pamh->broker_fd = -1;
+	return PAM_SYSTEM_ERR;
+    }
+
+    if (_pam_broker_await(pamh, &retval) != 0)
+	return PAM_SYSTEM_ERR;
+    return retval;
+}
+
+static void _pam_broker_notify(pam_handle_t *pamh, int type, int status)
+{
+    struct pam_broker_msg m;
+    int retval;
+
+    _pam_broker_msg_init(&m, type);
+    _pam_broker_put_int(&m, status);
+    retval = _pam_broker_send(pamh->broker_fd, &m);
+    _pam_broker_msg_free(&m);
+
+    if (retval != 0 || type == PAM_BROKER_END) {
+	close(pamh->broker_fd);
+	pamh->broker_fd = -1;
+    }
+}
+
+/* pam_reset() and pam_end() for the transaction in the broker */
+void _pam_broker_reset(pam_handle_t *pamh, int status)
+{
+    if (pamh->broker_fd >= 0)
+	_pam_broker_notify(pamh, PAM_BROKER_RESET, status);
+    _pam_arena_drop(pamh, pamh->broker_modules);
+}
+
+void _pam_broker_end(pam_handle_t *pamh, int status)
+{
+    if (pamh->broker_fd >= 0)
+	_pam_broker_notify(pamh, PAM_BROKER_END, status);
+}
+
+/* broker */
+
+/* The conversation function of the broker asks the client */
+static int _pam_broker_relay(int num_msg, const struct pam_message **msg,
+			     struct pam_response **resp, void *appdata_ptr)
+{
+    int fd = *(const int *) appdata_ptr;
+    struct pam_response *reply = NULL;
+    struct pam_broker_msg m;
+    const char *text;
+    size_t len;
+    int i, n, retval, code, binary;
+
+    _pam_broker_msg_init(&m, PAM_BROKER_CONV);
+    _pam_broker_put_int(&m, num_msg);
+    for (i = 0; i < num_msg; i++) {
+	_pam_broker_put_int(&m, msg[i]->msg_style);
+	_pam_broker_put_text(&m, msg[i]->msg,
+			     msg[i]->msg_style == PAM_BINARY_PROMPT);
+    }
+    retval = _pam_broker_send(fd, &m);
+    _pam_broker_msg_free(&m);
+    if (retval != 0)
+	return PAM_CONV_ERR;
+
+    if (_pam_broker_recv(fd, &m) != 0 || m.type != PAM_BROKER_CONV_REPLY
+	|| _pam_broker_get_int(&m, &retval) != 0
+	|| _pam_broker_get_int(&m, &n) != 0
+	|| (n != 0 && n != num_msg))
+	goto fail;
+
+    if (n > 0) {
+	if ((reply = calloc(n, sizeof(*reply))) == NULL)
+	    goto fail;
+	for (i = 0; i < n; i++) {
+	    binary = msg[i]->msg_style == PAM_BINARY_PROMPT;
+	    if (_pam_broker_get_text(&m, &text, &len, binary) != 0
+		|| _pam_broker_get_int(&m, &code) != 0)
+		goto fail;
+	    if (text != NULL) {
+		if ((reply[i].resp = malloc(len)) == NULL)
+		    goto fail;
+		memcpy(reply[i].resp, text, len);
+	    }
+	    reply[i].resp_retcode = code;
+	}
+    }
+    _pam_broker_msg_free(&m);
+
+    *resp = reply;
+    return retval;
+
+fail:
+    _pam_broker_msg_free(&m);
+    if (reply != NULL)
+	_pam_drop_reply(reply, num_msg);
+    return PAM_CONV_ERR;
+}
+
+/*
+ * Take the credentials of the peer, so that the modules run as they
+ * would in its process.  The effective ids and the groups are those the
+ * kernel recorded when the peer connected, the real ids those it sent
+ * with its first message, which the kernel only lets it send if they
+ * are its own.  Nothing is read from /proc, where the pid of the peer
+ * may belong to another process by now.
+ */
+static int _pam_broker_become_peer(int fd, const struct ucred *real,
+				   uid_t *peer)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    gid_t *groups = NULL;
+    int retval = PAM_PERM_DENIED;
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+	pam_syslog(NULL, LOG_ERR, "pam_broker_serve: SO_PEERCRED: %m");
+	return PAM_SYSTEM_ERR;
+    }
+    if (real == NULL) {
+	pam_syslog(NULL, LOG_ERR,
+		   "pam_broker_serve: process %ld sent no credentials",
+		   (long) cred.pid);
+	return PAM_PERM_DENIED;
+    }
+
+    len = 0;
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERGROUPS, NULL, &len) != 0
+	&& errno != ERANGE) {
+	pam_syslog(NULL, LOG_ERR, "pam_broker_serve: SO_PEERGROUPS: %m");
+	return PAM_PERM_DENIED;
+    }
+    if (len > 0 && ((groups = malloc(len)) == NULL
+		    || getsockopt(fd, SOL_SOCKET, SO_PEERGROUPS,
+				  groups, &len) != 0)) {
+	pam_syslog(NULL, LOG_ERR, "pam_broker_serve: SO_PEERGROUPS: %m");
+	goto out;
+    }
+
+    if (getuid() != real->uid || geteuid() != cred.uid
+	|| getgid() != real->gid || getegid() != cred.gid) {
+	if (setgroups(len / sizeof(*groups), groups) != 0
+	    || setresgid(real->gid, cred.gid, cred.gid) != 0
+	    || setresuid(real->uid, cred.uid, cred.uid) != 0) {
+	    pam_syslog(NULL, LOG_ERR,
+		       "pam_broker_serve: cannot take the ids of process %ld: %m",
+		       (long) cred.pid);
+	    goto out;
+	}
+    }
+
+    *peer = cred.uid;
+    retval = PAM_SUCCESS;
+
+out:
+    free(groups);
+    return retval;
+}
+
+/* Whether data is the first entry of the module that set it */
+static int _pam_broker_first_data(const pam_handle_t *pamh,
+				  const struct pam_data *data)
+{
+    const struct pam_data *prev;
+
+    if (data->module == NULL)
+	return 0;
+    for (prev = pamh->data; prev != data; prev = prev->next) {
+	if (_pam_broker_streq(prev->module, data->module))
+	    return 0;
+    }
+    return 1;
+}
+
+/* Send the names of the modules with data, each once */
+static void _pam_broker_put_modules(struct pam_broker_msg *m,
+				    const pam_handle_t *pamh)
+{
+    const struct pam_data *data;
+    int n = 0;
+
+    if (pamh == NULL) {
+	_pam_broker_put_int(m, 0);
+	return;
+    }
+
+    for (data = pamh->data; data; data = data->next)
+	n += _pam_broker_first_data(pamh, data);
+    _pam_broker_put_int(m, n);
+    for (data = pamh->data; data; data = data->next) {
+	if (_pam_broker_first_data(pamh, data))
+	    _pam_broker_put_str(m, data->module);
+    }
+}
+
+static int _pam_broker_reply(int fd, pam_handle_t *pamh, int retval)
+{
+    struct pam_broker_msg m;
+    char **env = NULL;
+    int i, n = 0;
+
+    if (pamh != NULL && (env = pam_getenvlist(pamh)) != NULL) {
+	while (env[n] != NULL)
+	    n++;
+    }
+
+    _pam_broker_msg_init(&m, PAM_BROKER_RESULT);
+    _pam_broker_put_int(&m, retval);
+    _pam_broker_put_str(&m, pamh != NULL ? pamh->user : NULL);
+    _pam_broker_put_str(&m, pamh != NULL ? pamh->authtok : NULL);
+    _pam_broker_put_str(&m, pamh != NULL ? pamh->oldauthtok : NULL);
+    _pam_broker_put_int(&m, n);
+    for (i = 0; i < n; i++)
+	_pam_broker_put_str(&m, env[i]);
+    _pam_broker_put_modules(&m, pamh);
+    retval = _pam_broker_send(fd, &m);
+    _pam_broker_msg_free(&m);
+
+    if (env != NULL) {
+	for (i = 0; i < n; i++) {
+	    _pam_overwrite(env[i]);
+	    free(env[i]);
+	}
+	free(env);
+    }
+
+    return retval;
+}
+
+/* Set the items of a call and run its stack */
+static int _pam_broker_run(pam_handle_t *pamh, int fd,
+			   struct pam_broker_msg *m)
+{
+    const void *old;
+    const char *value;
+    int choice, flags, n, i, type, retval;
+    size_t j;
+
+    if (_pam_broker_get_int(m, &choice) != 0
+	|| _pam_broker_get_int(m, &flags) != 0
+	|| _pam_broker_get_int(m, &n) != 0)
+	return -1;
+
+    for (i = 0; i < n; i++) {
+	if (_pam_broker_get_int(m, &type) != 0
+	    || _pam_broker_get_str(m, &value) != 0)
+	    return -1;
+	for (j = 0; j < PAM_BROKER_NITEMS; j++) {
+	    if (_pam_broker_items[j] == type)
+		break;
+	}
+	if (j == PAM_BROKER_NITEMS
+	    || (type == PAM_SERVICE && value == NULL))
+	    return -1;
+	/* setting the service again would read its configuration again */
+	if (pam_get_item(pamh, type, &old) == PAM_SUCCESS
+	    && _pam_broker_streq(old, value))
+	    continue;
+	if (pam_set_item(pamh, type, value) != PAM_SUCCESS)
+	    return -1;
+    }
+
+    switch (choice) {
+    case PAM_AUTHENTICATE:
+	retval = pam_authenticate(pamh, flags);
+	break;
+    case PAM_ACCOUNT:
+	retval = pam_acct_mgmt(pamh, flags);
+	break;
+    case PAM_CHAUTHTOK:
+	retval = pam_chauthtok(pamh, flags);
+	break;
+    default:
+	return -1;
+    }
+
+    return _pam_broker_reply(fd, pamh, retval);
+}
+
+/* Call a module that keeps its data here for the client */
+static int _pam_broker_run_module(pam_handle_t *pamh, int fd,
+				  struct pam_broker_msg *m)
+{
+    const char *mod_name;
+    int choice, flags, depth;
+
+    if (_pam_broker_get_int(m, &choice) != 0
+	|| _pam_broker_get_int(m, &flags) != 0
+	|| _pam_broker_get_int(m, &depth) != 0
+	|| _pam_broker_get_str(m, &mod_name) != 0)
+	return -1;
+
+    switch (choice) {
+    case PAM_SETCRED:
+    case PAM_OPEN_SESSION:
+    case PAM_CLOSE_SESSION:
+	break;
+    default:
+	return -1;
+    }
+
+    return _pam_broker_reply(fd, pamh,
+			     _pam_dispatch_module(pamh, flags, choice, depth,
+						  mod_name));
+}
+
+int pam_broker_serve(int fd)
+{
+    struct pam_conv conv = { _pam_broker_relay, NULL };
+    struct pam_broker_msg m;
+    pam_handle_t *pamh = NULL;
+    const char *service, *user, *confdir;
+    int retval, status = PAM_ABORT, on = 1, have;
+    struct ucred real;
+    uid_t peer;
+
+    D(("called"));
+
+    conv.appdata_ptr = &fd;
+    _pam_broker_msg_init(&m, 0);
+
+    if (setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)) != 0
+	|| _pam_broker_recv_creds(fd, &m, &real, &have) != 0
+	|| m.type != PAM_BROKER_START
+	|| _pam_broker_get_str(&m, &service) != 0 || service == NULL
+	|| _pam_broker_get_str(&m, &user) != 0
+	|| _pam_broker_get_str(&m, &confdir) != 0) {
+	_pam_broker_msg_free(&m);
+	return PAM_SYSTEM_ERR;
+    }
+
+    retval = _pam_broker_become_peer(fd, have ? &real : NULL, &peer);
+    if (retval != PAM_SUCCESS) {
+	_pam_broker_msg_free(&m);
+	return retval;
+    }
+
+    /* only root may choose the configuration the broker reads */
+    if (confdir != NULL && peer != 0) {
+	pam_syslog(NULL, LOG_ERR,
+		   "pam_broker_serve: confdir from unprivileged peer");
+	retval = PAM_PERM_DENIED;
+    } else {
+	retval = pam_start_confdir(service, user, &conv, confdir, &pamh);
+    }
+    _pam_broker_msg_free(&m);
+
+    if (pamh != NULL)
+	_pam_broker_end(pamh, PAM_SUCCESS);      /* never pass it on */
+
+    if (_pam_broker_reply(fd, NULL, retval) != 0 || retval != PAM_SUCCESS) {
+	if (pamh != NULL)
+	    pam_end(pamh, PAM_ABORT);
+	return retval != PAM_SUCCESS ? retval : PAM_SYSTEM_ERR;
+    }
+
+    for (;;) {
+	if (_pam_broker_recv(fd, &m) != 0) {
+	    retval = PAM_SYSTEM_ERR;
+	    break;
+	}
+	if (m.type == PAM_BROKER_CALL || m.type == PAM_BROKER_MODULE) {
+	    if ((m.type == PAM_BROKER_CALL ? _pam_broker_run(pamh, fd, &m)
+		 : _pam_broker_run_module(pamh, fd, &m)) != 0) {
+		retval = PAM_SYSTEM_ERR;
+		break;
+	    }
+	} else if (m.type == PAM_BROKER_RESET
+		   && _pam_broker_get_int(&m, &status) == 0) {
+	    pam_reset(pamh, NULL, status);
+	} else if (m.type == PAM_BROKER_END
+		   && _pam_broker_get_int(&m, &status) == 0) {
+	    retval = PAM_SUCCESS;
+	    break;
+	} else {
+	    retval = PAM_SYSTEM_ERR;
+	    break;
+	}
+	_pam_broker_msg_free(&m);
+    }
+    _pam_broker_msg_free(&m);
+
+    if (retval != PAM_SUCCESS)
+	pam_syslog(pamh, LOG_ERR, "pam_broker_serve: lost the client");
+    pam_end(pamh, status);
+
+    return retval;
+}
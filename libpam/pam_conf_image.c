@@ -0,0 +1,867 @@
+/* pam_conf_image.c -- compiled image of the pam.d configuration */
+
+/*
+ * Reading the configuration of a service means opening its file in
+ * /etc/pam.d, the files it includes and "other", and tokenizing every
+ * line of them.  pam_conf_image_write() does this once for every
+ * service of a configuration directory and saves the result, the
+ * arguments of the _pam_add_handler() calls, in a binary image next to
+ * the files (/etc/pam.d/.image).  _pam_init_handlers() maps the image
+ * and adds the handlers of the service from it without parsing
+ * anything.
+ *
+ * Like the stack cache, the image lists every file that was opened or
+ * looked for while a service was compiled, with its stat() information.
+ * If one of them has changed, the image was written by another version
+ * of libpam or a checksum does not match, the configuration is parsed
+ * as usual.
+ */
+
+#include "pam_private.h"
+#include "pam_inline.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PAM_IMAGE_MAGIC      "PAMIMAGE"
+#define PAM_IMAGE_VERSION    2
+#define PAM_IMAGE_BYTEORDER  0x01020304
+#define PAM_IMAGE_MAX_SIZE   (64 << 20)
+#define PAM_IMAGE_NONE       UINT32_MAX   /* no string */
+#define RECORD_CHUNK         16
+
+/*
+ * The image is the header, the index of the services sorted by name,
+ * the names, and an 8 byte aligned block for every service.  The header
+ * checksum covers everything up to the first block and every block has
+ * a checksum of its own, so that loading a service only reads its
+ * block.  Integers are in the byte order of the host that wrote it.
+ */
+struct pam_image_header {
+    char magic[8];
+    uint64_t checksum;           /* of the rest up to the first block */
+    uint32_t version;
+    uint32_t byteorder;
+    uint32_t return_values;      /* _PAM_RETURN_VALUES */
+    uint32_t nservices;
+    uint32_t names_len;          /* padded to 8 bytes */
+    uint32_t reserved;
+    char libpam[32];             /* PAM_VERSION */
+};
+
+struct pam_image_index {
+    uint32_t name;               /* offset in the names */
+    uint32_t offset;             /* of the block in the image */
+    uint32_t length;
+    uint32_t reserved;
+    uint64_t checksum;           /* of the block */
+};
+
+/* a block: this, the files, the handlers and their strings */
+struct pam_image_service {
+    uint32_t ndeps;
+    uint32_t nhandlers;
+    uint32_t strings_len;
+    uint32_t reserved;
+};
+
+struct pam_image_dep {
+    uint32_t path;               /* offset in the strings */
+    uint32_t exists;
+    uint32_t mode;
+    uint32_t reserved;
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+};
+
+struct pam_image_handler {
+    int32_t handler_type;
+    int32_t parallel;
+    int32_t other;
+    int32_t stack_level;
+    int32_t type;
+    int32_t actions[_PAM_RETURN_VALUES];
+    uint32_t mod_path;           /* offset in the strings or _NONE */
+    uint32_t argc;
+    uint32_t args;               /* the arguments, one after the other */
+    uint32_t args_len;
+};
+
+/* what _pam_init_handlers() did for one service, see pamh->handlers */
+struct _pam_conf_record {
+    struct pam_image_dep *deps;
+    int deps_used;
+    int deps_allocated;
+    struct pam_image_handler *handlers;
+    int handlers_used;
+    int handlers_allocated;
+    char *strings;
+    size_t strings_len;
+    size_t strings_allocated;
+    int failed;                  /* out of memory */
+};
+
+#define PAD8(x) (((x) + 7) & ~(size_t) 7)
+
+/* FNV-1a over 64 bit words, len is a multiple of 8 */
+static uint64_t _pam_image_checksum(const char *data, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL, word;
+    size_t i;
+
+    for (i = 0; i < len; i += sizeof(word)) {
+	memcpy(&word, data + i, sizeof(word));
+	hash ^= word;
+	hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+/* Make room for one more element of an array in the record */
+static void *_pam_record_grow(struct _pam_conf_record *rec, void *array,
+			      int used, int *allocated, size_t size)
+{
+    void *tmp;
+
+    if (rec->failed)
+	return NULL;
+    if (used < *allocated)
+	return array;
+
+    if ((tmp = realloc(array, (*allocated + RECORD_CHUNK) * size)) == NULL) {
+	rec->failed = 1;
+	return NULL;
+    }
+    *allocated += RECORD_CHUNK;
+
+    return tmp;
+}
+
+/* Reserve len bytes in the strings of the record, returns the offset */
+static uint32_t _pam_record_strings(struct _pam_conf_record *rec, size_t len)
+{
+    size_t offset = rec->strings_len;
+
+    if (rec->failed || len > PAM_IMAGE_MAX_SIZE - offset) {
+	rec->failed = 1;
+	return PAM_IMAGE_NONE;
+    }
+
+    if (offset + len > rec->strings_allocated) {
+	size_t size = 2 * rec->strings_allocated + len + 256;
+	char *tmp = realloc(rec->strings, size);
+
+	if (tmp == NULL) {
+	    rec->failed = 1;
+	    return PAM_IMAGE_NONE;
+	}
+	rec->strings = tmp;
+	rec->strings_allocated = size;
+    }
+    rec->strings_len += len;
+
+    return offset;
+}
+
+static uint32_t _pam_record_string(struct _pam_conf_record *rec,
+				   const char *s)
+{
+    size_t len = strlen(s) + 1;
+    uint32_t offset = _pam_record_strings(rec, len);
+
+    if (offset != PAM_IMAGE_NONE)
+	memcpy(rec->strings + offset, s, len);
+
+    return offset;
+}
+
+static void _pam_record_free(struct _pam_conf_record *rec)
+{
+    if (rec == NULL)
+	return;
+
+    _pam_drop(rec->deps);
+    _pam_drop(rec->handlers);
+    _pam_drop(rec->strings);
+    free(rec);
+}
+
+/*
+ * Remember that the service being compiled depends on path.  st is the
+ * stat() information of the file or NULL if it does not exist.
+ */
+void _pam_conf_image_note(pam_handle_t *pamh, const char *path,
+			  const struct stat *st)
+{
+    struct _pam_conf_record *rec = pamh->handlers.record;
+    struct pam_image_dep *dep;
+    uint32_t offset;
+
+    if (rec == NULL
+	|| (dep = _pam_record_grow(rec, rec->deps, rec->deps_used,
+				   &rec->deps_allocated,
+				   sizeof(*dep))) == NULL)
+	return;
+    rec->deps = dep;
+    if ((offset = _pam_record_string(rec, path)) == PAM_IMAGE_NONE)
+	return;
+
+    dep = &rec->deps[rec->deps_used++];
+    memset(dep, 0, sizeof(*dep));
+    dep->path = offset;
+    if (st != NULL) {
+	dep->exists = 1;
+	dep->mode = st->st_mode;
+	dep->dev = st->st_dev;
+	dep->ino = st->st_ino;
+	dep->size = st->st_size;
+	dep->mtime_sec = st->st_mtim.tv_sec;
+	dep->mtime_nsec = st->st_mtim.tv_nsec;
+	dep->ctime_sec = st->st_ctim.tv_sec;
+	dep->ctime_nsec = st->st_ctim.tv_nsec;
+    }
+}
+
+/* Remember a _pam_add_handler() call of the service being compiled */
+int _pam_conf_image_add(pam_handle_t *pamh, int handler_type, int parallel,
+			int other, int stack_level, int type, const int *actions,
+			const char *mod_path, int argc, char **argv)
+{
+    struct _pam_conf_record *rec = pamh->handlers.record;
+    struct pam_image_handler *h;
+    size_t len = 0;
+    int i;
+
+    if ((h = _pam_record_grow(rec, rec->handlers, rec->handlers_used,
+			      &rec->handlers_allocated,
+			      sizeof(*h))) == NULL) {
+	pam_syslog(pamh, LOG_CRIT, "cannot record handler");
+	return PAM_BUF_ERR;
+    }
+    rec->handlers = h;
+
+    h = &rec->handlers[rec->handlers_used];
+    memset(h, 0, sizeof(*h));
+    h->handler_type = handler_type;
+    h->parallel = parallel;
+    h->other = other;
+    h->stack_level = stack_level;
+    h->type = type;
+    for (i = 0; i < _PAM_RETURN_VALUES; i++)
+	h->actions[i] = actions[i];
+    h->mod_path = mod_path ? _pam_record_string(rec, mod_path)
+			   : PAM_IMAGE_NONE;
+    h->argc = argv ? argc : 0;
+    h->args = PAM_IMAGE_NONE;
+
+    for (i = 0; i < (int) h->argc; i++)
+	len += strlen(argv[i]) + 1;
+    if (h->argc > 0
+	&& (h->args = _pam_record_strings(rec, len)) != PAM_IMAGE_NONE) {
+	char *p = rec->strings + h->args;
+
+	for (i = 0; i < argc; i++)
+	    p = stpcpy(p, argv[i]) + 1;
+	h->args_len = len;
+    }
+
+    if (rec->failed) {
+	pam_syslog(pamh, LOG_CRIT, "cannot record handler");
+	return PAM_BUF_ERR;
+    }
+    rec->handlers_used++;
+
+    return PAM_SUCCESS;
+}
+
+/* Is the file unchanged since the image was written? */
+static int _pam_image_dep_valid(const struct pam_image_dep *dep,
+				const char *path, struct stat *st)
+{
+    if (stat(path, st) != 0)
+	return !dep->exists;
+    if (!dep->exists)
+	return 0;
+
+    /* for directories only the presence matters */
+    if (S_ISDIR(dep->mode) || S_ISDIR(st->st_mode))
+	return S_ISDIR(dep->mode) && S_ISDIR(st->st_mode);
+
+    return dep->dev == (uint64_t) st->st_dev
+	&& dep->ino == (uint64_t) st->st_ino
+	&& dep->size == (int64_t) st->st_size
+	&& dep->mtime_sec == (int64_t) st->st_mtim.tv_sec
+	&& dep->mtime_nsec == (int64_t) st->st_mtim.tv_nsec
+	&& dep->ctime_sec == (int64_t) st->st_ctim.tv_sec
+	&& dep->ctime_nsec == (int64_t) st->st_ctim.tv_nsec;
+}
+
+/*
+ * Look up the block of service in the image.  Returns NULL if the
+ * image cannot be used or has no entry for the service.
+ */
+static const struct pam_image_service *
+_pam_image_find(pam_handle_t *pamh, const char *image, size_t size,
+		const char *service, size_t *length)
+{
+    const struct pam_image_header *hdr = (const void *) image;
+    const struct pam_image_index *idx, *entry = NULL;
+    const char *names;
+    size_t meta;
+    uint32_t lo, hi, mid;
+    int cmp;
+
+    if (memcmp(hdr->magic, PAM_IMAGE_MAGIC, sizeof(hdr->magic))
+	|| hdr->version != PAM_IMAGE_VERSION
+	|| hdr->byteorder != PAM_IMAGE_BYTEORDER
+	|| hdr->return_values != _PAM_RETURN_VALUES
+	|| strncmp(hdr->libpam, PAM_VERSION, sizeof(hdr->libpam))) {
+	D(("image is of another format or version"));
+	return NULL;
+    }
+
+    if (hdr->nservices > size / sizeof(*idx) || hdr->names_len > size
+	|| hdr->names_len % 8 != 0)
+	goto corrupt;
+    meta = sizeof(*hdr) + hdr->nservices * sizeof(*idx) + hdr->names_len;
+    if (meta > size
+	|| _pam_image_checksum(image + offsetof(struct pam_image_header,
+						version),
+			       meta - offsetof(struct pam_image_header,
+					       version)) != hdr->checksum)
+	goto corrupt;
+
+    idx = (const void *) (image + sizeof(*hdr));
+    names = image + sizeof(*hdr) + hdr->nservices * sizeof(*idx);
+    if (hdr->names_len > 0 && names[hdr->names_len - 1] != '\0')
+	goto corrupt;
+
+    for (lo = 0, hi = hdr->nservices; lo < hi; ) {
+	mid = lo + (hi - lo) / 2;
+	if (idx[mid].name >= hdr->names_len)
+	    goto corrupt;
+	cmp = strcmp(service, names + idx[mid].name);
+	if (cmp == 0) {
+	    entry = &idx[mid];
+	    break;
+	}
+	if (cmp < 0)
+	    hi = mid;
+	else
+	    lo = mid + 1;
+    }
+    if (entry == NULL) {
+	D(("no %s in the image", service));
+	return NULL;
+    }
+
+    if (entry->offset < meta || entry->offset % 8 != 0
+	|| entry->offset > size || entry->length > size - entry->offset
+	|| entry->length % 8 != 0
+	|| entry->length < sizeof(struct pam_image_service)
+	|| _pam_image_checksum(image + entry->offset,
+			       entry->length) != entry->checksum)
+	goto corrupt;
+
+    *length = entry->length;
+    return (const void *) (image + entry->offset);
+
+corrupt:
+    pam_syslog(pamh, LOG_ERR, "ignoring corrupt configuration image");
+    return NULL;
+}
+
+/* Do the handlers of a block only refer to strings inside it? */
+static int _pam_image_block_valid(const struct pam_image_service *svc,
+				  size_t length)
+{
+    const struct pam_image_dep *deps = (const void *) (svc + 1);
+    const struct pam_image_handler *h;
+    const char *strings;
+    uint32_t i;
+
+    if (svc->ndeps > length / sizeof(*deps)
+	|| svc->nhandlers > length / sizeof(*h)
+	|| sizeof(*svc) + svc->ndeps * sizeof(*deps)
+	   + svc->nhandlers * sizeof(*h) + svc->strings_len > length)
+	return 0;
+
+    h = (const void *) (deps + svc->ndeps);
+    strings = (const char *) (h + svc->nhandlers);
+    if (svc->strings_len > 0 && strings[svc->strings_len - 1] != '\0')
+	return 0;
+
+    for (i = 0; i < svc->ndeps; i++) {
+	if (deps[i].path >= svc->strings_len)
+	    return 0;
+    }
+
+    for (i = 0; i < svc->nhandlers; i++, h++) {
+	if ((h->mod_path != PAM_IMAGE_NONE && h->mod_path >= svc->strings_len)
+	    || h->stack_level < 0 || h->stack_level >= PAM_SUBSTACK_MAX_LEVEL
+	    || h->argc > h->args_len)
+	    return 0;
+	if (h->argc > 0) {
+	    const char *p = strings + h->args, *end;
+	    uint32_t n;
+
+	    if (h->args >= svc->strings_len
+		|| h->args_len > svc->strings_len - h->args)
+		return 0;
+	    end = p + h->args_len;
+	    for (n = 0; n < h->argc && p < end; n++)
+		p += strlen(p) + 1;
+	    if (n != h->argc || p != end)
+		return 0;
+	}
+    }
+
+    return 1;
+}
+
+/* Add the handlers of a block to pamh */
+static int _pam_image_apply(pam_handle_t *pamh,
+			    const struct pam_image_service *svc)
+{
+    const struct pam_image_dep *deps = (const void *) (svc + 1);
+    const struct pam_image_handler *h;
+    const char *strings, *path;
+    struct stat st;
+    uint32_t i, j;
+    int actions[_PAM_RETURN_VALUES];
+
+    h = (const void *) (deps + svc->ndeps);
+    strings = (const char *) (h + svc->nhandlers);
+
+    for (i = 0; i < svc->ndeps; i++) {
+	path = strings + deps[i].path;
+	if (!_pam_image_dep_valid(&deps[i], path, &st)) {
+	    D(("%s has changed since the image was written", path));
+	    return PAM_IGNORE;
+	}
+	_pam_stack_cache_note(pamh, path, deps[i].exists ? &st : NULL);
+    }
+
+    for (i = 0; i < svc->nhandlers; i++, h++) {
+	char **argv = NULL;
+	int argvlen = 0;
+
+	if (h->argc > 0) {
+	    char *p;
+
+	    argvlen = h->argc * sizeof(char *) + h->args_len;
+	    if ((argv = malloc(argvlen)) == NULL) {
+		pam_syslog(pamh, LOG_CRIT, "cannot malloc argv");
+		return PAM_ABORT;
+	    }
+	    p = memcpy(argv + h->argc, strings + h->args, h->args_len);
+	    for (j = 0; j < h->argc; j++) {
+		argv[j] = p;
+		p += strlen(p) + 1;
+	    }
+	}
+
+	for (j = 0; j < _PAM_RETURN_VALUES; j++)
+	    actions[j] = h->actions[j];
+
+	if (_pam_add_handler(pamh, h->handler_type, h->parallel, h->other,
+			     h->stack_level, h->type, actions,
+			     h->mod_path == PAM_IMAGE_NONE ? NULL
+			     : strings + h->mod_path,
+			     h->argc, argv, argvlen) != PAM_SUCCESS) {
+	    pam_syslog(pamh, LOG_ERR, "error adding handlers from image");
+	    return PAM_ABORT;
+	}
+    }
+
+    return PAM_SUCCESS;
+}
+
+/*
+ * Add the handlers of pamh from the compiled image of its configuration
+ * directory.  Returns PAM_IGNORE if there is no usable image, the
+ * configuration has to be parsed then.
+ */
+int _pam_conf_image_load(pam_handle_t *pamh)
+{
+    const struct pam_image_service *svc;
+    const char *image = PAM_CONFIG_IMAGE;
+    char *path = NULL;
+    struct stat st;
+    size_t size, length;
+    void *map;
+    int fd, retval = PAM_IGNORE;
+
+    if (pamh->handlers.record != NULL)
+	return PAM_IGNORE;              /* compiling, see below */
+
+    if (pamh->confdir != NULL) {
+	if (asprintf(&path, "%s/%s", pamh->confdir,
+		     PAM_CONFIG_IMAGE_NAME) < 0)
+	    return PAM_IGNORE;
+	image = path;
+    }
+
+    fd = open(image, O_RDONLY | O_CLOEXEC);
+    _pam_drop(path);
+    if (fd < 0)
+	return PAM_IGNORE;
+
+    /* it is as trusted as the files, so it may not be writable by others */
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)
+	|| (st.st_mode & (S_IWGRP | S_IWOTH))
+	|| st.st_size < (off_t) sizeof(struct pam_image_header)
+	|| st.st_size > PAM_IMAGE_MAX_SIZE) {
+	close(fd);
+	return PAM_IGNORE;
+    }
+
+    size = st.st_size;
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+	return PAM_IGNORE;
+
+    svc = _pam_image_find(pamh, map, size, pamh->service_name, &length);
+    if (svc != NULL) {
+	if (_pam_image_block_valid(svc, length))
+	    retval = _pam_image_apply(pamh, svc);
+	else
+	    pam_syslog(pamh, LOG_ERR, "ignoring corrupt configuration image");
+    }
+
+    munmap(map, size);
+
+    return retval;
+}
+
+/* compiling */
+
+struct _pam_image_entry {
+    char *name;
+    struct _pam_conf_record *rec;
+};
+
+static int _pam_image_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct _pam_image_entry *) a)->name,
+		  ((const struct _pam_image_entry *) b)->name);
+}
+
+/* Collect the names of the files in the configuration directories */
+static int _pam_image_services(const char *confdir,
+			       struct _pam_image_entry **entries, int *count)
+{
+    const char *dirs[] = { PAM_CONFIG_D, PAM_CONFIG_DIST_D
+#ifdef PAM_CONFIG_DIST2_D
+			   , PAM_CONFIG_DIST2_D
+#endif
+    };
+    struct _pam_image_entry *list = NULL;
+    int used = 0, allocated = 0, i, j;
+    size_t d, ndirs = PAM_ARRAY_SIZE(dirs);
+    struct dirent *de;
+    DIR *dir;
+
+    if (confdir != NULL) {
+	dirs[0] = confdir;
+	ndirs = 1;
+    }
+
+    for (d = 0; d < ndirs; d++) {
+	if ((dir = opendir(dirs[d])) == NULL)
+	    continue;
+	while ((de = readdir(dir)) != NULL) {
+	    char *p;
+
+	    /* the image, its temporary files, ., .. */
+	    if (de->d_name[0] == '.' || de->d_type == DT_DIR)
+		continue;
+	    if (used == allocated) {
+		void *tmp = realloc(list, (allocated + RECORD_CHUNK)
+					  * sizeof(*list));
+		if (tmp == NULL)
+		    break;
+		list = tmp;
+		allocated += RECORD_CHUNK;
+	    }
+	    if ((list[used].name = _pam_strdup(de->d_name)) == NULL)
+		break;
+	    for (p = list[used].name; *p; ++p)
+		*p = tolower((unsigned char) *p);   /* like pam_start() */
+	    list[used++].rec = NULL;
+	}
+	closedir(dir);
+	if (de != NULL) {
+	    for (i = 0; i < used; i++)
+		free(list[i].name);
+	    free(list);
+	    return PAM_BUF_ERR;
+	}
+    }
+
+    if (used > 0)
+	qsort(list, used, sizeof(*list), _pam_image_cmp);
+    for (i = j = 0; i < used; i++) {
+	if (j > 0 && !strcmp(list[j-1].name, list[i].name))
+	    free(list[i].name);
+	else
+	    list[j++] = list[i];
+    }
+
+    *entries = list;
+    *count = j;
+
+    return PAM_SUCCESS;
+}
+
+/* Lay out the records of the services in one buffer */
+static char *_pam_image_build(const struct _pam_image_entry *entries,
+			      int count, size_t *size)
+{
+    struct pam_image_header *hdr;
+    struct pam_image_index *idx;
+    struct pam_image_service *svc;
+    const struct _pam_conf_record *rec;
+    size_t names_len = 0, meta, offset, length;
+    char *image, *names, *p;
+    int i, n = 0;
+
+    for (i = 0; i < count; i++) {
+	if (entries[i].rec == NULL)
+	    continue;
+	names_len += strlen(entries[i].name) + 1;
+	n++;
+    }
+    names_len = PAD8(names_len);
+    meta = sizeof(*hdr) + n * sizeof(*idx) + names_len;
+
+    offset = meta;
+    for (i = 0; i < count; i++) {
+	if ((rec = entries[i].rec) == NULL)
+	    continue;
+	offset += PAD8(sizeof(*svc) + rec->deps_used * sizeof(*rec->deps)
+		       + rec->handlers_used * sizeof(*rec->handlers)
+		       + rec->strings_len);
+    }
+    if (offset > PAM_IMAGE_MAX_SIZE) {
+	errno = EFBIG;
+	return NULL;
+    }
+
+    if ((image = calloc(1, offset)) == NULL)
+	return NULL;
+    *size = offset;
+
+    hdr = (void *) image;
+    idx = (void *) (image + sizeof(*hdr));
+    names = image + sizeof(*hdr) + n * sizeof(*idx);
+
+    memcpy(hdr->magic, PAM_IMAGE_MAGIC, sizeof(hdr->magic));
+    hdr->version = PAM_IMAGE_VERSION;
+    hdr->byteorder = PAM_IMAGE_BYTEORDER;
+    hdr->return_values = _PAM_RETURN_VALUES;
+    hdr->nservices = n;
+    hdr->names_len = names_len;
+    strncpy(hdr->libpam, PAM_VERSION, sizeof(hdr->libpam) - 1);
+
+    offset = meta;
+    p = names;
+    for (i = 0; i < count; i++) {
+	if ((rec = entries[i].rec) == NULL)
+	    continue;
+
+	idx->name = p - names;
+	p = stpcpy(p, entries[i].name) + 1;
+
+	svc = (void *) (image + offset);
+	svc->ndeps = rec->deps_used;
+	svc->nhandlers = rec->handlers_used;
+	svc->strings_len = rec->strings_len;
+	length = sizeof(*svc);
+	memcpy(image + offset + length, rec->deps,
+	       rec->deps_used * sizeof(*rec->deps));
+	length += rec->deps_used * sizeof(*rec->deps);
+	memcpy(image + offset + length, rec->handlers,
+	       rec->handlers_used * sizeof(*rec->handlers));
+	length += rec->handlers_used * sizeof(*rec->handlers);
+	if (rec->strings_len > 0)
+	    memcpy(image + offset + length, rec->strings, rec->strings_len);
+	length = PAD8(length + rec->strings_len);
+
+	idx->offset = offset;
+	idx->length = length;
+	idx->checksum = _pam_image_checksum(image + offset, length);
+	offset += length;
+	idx++;
+    }
+
+    hdr->checksum =
+	_pam_image_checksum(image + offsetof(struct pam_image_header, version),
+			    meta - offsetof(struct pam_image_header, version));
+
+    return image;
+}
+
+/* Replace path with the image, readers see either the old or new one */
+static int _pam_image_save(const char *path, const char *image, size_t size)
+{
+    char *tmp;
+    ssize_t n;
+    size_t done = 0;
+    int fd, saved_errno;
+
+    if (asprintf(&tmp, "%s.XXXXXX", path) < 0)
+	return PAM_BUF_ERR;
+
+    if ((fd = mkstemp(tmp)) < 0) {
+	saved_errno = errno;
+	pam_syslog(NULL, LOG_ERR, "cannot create %s: %m", tmp);
+	free(tmp);
+	errno = saved_errno;
+	return PAM_SYSTEM_ERR;
+    }
+
+    if (fchmod(fd, 0644) != 0)
+	goto fail;
+    while (done < size) {
+	n = write(fd, image + done, size - done);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    goto fail;
+	done += n;
+    }
+    if (fsync(fd) != 0)
+	goto fail;
+    if (close(fd) != 0) {
+	fd = -1;
+	goto fail;
+    }
+    fd = -1;
+    if (rename(tmp, path) != 0)
+	goto fail;
+
+    free(tmp);
+    return PAM_SUCCESS;
+
+fail:
+    saved_errno = errno;
+    pam_syslog(NULL, LOG_ERR, "cannot write %s: %m", path);
+    if (fd >= 0)
+	close(fd);
+    unlink(tmp);
+    free(tmp);
+    errno = saved_errno;
+    return PAM_SYSTEM_ERR;
+}
+
+static int _pam_image_conv(int num_msg UNUSED,
+			   const struct pam_message **msg UNUSED,
+			   struct pam_response **resp UNUSED,
+			   void *appdata_ptr UNUSED)
+{
+    return PAM_CONV_ERR;
+}
+
+int pam_conf_image_write(const char *confdir)
+{
+    const struct pam_conv conv = { _pam_image_conv, NULL };
+    struct _pam_image_entry *entries = NULL;
+    struct _pam_conf_record *rec;
+    pam_handle_t *pamh = NULL;
+    char *image = NULL, *path = NULL;
+    size_t size = 0;
+    int count = 0, i, retval, saved_errno = 0;
+
+    D(("called"));
+
+    if ((retval = _pam_image_services(confdir, &entries,
+				      &count)) != PAM_SUCCESS)
+	return retval;
+
+    retval = _pam_start_internal(PAM_DEFAULT_SERVICE, NULL, &conv, confdir,
+				 &pamh, 0);
+    if (retval != PAM_SUCCESS)
+	goto out;
+
+    for (i = 0; i < count; i++) {
+	if ((rec = calloc(1, sizeof(*rec))) == NULL
+	    || (retval = pam_set_item(pamh, PAM_SERVICE,
+				      entries[i].name)) != PAM_SUCCESS) {
+	    free(rec);
+	    retval = PAM_BUF_ERR;
+	    goto out;
+	}
+
+	pamh->handlers.record = rec;
+	retval = _pam_init_handlers(pamh);
+	pamh->handlers.record = NULL;
+	_pam_free_handlers(pamh);
+
+	if (rec->failed) {
+	    _pam_record_free(rec);
+	    retval = PAM_BUF_ERR;
+	    goto out;
+	}
+	if (retval != PAM_SUCCESS) {
+	    /* the service is left to the parser, which logs the same */
+	    pam_syslog(pamh, LOG_WARNING,
+		       "not compiling %s: cannot read its configuration",
+		       entries[i].name);
+	    _pam_record_free(rec);
+	    continue;
+	}
+	entries[i].rec = rec;
+    }
+
+    if ((image = _pam_image_build(entries, count, &size)) == NULL) {
+	saved_errno = errno;
+	retval = (errno == EFBIG) ? PAM_SYSTEM_ERR : PAM_BUF_ERR;
+	goto out;
+    }
+
+    if (confdir != NULL) {
+	if (asprintf(&path, "%s/%s", confdir, PAM_CONFIG_IMAGE_NAME) < 0) {
+	    path = NULL;
+	    retval = PAM_BUF_ERR;
+	    goto out;
+	}
+    } else if ((path = _pam_strdup(PAM_CONFIG_IMAGE)) == NULL) {
+	retval = PAM_BUF_ERR;
+	goto out;
+    }
+
+    retval = _pam_image_save(path, image, size);
+    saved_errno = errno;
+
+out:
+    if (pamh != NULL)
+	pam_end(pamh, retval);
+    for (i = 0; i < count; i++) {
+	_pam_record_free(entries[i].rec);
+	free(entries[i].name);
+    }
+    free(entries);
+    free(image);
+    free(path);
+    if (saved_errno != 0)
+	errno = saved_errno;
+
+    return retval;
+}
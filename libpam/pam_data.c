@@ -38,8 +38,22 @@
 #include <stdlib.h>
 #include <string.h>
 
+#define PAM_DATA_BUCKETS          16   /* initial size of the table */
+
+static unsigned int _pam_data_hash(const char *name)
+{
+    unsigned int hash = 2166136261U;     /* FNV-1a */
+
+    while (*name) {
+	hash ^= (unsigned char) *name++;
+	hash *= 16777619U;
+    }
+
+    return hash;
+}
+
 static struct pam_data *_pam_locate_data(const pam_handle_t *pamh,
-					 const char *name)
+					 const char *name, unsigned int hash)
 {
     struct pam_data *data;
 
@@ -47,25 +61,63 @@ static struct pam_data *_pam_locate_data(const pam_handle_t *pamh,
 
     IF_NO_PAMH("_pam_locate_data", pamh, NULL);
 
-    data = pamh->data;
+    if (pamh->data_table.size == 0) {
+	return NULL;
+    }
+
+    data = pamh->data_table.bucket[hash & (pamh->data_table.size - 1)];
 
     while (data) {
-	if (!strcmp(data->name, name)) {
+	if (data->hash == hash && !strcmp(data->name, name)) {
 	    return data;
 	}
-	data = data->next;
+	data = data->hash_next;
     }
 
     return NULL;
 }
 
-int pam_set_data(
+/*
+ * Make sure the table has a bucket for every entry, including one more
+ * to be added.  If memory is short, the chains just get longer.
+ */
+static void _pam_grow_data_table(pam_handle_t *pamh)
+{
+    struct pam_data_table *table = &pamh->data_table;
+    struct pam_data **bucket, *data;
+    unsigned int size;
+
+    if (table->count < table->size) {
+	return;
+    }
+
+    size = table->size ? table->size * 2 : PAM_DATA_BUCKETS;
+    if ((bucket = _pam_arena_alloc(pamh, size * sizeof(*bucket))) == NULL) {
+	if (table->size == 0)
+	    pam_syslog(pamh, LOG_CRIT,
+		       "pam_set_data: no memory for data table");
+	return;
+    }
+
+    memset(bucket, 0, size * sizeof(*bucket));
+    for (data = pamh->data; data; data = data->next) {
+	data->hash_next = bucket[data->hash & (size - 1)];
+	bucket[data->hash & (size - 1)] = data;
+    }
+
+    _pam_arena_free(pamh, table->bucket);
+    table->bucket = bucket;
+    table->size = size;
+}
+
+static int _pam_set_data(
     pam_handle_t *pamh,
     const char *module_data_name,
     void *data,
     void (*cleanup)(pam_handle_t *pamh, void *data, int error_status))
 {
     struct pam_data *data_entry;
+    unsigned int hash;
 
     D(("called"));
 
@@ -84,23 +136,36 @@ int pam_set_data(
 
     /* first check if there is some data already. If so clean it up */
 
-    if ((data_entry = _pam_locate_data(pamh, module_data_name))) {
+    hash = _pam_data_hash(module_data_name);
+    if ((data_entry = _pam_locate_data(pamh, module_data_name, hash))) {
 	if (data_entry->cleanup) {
 	    data_entry->cleanup(pamh, data_entry->data,
 				PAM_DATA_REPLACE | PAM_SUCCESS );
 	}
-    } else if ((data_entry = malloc(sizeof(*data_entry)))) {
+    } else if ((data_entry = _pam_arena_alloc(pamh, sizeof(*data_entry)))) {
 	char *tname;
+	unsigned int idx;
 
-	if ((tname = _pam_strdup(module_data_name)) == NULL) {
+	if ((tname = _pam_arena_strdup(pamh, module_data_name)) == NULL) {
 	    pam_syslog(pamh, LOG_CRIT,
 		       "pam_set_data: no memory for data name");
-	    _pam_drop(data_entry);
+	    _pam_arena_free(pamh, data_entry);
+	    return PAM_BUF_ERR;
+	}
+	_pam_grow_data_table(pamh);
+	if (pamh->data_table.size == 0) {
+	    _pam_arena_free(pamh, tname);
+	    _pam_arena_free(pamh, data_entry);
 	    return PAM_BUF_ERR;
 	}
 	data_entry->next = pamh->data;
 	pamh->data = data_entry;
 	data_entry->name = tname;
+	data_entry->hash = hash;
+	idx = hash & (pamh->data_table.size - 1);
+	data_entry->hash_next = pamh->data_table.bucket[idx];
+	pamh->data_table.bucket[idx] = data_entry;
+	pamh->data_table.count++;
     } else {
 	pam_syslog(pamh, LOG_CRIT,
 		   "pam_set_data: cannot allocate data entry");
@@ -109,11 +174,27 @@ int pam_set_data(
 
     data_entry->data = data;           /* note this could be NULL */
     data_entry->cleanup = cleanup;
+    data_entry->module = _pam_module_name(pamh);
 
     return PAM_SUCCESS;
 }
 
-int pam_get_data(
+int pam_set_data(
+    pam_handle_t *pamh,
+    const char *module_data_name,
+    void *data,
+    void (*cleanup)(pam_handle_t *pamh, void *data, int error_status))
+{
+    int retval;
+
+    _pam_parallel_lock(pamh);
+    retval = _pam_set_data(pamh, module_data_name, data, cleanup);
+    _pam_parallel_unlock(pamh);
+
+    return retval;
+}
+
+static int _pam_get_data(
     const pam_handle_t *pamh,
     const char *module_data_name,
     const void **datap)
@@ -135,7 +216,8 @@ int pam_get_data(
 	return PAM_SYSTEM_ERR;
     }
 
-    data = _pam_locate_data(pamh, module_data_name);
+    data = _pam_locate_data(pamh, module_data_name,
+			    _pam_data_hash(module_data_name));
     if (data) {
 	*datap = data->data;
 	return PAM_SUCCESS;
@@ -144,6 +226,20 @@ int pam_get_data(
     return PAM_NO_MODULE_DATA;
 }
 
+int pam_get_data(
+    const pam_handle_t *pamh,
+    const char *module_data_name,
+    const void **datap)
+{
+    int retval;
+
+    _pam_parallel_lock(pamh);
+    retval = _pam_get_data(pamh, module_data_name, datap);
+    _pam_parallel_unlock(pamh);
+
+    return retval;
+}
+
 void _pam_free_data(pam_handle_t *pamh, int status)
 {
     struct pam_data *last;
@@ -154,13 +250,19 @@ void _pam_free_data(pam_handle_t *pamh, int status)
     IF_NO_PAMH("_pam_free_data", pamh, /* no return value for void fn */);
     data = pamh->data;
 
+    /* the cleanup functions see an empty store */
+    pamh->data = NULL;
+    _pam_arena_drop(pamh, pamh->data_table.bucket);
+    pamh->data_table.size = pamh->data_table.count = 0;
+
+    /* newest first, as the entries are on the stack */
     while (data) {
 	last = data;
 	data = data->next;
 	if (last->cleanup) {
 	    last->cleanup(pamh, last->data, status);
 	}
-	_pam_drop(last->name);
-	_pam_drop(last);
+	_pam_arena_drop(pamh, last->name);
+	_pam_arena_drop(pamh, last);
     }
 }
@@ -83,7 +83,9 @@ static unsigned int _pam_compute_delay(unsigned int seed, unsigned int base)
  * actual time slept is computed above. It is based on the requested
  * time but will differ by up to +/- 50%. If the PAM_FAIL_DELAY item is
  * set by the client, this function will call the function referenced by
- * that item, overriding the default behavior.
+ * that item, overriding the default behavior. If the application asked
+ * for it with pam_fail_delay_defer(), the time to wait until is noted
+ * instead of sleeping.
  */
 
 void _pam_await_timer(pam_handle_t *pamh, int status)
@@ -91,6 +93,9 @@ void _pam_await_timer(pam_handle_t *pamh, int status)
     unsigned int delay;
     D(("waiting?..."));
 
+    pamh->fail_delay.deadline.tv_sec = 0;
+    pamh->fail_delay.deadline.tv_nsec = 0;
+
     delay = _pam_compute_delay(pamh->fail_delay.begin,
 			       pamh->fail_delay.delay);
     if (pamh->fail_delay.delay_fn_ptr) {
@@ -115,9 +120,24 @@ void _pam_await_timer(pam_handle_t *pamh, int status)
 
 	D(("will wait %u usec", delay));
 
-	if (delay > 0) {
+	if (delay > 0 && pamh->fail_delay.defer
+	    && clock_gettime(CLOCK_MONOTONIC,
+			     &pamh->fail_delay.deadline) == 0) {
+	    struct timespec *deadline = &pamh->fail_delay.deadline;
+
+	    D(("leaving the wait to the application"));
+	    deadline->tv_sec += delay / 1000000;
+	    deadline->tv_nsec += (long) (delay % 1000000) * 1000;
+	    if (deadline->tv_nsec >= 1000000000) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	    }
+	} else if (delay > 0) {
 	    struct timeval tval;
 
+	    pamh->fail_delay.deadline.tv_sec = 0;
+	    pamh->fail_delay.deadline.tv_nsec = 0;
+
 	    tval.tv_sec  = delay / 1000000;
 	    tval.tv_usec = delay % 1000000;
 	    select(0, NULL, NULL, NULL, &tval);
@@ -158,3 +178,37 @@ int pam_fail_delay(pam_handle_t *pamh, unsigned int usec)
 
      return PAM_SUCCESS;
 }
+
+/* **********************************************************************
+ * these functions let an event driven application wait for the delay
+ * itself, without blocking in libpam.
+ */
+
+int pam_fail_delay_defer(pam_handle_t *pamh, int defer)
+{
+     IF_NO_PAMH("pam_fail_delay_defer", pamh, PAM_SYSTEM_ERR);
+
+     if (__PAM_FROM_MODULE(pamh)) {
+	  D(("called from module!?"));
+	  return PAM_SYSTEM_ERR;
+     }
+
+     pamh->fail_delay.defer = defer ? PAM_TRUE : PAM_FALSE;
+
+     return PAM_SUCCESS;
+}
+
+int pam_fail_delay_deadline(const pam_handle_t *pamh,
+			    struct timespec *deadline)
+{
+     IF_NO_PAMH("pam_fail_delay_deadline", pamh, PAM_SYSTEM_ERR);
+
+     if (deadline == NULL) {
+	  D(("called with NULL deadline"));
+	  return PAM_SYSTEM_ERR;
+     }
+
+     *deadline = pamh->fail_delay.deadline;
+
+     return PAM_SUCCESS;
+}
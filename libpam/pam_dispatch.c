@@ -6,9 +6,11 @@
  */
 
 #include "pam_private.h"
+#include "pam_probes.h"
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 /*
  * this is the return code we return when a function pointer is NULL
@@ -31,15 +33,19 @@
  * when combining the return code of each module.
  */
 
-static int _pam_dispatch_aux(pam_handle_t *pamh, int flags, struct handler *h,
+static int _pam_dispatch_aux(pam_handle_t *pamh, int flags,
+			     const struct handler_chain *chain,
 			     _pam_boolean resumed, int use_cached_chain)
 {
-    int depth, impression, status, skip_depth, prev_level, stack_level;
-    struct _pam_substack_state *substates = NULL;
+    int depth, next, impression, status, prev_level, stack_level;
+    int par_begin = 0, par_end = 0, par_retval[_PAM_PARALLEL_MAX];
+    struct _pam_substack_state *substates;
+    const struct handler *h;
+    struct handler_state *st;
 
     IF_NO_PAMH("_pam_dispatch_aux", pamh, PAM_SYSTEM_ERR);
 
-    if (h == NULL) {
+    if (chain == NULL || chain->count == 0) {
         const void *service=NULL;
 
 	(void) pam_get_item(pamh, PAM_SERVICE, &service);
@@ -49,42 +55,34 @@ static int _pam_dispatch_aux(pam_handle_t *pamh, int flags, struct handler *h,
 	return PAM_MUST_FAIL_CODE;
     }
 
+    /* the substack states live in pamh, so they survive PAM_INCOMPLETE */
+    substates = pamh->former.substates;
+
     /* if we are recalling this module stack because a former call did
        not complete, we restore the state of play from pamh. */
     if (resumed) {
-	skip_depth = pamh->former.depth;
+	depth = pamh->former.depth;
 	status = pamh->former.status;
 	impression = pamh->former.impression;
-	substates = pamh->former.substates;
 	/* forget all that */
 	pamh->former.impression = _PAM_UNDEF;
 	pamh->former.status = PAM_MUST_FAIL_CODE;
 	pamh->former.depth = 0;
-	pamh->former.substates = NULL;
     } else {
-	skip_depth = 0;
-	substates = malloc(PAM_SUBSTACK_MAX_LEVEL * sizeof(*substates));
-	if (substates == NULL) {
-	    pam_syslog(pamh, LOG_CRIT,
-		       "_pam_dispatch_aux: no memory for substack states");
-	    return PAM_BUF_ERR;
-	}
+	depth = 0;
 	substates[0].impression = impression = _PAM_UNDEF;
 	substates[0].status = status = PAM_MUST_FAIL_CODE;
     }
 
-    prev_level = 0;
-
     /* Loop through module logic stack */
-    for (depth=0 ; h != NULL ; prev_level = stack_level, h = h->next, ++depth) {
+    for ( ; depth < chain->count ; depth = next) {
 	int retval, cached_retval, action;
 
+	h = &chain->handlers[depth];
+	st = &chain->state[depth];
+	next = depth + 1;
         stack_level = h->stack_level;
-
-	/* skip leading modules if they have already returned */
-	if (depth < skip_depth) {
-	    continue;
-	}
+	prev_level = depth > 0 ? h[-1].stack_level : 0;
 
 	/* remember state if we are entering a substack */
 	if (prev_level < stack_level) {
@@ -92,6 +90,13 @@ static int _pam_dispatch_aux(pam_handle_t *pamh, int flags, struct handler *h,
 	    substates[stack_level].status = status;
 	}
 
+	/* consecutive parallel modules are called at once, see
+	   pam_parallel.c; their results are taken one by one below */
+	if (h->parallel && depth >= par_end) {
+	    par_begin = depth;
+	    par_end = _pam_parallel_run(pamh, flags, chain, depth, par_retval);
+	}
+
 	/* attempt to call the module */
 	if (h->handler_type == PAM_HT_MUST_FAIL) {
 	    D(("module poorly listed in PAM config; forcing failure"));
@@ -102,12 +107,27 @@ static int _pam_dispatch_aux(pam_handle_t *pamh, int flags, struct handler *h,
 	} else if (h->func == NULL) {
 	    D(("module function is not defined, indicating failure"));
 	    retval = PAM_MODULE_UNKNOWN;
+	} else if (depth < par_end) {
+	    retval = par_retval[depth - par_begin];
+	} else if (_pam_broker_holds(pamh, h->mod_name)) {
+	    /* the module keeps its data in the broker, see pam_broker.c */
+	    retval = _pam_broker_module(pamh, flags, depth, h->mod_name);
 	} else {
+	    struct timespec begin;
+	    int timed = _pam_module_stats_enabled()
+		&& clock_gettime(CLOCK_MONOTONIC, &begin) == 0;
+
 	    D(("passing control to module..."));
 	    pamh->mod_name=h->mod_name;
 	    pamh->mod_argc = h->argc;
 	    pamh->mod_argv = h->argv;
+	    PAM_PROBE3(libpam, module__entry, pamh->service_name,
+		       pamh->choice, h->mod_name);
 	    retval = h->func(pamh, flags, h->argc, h->argv);
+	    PAM_PROBE4(libpam, module__return, pamh->service_name,
+		       pamh->choice, h->mod_name, retval);
+	    if (timed)
+		_pam_module_stats_record(pamh, h->mod_name, &begin, retval);
 	    pamh->mod_name=NULL;
 	    pamh->mod_argc = 0;
 	    pamh->mod_argv = NULL;
@@ -125,7 +145,6 @@ static int _pam_dispatch_aux(pam_handle_t *pamh, int flags, struct handler *h,
 	    pamh->former.impression = impression;
 	    pamh->former.status = status;
 	    pamh->former.depth = depth;
-	    pamh->former.substates = substates;
 
 	    D(("module %d returned PAM_INCOMPLETE", depth));
 	    return retval;
@@ -141,7 +160,7 @@ static int _pam_dispatch_aux(pam_handle_t *pamh, int flags, struct handler *h,
 
 	    /* a former stack execution should have frozen the chain */
 
-	    cached_retval = *(h->cached_retval_p);
+	    cached_retval = chain->frozen[depth].cached_retval;
 	    if (cached_retval == _PAM_INVALID_RETVAL) {
 
 		/* This may be a problem condition. It implies that
@@ -171,7 +190,7 @@ static int _pam_dispatch_aux(pam_handle_t *pamh, int flags, struct handler *h,
 	    }
 	} else {
 	    /* this stack execution is defining the frozen chain */
-	    cached_retval = h->cached_retval = retval;
+	    cached_retval = st->cached_retval = retval;
 	}
 
 	/* verify that the return value is a valid one */
@@ -219,7 +238,7 @@ static int _pam_dispatch_aux(pam_handle_t *pamh, int flags, struct handler *h,
 	    }
 	    if ( impression == _PAM_POSITIVE ) {
 		if ( retval == PAM_SUCCESS ) {
-		    h->grantor = 1;
+		    st->grantor = 1;
 		}
 
 		if ( action == _PAM_ACTION_DONE ) {
@@ -254,10 +273,12 @@ static int _pam_dispatch_aux(pam_handle_t *pamh, int flags, struct handler *h,
 	    break;
 
         /* if we get here, we expect action is a positive number --
-           this is what the ...JUMP macro checks. */
+           this is what the ...JUMP macro checks.  _pam_resolve_chain()
+           has made it the index of the module to continue with. */
 
 	default:
-	    if ( _PAM_ACTION_IS_JUMP(action) ) {
+	    if ( _PAM_ACTION_IS_JUMP(action)
+		 || action == _PAM_ACTION_BAD_JUMP ) {
 
 		/* If we are evaluating a cached chain, we treat this
 		   module as required (aka _PAM_ACTION_OK) as well as
@@ -269,7 +290,7 @@ static int _pam_dispatch_aux(pam_handle_t *pamh, int flags, struct handler *h,
 			    && status == PAM_SUCCESS) ) {
 			if ( retval != PAM_IGNORE || cached_retval == retval ) {
 			    if ( impression == _PAM_UNDEF && retval == PAM_SUCCESS ) {
-				h->grantor = 1;
+				st->grantor = 1;
 			    }
 			    impression = _PAM_POSITIVE;
 			    status = retval;
@@ -277,33 +298,26 @@ static int _pam_dispatch_aux(pam_handle_t *pamh, int flags, struct handler *h,
 		    }
 		}
 
-		/* this means that we need to skip #action stacked modules */
-		while (h->next != NULL && h->next->stack_level >= stack_level && action > 0) {
-		    do {
-			h = h->next;
-			++depth;
-		    } while (h->next != NULL && h->next->stack_level > stack_level);
-		    --action;
+		/* this means that we need to skip the stacked modules */
+		if (action > 0) {
+		    next = action;
+		    continue;
 		}
 
-		/* note if we try to skip too many modules action is
-                   still non-zero and we snag the next if. */
+		/* if we try to skip too many modules we leave the
+		   substack and snag the next if. */
+		next = h->substack_end;
 	    }
 
 	    /* this case is a syntax error: we can't succeed */
-	    if (action) {
-		pam_syslog(pamh, LOG_ERR, "bad jump in stack");
-		impression = _PAM_NEGATIVE;
-		status = PAM_MUST_FAIL_CODE;
-	    }
+	    pam_syslog(pamh, LOG_ERR, "bad jump in stack");
+	    impression = _PAM_NEGATIVE;
+	    status = PAM_MUST_FAIL_CODE;
 	}
 	continue;
 
 decision_made:     /* by getting  here we have made a decision */
-	while (h->next != NULL && h->next->stack_level >= stack_level) {
-	    h = h->next;
-	    ++depth;
-	}
+	next = h->substack_end;
     }
 
     /* Sanity check */
@@ -312,15 +326,16 @@ decision_made:     /* by getting  here we have made a decision */
 	status = PAM_MUST_FAIL_CODE;
     }
 
-    free(substates);
     /* We have made a decision about the modules executed */
     return status;
 }
 
-static void _pam_clear_grantors(struct handler *h)
+static void _pam_clear_grantors(const struct handler_chain *chain)
 {
-    for (; h != NULL; h = h->next) {
-	h->grantor = 0;
+    int i;
+
+    for (i = 0; chain != NULL && i < chain->count; i++) {
+	chain->state[i].grantor = 0;
     }
 }
 
@@ -331,79 +346,68 @@ static void _pam_clear_grantors(struct handler *h)
  * module stack.
  */
 
+static struct handler_chain *_pam_choose_chain(struct handlers *handlers,
+					       int choice)
+{
+    switch (choice) {
+    case PAM_AUTHENTICATE:
+	return &handlers->authenticate;
+    case PAM_SETCRED:
+	return &handlers->setcred;
+    case PAM_ACCOUNT:
+	return &handlers->acct_mgmt;
+    case PAM_OPEN_SESSION:
+	return &handlers->open_session;
+    case PAM_CLOSE_SESSION:
+	return &handlers->close_session;
+    case PAM_CHAUTHTOK:
+	return &handlers->chauthtok;
+    default:
+	return NULL;
+    }
+}
+
 int _pam_dispatch(pam_handle_t *pamh, int flags, int choice)
 {
-    struct handler *h = NULL;
+    struct handler_chain *h = NULL;
     int retval = PAM_SYSTEM_ERR, use_cached_chain;
     _pam_boolean resumed;
 
     IF_NO_PAMH("_pam_dispatch", pamh, PAM_SYSTEM_ERR);
 
+    PAM_PROBE3(libpam, dispatch__entry, pamh->service_name, choice, flags);
+
     if (__PAM_FROM_MODULE(pamh)) {
 	D(("called from a module!?"));
 	goto end;
     }
 
-    /* Load all modules, resolve all symbols */
+    /* Read the configuration, the modules are loaded further down */
 
     if ((retval = _pam_init_handlers(pamh)) != PAM_SUCCESS) {
 	pam_syslog(pamh, LOG_ERR, "unable to dispatch function");
 	goto end;
     }
 
-    use_cached_chain = _PAM_PLEASE_FREEZE;
-
-    switch (choice) {
-    case PAM_AUTHENTICATE:
-	h = pamh->handlers.conf.authenticate;
-	break;
-    case PAM_SETCRED:
-	h = pamh->handlers.conf.setcred;
-	use_cached_chain = _PAM_MAY_BE_FROZEN;
-	break;
-    case PAM_ACCOUNT:
-	h = pamh->handlers.conf.acct_mgmt;
-	break;
-    case PAM_OPEN_SESSION:
-	h = pamh->handlers.conf.open_session;
-	break;
-    case PAM_CLOSE_SESSION:
-	h = pamh->handlers.conf.close_session;
-	use_cached_chain = _PAM_MAY_BE_FROZEN;
-	break;
-    case PAM_CHAUTHTOK:
-	h = pamh->handlers.conf.chauthtok;
-	break;
-    default:
+    h = _pam_choose_chain(&pamh->handlers.conf, choice);
+    if (h == NULL) {
 	pam_syslog(pamh, LOG_ERR, "undefined fn choice; %d", choice);
 	retval = PAM_ABORT;
 	goto end;
     }
-
-    if (h == NULL) {     /* there was no handlers.conf... entry; will use
+    if (h->count == 0) { /* there was no handlers.conf... entry; will use
 			  * handlers.other... */
-	switch (choice) {
-	case PAM_AUTHENTICATE:
-	    h = pamh->handlers.other.authenticate;
-	    break;
-	case PAM_SETCRED:
-	    h = pamh->handlers.other.setcred;
-	    break;
-	case PAM_ACCOUNT:
-	    h = pamh->handlers.other.acct_mgmt;
-	    break;
-	case PAM_OPEN_SESSION:
-	    h = pamh->handlers.other.open_session;
-	    break;
-	case PAM_CLOSE_SESSION:
-	    h = pamh->handlers.other.close_session;
-	    break;
-	case PAM_CHAUTHTOK:
-	    h = pamh->handlers.other.chauthtok;
-	    break;
-	}
+	h = _pam_choose_chain(&pamh->handlers.other, choice);
     }
 
+    if (choice == PAM_SETCRED || choice == PAM_CLOSE_SESSION)
+	use_cached_chain = _PAM_MAY_BE_FROZEN;
+    else
+	use_cached_chain = _PAM_PLEASE_FREEZE;
+
+    /* the modules of a chain are loaded when it is needed first */
+    _pam_load_chain(pamh, h);
+
     /* Did a module return an "incomplete state" last time? */
     if (pamh->former.choice != PAM_NOT_STACKED) {
 	if (pamh->former.choice != choice) {
@@ -444,5 +448,57 @@ end:
     }
 #endif
 
+    PAM_PROBE3(libpam, dispatch__return, pamh->service_name, choice, retval);
+
+    return retval;
+}
+
+/*
+ * Call the module at depth of the stack of choice, as _pam_dispatch()
+ * would.  The broker calls the setcred and session functions of the
+ * modules that keep their data there this way.
+ */
+int _pam_dispatch_module(pam_handle_t *pamh, int flags, int choice,
+			 int depth, const char *mod_name)
+{
+    struct handler_chain *chain;
+    const struct handler *h;
+    int retval;
+
+    IF_NO_PAMH("_pam_dispatch_module", pamh, PAM_SYSTEM_ERR);
+
+    if (_pam_init_handlers(pamh) != PAM_SUCCESS
+	|| (chain = _pam_choose_chain(&pamh->handlers.conf, choice)) == NULL)
+	return PAM_SYSTEM_ERR;
+    if (chain->count == 0)
+	chain = _pam_choose_chain(&pamh->handlers.other, choice);
+    _pam_load_chain(pamh, chain);
+
+    /* both ends read the same configuration */
+    if (depth < 0 || depth >= chain->count) {
+	pam_syslog(pamh, LOG_ERR, "no module %d to call", depth);
+	return PAM_SYSTEM_ERR;
+    }
+    h = &chain->handlers[depth];
+    if (mod_name == NULL || h->mod_name == NULL
+	|| strcmp(h->mod_name, mod_name) != 0) {
+	pam_syslog(pamh, LOG_ERR, "module %d is not %s", depth,
+		   mod_name ? mod_name : "<unknown>");
+	return PAM_SYSTEM_ERR;
+    }
+    if (h->func == NULL)
+	return PAM_MODULE_UNKNOWN;
+
+    __PAM_TO_MODULE(pamh);
+    pamh->choice = choice;
+    pamh->mod_name = h->mod_name;
+    pamh->mod_argc = h->argc;
+    pamh->mod_argv = h->argv;
+    retval = h->func(pamh, flags, h->argc, h->argv);
+    pamh->mod_name = NULL;
+    pamh->mod_argc = 0;
+    pamh->mod_argv = NULL;
+    __PAM_TO_APP(pamh);
+
     return retval;
 }
@@ -7,6 +7,51 @@
 #include "pam_private.h"
 
 #include <stdlib.h>
+#include <string.h>
+
+/*
+ * Drop the items describing a transaction.  The service, conversation
+ * and fail delay function belong to the handle and are kept.
+ */
+
+static void _pam_drop_transaction(pam_handle_t *pamh)
+{
+    _pam_overwrite(pamh->authtok);            /* blank out old token */
+    _pam_arena_drop(pamh, pamh->authtok);
+
+    _pam_overwrite(pamh->oldauthtok);         /* blank out old token */
+    _pam_arena_drop(pamh, pamh->oldauthtok);
+
+    _pam_overwrite(pamh->former.prompt);
+    _pam_arena_drop(pamh, pamh->former.prompt); /* drop saved prompt */
+
+    _pam_overwrite(pamh->user);
+    _pam_arena_drop(pamh, pamh->user);
+
+    _pam_overwrite(pamh->prompt);
+    _pam_arena_drop(pamh, pamh->prompt);   /* prompt for pam_get_user() */
+
+    _pam_overwrite(pamh->tty);
+    _pam_arena_drop(pamh, pamh->tty);
+
+    _pam_overwrite(pamh->rhost);
+    _pam_arena_drop(pamh, pamh->rhost);
+
+    _pam_overwrite(pamh->ruser);
+    _pam_arena_drop(pamh, pamh->ruser);
+
+    _pam_overwrite(pamh->xdisplay);
+    _pam_arena_drop(pamh, pamh->xdisplay);
+
+    _pam_overwrite(pamh->xauth.name);
+    _pam_arena_drop(pamh, pamh->xauth.name);
+    _pam_overwrite_n(pamh->xauth.data, (unsigned int)pamh->xauth.datalen);
+    _pam_arena_drop(pamh, pamh->xauth.data);
+    _pam_overwrite_n((char *)&pamh->xauth, sizeof(pamh->xauth));
+
+    _pam_overwrite(pamh->authtok_type);
+    _pam_arena_drop(pamh, pamh->authtok_type);
+}
 
 int pam_end(pam_handle_t *pamh, int pam_status)
 {
@@ -25,11 +70,17 @@ int pam_end(pam_handle_t *pamh, int pam_status)
     _pam_audit_end(pamh, pam_status);
 #endif
 
+    _pam_broker_end(pamh, pam_status);
+
     /* first liberate the modules (it is not inconcevible that the
        modules may need to use the service_name etc. to clean up) */
 
     _pam_free_data(pamh, pam_status);
 
+    /* the module data may have pointed into these */
+
+    _pam_modutil_cache_free(pamh);
+
     /* now drop all modules */
 
     if ((ret = _pam_free_handlers(pamh)) != PAM_SUCCESS) {
@@ -41,55 +92,74 @@ int pam_end(pam_handle_t *pamh, int pam_status)
 
     _pam_drop_env(pamh);                      /* purge the environment */
 
-    _pam_overwrite(pamh->authtok);            /* blank out old token */
-    _pam_drop(pamh->authtok);
-
-    _pam_overwrite(pamh->oldauthtok);         /* blank out old token */
-    _pam_drop(pamh->oldauthtok);
-
-    _pam_overwrite(pamh->former.prompt);
-    _pam_drop(pamh->former.prompt);           /* drop saved prompt */
+    _pam_drop_transaction(pamh);
 
     _pam_overwrite(pamh->service_name);
     _pam_drop(pamh->service_name);
 
-    _pam_overwrite(pamh->user);
-    _pam_drop(pamh->user);
+    _pam_drop(pamh->confdir);
 
-    _pam_overwrite(pamh->prompt);
-    _pam_drop(pamh->prompt);                  /* prompt for pam_get_user() */
+    _pam_async_end(pamh);
+    _pam_drop(pamh->pam_conversation);
+    pamh->fail_delay.delay_fn_ptr = NULL;
 
-    _pam_overwrite(pamh->tty);
-    _pam_drop(pamh->tty);
+    _pam_arena_release(pamh);
 
-    _pam_overwrite(pamh->rhost);
-    _pam_drop(pamh->rhost);
+    /* and finally liberate the memory for the pam_handle structure */
 
-    _pam_overwrite(pamh->ruser);
-    _pam_drop(pamh->ruser);
+    _pam_drop(pamh);
 
-    _pam_drop(pamh->pam_conversation);
-    pamh->fail_delay.delay_fn_ptr = NULL;
+    D(("exiting pam_end() successfully"));
 
-    _pam_drop(pamh->former.substates);
+    return PAM_SUCCESS;
+}
 
-    _pam_overwrite(pamh->xdisplay);
-    _pam_drop(pamh->xdisplay);
+int pam_reset(pam_handle_t *pamh, const char *user, int pam_status)
+{
+    char *new_user = NULL;
 
-    _pam_overwrite(pamh->xauth.name);
-    _pam_drop(pamh->xauth.name);
-    _pam_overwrite_n(pamh->xauth.data, (unsigned int)pamh->xauth.datalen);
-    _pam_drop(pamh->xauth.data);
-    _pam_overwrite_n((char *)&pamh->xauth, sizeof(pamh->xauth));
+    D(("entering pam_reset()"));
 
-    _pam_overwrite(pamh->authtok_type);
-    _pam_drop(pamh->authtok_type);
+    IF_NO_PAMH("pam_reset", pamh, PAM_SYSTEM_ERR);
 
-    /* and finally liberate the memory for the pam_handle structure */
+    if (__PAM_FROM_MODULE(pamh)) {
+	D(("called from module!?"));
+	return PAM_SYSTEM_ERR;
+    }
 
-    _pam_drop(pamh);
+    if (user != NULL && (new_user = _pam_strdup(user)) == NULL) {
+	pam_syslog(pamh, LOG_CRIT, "pam_reset: _pam_strdup failed for user");
+	return PAM_BUF_ERR;
+    }
 
-    D(("exiting pam_end() successfully"));
+#ifdef HAVE_LIBAUDIT
+    _pam_audit_end(pamh, pam_status);
+    pamh->audit_state = 0;
+#endif
+
+    _pam_broker_reset(pamh, pam_status);
+
+    /* the modules clean up as they would in pam_end() */
+
+    _pam_free_data(pamh, pam_status);
+    _pam_modutil_cache_free(pamh);
+
+    /* the handlers stay loaded, but forget the last transaction */
+
+    _pam_reset_handlers(pamh);
+    _pam_async_end(pamh);
+
+    _pam_clear_env(pamh);
+    _pam_drop_transaction(pamh);
+    _pam_arena_clear(pamh);
+
+    pamh->user = new_user;
+    pamh->authtok_verified = 0;
+    memset(&pamh->former, 0, sizeof(pamh->former));
+    pamh->former.choice = PAM_NOT_STACKED;
+    _pam_reset_timer(pamh);
+
+    D(("exiting pam_reset() successfully"));
 
     return PAM_SUCCESS;
 }
@@ -101,7 +101,7 @@ void _pam_drop_env(pam_handle_t *pamh)
 	for (i=pamh->env->requested-1; i-- > 0; ) {
 	    D(("dropping #%3d>%s<", i, pamh->env->list[i]));
 	    _pam_overwrite(pamh->env->list[i]);          /* clean */
-	    _pam_drop(pamh->env->list[i]);              /* forget */
+	    _pam_arena_drop(pamh, pamh->env->list[i]);  /* forget */
 	}
 	pamh->env->requested = 0;
 	pamh->env->entries = 0;
@@ -112,6 +112,27 @@ void _pam_drop_env(pam_handle_t *pamh)
     }
 }
 
+/*
+ * empty the environment, but keep the list for reuse
+ */
+
+void _pam_clear_env(pam_handle_t *pamh)
+{
+    D(("called."));
+    IF_NO_PAMH("_pam_clear_env", pamh, /* nothing to return */);
+
+    if (pamh->env != NULL) {
+	int i;
+
+	for (i=pamh->env->requested-1; i-- > 0; ) {
+	    _pam_overwrite(pamh->env->list[i]);          /* clean */
+	    _pam_arena_drop(pamh, pamh->env->list[i]);  /* forget */
+	}
+	pamh->env->requested = 1;
+	pamh->env->list[0] = NULL;
+    }
+}
+
 /*
  * Return the item number of the given variable = first 'length' chars
  * of 'name_value'. Since this is a static function, it is safe to
@@ -149,7 +170,7 @@ static int _pam_search_env(const struct pam_environ *env
  *      name_value = "NAME"
  */
 
-int pam_putenv(pam_handle_t *pamh, const char *name_value)
+static int _pam_putenv(pam_handle_t *pamh, const char *name_value)
 {
     int l2eq, item, retval;
 
@@ -228,14 +249,14 @@ int pam_putenv(pam_handle_t *pamh, const char *name_value)
 	    D(("replacing item: %s\n          with: %s"
 	       , pamh->env->list[item], name_value));
 	    _pam_overwrite(pamh->env->list[item]);
-	    _pam_drop(pamh->env->list[item]);
+	    _pam_arena_drop(pamh, pamh->env->list[item]);
 	}
 
 	/*
 	 * now we have a place to put the new env-item, insert at 'item'
 	 */
 
-	pamh->env->list[item] = _pam_strdup(name_value);
+	pamh->env->list[item] = _pam_arena_strdup(pamh, name_value);
 	if (pamh->env->list[item] != NULL) {
 	    _pam_dump_env(pamh);                   /* only when debugging */
 	    return PAM_SUCCESS;
@@ -262,7 +283,7 @@ int pam_putenv(pam_handle_t *pamh, const char *name_value)
 
     D(("deleting: env#%3d:[%s]", item, pamh->env->list[item]));
     _pam_overwrite(pamh->env->list[item]);
-    _pam_drop(pamh->env->list[item]);
+    _pam_arena_drop(pamh, pamh->env->list[item]);
     --(pamh->env->requested);
     D(("mmove: item[%d]+%d -> item[%d]"
        , item+1, ( pamh->env->requested - item ), item));
@@ -278,11 +299,22 @@ int pam_putenv(pam_handle_t *pamh, const char *name_value)
     return retval;
 }
 
+int pam_putenv(pam_handle_t *pamh, const char *name_value)
+{
+    int retval;
+
+    _pam_parallel_lock(pamh);
+    retval = _pam_putenv(pamh, name_value);
+    _pam_parallel_unlock(pamh);
+
+    return retval;
+}
+
 /*
  *  Return the value of the requested environment variable
  */
 
-const char *pam_getenv(pam_handle_t *pamh, const char *name)
+static const char *_pam_getenv(pam_handle_t *pamh, const char *name)
 {
     int item;
 
@@ -316,6 +348,17 @@ const char *pam_getenv(pam_handle_t *pamh, const char *name)
     }
 }
 
+const char *pam_getenv(pam_handle_t *pamh, const char *name)
+{
+    const char *value;
+
+    _pam_parallel_lock(pamh);
+    value = _pam_getenv(pamh, name);
+    _pam_parallel_unlock(pamh);
+
+    return value;
+}
+
 static char **_copy_env(pam_handle_t *pamh)
 {
     char **dump;
@@ -355,7 +398,7 @@ static char **_copy_env(pam_handle_t *pamh)
     return dump;
 }
 
-char **pam_getenvlist(pam_handle_t *pamh)
+static char **_pam_getenvlist(pam_handle_t *pamh)
 {
     int i;
 
@@ -390,3 +433,14 @@ char **pam_getenvlist(pam_handle_t *pamh)
 
     return _copy_env(pamh);
 }
+
+char **pam_getenvlist(pam_handle_t *pamh)
+{
+    char **list;
+
+    _pam_parallel_lock(pamh);
+    list = _pam_getenvlist(pamh);
+    _pam_parallel_unlock(pamh);
+
+    return list;
+}
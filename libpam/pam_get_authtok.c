@@ -53,23 +53,28 @@
 static const char *
 get_option (pam_handle_t *pamh, const char *option)
 {
-  int i;
+  char **argv;
+  int argc, i;
   size_t len;
 
 
-  if (option == NULL || pamh == NULL ||
-      pamh->mod_argc == 0 || pamh->mod_argv == NULL)
+  if (option == NULL || pamh == NULL)
+    return NULL;
+
+  /* those of the module calling, also in a parallel one */
+  argc = _pam_module_args (pamh, &argv);
+  if (argc == 0 || argv == NULL)
     return NULL;
 
   len = strlen (option);
 
-  for (i = 0; i < pamh->mod_argc; i++)
+  for (i = 0; i < argc; i++)
     {
-      if (strncmp (option, pamh->mod_argv[i], len) == 0)
+      if (strncmp (option, argv[i], len) == 0)
         {
-          if (pamh->mod_argv[i][len] == '=')
-            return &(pamh->mod_argv[i][len+1]);
-          else if (pamh->mod_argv[i][len] == '\0')
+          if (argv[i][len] == '=')
+            return &(argv[i][len+1]);
+          else if (argv[i][len] == '\0')
             return "";
         }
     }
@@ -170,6 +175,14 @@ pam_get_authtok_internal (pam_handle_t *pamh, int item,
   else
     retval = pam_prompt (pamh, PAM_PROMPT_ECHO_OFF, &resp[0], "%s", PROMPT);
 
+  if (retval == PAM_CONV_AGAIN)
+    {
+      /* the application answers later, the module asks again then */
+      _pam_overwrite (resp[0]);
+      _pam_drop (resp[0]);
+      return PAM_CONV_AGAIN;
+    }
+
   if (retval != PAM_SUCCESS || resp[0] == NULL ||
       (chpass > 1 && resp[1] == NULL))
     {
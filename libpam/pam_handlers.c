@@ -8,7 +8,9 @@
 
 #include "pam_private.h"
 #include "pam_inline.h"
+#include "pam_probes.h"
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -19,6 +21,8 @@
 
 #define BUF_SIZE                  1024
 #define MODULE_CHUNK              4
+#define HANDLER_CHUNK             8
+#define MODULE_TABLE_SIZE         64
 #define UNKNOWN_MODULE       "<*unknown module*>"
 #ifndef _PAM_ISA
 #define _PAM_ISA "."
@@ -26,12 +30,16 @@
 
 static int _pam_assemble_line(FILE *f, char *buf, int buf_len);
 
-static void _pam_free_handlers_aux(struct handler **hp);
+static void _pam_free_handlers_aux(struct handler_chain *chain, int shared);
+static int _pam_resolve_chains(pam_handle_t *pamh,
+			       struct handlers *the_handlers);
+static int _pam_init_state(pam_handle_t *pamh);
 
-static int _pam_add_handler(pam_handle_t *pamh
-		     , int must_fail, int other, int stack_level, int type
-		     , int *actions, const char *mod_path
-		     , int argc, char **argv, int argvlen);
+/* the chains of a service, setcred and close_session follow their primary */
+#define PAM_CHAINS 12
+static void _pam_service_chains(struct service *svc,
+				struct handler_chain *chains[PAM_CHAINS],
+				struct handler_chain *primary[PAM_CHAINS]);
 
 /* Values for module type */
 
@@ -72,6 +80,7 @@ static int _pam_parse_conf_file(pam_handle_t *pamh, FILE *f
 	int other;            /* set if module is for PAM_DEFAULT_SERVICE */
 	int res;              /* module added successfully? */
 	int handler_type = PAM_HT_MODULE; /* regular handler from a module */
+	int parallel = 0;     /* may run at once with its neighbours */
 	int argc;
 	char **argv;
 	int argvlen;
@@ -173,6 +182,18 @@ static int _pam_parse_conf_file(pam_handle_t *pamh, FILE *f
 		actions[PAM_SUCCESS] = _PAM_ACTION_OK;
 		actions[PAM_NEW_AUTHTOK_REQD] = _PAM_ACTION_OK;
 		_pam_set_default_control(actions, _PAM_ACTION_IGNORE);
+	    } else if (!strcasecmp("parallel", tok)) {
+		D(("*PAM_F_PARALLEL*"));
+		/* optional, but run at once with the parallel neighbours */
+		actions[PAM_SUCCESS] = _PAM_ACTION_OK;
+		actions[PAM_NEW_AUTHTOK_REQD] = _PAM_ACTION_OK;
+		_pam_set_default_control(actions, _PAM_ACTION_IGNORE);
+		if (module_type == PAM_T_SESS)
+		    parallel = 1;
+		else
+		    pam_syslog(pamh, LOG_WARNING,
+			       "(%s) parallel is for session modules only,"
+			       " treating as optional", this_service);
 	    } else if (!strcasecmp("sufficient", tok)) {
 		D(("*PAM_F_SUFFICIENT*"));
 		actions[PAM_SUCCESS] = _PAM_ACTION_DONE;
@@ -196,7 +217,7 @@ static int _pam_parse_conf_file(pam_handle_t *pamh, FILE *f
 	    tok = _pam_StrTok(NULL, " \n\t", &nexttok);
 	    if (pam_include) {
 		if (substack) {
-		    res = _pam_add_handler(pamh, PAM_HT_SUBSTACK, other,
+		    res = _pam_add_handler(pamh, PAM_HT_SUBSTACK, 0, other,
 				stack_level, module_type, actions, tok,
 				0, NULL, 0);
 		    if (res != PAM_SUCCESS) {
@@ -261,7 +282,8 @@ static int _pam_parse_conf_file(pam_handle_t *pamh, FILE *f
 	    }
 #endif
 
-	    res = _pam_add_handler(pamh, handler_type, other, stack_level
+	    res = _pam_add_handler(pamh, handler_type, parallel, other
+				   , stack_level
 				   , module_type, actions, mod_path
 				   , argc, argv, argvlen);
 	    if (res != PAM_SUCCESS) {
@@ -275,6 +297,50 @@ static int _pam_parse_conf_file(pam_handle_t *pamh, FILE *f
     return ( (x < 0) ? PAM_ABORT:PAM_SUCCESS );
 }
 
+/* Tell the stack cache and the image being compiled about a file */
+static void
+_pam_note_config(pam_handle_t *pamh, const char *path, const struct stat *st)
+{
+    _pam_stack_cache_note(pamh, path, st);
+    _pam_conf_image_note(pamh, path, st);
+}
+
+/*
+ * fopen() a configuration file and tell the stack cache about it, also
+ * when it does not exist: creating it later changes the configuration.
+ */
+static FILE *
+_pam_open_noted(pam_handle_t *pamh, const char *path)
+{
+    FILE *f;
+    struct stat st;
+
+    f = fopen(path, "r");
+    if (pamh->handlers.pending != NULL || pamh->handlers.record != NULL) {
+	if (f != NULL ? fstat(fileno(f), &st) == 0 : stat(path, &st) == 0)
+	    _pam_note_config(pamh, path, &st);
+	else
+	    _pam_note_config(pamh, path, NULL);
+    }
+
+    return f;
+}
+
+/* stat() a configuration directory and tell the stack cache about it */
+static int
+_pam_config_dir_exists(pam_handle_t *pamh, const char *path)
+{
+    struct stat st;
+
+    if (stat(path, &st) != 0) {
+	_pam_note_config(pamh, path, NULL);
+	return 0;
+    }
+    _pam_note_config(pamh, path, &st);
+
+    return S_ISDIR(st.st_mode);
+}
+
 static int
 _pam_open_config_file(pam_handle_t *pamh
 			, const char *service
@@ -306,7 +372,7 @@ _pam_open_config_file(pam_handle_t *pamh
 
     if (p != NULL) {
 	D(("opening %s", p));
-	f = fopen(p, "r");
+	f = _pam_open_noted(pamh, p);
 	if (f != NULL) {
 	    *path = p;
 	    *file = f;
@@ -323,7 +389,7 @@ _pam_open_config_file(pam_handle_t *pamh
 	}
 
 	D(("opening %s", p));
-	f = fopen(p, "r");
+	f = _pam_open_noted(pamh, p);
 	if (f != NULL) {
 	    *path = p;
 	    *file = f;
@@ -384,7 +450,7 @@ static int _pam_load_conf_file(pam_handle_t *pamh, const char *config_name
     return retval;
 }
 
-/* Parse config file, allocate handler structures, dlopen() */
+/* Parse config file, allocate handler structures */
 int _pam_init_handlers(pam_handle_t *pamh)
 {
     FILE *f;
@@ -403,16 +469,6 @@ int _pam_init_handlers(pam_handle_t *pamh)
     /* First clean the service structure */
 
     _pam_free_handlers(pamh);
-    if (! pamh->handlers.module) {
-	if ((pamh->handlers.module =
-	     malloc(MODULE_CHUNK * sizeof(struct loaded_module))) == NULL) {
-	    pam_syslog(pamh, LOG_CRIT,
-		       "_pam_init_handlers: no memory loading module");
-	    return PAM_BUF_ERR;
-	}
-	pamh->handlers.modules_allocated = MODULE_CHUNK;
-	pamh->handlers.modules_used = 0;
-    }
 
     if (pamh->service_name == NULL) {
 	return PAM_BAD_ITEM;                /* XXX - better error? */
@@ -440,19 +496,31 @@ int _pam_init_handlers(pam_handle_t *pamh)
     }
 #endif /* PAM_LOCKING */
 
+    /* Has the stack been parsed by another handle already? */
+    if (pamh->handlers.record == NULL && !pamh->handlers.refresh
+	&& _pam_stack_cache_attach(pamh) == PAM_SUCCESS) {
+	if (_pam_init_state(pamh) != PAM_SUCCESS) {
+	    _pam_free_handlers(pamh);
+	    return PAM_BUF_ERR;
+	}
+	pamh->handlers.handlers_loaded = 1;
+	return PAM_SUCCESS;
+    }
+
+    _pam_stack_cache_begin(pamh);
+    PAM_PROBE1(libpam, config__entry, pamh->service_name);
+
     /*
-     * Now parse the config file(s) and add handlers
+     * Now take the handlers from the compiled image, or parse the
+     * config file(s) and add them
      */
-    {
-	struct stat test_d;
-
+    if ((retval = _pam_conf_image_load(pamh)) == PAM_IGNORE) {
 	/* Is there a PAM_CONFIG_D directory? */
 	if (pamh->confdir != NULL ||
-	    (stat(PAM_CONFIG_D, &test_d) == 0 && S_ISDIR(test_d.st_mode)) ||
-	    (stat(PAM_CONFIG_DIST_D, &test_d) == 0 && S_ISDIR(test_d.st_mode))
+	    _pam_config_dir_exists(pamh, PAM_CONFIG_D) ||
+	    _pam_config_dir_exists(pamh, PAM_CONFIG_DIST_D)
 #ifdef PAM_CONFIG_DIST2_D
-	    || (stat(PAM_CONFIG_DIST2_D, &test_d) == 0
-		&& S_ISDIR(test_d.st_mode))
+	    || _pam_config_dir_exists(pamh, PAM_CONFIG_DIST2_D)
 #endif
 	   ) {
 	    char *path = NULL;
@@ -482,7 +550,7 @@ int _pam_init_handlers(pam_handle_t *pamh)
 		D(("checking %s", PAM_CONFIG));
 
 		if (pamh->confdir == NULL
-		    && (f = fopen(PAM_CONFIG,"r")) != NULL) {
+		    && (f = _pam_open_noted(pamh, PAM_CONFIG)) != NULL) {
 		    retval = _pam_parse_conf_file(pamh, f, NULL, PAM_T_ANY, 0, 1);
 		    fclose(f);
 		} else
@@ -528,9 +596,11 @@ int _pam_init_handlers(pam_handle_t *pamh)
 		}
 	    }
 	} else {
-	    if ((f = fopen(PAM_CONFIG, "r")) == NULL) {
+	    if ((f = _pam_open_noted(pamh, PAM_CONFIG)) == NULL) {
 		pam_syslog(pamh, LOG_ERR, "_pam_init_handlers: could not open "
 				PAM_CONFIG );
+		_pam_stack_cache_commit(pamh, PAM_ABORT);
+		PAM_PROBE2(libpam, config__return, pamh->service_name, PAM_ABORT);
 		return PAM_ABORT;
 	    }
 
@@ -545,14 +615,33 @@ int _pam_init_handlers(pam_handle_t *pamh)
 	}
     }
 
+    if (retval == PAM_SUCCESS) {
+	/* Turn the chains into their final form */
+	if (_pam_resolve_chains(pamh, &pamh->handlers.conf) != PAM_SUCCESS
+	    || _pam_resolve_chains(pamh, &pamh->handlers.other) != PAM_SUCCESS)
+	    retval = PAM_ABORT;
+    }
+
     if (retval != PAM_SUCCESS) {
 	/* Read error */
 	pam_syslog(pamh, LOG_ERR, "error reading PAM configuration file");
+	_pam_stack_cache_commit(pamh, retval);
+	PAM_PROBE2(libpam, config__return, pamh->service_name, PAM_ABORT);
 	return PAM_ABORT;
     }
 
     pamh->handlers.handlers_loaded = 1;
 
+    /* Share the parsed stack with later handles, if asked to */
+    _pam_stack_cache_commit(pamh, retval);
+
+    if (_pam_init_state(pamh) != PAM_SUCCESS) {
+	_pam_free_handlers(pamh);
+	PAM_PROBE2(libpam, config__return, pamh->service_name, PAM_BUF_ERR);
+	return PAM_BUF_ERR;
+    }
+    PAM_PROBE2(libpam, config__return, pamh->service_name, PAM_SUCCESS);
+
     D(("_pam_init_handlers exiting"));
     return PAM_SUCCESS;
 }
@@ -668,125 +757,340 @@ extract_modulename(const char *mod_path)
   return retval;
 }
 
-static struct loaded_module *
-_pam_load_module(pam_handle_t *pamh, const char *mod_path, int handler_type)
+/*
+ * The modules loaded by all handles of the process.  A module is
+ * dlopen()ed and its pam_sm_* functions are resolved once; every
+ * handler list (of a handle or of a cached stack) referencing it holds
+ * a reference, and the module is dlclose()d with the last one.  Reading
+ * the configuration only enters the modules into the table; they are
+ * dlopen()ed by _pam_load_chain() when a chain that lists them is
+ * dispatched for the first time, so that short lived applications do
+ * not load the modules of the functions they never call.  A module that
+ * cannot be loaded is taken out of the table at once, so the next
+ * handle that lists it tries dlopen() again; the handler lists holding
+ * the faulty entry keep it until they release it.
+ */
+
+static struct {
+    pthread_mutex_t lock;
+    struct loaded_module *bucket[MODULE_TABLE_SIZE];
+} _pam_modules = { PTHREAD_MUTEX_INITIALIZER, { NULL } };
+
+static const char * const _pam_sm_symbols[PAM_SM_FUNCS] = {
+    "pam_sm_authenticate",
+    "pam_sm_setcred",
+    "pam_sm_acct_mgmt",
+    "pam_sm_open_session",
+    "pam_sm_close_session",
+    "pam_sm_chauthtok"
+};
+
+static unsigned int _pam_module_hash(const char *mod_path)
 {
-    int x = 0;
-    int success;
-    struct loaded_module *mod;
+    unsigned int hash = 2166136261U;     /* FNV-1a */
+
+    while (*mod_path) {
+	hash ^= (unsigned char) *mod_path++;
+	hash *= 16777619U;
+    }
 
-    D(("_pam_load_module: loading module `%s'", mod_path));
+    return hash % MODULE_TABLE_SIZE;
+}
 
-    mod = pamh->handlers.module;
+/* Take mod out of the table.  Must be called with _pam_modules.lock held. */
+static void _pam_unlink_module(struct loaded_module *mod)
+{
+    struct loaded_module **mp;
 
-    /* First, ensure the module is loaded */
-    while (x < pamh->handlers.modules_used) {
-	if (!strcmp(mod[x].name, mod_path)) {  /* case sensitive ! */
+    for (mp = &_pam_modules.bucket[_pam_module_hash(mod->name)];
+	 *mp != NULL; mp = &(*mp)->next) {
+	if (*mp == mod) {
+	    *mp = mod->next;
 	    break;
 	}
-	x++;
     }
-    if (x == pamh->handlers.modules_used) {
-	/* Not found */
-	if (pamh->handlers.modules_allocated == pamh->handlers.modules_used) {
-	    /* will need more memory */
-	    void *tmp = realloc(pamh->handlers.module,
-                               (pamh->handlers.modules_allocated+MODULE_CHUNK)
-                               *sizeof(struct loaded_module));
-	    if (tmp == NULL) {
-		D(("cannot enlarge module pointer memory"));
-		pam_syslog(pamh, LOG_CRIT,
-				"realloc returned NULL in _pam_load_module");
-		return NULL;
-	    }
-	    pamh->handlers.module = tmp;
-	    pamh->handlers.modules_allocated += MODULE_CHUNK;
-	}
-	mod = &(pamh->handlers.module[x]);
-	/* Be pessimistic... */
-	success = PAM_ABORT;
-
-	D(("_pam_load_module: _pam_dlopen(%s)", mod_path));
-	mod->dl_handle = _pam_dlopen(mod_path);
-	D(("_pam_load_module: _pam_dlopen'ed"));
-	D(("_pam_load_module: dlopen'ed"));
-	if (mod->dl_handle == NULL) {
-	    const char *isa = strstr(mod_path, "$ISA");
-	    size_t isa_len = strlen("$ISA");
-
-	    if (isa != NULL) {
-		size_t pam_isa_len = strlen(_PAM_ISA);
-		char *mod_full_isa_path =
-			malloc(strlen(mod_path) - isa_len + pam_isa_len + 1);
-
-		if (mod_full_isa_path == NULL) {
-		    D(("_pam_load_module: couldn't get memory for mod_path"));
-		    pam_syslog(pamh, LOG_CRIT, "no memory for module path");
-		    success = PAM_ABORT;
-		} else {
-		    char *p = mod_full_isa_path;
+    mod->next = NULL;
+}
 
-		    memcpy(p, mod_path, isa - mod_path);
-		    p += isa - mod_path;
-		    memcpy(p, _PAM_ISA, pam_isa_len);
-		    p += pam_isa_len;
-		    strcpy(p, isa + isa_len);
+/*
+ * dlopen() a module and resolve its functions, faulty and out of the
+ * table if that fails.  Must be called with _pam_modules.lock held.
+ */
+static void
+_pam_open_module(pam_handle_t *pamh, struct loaded_module *mod,
+		 int handler_type)
+{
+    const char *mod_path = mod->name;
+    int i;
+
+    D(("_pam_open_module: _pam_dlopen(%s)", mod_path));
+    mod->dl_handle = _pam_dlopen(mod_path);
+    D(("_pam_open_module: _pam_dlopen'ed"));
+    if (mod->dl_handle == NULL) {
+	const char *isa = strstr(mod_path, "$ISA");
+	size_t isa_len = strlen("$ISA");
+
+	if (isa != NULL) {
+	    size_t pam_isa_len = strlen(_PAM_ISA);
+	    char *mod_full_isa_path =
+		    malloc(strlen(mod_path) - isa_len + pam_isa_len + 1);
+
+	    if (mod_full_isa_path == NULL) {
+		D(("_pam_open_module: couldn't get memory for mod_path"));
+		pam_syslog(pamh, LOG_CRIT, "no memory for module path");
+	    } else {
+		char *p = mod_full_isa_path;
 
-		    mod->dl_handle = _pam_dlopen(mod_full_isa_path);
-		    _pam_drop(mod_full_isa_path);
-		}
+		memcpy(p, mod_path, isa - mod_path);
+		p += isa - mod_path;
+		memcpy(p, _PAM_ISA, pam_isa_len);
+		p += pam_isa_len;
+		strcpy(p, isa + isa_len);
+
+		mod->dl_handle = _pam_dlopen(mod_full_isa_path);
+		_pam_drop(mod_full_isa_path);
 	    }
 	}
-	if (mod->dl_handle == NULL) {
-	    D(("_pam_load_module: _pam_dlopen(%s) failed", mod_path));
-	    if (handler_type != PAM_HT_SILENT_MODULE)
-		pam_syslog(pamh, LOG_ERR, "unable to dlopen(%s): %s", mod_path,
-		    _pam_dlerror());
-	    /* Don't abort yet; static code may be able to find function.
-	     * But defaults to abort if nothing found below... */
-	} else {
-	    D(("module added successfully"));
-	    success = PAM_SUCCESS;
-	    mod->type = PAM_MT_DYNAMIC_MOD;
-	    pamh->handlers.modules_used++;
+    }
+    if (mod->dl_handle == NULL) {
+	D(("_pam_open_module: _pam_dlopen(%s) failed", mod_path));
+	if (handler_type != PAM_HT_SILENT_MODULE)
+	    pam_syslog(pamh, LOG_ERR, "unable to dlopen(%s): %s", mod_path,
+		_pam_dlerror());
+	/* add a malformed module */
+	mod->type = PAM_MT_FAULTY_MOD;
+	_pam_unlink_module(mod);
+	if (handler_type != PAM_HT_SILENT_MODULE)
+	    pam_syslog(pamh, LOG_ERR, "adding faulty module: %s", mod_path);
+    } else {
+	D(("module added successfully"));
+	mod->type = PAM_MT_DYNAMIC_MOD;
+	for (i = 0; i < PAM_SM_FUNCS; i++) {
+	    mod->func[i] = _pam_dlsym(mod->dl_handle, _pam_sm_symbols[i]);
 	}
+    }
+}
+
+static void _pam_release_module(struct loaded_module *mod)
+{
+    int last;
+
+    pthread_mutex_lock(&_pam_modules.lock);
+    last = (--mod->refcount == 0);
+    if (last)
+	_pam_unlink_module(mod);
+    pthread_mutex_unlock(&_pam_modules.lock);
 
-	if (success != PAM_SUCCESS) {	         /* add a malformed module */
-	    mod->dl_handle = NULL;
-	    mod->type = PAM_MT_FAULTY_MOD;
-	    pamh->handlers.modules_used++;
-	    if (handler_type != PAM_HT_SILENT_MODULE)
-		pam_syslog(pamh, LOG_ERR, "adding faulty module: %s", mod_path);
-	    success = PAM_SUCCESS;  /* We have successfully added a module */
+    if (last) {
+	D(("_pam_release_module: dlclose(%s)", mod->name));
+	if (mod->type == PAM_MT_DYNAMIC_MOD) {
+	    _pam_dlclose(mod->dl_handle);
 	}
+	_pam_drop(mod->name);
+	free(mod);
+    }
+}
+
+static struct loaded_module *
+_pam_load_module(pam_handle_t *pamh, const char *mod_path)
+{
+    struct loaded_module *mod;
+    unsigned int hash;
+
+    D(("_pam_load_module: adding module `%s'", mod_path));
 
-	/* indicate its name - later we will search for it by this */
-	if ((mod->name = _pam_strdup(mod_path)) == NULL) {
+    /* make room for the reference first, dropping it again is awkward */
+    if (pamh->handlers.modules_allocated == pamh->handlers.modules_used) {
+	void *tmp = realloc(pamh->handlers.module,
+			    (pamh->handlers.modules_allocated+MODULE_CHUNK)
+			    *sizeof(*pamh->handlers.module));
+	if (tmp == NULL) {
+	    D(("cannot enlarge module pointer memory"));
+	    pam_syslog(pamh, LOG_CRIT,
+		       "realloc returned NULL in _pam_load_module");
+	    return NULL;
+	}
+	pamh->handlers.module = tmp;
+	pamh->handlers.modules_allocated += MODULE_CHUNK;
+    }
+
+    hash = _pam_module_hash(mod_path);
+
+    pthread_mutex_lock(&_pam_modules.lock);
+    for (mod = _pam_modules.bucket[hash]; mod != NULL; mod = mod->next) {
+	if (!strcmp(mod->name, mod_path)) {  /* case sensitive ! */
+	    break;
+	}
+    }
+    if (mod == NULL) {
+	if ((mod = calloc(1, sizeof(*mod))) == NULL
+	    || (mod->name = _pam_strdup(mod_path)) == NULL) {
 	    D(("_pam_load_module: couldn't get memory for mod_path"));
 	    pam_syslog(pamh, LOG_CRIT, "no memory for module path");
-	    success = PAM_ABORT;
+	    _pam_drop(mod);
+	} else {
+	    mod->type = PAM_MT_LAZY_MOD;
+	    mod->next = _pam_modules.bucket[hash];
+	    _pam_modules.bucket[hash] = mod;
 	}
+    }
+    if (mod != NULL)
+	mod->refcount++;
+    pthread_mutex_unlock(&_pam_modules.lock);
+
+    if (mod != NULL)
+	pamh->handlers.module[pamh->handlers.modules_used++] = mod;
+
+    return mod;
+}
 
-    } else {                           /* x != pamh->handlers.modules_used */
-	mod += x;                                    /* the located module */
-	success = PAM_SUCCESS;
+/*
+ * Load the modules of a chain that is about to be dispatched and
+ * resolve the functions of its handlers.  A module that cannot be
+ * loaded is faulty, like a missing function its handlers fail with
+ * PAM_MODULE_UNKNOWN.
+ */
+void _pam_load_chain(pam_handle_t *pamh, struct handler_chain *chain)
+{
+    struct handler *h;
+    int i, type;
+
+    if (chain->loaded)
+	return;
+
+    for (i = 0; i < chain->count; i++) {
+	h = &chain->handlers[i];
+	if (h->module == NULL)
+	    continue;
+
+	pthread_mutex_lock(&_pam_modules.lock);
+	if (h->module->type == PAM_MT_LAZY_MOD)
+	    _pam_open_module(pamh, h->module, h->handler_type);
+	type = h->module->type;
+	h->func = (type == PAM_MT_DYNAMIC_MOD) ? h->module->func[h->sym]
+					       : NULL;
+	pthread_mutex_unlock(&_pam_modules.lock);
+
+	if (type == PAM_MT_DYNAMIC_MOD && h->func == NULL)
+	    pam_syslog(pamh, LOG_ERR, "unable to resolve symbol: %s",
+		       _pam_sm_symbols[h->sym]);
     }
-    return success == PAM_SUCCESS ? mod : NULL;
+
+    chain->loaded = 1;
+}
+
+/* Load the modules of all chains of svc */
+void _pam_load_chains(pam_handle_t *pamh, struct service *svc)
+{
+    struct handler_chain *chains[PAM_CHAINS];
+    int c;
+
+    _pam_service_chains(svc, chains, NULL);
+    for (c = 0; c < PAM_CHAINS; c++)
+	_pam_load_chain(pamh, chains[c]);
+}
+
+/* Append a cleared handler to a chain */
+static struct handler *_pam_new_handler(pam_handle_t *pamh,
+					struct handler_chain *chain)
+{
+    struct handler *h;
+
+    if (chain->count == chain->allocated) {
+	void *tmp = realloc(chain->handlers,
+			    (chain->allocated + HANDLER_CHUNK)
+			    * sizeof(*chain->handlers));
+	if (tmp == NULL) {
+	    pam_syslog(pamh, LOG_CRIT, "cannot malloc struct handler");
+	    return NULL;
+	}
+	chain->handlers = tmp;
+	chain->allocated += HANDLER_CHUNK;
+    }
+
+    h = &chain->handlers[chain->count++];
+    memset(h, 0, sizeof(*h));
+
+    return h;
+}
+
+/*
+ * Prepare a chain for _pam_dispatch_aux().  Every handler learns where
+ * the substack it belongs to ends, and the jump actions ("[...=N]") are
+ * replaced with the index of the handler to continue with.  The
+ * handlers of the setcred and close_session chains use the cached
+ * return values of the parallel authenticate and open_session chain
+ * (primary).
+ */
+static int _pam_resolve_chain(pam_handle_t *pamh, struct handler_chain *chain,
+			      struct handler_chain *primary)
+{
+    struct handler *h = chain->handlers;
+    int i, j, r, level, action;
+
+    if (primary != NULL && primary->count != chain->count) {
+	pam_syslog(pamh, LOG_ERR, "internal error: handler chains differ");
+	return PAM_ABORT;
+    }
+
+    for (i = chain->count - 1; i >= 0; i--) {
+	level = h[i].stack_level;
+
+	/* hop over the siblings, they know where the substack ends */
+	for (j = i + 1; j < chain->count && h[j].stack_level >= level;
+	     j = (h[j].stack_level == level) ? h[j].substack_end : j + 1)
+	    ;
+	h[i].substack_end = j;
+
+	for (r = 0; r < _PAM_RETURN_VALUES; r++) {
+	    action = h[i].actions[r];
+	    if (!_PAM_ACTION_IS_JUMP(action))
+		continue;
+
+	    /* skip #action modules of this level, with their substacks */
+	    j = i;
+	    while (j + 1 < chain->count && h[j+1].stack_level >= level
+		   && action > 0) {
+		do {
+		    ++j;
+		} while (j + 1 < chain->count && h[j+1].stack_level > level);
+		--action;
+	    }
+	    h[i].actions[r] = action ? _PAM_ACTION_BAD_JUMP : j + 1;
+	}
+    }
+
+    return PAM_SUCCESS;
+}
+
+static int _pam_resolve_chains(pam_handle_t *pamh, struct handlers *the_handlers)
+{
+    if (_pam_resolve_chain(pamh, &the_handlers->authenticate, NULL)
+	|| _pam_resolve_chain(pamh, &the_handlers->setcred,
+			      &the_handlers->authenticate)
+	|| _pam_resolve_chain(pamh, &the_handlers->acct_mgmt, NULL)
+	|| _pam_resolve_chain(pamh, &the_handlers->open_session, NULL)
+	|| _pam_resolve_chain(pamh, &the_handlers->close_session,
+			      &the_handlers->open_session)
+	|| _pam_resolve_chain(pamh, &the_handlers->chauthtok, NULL))
+	return PAM_ABORT;
+
+    return PAM_SUCCESS;
 }
 
 int _pam_add_handler(pam_handle_t *pamh
-		     , int handler_type, int other, int stack_level, int type
+		     , int handler_type, int parallel, int other
+		     , int stack_level, int type
 		     , int *actions, const char *mod_path
 		     , int argc, char **argv, int argvlen)
 {
     struct loaded_module *mod = NULL;
-    struct handler **handler_p;
-    struct handler **handler_p2;
+    struct handler_chain *handler_p;
+    struct handler_chain *handler_p2;
+    struct handler *h, *h2;
     struct handlers *the_handlers;
-    const char *sym, *sym2;
+    int sym, sym2;
     char *mod_full_path;
-    servicefn func, func2;
-    int mod_type = PAM_MT_FAULTY_MOD;
 
     D(("called."));
     IF_NO_PAMH("_pam_add_handler",pamh,PAM_SYSTEM_ERR);
@@ -794,13 +1098,19 @@ int _pam_add_handler(pam_handle_t *pamh
     D(("_pam_add_handler: adding type %d, handler_type %d, module `%s'",
 	type, handler_type, mod_path));
 
+    if (pamh->handlers.record != NULL
+	&& _pam_conf_image_add(pamh, handler_type, parallel, other,
+			       stack_level, type, actions, mod_path,
+			       argc, argv) != PAM_SUCCESS)
+	return PAM_ABORT;
+
     if ((handler_type == PAM_HT_MODULE || handler_type == PAM_HT_SILENT_MODULE) &&
 	mod_path != NULL) {
 	if (mod_path[0] == '/') {
-	    mod = _pam_load_module(pamh, mod_path, handler_type);
+	    mod = _pam_load_module(pamh, mod_path);
 	} else if (asprintf(&mod_full_path, "%s%s",
 			     DEFAULT_MODULE_PATH, mod_path) >= 0) {
-	    mod = _pam_load_module(pamh, mod_full_path, handler_type);
+	    mod = _pam_load_module(pamh, mod_full_path);
 	    _pam_drop(mod_full_path);
 	} else {
 	    pam_syslog(pamh, LOG_CRIT, "cannot malloc full mod path");
@@ -811,47 +1121,43 @@ int _pam_add_handler(pam_handle_t *pamh
 	    /* if we get here with NULL it means allocation error */
 	    return PAM_ABORT;
 	}
-
-	mod_type = mod->type;
     }
 
     if (mod_path == NULL)
 	mod_path = UNKNOWN_MODULE;
 
     /*
-     * At this point 'mod' points to the stored/loaded module.
+     * At this point 'mod' points to the module, which is loaded when
+     * one of the chains is dispatched, see _pam_load_chain().
      */
 
-    /* Now define the handler(s) based on mod->dlhandle and type */
-
     /* decide which list of handlers to use */
     the_handlers = (other) ? &pamh->handlers.other : &pamh->handlers.conf;
 
     handler_p = handler_p2 = NULL;
-    func = func2 = NULL;
-    sym2 = NULL;
+    sym2 = -1;
 
-    /* point handler_p's at the root addresses of the function stacks */
+    /* point handler_p's at the chains of the functions */
     switch (type) {
     case PAM_T_AUTH:
 	handler_p = &the_handlers->authenticate;
-	sym = "pam_sm_authenticate";
+	sym = PAM_SM_AUTHENTICATE;
 	handler_p2 = &the_handlers->setcred;
-	sym2 = "pam_sm_setcred";
+	sym2 = PAM_SM_SETCRED;
 	break;
     case PAM_T_SESS:
 	handler_p = &the_handlers->open_session;
-	sym = "pam_sm_open_session";
+	sym = PAM_SM_OPEN_SESSION;
 	handler_p2 = &the_handlers->close_session;
-	sym2 = "pam_sm_close_session";
+	sym2 = PAM_SM_CLOSE_SESSION;
 	break;
     case PAM_T_ACCT:
 	handler_p = &the_handlers->acct_mgmt;
-	sym = "pam_sm_acct_mgmt";
+	sym = PAM_SM_ACCT_MGMT;
 	break;
     case PAM_T_PASS:
 	handler_p = &the_handlers->chauthtok;
-	sym = "pam_sm_chauthtok";
+	sym = PAM_SM_CHAUTHTOK;
 	break;
     default:
 	/* Illegal module type */
@@ -859,87 +1165,48 @@ int _pam_add_handler(pam_handle_t *pamh
 	return PAM_ABORT;
     }
 
-    /* are the modules reliable? */
-    if (mod_type != PAM_MT_DYNAMIC_MOD &&
-	 mod_type != PAM_MT_FAULTY_MOD) {
-	D(("_pam_add_handlers: illegal module library type; %d", mod_type));
-	pam_syslog(pamh, LOG_ERR,
-			"internal error: module library type not known: %s;%d",
-			sym, mod_type);
-	return PAM_ABORT;
-    }
-
-    /* now identify this module's functions - for non-faulty modules */
-
-    if ((mod_type == PAM_MT_DYNAMIC_MOD) &&
-        !(func = _pam_dlsym(mod->dl_handle, sym)) ) {
-	pam_syslog(pamh, LOG_ERR, "unable to resolve symbol: %s", sym);
-    }
-    if (sym2) {
-	if ((mod_type == PAM_MT_DYNAMIC_MOD) &&
-	    !(func2 = _pam_dlsym(mod->dl_handle, sym2)) ) {
-	    pam_syslog(pamh, LOG_ERR, "unable to resolve symbol: %s", sym2);
-	}
-    }
-
-    /* here func (and perhaps func2) point to the appropriate functions */
-
     /* add new handler to end of existing list */
-    while (*handler_p != NULL) {
-	handler_p = &((*handler_p)->next);
-    }
-
-    if ((*handler_p = malloc(sizeof(struct handler))) == NULL) {
-	pam_syslog(pamh, LOG_CRIT, "cannot malloc struct handler #1");
+    if ((h = _pam_new_handler(pamh, handler_p)) == NULL) {
 	return (PAM_ABORT);
     }
 
-    (*handler_p)->handler_type = handler_type;
-    (*handler_p)->stack_level = stack_level;
-    (*handler_p)->func = func;
-    memcpy((*handler_p)->actions,actions,sizeof((*handler_p)->actions));
-    (*handler_p)->cached_retval = _PAM_INVALID_RETVAL;
-    (*handler_p)->cached_retval_p = &((*handler_p)->cached_retval);
-    (*handler_p)->argc = argc;
-    (*handler_p)->argv = argv;                       /* not a copy */
-    if (((*handler_p)->mod_name = extract_modulename(mod_path)) == NULL)
+    h->handler_type = handler_type;
+    h->parallel = parallel;
+    h->stack_level = stack_level;
+    h->func = NULL;
+    h->module = mod;
+    h->sym = sym;
+    memcpy(h->actions,actions,sizeof(h->actions));
+    h->argc = argc;
+    h->argv = argv;                                  /* not a copy */
+    if ((h->mod_name = extract_modulename(mod_path)) == NULL)
 	return PAM_ABORT;
-    (*handler_p)->grantor = 0;
-    (*handler_p)->next = NULL;
 
     /* some of the modules have a second calling function */
     if (handler_p2) {
-	/* add new handler to end of existing list */
-	while (*handler_p2) {
-	    handler_p2 = &((*handler_p2)->next);
-	}
-
-	if ((*handler_p2 = malloc(sizeof(struct handler))) == NULL) {
-	    pam_syslog(pamh, LOG_CRIT, "cannot malloc struct handler #2");
+	if ((h2 = _pam_new_handler(pamh, handler_p2)) == NULL) {
 	    return (PAM_ABORT);
 	}
 
-	(*handler_p2)->handler_type = handler_type;
-	(*handler_p2)->stack_level = stack_level;
-	(*handler_p2)->func = func2;
-	memcpy((*handler_p2)->actions,actions,sizeof((*handler_p2)->actions));
-	(*handler_p2)->cached_retval =  _PAM_INVALID_RETVAL;     /* ignored */
-	/* Note, this next entry points to the handler_p value! */
-	(*handler_p2)->cached_retval_p = &((*handler_p)->cached_retval);
-	(*handler_p2)->argc = argc;
+	h2->handler_type = handler_type;
+	h2->parallel = parallel;
+	h2->stack_level = stack_level;
+	h2->func = NULL;
+	h2->module = mod;
+	h2->sym = sym2;
+	memcpy(h2->actions,actions,sizeof(h2->actions));
+	h2->argc = argc;
 	if (argv) {
-	    if (((*handler_p2)->argv = malloc(argvlen)) == NULL) {
+	    if ((h2->argv = malloc(argvlen)) == NULL) {
 		pam_syslog(pamh, LOG_CRIT, "cannot malloc argv for handler #2");
 		return (PAM_ABORT);
 	    }
-	    memcpy((*handler_p2)->argv, argv, argvlen);
+	    memcpy(h2->argv, argv, argvlen);
 	} else {
-	    (*handler_p2)->argv = NULL;              /* no arguments */
+	    h2->argv = NULL;                         /* no arguments */
 	}
-	if (((*handler_p2)->mod_name = extract_modulename(mod_path)) == NULL)
+	if ((h2->mod_name = extract_modulename(mod_path)) == NULL)
 	    return PAM_ABORT;
-	(*handler_p2)->grantor = 0;
-	(*handler_p2)->next = NULL;
     }
 
     D(("_pam_add_handler: returning successfully"));
@@ -947,51 +1214,58 @@ int _pam_add_handler(pam_handle_t *pamh
     return PAM_SUCCESS;
 }
 
-/* Free various allocated structures and dlclose() the libs */
-int _pam_free_handlers(pam_handle_t *pamh)
+/*
+ * Free the handler chains of a service structure and release its
+ * modules.  If shared is set, the argument vectors and module names
+ * belong to a cached stack and are left alone.
+ */
+void _pam_free_service(struct service *svc, int shared)
 {
-    struct loaded_module *mod;
+    /* Release all loaded modules */
 
-    D(("called."));
-    IF_NO_PAMH("_pam_free_handlers",pamh,PAM_SYSTEM_ERR);
-
-    mod = pamh->handlers.module;
-
-    /* Close all loaded modules */
-
-    while (pamh->handlers.modules_used) {
-	D(("_pam_free_handlers: dlclose(%s)", mod->name));
-	free(mod->name);
-	if (mod->type == PAM_MT_DYNAMIC_MOD) {
-	    _pam_dlclose(mod->dl_handle);
-	}
-	mod++;
-	pamh->handlers.modules_used--;
+    while (svc->modules_used) {
+	_pam_release_module(svc->module[--svc->modules_used]);
     }
 
     /* Free all the handlers */
 
-    _pam_free_handlers_aux(&(pamh->handlers.conf.authenticate));
-    _pam_free_handlers_aux(&(pamh->handlers.conf.setcred));
-    _pam_free_handlers_aux(&(pamh->handlers.conf.acct_mgmt));
-    _pam_free_handlers_aux(&(pamh->handlers.conf.open_session));
-    _pam_free_handlers_aux(&(pamh->handlers.conf.close_session));
-    _pam_free_handlers_aux(&(pamh->handlers.conf.chauthtok));
+    _pam_free_handlers_aux(&(svc->conf.authenticate), shared);
+    _pam_free_handlers_aux(&(svc->conf.setcred), shared);
+    _pam_free_handlers_aux(&(svc->conf.acct_mgmt), shared);
+    _pam_free_handlers_aux(&(svc->conf.open_session), shared);
+    _pam_free_handlers_aux(&(svc->conf.close_session), shared);
+    _pam_free_handlers_aux(&(svc->conf.chauthtok), shared);
 
-    _pam_free_handlers_aux(&(pamh->handlers.other.authenticate));
-    _pam_free_handlers_aux(&(pamh->handlers.other.setcred));
-    _pam_free_handlers_aux(&(pamh->handlers.other.acct_mgmt));
-    _pam_free_handlers_aux(&(pamh->handlers.other.open_session));
-    _pam_free_handlers_aux(&(pamh->handlers.other.close_session));
-    _pam_free_handlers_aux(&(pamh->handlers.other.chauthtok));
+    _pam_free_handlers_aux(&(svc->other.authenticate), shared);
+    _pam_free_handlers_aux(&(svc->other.setcred), shared);
+    _pam_free_handlers_aux(&(svc->other.acct_mgmt), shared);
+    _pam_free_handlers_aux(&(svc->other.open_session), shared);
+    _pam_free_handlers_aux(&(svc->other.close_session), shared);
+    _pam_free_handlers_aux(&(svc->other.chauthtok), shared);
+
+    _pam_drop(svc->state);
 
     /* no more loaded modules */
 
-    _pam_drop(pamh->handlers.module);
+    _pam_drop(svc->module);
+    svc->modules_allocated = 0;
 
-    /* Indicate that handlers are not initialized for this pamh */
+    /* Indicate that handlers are not initialized */
 
-    pamh->handlers.handlers_loaded = 0;
+    svc->handlers_loaded = 0;
+}
+
+/* Free various allocated structures and dlclose() the libs */
+int _pam_free_handlers(pam_handle_t *pamh)
+{
+    D(("called."));
+    IF_NO_PAMH("_pam_free_handlers",pamh,PAM_SYSTEM_ERR);
+
+    _pam_free_service(&pamh->handlers, pamh->handlers.stack != NULL);
+
+    /* let go of the cached stack the handlers were copied from */
+
+    _pam_stack_cache_release(pamh);
 
     return PAM_SUCCESS;
 }
@@ -1011,35 +1285,110 @@ void _pam_start_handlers(pam_handle_t *pamh)
 
     /* initialize the .conf and .other entries */
 
-    pamh->handlers.conf.authenticate = NULL;
-    pamh->handlers.conf.setcred = NULL;
-    pamh->handlers.conf.acct_mgmt = NULL;
-    pamh->handlers.conf.open_session = NULL;
-    pamh->handlers.conf.close_session = NULL;
-    pamh->handlers.conf.chauthtok = NULL;
-
-    pamh->handlers.other.authenticate = NULL;
-    pamh->handlers.other.setcred = NULL;
-    pamh->handlers.other.acct_mgmt = NULL;
-    pamh->handlers.other.open_session = NULL;
-    pamh->handlers.other.close_session = NULL;
-    pamh->handlers.other.chauthtok = NULL;
+    memset(&pamh->handlers.conf, 0, sizeof(pamh->handlers.conf));
+    memset(&pamh->handlers.other, 0, sizeof(pamh->handlers.other));
+
+    pamh->handlers.state = NULL;
+    pamh->handlers.stack = NULL;
+    pamh->handlers.pending = NULL;
+    pamh->handlers.record = NULL;
+    pamh->handlers.refresh = 0;
+}
+
+static void _pam_service_chains(struct service *svc,
+				struct handler_chain *chains[PAM_CHAINS],
+				struct handler_chain *primary[PAM_CHAINS])
+{
+    struct handlers *h[2] = { &svc->conf, &svc->other };
+    int i;
+
+    for (i = 0; i < 2; i++) {
+	chains[6*i] = &h[i]->authenticate;
+	chains[6*i+1] = &h[i]->setcred;
+	chains[6*i+2] = &h[i]->acct_mgmt;
+	chains[6*i+3] = &h[i]->open_session;
+	chains[6*i+4] = &h[i]->close_session;
+	chains[6*i+5] = &h[i]->chauthtok;
+	if (primary != NULL) {
+	    primary[6*i] = primary[6*i+2] = primary[6*i+3] = NULL;
+	    primary[6*i+5] = NULL;
+	    primary[6*i+1] = &h[i]->authenticate;
+	    primary[6*i+4] = &h[i]->open_session;
+	}
+    }
+}
+
+/*
+ * Give the handle the state it keeps for every handler of its chains.
+ * The handlers themselves may be shared with other handles, see
+ * pam_stack_cache.c.
+ */
+static int _pam_init_state(pam_handle_t *pamh)
+{
+    struct handler_chain *chains[PAM_CHAINS], *primary[PAM_CHAINS];
+    struct handler_state *state;
+    int c, total = 0;
+
+    _pam_service_chains(&pamh->handlers, chains, primary);
+    for (c = 0; c < PAM_CHAINS; c++)
+	total += chains[c]->count;
+    if (total == 0)
+	return PAM_SUCCESS;
+
+    if ((state = malloc(total * sizeof(*state))) == NULL) {
+	pam_syslog(pamh, LOG_CRIT, "cannot allocate the handler state");
+	return PAM_BUF_ERR;
+    }
+    pamh->handlers.state = state;
+
+    for (c = 0; c < PAM_CHAINS; c++) {
+	chains[c]->state = state;
+	state += chains[c]->count;
+    }
+    for (c = 0; c < PAM_CHAINS; c++) {
+	chains[c]->frozen = primary[c] ? primary[c]->state : chains[c]->state;
+    }
+
+    _pam_reset_handlers(pamh);
+
+    return PAM_SUCCESS;
+}
+
+void _pam_reset_handlers(pam_handle_t *pamh)
+{
+    struct handler_chain *chains[PAM_CHAINS];
+    int c, i;
+
+    D(("called."));
+
+    _pam_service_chains(&pamh->handlers, chains, NULL);
+    for (c = 0; c < PAM_CHAINS; c++) {
+	for (i = 0; i < chains[c]->count; i++) {
+	    chains[c]->state[i].cached_retval = _PAM_INVALID_RETVAL;
+	    chains[c]->state[i].grantor = 0;
+	}
+    }
 }
 
-void _pam_free_handlers_aux(struct handler **hp)
+void _pam_free_handlers_aux(struct handler_chain *chain, int shared)
 {
-    struct handler *h = *hp;
-    struct handler *last;
+    int i;
 
     D(("called."));
-    while (h) {
-	last = h;
-	_pam_drop(h->argv);  /* This is all allocated in a single chunk */
-	_pam_drop(h->mod_name);
-	h = h->next;
-	memset(last, 0, sizeof(*last));
-	free(last);
+    if (!shared) {
+	for (i = 0; i < chain->count; i++) {
+	    /* This is all allocated in a single chunk */
+	    _pam_drop(chain->handlers[i].argv);
+	    _pam_drop(chain->handlers[i].mod_name);
+	}
+    }
+    if (chain->allocated != 0) {
+	memset(chain->handlers, 0, chain->count * sizeof(*chain->handlers));
+	_pam_drop(chain->handlers);
     }
 
-    *hp = NULL;
+    chain->handlers = NULL;
+    chain->count = chain->allocated = 0;
+    chain->loaded = 0;
+    chain->state = chain->frozen = NULL;
 }
@@ -5,26 +5,27 @@
  */
 
 #include "pam_private.h"
+#include "pam_probes.h"
 
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
 
-#define TRY_SET(X, Y)                      \
-{                                          \
-    if ((X) != (Y)) {		           \
-	char *_TMP_ = _pam_strdup(Y);      \
-	if (_TMP_ == NULL && (Y) != NULL)  \
-	    return PAM_BUF_ERR;            \
-	free(X);                           \
-	(X) = _TMP_;                       \
-    }					   \
+#define TRY_SET(X, Y)                            \
+{                                                \
+    if ((X) != (Y)) {		                 \
+	char *_TMP_ = _pam_arena_strdup(pamh, Y); \
+	if (_TMP_ == NULL && (Y) != NULL)        \
+	    return PAM_BUF_ERR;                  \
+	_pam_arena_free(pamh, X);                \
+	(X) = _TMP_;                             \
+    }					         \
 }
 
 /* functions */
 
-int pam_set_item (pam_handle_t *pamh, int item_type, const void *item)
+static int _pam_set_item(pam_handle_t *pamh, int item_type, const void *item)
 {
     int retval;
 
@@ -41,7 +42,15 @@ int pam_set_item (pam_handle_t *pamh, int item_type, const void *item)
 	 * to be reloaded on the next call to a service module.
 	 */
 	pamh->handlers.handlers_loaded = 0;
-	TRY_SET(pamh->service_name, item);
+	/* the service outlives the transaction, see pam_reset() */
+	if (pamh->service_name != item) {
+	    char *tmp = _pam_strdup(item);
+
+	    if (tmp == NULL && item != NULL)
+		return PAM_BUF_ERR;
+	    free(pamh->service_name);
+	    pamh->service_name = tmp;
+	}
 	{
 	    char *tmp;
 	    for (tmp=pamh->service_name; *tmp; ++tmp)
@@ -120,8 +129,7 @@ int pam_set_item (pam_handle_t *pamh, int item_type, const void *item)
 		retval = PAM_BUF_ERR;
 	    } else {
 		memcpy(tconv, item, sizeof(struct pam_conv));
-		_pam_drop(pamh->pam_conversation);
-		pamh->pam_conversation = tconv;
+		_pam_async_set_conv(pamh, tconv);
 		pamh->former.fail_user = PAM_SUCCESS;
 	    }
 	}
@@ -140,22 +148,23 @@ int pam_set_item (pam_handle_t *pamh, int item_type, const void *item)
 	    break;
 	if (pamh->xauth.namelen) {
 	    _pam_overwrite(pamh->xauth.name);
-	    free(pamh->xauth.name);
+	    _pam_arena_free(pamh, pamh->xauth.name);
 	}
 	if (pamh->xauth.datalen) {
 	    _pam_overwrite_n(pamh->xauth.data,
 			   (unsigned int) pamh->xauth.datalen);
-	    free(pamh->xauth.data);
+	    _pam_arena_free(pamh, pamh->xauth.data);
 	}
 	pamh->xauth = *((const struct pam_xauth_data *) item);
-	if ((pamh->xauth.name=_pam_strdup(pamh->xauth.name)) == NULL) {
+	if ((pamh->xauth.name=_pam_arena_strdup(pamh,
+					pamh->xauth.name)) == NULL) {
 	    memset(&pamh->xauth, '\0', sizeof(pamh->xauth));
 	    return PAM_BUF_ERR;
 	}
-	if ((pamh->xauth.data=_pam_memdup(pamh->xauth.data,
+	if ((pamh->xauth.data=_pam_arena_memdup(pamh, pamh->xauth.data,
 	    pamh->xauth.datalen)) == NULL) {
 	    _pam_overwrite(pamh->xauth.name);
-	    free(pamh->xauth.name);
+	    _pam_arena_free(pamh, pamh->xauth.name);
 	    memset(&pamh->xauth, '\0', sizeof(pamh->xauth));
 	    return PAM_BUF_ERR;
 	}
@@ -172,7 +181,19 @@ int pam_set_item (pam_handle_t *pamh, int item_type, const void *item)
     return retval;
 }
 
-int pam_get_item (const pam_handle_t *pamh, int item_type, const void **item)
+int pam_set_item (pam_handle_t *pamh, int item_type, const void *item)
+{
+    int retval;
+
+    _pam_parallel_lock(pamh);
+    retval = _pam_set_item(pamh, item_type, item);
+    _pam_parallel_unlock(pamh);
+
+    return retval;
+}
+
+static int _pam_get_item(const pam_handle_t *pamh, int item_type,
+			 const void **item)
 {
     int retval = PAM_SUCCESS;
 
@@ -266,11 +287,23 @@ int pam_get_item (const pam_handle_t *pamh, int item_type, const void **item)
     return retval;
 }
 
+int pam_get_item (const pam_handle_t *pamh, int item_type, const void **item)
+{
+    int retval;
+
+    _pam_parallel_lock(pamh);
+    retval = _pam_get_item(pamh, item_type, item);
+    _pam_parallel_unlock(pamh);
+
+    return retval;
+}
+
 /*
  * This function is the 'preferred method to obtain the username'.
  */
 
-int pam_get_user(pam_handle_t *pamh, const char **user, const char *prompt)
+static int _pam_get_user(pam_handle_t *pamh, const char **user,
+			 const char *prompt)
 {
     const char *use_prompt;
     int retval;
@@ -331,7 +364,7 @@ int pam_get_user(pam_handle_t *pamh, const char **user, const char *prompt)
 	/* ok, we can resume where we left off last time */
 	pamh->former.want_user = PAM_FALSE;
 	_pam_overwrite(pamh->former.prompt);
-	_pam_drop(pamh->former.prompt);
+	_pam_arena_drop(pamh, pamh->former.prompt);
     }
 
     /* converse with application -- prompt user for a username */
@@ -340,8 +373,10 @@ int pam_get_user(pam_handle_t *pamh, const char **user, const char *prompt)
     msg.msg = use_prompt;
     resp = NULL;
 
+    PAM_PROBE2(libpam, conv__entry, 1, PAM_PROMPT_ECHO_ON);
     retval = pamh->pam_conversation->
 	conv(1, &pmsg, &resp, pamh->pam_conversation->appdata_ptr);
+    PAM_PROBE1(libpam, conv__return, retval);
 
     switch (retval) {
 	case PAM_SUCCESS:
@@ -358,7 +393,7 @@ int pam_get_user(pam_handle_t *pamh, const char **user, const char *prompt)
 	    /* conversation function is waiting for an event - save state */
 	    D(("conversation function is not ready yet"));
 	    pamh->former.want_user = PAM_TRUE;
-	    pamh->former.prompt = _pam_strdup(use_prompt);
+	    pamh->former.prompt = _pam_arena_strdup(pamh, use_prompt);
 	    break;
 	case PAM_SUCCESS:
 	    if (resp != NULL && resp->resp != NULL) {
@@ -394,3 +429,14 @@ int pam_get_user(pam_handle_t *pamh, const char **user, const char *prompt)
     D(("completed"));
     return retval;        /* pass on any error from conversation */
 }
+
+int pam_get_user(pam_handle_t *pamh, const char **user, const char *prompt)
+{
+    int retval;
+
+    _pam_parallel_lock(pamh);
+    retval = _pam_get_user(pamh, user, prompt);
+    _pam_parallel_unlock(pamh);
+
+    return retval;
+}
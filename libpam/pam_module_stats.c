@@ -0,0 +1,376 @@
+/* pam_module_stats.c -- latency of the module calls */
+
+/*
+ * When a login is slow, the question is which module takes the time.
+ * Once an application has called pam_module_stats_enable(),
+ * _pam_dispatch_aux() times every call of a module function with the
+ * monotonic clock and adds it to the entry of its (service, function,
+ * module) triple: a histogram of the latencies, their sum and maximum,
+ * and a counter for every return value.  pam_module_stats_walk() hands
+ * the entries to the application, pam_module_stats_dump() writes them
+ * to a file, now and then every few seconds.
+ *
+ * The counters are process-wide.  While they are disabled, a module
+ * call costs one test of a flag more.
+ */
+
+#include "pam_private.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PAM_MODULE_STATS_HASH     64   /* buckets of the table */
+
+struct _pam_module_stat {
+    struct _pam_module_stat *next;
+    unsigned int hash;
+    int choice;
+    struct pam_module_stats stats;   /* strings are in the same block */
+};
+
+static struct {
+    pthread_mutex_t lock;
+    int enabled;
+    struct _pam_module_stat *table[PAM_MODULE_STATS_HASH];
+    char *dump_path;
+    unsigned int dump_interval;      /* seconds, 0 if not periodic */
+    time_t dump_last;
+} _pam_module_stats = { PTHREAD_MUTEX_INITIALIZER, 0, { NULL },
+			NULL, 0, 0 };
+
+static const char *_pam_choice_name(int choice)
+{
+    switch (choice) {
+    case PAM_AUTHENTICATE:
+	return "authenticate";
+    case PAM_SETCRED:
+	return "setcred";
+    case PAM_ACCOUNT:
+	return "acct_mgmt";
+    case PAM_OPEN_SESSION:
+	return "open_session";
+    case PAM_CLOSE_SESSION:
+	return "close_session";
+    case PAM_CHAUTHTOK:
+	return "chauthtok";
+    }
+    return "unknown";
+}
+
+static unsigned int _pam_module_stats_hash(const char *service,
+					   const char *module, int choice)
+{
+    unsigned int hash = 2166136261U;     /* FNV-1a */
+
+    while (*service) {
+	hash ^= (unsigned char) *service++;
+	hash *= 16777619U;
+    }
+    hash ^= (unsigned char) choice;
+    hash *= 16777619U;
+    while (*module) {
+	hash ^= (unsigned char) *module++;
+	hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+/* must be called with _pam_module_stats.lock held */
+static struct _pam_module_stat *
+_pam_module_stats_find(const char *service, const char *module, int choice)
+{
+    struct _pam_module_stat *stat, **bucket;
+    unsigned int hash;
+    size_t service_len, module_len;
+
+    hash = _pam_module_stats_hash(service, module, choice);
+    bucket = &_pam_module_stats.table[hash % PAM_MODULE_STATS_HASH];
+
+    for (stat = *bucket; stat != NULL; stat = stat->next) {
+	if (stat->hash == hash && stat->choice == choice
+	    && !strcmp(stat->stats.service, service)
+	    && !strcmp(stat->stats.module, module))
+	    return stat;
+    }
+
+    service_len = strlen(service) + 1;
+    module_len = strlen(module) + 1;
+    stat = calloc(1, sizeof(*stat) + service_len + module_len);
+    if (stat == NULL)
+	return NULL;
+
+    stat->hash = hash;
+    stat->choice = choice;
+    stat->stats.service = memcpy(stat + 1, service, service_len);
+    stat->stats.module = memcpy((char *) (stat + 1) + service_len,
+				module, module_len);
+    stat->stats.function = _pam_choice_name(choice);
+    stat->next = *bucket;
+    *bucket = stat;
+
+    return stat;
+}
+
+/* must be called with _pam_module_stats.lock held */
+static void _pam_module_stats_clear(void)
+{
+    struct _pam_module_stat *stat;
+    unsigned int i;
+
+    for (i = 0; i < PAM_MODULE_STATS_HASH; i++) {
+	while ((stat = _pam_module_stats.table[i]) != NULL) {
+	    _pam_module_stats.table[i] = stat->next;
+	    free(stat);
+	}
+    }
+}
+
+static void _pam_module_stats_print(FILE *fp, const struct pam_module_stats *s)
+{
+    int i;
+
+    fprintf(fp, "%s %s %s calls %lu total_us %llu max_us %llu hist",
+	    s->service, s->function, s->module, s->calls,
+	    s->total_usec, s->max_usec);
+    for (i = 0; i < PAM_MODULE_STATS_BUCKETS; i++)
+	fprintf(fp, " %lu", s->histogram[i]);
+    fputs(" rc", fp);
+    for (i = 0; i < _PAM_RETURN_VALUES; i++) {
+	if (s->retval[i] != 0)
+	    fprintf(fp, " %d:%lu", i, s->retval[i]);
+    }
+    fputc('\n', fp);
+}
+
+/*
+ * A copy of the entries, with their strings after them in the same
+ * block, so that they can be written without holding the lock.  NULL
+ * if out of memory.  Must be called with _pam_module_stats.lock held.
+ */
+static struct pam_module_stats *_pam_module_stats_copy(size_t *count)
+{
+    const struct _pam_module_stat *stat;
+    struct pam_module_stats *copy;
+    size_t n = 0, size = 0, len;
+    unsigned int i;
+    char *p;
+
+    for (i = 0; i < PAM_MODULE_STATS_HASH; i++) {
+	for (stat = _pam_module_stats.table[i]; stat; stat = stat->next) {
+	    n++;
+	    size += strlen(stat->stats.service) + strlen(stat->stats.module)
+		+ 2;
+	}
+    }
+
+    if ((copy = malloc(n * sizeof(*copy) + size + 1)) == NULL)
+	return NULL;
+    p = (char *) (copy + n);
+
+    n = 0;
+    for (i = 0; i < PAM_MODULE_STATS_HASH; i++) {
+	for (stat = _pam_module_stats.table[i]; stat; stat = stat->next) {
+	    copy[n] = stat->stats;
+	    len = strlen(stat->stats.service) + 1;
+	    copy[n].service = memcpy(p, stat->stats.service, len);
+	    p += len;
+	    len = strlen(stat->stats.module) + 1;
+	    copy[n].module = memcpy(p, stat->stats.module, len);
+	    p += len;
+	    n++;
+	}
+    }
+
+    *count = n;
+    return copy;
+}
+
+/* Write count entries to path, through a file renamed into place */
+static int _pam_module_stats_write(const char *path,
+				   const struct pam_module_stats *stats,
+				   size_t count)
+{
+    char *tmp;
+    FILE *fp;
+    size_t i;
+    int fd, err;
+
+    if (asprintf(&tmp, "%s.XXXXXX", path) < 0)
+	return PAM_BUF_ERR;
+
+    if ((fd = mkstemp(tmp)) < 0 || (fp = fdopen(fd, "w")) == NULL) {
+	err = errno;
+	if (fd >= 0) {
+	    close(fd);
+	    unlink(tmp);
+	}
+	pam_syslog(NULL, LOG_ERR, "pam_module_stats_dump: %s: %s",
+		   path, strerror(err));
+	free(tmp);
+	return PAM_SYSTEM_ERR;
+    }
+
+    for (i = 0; i < count; i++)
+	_pam_module_stats_print(fp, &stats[i]);
+
+    if (fclose(fp) != 0 || rename(tmp, path) != 0) {
+	pam_syslog(NULL, LOG_ERR, "pam_module_stats_dump: %s: %m", path);
+	unlink(tmp);
+	free(tmp);
+	return PAM_SYSTEM_ERR;
+    }
+
+    free(tmp);
+    return PAM_SUCCESS;
+}
+
+/* Is there a module call to time? */
+int _pam_module_stats_enabled(void)
+{
+    return _pam_module_stats.enabled;
+}
+
+/* Add a module call that started at begin */
+void _pam_module_stats_record(pam_handle_t *pamh, const char *mod_name,
+			      const struct timespec *begin, int retval)
+{
+    struct _pam_module_stat *stat;
+    struct pam_module_stats *copy = NULL;
+    struct timespec end;
+    unsigned long long usec;
+    char *path = NULL;
+    size_t count = 0;
+    int bucket;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &end) != 0)
+	return;
+
+    usec = (unsigned long long) (end.tv_sec - begin->tv_sec) * 1000000
+	+ (end.tv_nsec - begin->tv_nsec) / 1000;
+    for (bucket = 0; bucket < PAM_MODULE_STATS_BUCKETS - 1; bucket++) {
+	if (usec < (1ULL << bucket))
+	    break;
+    }
+
+    pthread_mutex_lock(&_pam_module_stats.lock);
+
+    stat = _pam_module_stats_find(pamh->service_name,
+				  mod_name ? mod_name : "<unknown>",
+				  pamh->choice);
+    if (stat != NULL) {
+	stat->stats.calls++;
+	stat->stats.total_usec += usec;
+	if (stat->stats.max_usec < usec)
+	    stat->stats.max_usec = usec;
+	stat->stats.histogram[bucket]++;
+	if (retval >= 0 && retval < _PAM_RETURN_VALUES)
+	    stat->stats.retval[retval]++;
+    }
+
+    if (_pam_module_stats.dump_interval != 0
+	&& end.tv_sec - _pam_module_stats.dump_last
+	   >= (time_t) _pam_module_stats.dump_interval) {
+	_pam_module_stats.dump_last = end.tv_sec;
+	path = _pam_strdup(_pam_module_stats.dump_path);
+	copy = _pam_module_stats_copy(&count);
+    }
+
+    pthread_mutex_unlock(&_pam_module_stats.lock);
+
+    /* the module calls of other threads do not wait for the file */
+    if (path != NULL && copy != NULL)
+	_pam_module_stats_write(path, copy, count);
+    _pam_drop(copy);
+    _pam_drop(path);
+}
+
+int pam_module_stats_enable(int enable)
+{
+    D(("called: %d", enable));
+
+    _pam_module_stats.enabled = enable ? 1 : 0;
+
+    return PAM_SUCCESS;
+}
+
+void pam_module_stats_reset(void)
+{
+    D(("called"));
+
+    pthread_mutex_lock(&_pam_module_stats.lock);
+    _pam_module_stats_clear();
+    pthread_mutex_unlock(&_pam_module_stats.lock);
+}
+
+int pam_module_stats_walk(int (*fn)(const struct pam_module_stats *stats,
+				    void *arg),
+			  void *arg)
+{
+    const struct _pam_module_stat *stat;
+    unsigned int i;
+    int ret = 0;
+
+    D(("called"));
+
+    if (fn == NULL)
+	return PAM_SYSTEM_ERR;
+
+    pthread_mutex_lock(&_pam_module_stats.lock);
+    for (i = 0; i < PAM_MODULE_STATS_HASH && ret == 0; i++) {
+	for (stat = _pam_module_stats.table[i]; stat && ret == 0;
+	     stat = stat->next)
+	    ret = fn(&stat->stats, arg);
+    }
+    pthread_mutex_unlock(&_pam_module_stats.lock);
+
+    return PAM_SUCCESS;
+}
+
+int pam_module_stats_dump(const char *path, unsigned int interval)
+{
+    struct pam_module_stats *copy;
+    struct timespec now;
+    char *new_path = NULL;
+    size_t count;
+    int ret = PAM_SUCCESS;
+
+    D(("called: %s every %u seconds", path ? path : "(null)", interval));
+
+    if (path != NULL) {
+	if ((new_path = _pam_strdup(path)) == NULL)
+	    return PAM_BUF_ERR;
+
+	pthread_mutex_lock(&_pam_module_stats.lock);
+	copy = _pam_module_stats_copy(&count);
+	pthread_mutex_unlock(&_pam_module_stats.lock);
+	if (copy == NULL) {
+	    _pam_drop(new_path);
+	    return PAM_BUF_ERR;
+	}
+	ret = _pam_module_stats_write(new_path, copy, count);
+	_pam_drop(copy);
+    }
+
+    pthread_mutex_lock(&_pam_module_stats.lock);
+
+    if (new_path != NULL && clock_gettime(CLOCK_MONOTONIC, &now) == 0)
+	_pam_module_stats.dump_last = now.tv_sec;
+    _pam_drop(_pam_module_stats.dump_path);
+    if (ret == PAM_SUCCESS && new_path != NULL && interval != 0) {
+	_pam_module_stats.dump_path = new_path;
+	_pam_module_stats.dump_interval = interval;
+	new_path = NULL;
+    } else {
+	_pam_module_stats.dump_interval = 0;
+    }
+
+    pthread_mutex_unlock(&_pam_module_stats.lock);
+
+    _pam_drop(new_path);
+    return ret;
+}
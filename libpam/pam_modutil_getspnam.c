@@ -10,21 +10,9 @@
 #include "pam_modutil_private.h"
 
 #include <errno.h>
-#include <limits.h>
 #include <shadow.h>
-#include <stdio.h>
 #include <stdlib.h>
 
-static int intlen(int number)
-{
-    int len = 2;
-    while (number != 0) {
-        number /= 10;
-	len++;
-    }
-    return len;
-}
-
 struct spwd *
 pam_modutil_getspnam(pam_handle_t *pamh, const char *user)
 {
@@ -33,6 +21,16 @@ pam_modutil_getspnam(pam_handle_t *pamh, const char *user)
     void *buffer=NULL;
     size_t length = PWD_INITIAL_LENGTH;
 
+    if (pamh != NULL) {
+	struct spwd *cached;
+	int missing;
+
+	cached = _pam_modutil_cache_lookup(pamh, PAM_MODUTIL_NSS_SPNAM,
+					   user, 0, &missing);
+	if (cached != NULL || missing)
+	    return cached;
+    }
+
     do {
 	int status;
 	void *new_buffer;
@@ -57,50 +55,25 @@ pam_modutil_getspnam(pam_handle_t *pamh, const char *user)
 			    sizeof(struct spwd) + (char *) buffer,
 			    length, &result);
 	if (!status && (result == buffer)) {
-	    char *data_name;
-	    const void *ignore;
-	    int i;
-
-	    data_name = malloc(strlen("_pammodutil_getspnam") + 1 +
-			       strlen(user) + 1 + intlen(INT_MAX) + 1);
-	    if ((pamh != NULL) && (data_name == NULL)) {
-	        D(("was unable to register the data item [%s]",
-	           pam_strerror(pamh, status)));
+	    if (pamh != NULL &&
+		(status = _pam_modutil_cache_store(pamh,
+				PAM_MODUTIL_NSS_SPNAM, user,
+				0, result,
+				sizeof(struct spwd) + length)) != PAM_SUCCESS) {
+		D(("was unable to register the data item [%s]",
+		   pam_strerror(pamh, status)));
 		free(buffer);
 		return NULL;
 	    }
 
-	    if (pamh != NULL) {
-	        for (i = 0; i < INT_MAX; i++) {
-	            sprintf(data_name, "_pammodutil_getspnam_%s_%d", user, i);
-		    status = PAM_NO_MODULE_DATA;
-	            if (pam_get_data(pamh, data_name, &ignore) != PAM_SUCCESS) {
-		        status = pam_set_data(pamh, data_name,
-					      result, pam_modutil_cleanup);
-		    }
-		    if (status == PAM_SUCCESS) {
-		        break;
-		    }
-		}
-	    } else {
-	        status = PAM_SUCCESS;
-	    }
-
-	    free(data_name);
-
-	    if (status == PAM_SUCCESS) {
-		D(("success"));
-		return result;
-	    }
-
-	    D(("was unable to register the data item [%s]",
-	       pam_strerror(pamh, status)));
-
-	    free(buffer);
-	    return NULL;
+	    D(("success"));
+	    return result;
 
 	} else if (errno != ERANGE && errno != EINTR) {
                 /* no sense in repeating the call */
+                if (!status && pamh != NULL)
+                    _pam_modutil_cache_missing(PAM_MODUTIL_NSS_SPNAM,
+                                               user, 0);
                 break;
         }
 
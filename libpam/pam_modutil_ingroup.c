@@ -20,6 +20,10 @@ static int checkgrouplist(const char *user, gid_t primary, gid_t target)
 {
 	int ngroups, pgroups, i;
 
+	if ((i = _pam_modutil_cache_grouplist(user, primary, target)) >= 0) {
+		return i;
+	}
+
 	ngroups = NGROUPS_MIN;
 	do {
 		gid_t *grouplist;
@@ -31,6 +35,8 @@ static int checkgrouplist(const char *user, gid_t primary, gid_t target)
 		}
 		i = getgrouplist(user, primary, grouplist, &ngroups);
 		if (i >= 0) {
+			_pam_modutil_cache_set_grouplist(user, grouplist,
+							 ngroups);
 			for (i = 0; i < ngroups; i++) {
 				if (grouplist[i] == target) {
 					free(grouplist);
@@ -0,0 +1,578 @@
+/*
+ * Caches of the passwd, group and shadow entries looked up by the
+ * pam_modutil_get*() functions.
+ *
+ * Every PAM handle keeps the entries it has looked up.  They are
+ * returned to every module of the stack that asks for the same name or
+ * id, so a transaction asks NSS only once for each of them.  Failed
+ * lookups are not remembered there, the user may be created by a
+ * module later in the stack.  The entries are freed by pam_end().
+ *
+ * A long running application can in addition enable a process-wide
+ * cache with pam_nss_cache_enable().  It keeps copies of the entries
+ * (and of the results of getgrouplist()) for a limited time, remembers
+ * unknown names for a usually shorter time, and holds at most a given
+ * number of entries, dropping the least recently used ones first.  All
+ * entries read from a file are dropped as soon as /etc/passwd,
+ * /etc/group or /etc/shadow changes.
+ */
+
+#include "pam_modutil_private.h"
+#include "pam_private.h"
+
+#include <grp.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <shadow.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+struct pam_modutil_nss_entry {
+    struct pam_modutil_nss_entry *next;
+    int type;                    /* PAM_MODUTIL_NSS_* */
+    unsigned long id;            /* uid or gid, if looked up by id */
+    void *result;                /* struct passwd, group or spwd */
+    char name[];                 /* the name, if looked up by name */
+};
+
+/* --- process-wide cache --- */
+
+#define NSS_CACHE_BUCKETS  256
+
+#define NSS_FILE_PASSWD    0
+#define NSS_FILE_GROUP     1
+#define NSS_FILE_SHADOW    2
+#define NSS_FILES          3
+
+struct pam_nss_global_entry {
+    struct pam_nss_global_entry *hash_next;
+    struct pam_nss_global_entry *lru_prev;   /* more recently used */
+    struct pam_nss_global_entry *lru_next;   /* less recently used */
+    int type;
+    unsigned long id;
+    unsigned int hash;
+    time_t expires;
+    size_t size;                 /* of result, 0 for an unknown name */
+    void *result;
+    char name[];
+};
+
+struct pam_nss_file {
+    const char *path;
+    int known;                   /* the stat() information is set */
+    int exists;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    unsigned int max_entries;    /* 0 if the cache is disabled */
+    time_t ttl;
+    time_t negative_ttl;
+    unsigned int count;
+    struct pam_nss_global_entry *bucket[NSS_CACHE_BUCKETS];
+    struct pam_nss_global_entry *lru_first;  /* most recently used */
+    struct pam_nss_global_entry *lru_last;
+    struct pam_nss_file files[NSS_FILES];
+    struct pam_nss_cache_stats stats;
+} _pam_nss_cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .files = {
+	[NSS_FILE_PASSWD] = { .path = "/etc/passwd" },
+	[NSS_FILE_GROUP] = { .path = "/etc/group" },
+	[NSS_FILE_SHADOW] = { .path = "/etc/shadow" },
+    },
+};
+
+static int _pam_nss_file_of(int type)
+{
+    switch (type) {
+    case PAM_MODUTIL_NSS_PWNAM:
+    case PAM_MODUTIL_NSS_PWUID:
+	return NSS_FILE_PASSWD;
+    case PAM_MODUTIL_NSS_SPNAM:
+	return NSS_FILE_SHADOW;
+    default:
+	return NSS_FILE_GROUP;
+    }
+}
+
+static time_t _pam_nss_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static unsigned int _pam_nss_hash(int type, const char *name,
+				  unsigned long id)
+{
+    unsigned int hash = 2166136261U;     /* FNV-1a */
+
+    hash = (hash ^ (unsigned int) type) * 16777619U;
+    if (name != NULL) {
+	while (*name) {
+	    hash ^= (unsigned char) *name++;
+	    hash *= 16777619U;
+	}
+    } else {
+	hash = (hash ^ (unsigned int) id) * 16777619U;
+    }
+
+    return hash;
+}
+
+/* must be called with _pam_nss_cache.lock held */
+static void _pam_nss_unlink(struct pam_nss_global_entry *entry)
+{
+    struct pam_nss_global_entry **ep;
+
+    for (ep = &_pam_nss_cache.bucket[entry->hash % NSS_CACHE_BUCKETS];
+	 *ep != NULL; ep = &(*ep)->hash_next) {
+	if (*ep == entry) {
+	    *ep = entry->hash_next;
+	    break;
+	}
+    }
+
+    if (entry->lru_prev != NULL)
+	entry->lru_prev->lru_next = entry->lru_next;
+    else
+	_pam_nss_cache.lru_first = entry->lru_next;
+    if (entry->lru_next != NULL)
+	entry->lru_next->lru_prev = entry->lru_prev;
+    else
+	_pam_nss_cache.lru_last = entry->lru_prev;
+
+    _pam_nss_cache.count--;
+    free(entry->result);
+    free(entry);
+}
+
+/* must be called with _pam_nss_cache.lock held */
+static void _pam_nss_lru_front(struct pam_nss_global_entry *entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = _pam_nss_cache.lru_first;
+    if (entry->lru_next != NULL)
+	entry->lru_next->lru_prev = entry;
+    else
+	_pam_nss_cache.lru_last = entry;
+    _pam_nss_cache.lru_first = entry;
+}
+
+/*
+ * Drop the entries read from a file if it has changed since it was
+ * looked at last.  Must be called with _pam_nss_cache.lock held.
+ */
+static void _pam_nss_check_file(int file, const struct stat *st)
+{
+    struct pam_nss_file *f = &_pam_nss_cache.files[file];
+    struct pam_nss_global_entry *entry, *next;
+
+    if (f->known && f->exists == (st != NULL)
+	&& (st == NULL
+	    || (f->dev == st->st_dev && f->ino == st->st_ino
+		&& f->size == st->st_size
+		&& f->mtime.tv_sec == st->st_mtim.tv_sec
+		&& f->mtime.tv_nsec == st->st_mtim.tv_nsec
+		&& f->ctime.tv_sec == st->st_ctim.tv_sec
+		&& f->ctime.tv_nsec == st->st_ctim.tv_nsec)))
+	return;
+
+    if (f->known) {
+	D(("%s has changed", f->path));
+	for (entry = _pam_nss_cache.lru_first; entry != NULL; entry = next) {
+	    next = entry->lru_next;
+	    if (_pam_nss_file_of(entry->type) == file) {
+		_pam_nss_unlink(entry);
+		_pam_nss_cache.stats.invalidated++;
+	    }
+	}
+    }
+
+    f->known = 1;
+    f->exists = (st != NULL);
+    if (st != NULL) {
+	f->dev = st->st_dev;
+	f->ino = st->st_ino;
+	f->size = st->st_size;
+	f->mtime = st->st_mtim;
+	f->ctime = st->st_ctim;
+    }
+}
+
+/*
+ * Find a valid entry and make it the most recently used one.  Must be
+ * called with _pam_nss_cache.lock held.
+ */
+static struct pam_nss_global_entry *
+_pam_nss_find(int type, const char *name, unsigned long id, unsigned int hash)
+{
+    struct pam_nss_global_entry *entry;
+
+    for (entry = _pam_nss_cache.bucket[hash % NSS_CACHE_BUCKETS];
+	 entry != NULL; entry = entry->hash_next) {
+	if (entry->hash == hash && entry->type == type
+	    && (name != NULL ? !strcmp(entry->name, name) : entry->id == id))
+	    break;
+    }
+    if (entry == NULL)
+	return NULL;
+
+    if (entry->expires <= _pam_nss_now()) {
+	_pam_nss_unlink(entry);
+	_pam_nss_cache.stats.expired++;
+	return NULL;
+    }
+
+    if (entry != _pam_nss_cache.lru_first) {
+	/* take it out of the LRU list and put it in front */
+	entry->lru_prev->lru_next = entry->lru_next;
+	if (entry->lru_next != NULL)
+	    entry->lru_next->lru_prev = entry->lru_prev;
+	else
+	    _pam_nss_cache.lru_last = entry->lru_prev;
+	_pam_nss_lru_front(entry);
+    }
+
+    return entry;
+}
+
+/* Let a pointer into the buffer at from point into the copy at to */
+static void *_pam_nss_reloc(void *p, const void *from, size_t size, void *to)
+{
+    uintptr_t u = (uintptr_t) p, base = (uintptr_t) from;
+
+    if (p != NULL && u >= base && u < base + size)
+	return (char *) to + (u - base);
+    return p;
+}
+
+#define RELOC(field) \
+    ((field) = _pam_nss_reloc((field), src, size, dst))
+
+/* Copy an entry together with the strings it points to */
+static void *_pam_nss_copy(int type, const void *src, size_t size)
+{
+    void *dst;
+
+    if ((dst = malloc(size)) == NULL)
+	return NULL;
+    memcpy(dst, src, size);
+
+    switch (type) {
+    case PAM_MODUTIL_NSS_PWNAM:
+    case PAM_MODUTIL_NSS_PWUID: {
+	struct passwd *pwd = dst;
+
+	RELOC(pwd->pw_name);
+	RELOC(pwd->pw_passwd);
+	RELOC(pwd->pw_gecos);
+	RELOC(pwd->pw_dir);
+	RELOC(pwd->pw_shell);
+	break;
+    }
+    case PAM_MODUTIL_NSS_GRNAM:
+    case PAM_MODUTIL_NSS_GRGID: {
+	struct group *grp = dst;
+	int i;
+
+	RELOC(grp->gr_name);
+	RELOC(grp->gr_passwd);
+	RELOC(grp->gr_mem);
+	for (i = 0; grp->gr_mem != NULL && grp->gr_mem[i] != NULL; i++)
+	    RELOC(grp->gr_mem[i]);
+	break;
+    }
+    case PAM_MODUTIL_NSS_SPNAM: {
+	struct spwd *spw = dst;
+
+	RELOC(spw->sp_namp);
+	RELOC(spw->sp_pwdp);
+	break;
+    }
+    default:
+	break;                       /* no pointers in a group list */
+    }
+
+    return dst;
+}
+
+#undef RELOC
+
+/*
+ * Look up an entry in the process-wide cache.  Returns a copy of it
+ * (size bytes, to be freed by the caller), or NULL with *missing set
+ * if the name is known not to exist.
+ */
+static void *_pam_nss_lookup(int type, const char *name, unsigned long id,
+			     int *missing, size_t *size)
+{
+    struct pam_nss_global_entry *entry;
+    unsigned int hash = _pam_nss_hash(type, name, id);
+    int file = _pam_nss_file_of(type);
+    struct stat st;
+    int exists;
+    void *result = NULL;
+
+    exists = (stat(_pam_nss_cache.files[file].path, &st) == 0);
+
+    pthread_mutex_lock(&_pam_nss_cache.lock);
+    if (_pam_nss_cache.max_entries != 0) {
+	_pam_nss_check_file(file, exists ? &st : NULL);
+	if ((entry = _pam_nss_find(type, name, id, hash)) == NULL) {
+	    _pam_nss_cache.stats.misses++;
+	} else if (entry->result == NULL) {
+	    _pam_nss_cache.stats.negative_hits++;
+	    *missing = 1;
+	} else if ((result = _pam_nss_copy(type, entry->result,
+					   entry->size)) != NULL) {
+	    _pam_nss_cache.stats.hits++;
+	    *size = entry->size;
+	}
+    }
+    pthread_mutex_unlock(&_pam_nss_cache.lock);
+
+    return result;
+}
+
+/* Remember a result (or with result NULL, that name is unknown) */
+static void _pam_nss_store(int type, const char *name, unsigned long id,
+			   const void *result, size_t size)
+{
+    struct pam_nss_global_entry *entry, *old;
+    size_t len = name != NULL ? strlen(name) : 0;
+
+    if (_pam_nss_cache.max_entries == 0
+	|| (result == NULL && _pam_nss_cache.negative_ttl == 0))
+	return;
+
+    if ((entry = calloc(1, sizeof(*entry) + len + 1)) == NULL)
+	return;
+    if (result != NULL
+	&& (entry->result = _pam_nss_copy(type, result, size)) == NULL) {
+	free(entry);
+	return;
+    }
+    entry->type = type;
+    entry->id = id;
+    entry->hash = _pam_nss_hash(type, name, id);
+    entry->size = result != NULL ? size : 0;
+    memcpy(entry->name, name != NULL ? name : "", len + 1);
+
+    pthread_mutex_lock(&_pam_nss_cache.lock);
+    if (_pam_nss_cache.max_entries == 0) {
+	pthread_mutex_unlock(&_pam_nss_cache.lock);
+	free(entry->result);
+	free(entry);
+	return;
+    }
+    entry->expires = _pam_nss_now()
+	+ (result != NULL ? _pam_nss_cache.ttl : _pam_nss_cache.negative_ttl);
+
+    /* another thread may have been quicker */
+    if ((old = _pam_nss_find(type, name, id, entry->hash)) != NULL)
+	_pam_nss_unlink(old);
+    while (_pam_nss_cache.count >= _pam_nss_cache.max_entries) {
+	_pam_nss_unlink(_pam_nss_cache.lru_last);
+	_pam_nss_cache.stats.evicted++;
+    }
+
+    entry->hash_next = _pam_nss_cache.bucket[entry->hash % NSS_CACHE_BUCKETS];
+    _pam_nss_cache.bucket[entry->hash % NSS_CACHE_BUCKETS] = entry;
+    _pam_nss_lru_front(entry);
+    _pam_nss_cache.count++;
+    pthread_mutex_unlock(&_pam_nss_cache.lock);
+}
+
+void
+pam_nss_cache_flush(void)
+{
+    pthread_mutex_lock(&_pam_nss_cache.lock);
+    while (_pam_nss_cache.lru_first != NULL)
+	_pam_nss_unlink(_pam_nss_cache.lru_first);
+    pthread_mutex_unlock(&_pam_nss_cache.lock);
+}
+
+int
+pam_nss_cache_enable(unsigned int max_entries, unsigned int ttl,
+		     unsigned int negative_ttl)
+{
+    D(("called: %u %u %u", max_entries, ttl, negative_ttl));
+
+    pthread_mutex_lock(&_pam_nss_cache.lock);
+    _pam_nss_cache.max_entries = (ttl != 0) ? max_entries : 0;
+    _pam_nss_cache.ttl = ttl;
+    _pam_nss_cache.negative_ttl = negative_ttl;
+    /* make room for the new limit */
+    while (_pam_nss_cache.count > _pam_nss_cache.max_entries) {
+	_pam_nss_unlink(_pam_nss_cache.lru_last);
+	_pam_nss_cache.stats.evicted++;
+    }
+    pthread_mutex_unlock(&_pam_nss_cache.lock);
+
+    return PAM_SUCCESS;
+}
+
+int
+pam_nss_cache_stats(struct pam_nss_cache_stats *stats)
+{
+    if (stats == NULL)
+	return PAM_SYSTEM_ERR;
+
+    pthread_mutex_lock(&_pam_nss_cache.lock);
+    *stats = _pam_nss_cache.stats;
+    stats->entries = _pam_nss_cache.count;
+    pthread_mutex_unlock(&_pam_nss_cache.lock);
+
+    return PAM_SUCCESS;
+}
+
+/* --- per-handle cache --- */
+
+static void *
+_pam_modutil_cache_lookup_handle(pam_handle_t *pamh, int type,
+				 const char *name, unsigned long id,
+				 int *missing)
+{
+    struct pam_modutil_nss_entry *entry;
+    void *result;
+    size_t size;
+
+    *missing = 0;
+    if (pamh == NULL)
+	return NULL;
+
+    for (entry = pamh->nss_cache; entry != NULL; entry = entry->next) {
+	if (entry->type == type
+	    && (name != NULL ? !strcmp(entry->name, name) : entry->id == id)) {
+	    D(("cache hit"));
+	    return entry->result;
+	}
+    }
+
+    if (_pam_nss_cache.max_entries == 0)
+	return NULL;
+
+    /* the handle gets its own copy of the process-wide entry */
+    result = _pam_nss_lookup(type, name, id, missing, &size);
+    if (result != NULL
+	&& _pam_modutil_cache_store(pamh, type, name, id, result, 0)
+	   != PAM_SUCCESS) {
+	free(result);
+	result = NULL;
+    }
+
+    return result;
+}
+
+void *
+_pam_modutil_cache_lookup(pam_handle_t *pamh, int type,
+			  const char *name, unsigned long id, int *missing)
+{
+    void *result;
+
+    /* parallel modules share the cache of the handle */
+    _pam_parallel_lock(pamh);
+    result = _pam_modutil_cache_lookup_handle(pamh, type, name, id, missing);
+    _pam_parallel_unlock(pamh);
+
+    return result;
+}
+
+int
+_pam_modutil_cache_store(pam_handle_t *pamh, int type,
+			 const char *name, unsigned long id,
+			 void *result, size_t size)
+{
+    struct pam_modutil_nss_entry *entry;
+    size_t len = name != NULL ? strlen(name) : 0;
+
+    if (size != 0)
+	_pam_nss_store(type, name, id, result, size);
+
+    if ((entry = malloc(sizeof(*entry) + len + 1)) == NULL) {
+	D(("no memory for cache entry"));
+	return PAM_BUF_ERR;
+    }
+
+    entry->type = type;
+    entry->id = id;
+    entry->result = result;
+    memcpy(entry->name, name != NULL ? name : "", len + 1);
+    _pam_parallel_lock(pamh);
+    entry->next = pamh->nss_cache;
+    pamh->nss_cache = entry;
+    _pam_parallel_unlock(pamh);
+
+    return PAM_SUCCESS;
+}
+
+void
+_pam_modutil_cache_missing(int type, const char *name, unsigned long id)
+{
+    _pam_nss_store(type, name, id, NULL, 0);
+}
+
+int
+_pam_modutil_cache_grouplist(const char *user, gid_t primary, gid_t target)
+{
+    struct pam_nss_global_entry *entry;
+    const gid_t *groups;
+    size_t i;
+    int found = -1;
+
+    if (_pam_nss_cache.max_entries == 0)
+	return -1;
+
+    pthread_mutex_lock(&_pam_nss_cache.lock);
+    entry = _pam_nss_find(PAM_MODUTIL_NSS_GROUPLIST, user, 0,
+			  _pam_nss_hash(PAM_MODUTIL_NSS_GROUPLIST, user, 0));
+    /* the primary group is the first one in the list */
+    if (entry == NULL || entry->result == NULL
+	|| *(const gid_t *) entry->result != primary) {
+	_pam_nss_cache.stats.misses++;
+    } else {
+	_pam_nss_cache.stats.hits++;
+	groups = entry->result;
+	for (i = found = 0; i < entry->size / sizeof(gid_t); i++) {
+	    if (groups[i] == target) {
+		found = 1;
+		break;
+	    }
+	}
+    }
+    pthread_mutex_unlock(&_pam_nss_cache.lock);
+
+    return found;
+}
+
+void
+_pam_modutil_cache_set_grouplist(const char *user, const gid_t *groups,
+				 int ngroups)
+{
+    if (ngroups > 0)
+	_pam_nss_store(PAM_MODUTIL_NSS_GROUPLIST, user, 0, groups,
+		       ngroups * sizeof(gid_t));
+}
+
+void
+_pam_modutil_cache_free(pam_handle_t *pamh)
+{
+    struct pam_modutil_nss_entry *entry;
+
+    while ((entry = pamh->nss_cache) != NULL) {
+	pamh->nss_cache = entry->next;
+	free(entry->result);
+	free(entry);
+    }
+}
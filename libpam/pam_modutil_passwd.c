@@ -0,0 +1,345 @@
+/*
+ * This file implements the following functions:
+ *   pam_modutil_search_passwd:
+ *     finds the line of a user in a passwd file.
+ *
+ * Scanning the file line by line takes tens of milliseconds when it has
+ * hundreds of thousands of users.  The first lookup in a regular file
+ * reads it into memory and builds a hash table of the line offsets
+ * keyed on the login names, which is kept for the process and used for
+ * all lookups until the file changes.  Every lookup stat()s the file, a
+ * different inode, size, modification or change time makes it build
+ * the table again.  The file is copied rather than mapped, since a
+ * mapping of a file that is truncated in place faults.  Files that are
+ * not regular are still scanned.
+ */
+
+#include "pam_modutil_private.h"
+#include <security/pam_ext.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+struct passwd_index {
+	struct passwd_index *next;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	struct timespec ctime;
+	char *data;		/* a copy of the file, NULL if it is empty */
+	size_t len;
+	uint32_t mask;		/* number of slots - 1 */
+	uint32_t *slots;	/* offset of a line + 1, 0 if free */
+	char path[];
+};
+
+static struct passwd_index *indexes;
+static pthread_rwlock_t indexes_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static uint32_t
+name_hash(const char *name, size_t len)
+{
+	uint32_t hash = 2166136261U;	/* FNV-1a */
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		hash = (hash ^ (unsigned char) name[i]) * 16777619U;
+	return hash;
+}
+
+static int
+index_is_current(const struct passwd_index *idx, const struct stat *st)
+{
+	return idx->dev == st->st_dev && idx->ino == st->st_ino
+		&& idx->size == st->st_size
+		&& idx->mtime.tv_sec == st->st_mtim.tv_sec
+		&& idx->mtime.tv_nsec == st->st_mtim.tv_nsec
+		&& idx->ctime.tv_sec == st->st_ctim.tv_sec
+		&& idx->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+/* The slot of the line of name, or of the free slot it would go in. */
+static uint32_t *
+index_slot(const struct passwd_index *idx, const char *name, size_t len)
+{
+	uint32_t i = name_hash(name, len) & idx->mask;
+	uint32_t *slot;
+
+	for (;; i = (i + 1) & idx->mask) {
+		slot = &idx->slots[i];
+		if (*slot == 0)
+			return slot;
+		if (*slot - 1 + len < idx->len
+		    && idx->data[*slot - 1 + len] == ':'
+		    && memcmp(idx->data + *slot - 1, name, len) == 0)
+			return slot;
+	}
+}
+
+static void
+index_release(struct passwd_index *idx)
+{
+	free(idx->data);
+	free(idx->slots);
+	idx->data = NULL;
+	idx->slots = NULL;
+}
+
+/*
+ * Reads the file into idx->data.  A file that changes while it is read
+ * is read again, a few times; the table is built from the last copy
+ * then, and replaced at the next lookup.  Returns 0, or -1 with errno
+ * set.
+ */
+static int
+index_read(struct passwd_index *idx)
+{
+	struct stat st, after;
+	char *data = NULL;
+	size_t len = 0;
+	ssize_t n;
+	int fd, tries, err;
+
+	if ((fd = open(idx->path, O_RDONLY | O_CLOEXEC)) < 0)
+		return -1;
+
+	for (tries = 0; tries < 3; tries++) {
+		if (fstat(fd, &st) != 0)
+			goto fail;
+		if ((uintmax_t) st.st_size >= UINT32_MAX) {
+			errno = EFBIG;
+			goto fail;
+		}
+		free(data);
+		data = NULL;
+		len = 0;
+		if (st.st_size > 0
+		    && (data = malloc(st.st_size)) == NULL)
+			goto fail;
+		while (len < (size_t) st.st_size) {
+			n = pread(fd, data + len, st.st_size - len, len);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0)
+				goto fail;
+			if (n == 0)
+				break;		/* truncated meanwhile */
+			len += n;
+		}
+		if (fstat(fd, &after) != 0)
+			goto fail;
+		if (len == (size_t) st.st_size
+		    && after.st_size == st.st_size
+		    && after.st_mtim.tv_sec == st.st_mtim.tv_sec
+		    && after.st_mtim.tv_nsec == st.st_mtim.tv_nsec)
+			break;
+	}
+	close(fd);
+
+	idx->dev = st.st_dev;
+	idx->ino = st.st_ino;
+	idx->size = st.st_size;
+	idx->mtime = st.st_mtim;
+	idx->ctime = st.st_ctim;
+	if (len == 0) {
+		free(data);
+		data = NULL;
+	}
+	idx->data = data;
+	idx->len = len;
+	return 0;
+
+fail:
+	err = errno;
+	free(data);
+	close(fd);
+	errno = err;
+	return -1;
+}
+
+/* Reads the file and indexes its lines.  Returns 0, or -1 with errno set. */
+static int
+index_build(struct passwd_index *idx)
+{
+	const char *p, *end, *eol, *colon;
+	size_t lines, nslots;
+
+	if (index_read(idx) != 0)
+		return -1;
+
+	/* at most half of the slots are used */
+	end = idx->data + idx->len;
+	for (lines = 1, p = idx->data; p < end
+	     && (p = memchr(p, '\n', end - p)) != NULL; p++)
+		lines++;
+	for (nslots = 16; nslots < 2 * lines; nslots *= 2)
+		;
+	if ((idx->slots = calloc(nslots, sizeof(*idx->slots))) == NULL) {
+		index_release(idx);
+		errno = ENOMEM;
+		return -1;
+	}
+	idx->mask = nslots - 1;
+
+	/* the first line of a name is the one that counts */
+	for (p = idx->data; p < end; p = eol + 1) {
+		uint32_t *slot;
+
+		if ((eol = memchr(p, '\n', end - p)) == NULL)
+			eol = end;
+		if ((colon = memchr(p, ':', eol - p)) == NULL)
+			continue;
+		slot = index_slot(idx, p, colon - p);
+		if (*slot == 0)
+			*slot = p - idx->data + 1;
+	}
+
+	return 0;
+}
+
+/* Copies the line at p without its newline into buf. */
+static int
+copy_line(const char *p, size_t len, char *buf, size_t size)
+{
+	if (buf == NULL)
+		return PAM_SUCCESS;
+	if (len >= size)
+		return PAM_BUF_ERR;
+	memcpy(buf, p, len);
+	buf[len] = '\0';
+	return PAM_SUCCESS;
+}
+
+static int
+index_lookup(const struct passwd_index *idx, const char *user_name,
+	     char *buf, size_t size)
+{
+	const char *line, *eol;
+	uint32_t *slot;
+
+	if (idx->data == NULL)
+		return PAM_USER_UNKNOWN;
+	slot = index_slot(idx, user_name, strlen(user_name));
+	if (*slot == 0)
+		return PAM_USER_UNKNOWN;
+
+	line = idx->data + *slot - 1;
+	eol = memchr(line, '\n', idx->data + idx->len - line);
+	return copy_line(line, (eol != NULL ? eol : idx->data + idx->len) - line,
+			 buf, size);
+}
+
+static int
+search_indexed(pam_handle_t *pamh, const char *user_name,
+	       const char *file_name, const struct stat *st,
+	       char *buf, size_t size)
+{
+	struct passwd_index *idx;
+	int rc = PAM_USER_UNKNOWN;
+
+	pthread_rwlock_rdlock(&indexes_lock);
+	for (idx = indexes; idx != NULL; idx = idx->next) {
+		if (strcmp(idx->path, file_name) == 0) {
+			if (idx->slots != NULL && index_is_current(idx, st)) {
+				rc = index_lookup(idx, user_name, buf, size);
+				pthread_rwlock_unlock(&indexes_lock);
+				return rc;
+			}
+			break;
+		}
+	}
+	pthread_rwlock_unlock(&indexes_lock);
+
+	/* another thread may have built it in the meantime */
+	pthread_rwlock_wrlock(&indexes_lock);
+	for (idx = indexes; idx != NULL; idx = idx->next) {
+		if (strcmp(idx->path, file_name) == 0)
+			break;
+	}
+	if (idx == NULL) {
+		if ((idx = calloc(1, sizeof(*idx) + strlen(file_name) + 1))
+		    == NULL) {
+			pthread_rwlock_unlock(&indexes_lock);
+			pam_syslog(pamh, LOG_CRIT, "out of memory");
+			return PAM_BUF_ERR;
+		}
+		strcpy(idx->path, file_name);
+		idx->next = indexes;
+		indexes = idx;
+	}
+	if (idx->slots == NULL || !index_is_current(idx, st)) {
+		index_release(idx);
+		if (index_build(idx) != 0) {
+			pam_syslog(pamh, LOG_ERR, "error reading %s: %m",
+				   file_name);
+			rc = PAM_SERVICE_ERR;
+		}
+	}
+	if (idx->slots != NULL)
+		rc = index_lookup(idx, user_name, buf, size);
+	pthread_rwlock_unlock(&indexes_lock);
+
+	return rc;
+}
+
+static int
+search_scan(pam_handle_t *pamh, const char *user_name,
+	    const char *file_name, char *buf, size_t size)
+{
+	size_t user_len = strlen(user_name), n = 0;
+	char *line = NULL;
+	ssize_t len;
+	FILE *fp;
+	int rc = PAM_USER_UNKNOWN;
+
+	if ((fp = fopen(file_name, "r")) == NULL) {
+		pam_syslog(pamh, LOG_ERR, "error opening %s: %m", file_name);
+		return PAM_SERVICE_ERR;
+	}
+
+	while ((len = getline(&line, &n, fp)) > 0) {
+		if ((size_t) len > user_len && line[user_len] == ':'
+		    && strncmp(user_name, line, user_len) == 0) {
+			if (line[len - 1] == '\n')
+				len--;
+			rc = copy_line(line, len, buf, size);
+			break;
+		}
+	}
+
+	free(line);
+	fclose(fp);
+	return rc;
+}
+
+int
+pam_modutil_search_passwd(pam_handle_t *pamh, const char *user_name,
+			  const char *file_name, char *buf, size_t size)
+{
+	struct stat st;
+
+	/* "root:x" is not a user name even if a line starts with "root:x:" */
+	if (*user_name == '\0' || strpbrk(user_name, ":\n") != NULL)
+		return PAM_USER_UNKNOWN;
+
+	if (file_name == NULL)
+		file_name = "/etc/passwd";
+	if (stat(file_name, &st) != 0) {
+		pam_syslog(pamh, LOG_ERR, "error opening %s: %m", file_name);
+		return PAM_SERVICE_ERR;
+	}
+
+	if (S_ISREG(st.st_mode) && (uintmax_t) st.st_size < UINT32_MAX)
+		return search_indexed(pamh, user_name, file_name, &st,
+				      buf, size);
+	return search_scan(pamh, user_name, file_name, buf, size);
+}
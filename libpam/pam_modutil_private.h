@@ -21,4 +21,43 @@ extern void
 pam_modutil_cleanup(pam_handle_t *pamh, void *data,
                     int error_status);
 
+/* kinds of entries in the NSS caches */
+#define PAM_MODUTIL_NSS_PWNAM      1
+#define PAM_MODUTIL_NSS_PWUID      2
+#define PAM_MODUTIL_NSS_GRNAM      3
+#define PAM_MODUTIL_NSS_GRGID      4
+#define PAM_MODUTIL_NSS_SPNAM      5
+#define PAM_MODUTIL_NSS_GROUPLIST  6
+
+/*
+ * Find an entry looked up by name (or by id if name is NULL), first in
+ * the handle and then in the process-wide cache.  *missing is set if
+ * the process-wide cache knows there is no such entry.
+ */
+extern void *
+_pam_modutil_cache_lookup(pam_handle_t *pamh, int type,
+			  const char *name, unsigned long id, int *missing);
+
+/*
+ * Keep result, allocated with malloc(), until pam_end().  If size is
+ * not zero, the result is a buffer of that size holding the entry and
+ * its strings, and a copy is put in the process-wide cache.
+ */
+extern int
+_pam_modutil_cache_store(pam_handle_t *pamh, int type,
+			 const char *name, unsigned long id,
+			 void *result, size_t size);
+
+/* Remember in the process-wide cache that a lookup found nothing */
+extern void
+_pam_modutil_cache_missing(int type, const char *name, unsigned long id);
+
+/* Is target in the cached group list of user? -1 if it is not cached */
+extern int
+_pam_modutil_cache_grouplist(const char *user, gid_t primary, gid_t target);
+
+extern void
+_pam_modutil_cache_set_grouplist(const char *user, const gid_t *groups,
+				 int ngroups);
+
 #endif /* PAMMODUTIL_PRIVATE_H */
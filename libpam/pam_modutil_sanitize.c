@@ -128,6 +128,12 @@ close_fds(void)
 	/* The lower limit is the same as for _POSIX_OPEN_MAX. */
 	const unsigned int MIN_FD_NO = 20;
 
+#ifdef HAVE_CLOSE_RANGE
+	/* all of them at once */
+	if (close_range(STDERR_FILENO + 1, ~0U, 0) == 0)
+		return;
+#endif
+
 	/* If /proc is mounted, we can optimize which fd can be closed. */
 	if ((dir = opendir("/proc/self/fd")) != NULL) {
 		if ((dfd = dirfd(dir)) >= 0 && is_in_procfs(dfd) > 0) {
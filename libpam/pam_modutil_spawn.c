@@ -0,0 +1,256 @@
+/*
+ * This file implements the following functions:
+ *   pam_modutil_spawn_helper:
+ *     runs a helper program with its standard descriptors set up and all
+ *     other descriptors closed, without copying the calling process.
+ *
+ * fork() has to copy the page tables of the caller, which takes
+ * milliseconds in a daemon with gigabytes of memory, only for the child
+ * to throw them away in execve().  On Linux the child is started with
+ * clone(CLONE_VM | CLONE_VFORK) on a small stack of its own instead, it
+ * runs in the memory of the caller until execve(), and the caller waits
+ * for that.  Elsewhere vfork() does the same.
+ *
+ * As the child shares the memory of the caller, it must not take locks
+ * or allocate memory, and must not call the libc functions that change
+ * the ids of all threads of the process: the ids are set with the
+ * system calls themselves.  The child reports a failure in the shared
+ * memory, the caller logs it.
+ *
+ * -1 is returned when no child could be started, -2 when the child
+ * could not run the helper, so that a caller can tell a missing helper
+ * from a process that ran out of resources.
+ */
+
+#include "pam_modutil_private.h"
+#include <security/pam_ext.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+/* the stack has to grow down for clone() to be given its top */
+#if defined __linux__ && defined CLONE_VFORK && defined MAP_STACK \
+    && !defined __hppa__ && !defined __ia64__
+#define SPAWN_CLONE 1
+#define SPAWN_STACK_SIZE (64 * 1024)
+#endif
+
+struct spawn_args {
+	const char *path;
+	char *const *argv;
+	char *const *envp;
+	const struct pam_modutil_spawn_attr *attr;
+	sigset_t oldmask;
+	int err;		/* errno of the step that failed */
+	const char *step;
+};
+
+/* set*id() of glibc and musl signal all threads of the caller */
+#if defined SYS_setuid32
+#define spawn_setuid(uid)	syscall(SYS_setuid32, (uid))
+#define spawn_setgid(gid)	syscall(SYS_setgid32, (gid))
+#define spawn_setgroups0()	syscall(SYS_setgroups32, 0, NULL)
+#elif defined SYS_setuid
+#define spawn_setuid(uid)	syscall(SYS_setuid, (uid))
+#define spawn_setgid(gid)	syscall(SYS_setgid, (gid))
+#define spawn_setgroups0()	syscall(SYS_setgroups, 0, NULL)
+#else
+#define spawn_setuid(uid)	setuid(uid)
+#define spawn_setgid(gid)	setgid(gid)
+#define spawn_setgroups0()	setgroups(0, NULL)
+#endif
+
+/* Closes all descriptors after stderr. */
+static void
+spawn_close_fds(void)
+{
+	struct rlimit rlim;
+	int fd;
+
+#if defined HAVE_CLOSE_RANGE
+	if (close_range(STDERR_FILENO + 1, ~0U, 0) == 0)
+		return;
+#elif defined SYS_close_range
+	if (syscall(SYS_close_range, STDERR_FILENO + 1, ~0U, 0) == 0)
+		return;
+#endif
+
+	/* opendir() would allocate memory, so go through all of them */
+	if (getrlimit(RLIMIT_NOFILE, &rlim) || rlim.rlim_max > 65535)
+		fd = 65535;
+	else if (rlim.rlim_max < 20)
+		fd = 20;
+	else
+		fd = rlim.rlim_max - 1;
+
+	for (; fd > STDERR_FILENO; --fd)
+		close(fd);
+}
+
+/* Redirects fd to the read end of a pipe or to /dev/null. */
+static int
+spawn_redirect(enum pam_modutil_redirect_fd mode, int fd)
+{
+	int new, p[2];
+
+	switch (mode) {
+	case PAM_MODUTIL_PIPE_FD:
+		if (pipe(p) < 0)
+			return -1;
+		close(p[1]);
+		new = p[0];
+		break;
+	case PAM_MODUTIL_NULL_FD:
+		if ((new = open("/dev/null", O_RDWR)) < 0)
+			return -1;
+		break;
+	default:
+		return 0;
+	}
+
+	if (new != fd) {
+		if (dup2(new, fd) != fd) {
+			close(new);
+			return -1;
+		}
+		close(new);
+	}
+	return 0;
+}
+
+#define SPAWN_FAIL(a, what) \
+	do { (a)->err = errno; (a)->step = (what); _exit(127); } while (0)
+
+static int
+spawn_child(void *arg)
+{
+	struct spawn_args *a = arg;
+	const struct pam_modutil_spawn_attr *attr = a->attr;
+	struct sigaction sa;
+	int fd[3], i;
+
+	/* no handler of the caller may run in here once signals come in */
+	for (i = 1; i < NSIG; i++) {
+		if (sigaction(i, NULL, &sa) == 0 && sa.sa_handler != SIG_IGN
+		    && sa.sa_handler != SIG_DFL) {
+			memset(&sa, 0, sizeof(sa));
+			sa.sa_handler = SIG_DFL;
+			sigaction(i, &sa, NULL);
+		}
+	}
+
+	/* move what is to become a standard descriptor out of the way */
+	for (i = 0; i < 3; i++) {
+		fd[i] = attr->stdfd[i];
+		if (fd[i] >= 0 && fd[i] <= STDERR_FILENO && fd[i] != i
+		    && (fd[i] = fcntl(fd[i], F_DUPFD, STDERR_FILENO + 1)) < 0)
+			SPAWN_FAIL(a, "dup");
+	}
+	for (i = 0; i < 3; i++) {
+		if (fd[i] == i) {
+			if (fcntl(i, F_SETFD, 0) < 0)
+				SPAWN_FAIL(a, "fcntl");
+		} else if (fd[i] >= 0) {
+			if (dup2(fd[i], i) != i)
+				SPAWN_FAIL(a, "dup2");
+		} else if (spawn_redirect(attr->redirect[i], i) < 0) {
+			SPAWN_FAIL(a, "redirect");
+		}
+	}
+	spawn_close_fds();
+
+	if (attr->flags & PAM_MODUTIL_SPAWN_IDS) {
+		if (spawn_setgid(attr->gid) != 0)
+			SPAWN_FAIL(a, "setgid");
+		if (spawn_setgroups0() != 0)
+			SPAWN_FAIL(a, "setgroups");
+		if (spawn_setuid(attr->uid) != 0)
+			SPAWN_FAIL(a, "setuid");
+	}
+	if ((attr->flags & PAM_MODUTIL_SPAWN_EUID)
+	    && spawn_setuid(geteuid()) != 0)
+		SPAWN_FAIL(a, "setuid");
+	if ((attr->flags & PAM_MODUTIL_SPAWN_SETSID) && setsid() < 0)
+		SPAWN_FAIL(a, "setsid");
+
+	sigprocmask(SIG_SETMASK, &a->oldmask, NULL);
+	execve(a->path, a->argv, a->envp);
+	SPAWN_FAIL(a, "execve");
+	return 127;
+}
+
+pid_t
+pam_modutil_spawn_helper(pam_handle_t *pamh, const char *path,
+			 char *const argv[], char *const envp[],
+			 const struct pam_modutil_spawn_attr *attr)
+{
+	struct spawn_args a;
+	sigset_t all;
+	pid_t pid;
+	int err;
+#ifdef SPAWN_CLONE
+	char *stack;
+
+	stack = mmap(NULL, SPAWN_STACK_SIZE, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if (stack == MAP_FAILED) {
+		pam_syslog(pamh, LOG_ERR, "Could not map a stack: %m");
+		return -1;
+	}
+#endif
+
+	memset(&a, 0, sizeof(a));
+	a.path = path;
+	a.argv = argv;
+	a.envp = envp;
+	a.attr = attr;
+
+	/* signals are unblocked by the child once the handlers are reset */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &a.oldmask);
+
+#ifdef SPAWN_CLONE
+	pid = clone(spawn_child, stack + SPAWN_STACK_SIZE,
+		    CLONE_VM | CLONE_VFORK | SIGCHLD, &a);
+#else
+	if ((pid = vfork()) == 0)
+		_exit(spawn_child(&a));
+#endif
+	err = errno;
+
+	pthread_sigmask(SIG_SETMASK, &a.oldmask, NULL);
+#ifdef SPAWN_CLONE
+	munmap(stack, SPAWN_STACK_SIZE);
+#endif
+
+	if (pid < 0) {
+		errno = err;
+		pam_syslog(pamh, LOG_ERR, "Could not start %s: %m", path);
+		return -1;
+	}
+
+	/* the child has either run the helper or given up */
+	if (a.err != 0) {
+		while (waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+			;
+		errno = a.err;
+		pam_syslog(pamh, LOG_ERR, "%s for %s failed: %m", a.step, path);
+		errno = a.err;
+		return -2;
+	}
+
+	return pid;
+}
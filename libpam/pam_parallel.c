@@ -0,0 +1,188 @@
+/* pam_parallel.c -- session modules running at once */
+
+/*
+ * A session line with the "parallel" control flag behaves like an
+ * optional one, but consecutive parallel lines of the same (sub)stack
+ * are called at once, each in a thread of its own, so opening or
+ * closing the session takes as long as the slowest of them rather than
+ * all of them together.  _pam_dispatch_aux() then goes through their
+ * return values in stack order, as if they had been called one after
+ * the other.
+ *
+ * The modules share the handle.  While they run, the functions a module
+ * uses to read or change it hold a recursive lock, so the conversation
+ * function of the application is not entered twice and the items, the
+ * data and the environment stay consistent.  Everything else a module
+ * does has to be safe in threads, which is why it is up to the
+ * administrator to mark the lines.
+ */
+
+#include "pam_private.h"
+#include "pam_probes.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct _pam_parallel {
+    pthread_mutex_t lock;        /* held by the module calling libpam */
+};
+
+struct _pam_parallel_call {
+    pthread_t thread;
+    int started;                 /* thread is valid */
+    pam_handle_t *pamh;
+    const struct handler *h;
+    int flags;
+    int retval;
+};
+
+/* the call a thread is running, for _pam_module_name() and the like */
+static pthread_key_t _pam_parallel_key;
+static pthread_once_t _pam_parallel_once = PTHREAD_ONCE_INIT;
+static int _pam_parallel_key_ok;
+
+static void _pam_parallel_init(void)
+{
+    _pam_parallel_key_ok = pthread_key_create(&_pam_parallel_key, NULL) == 0;
+}
+
+static void *_pam_parallel_call(void *arg)
+{
+    struct _pam_parallel_call *call = arg;
+    const struct handler *h = call->h;
+    pam_handle_t *pamh = call->pamh;
+    struct timespec begin;
+    int timed = _pam_module_stats_enabled()
+	&& clock_gettime(CLOCK_MONOTONIC, &begin) == 0;
+
+    pthread_setspecific(_pam_parallel_key, call);
+
+    PAM_PROBE3(libpam, module__entry, pamh->service_name,
+	       pamh->choice, h->mod_name);
+    call->retval = h->func(pamh, call->flags, h->argc, h->argv);
+    PAM_PROBE4(libpam, module__return, pamh->service_name,
+	       pamh->choice, h->mod_name, call->retval);
+    if (timed)
+	_pam_module_stats_record(pamh, h->mod_name, &begin, call->retval);
+
+    /* the others have been called already, there is nothing to resume */
+    if (call->retval == PAM_INCOMPLETE) {
+	pam_syslog(pamh, LOG_ERR, "PAM_INCOMPLETE in a parallel module");
+	call->retval = PAM_SYSTEM_ERR;
+    }
+
+    pthread_setspecific(_pam_parallel_key, NULL);
+
+    return NULL;
+}
+
+/*
+ * Call the module of chain->handlers[depth] and of the parallel
+ * handlers following it at once and store their return values in
+ * retvals.  Returns the index of the first handler not called, which is
+ * depth if there was nothing to run at once; the caller then calls the
+ * module itself.
+ */
+
+int _pam_parallel_run(pam_handle_t *pamh, int flags,
+		      const struct handler_chain *chain, int depth,
+		      int *retvals)
+{
+    struct _pam_parallel_call calls[_PAM_PARALLEL_MAX];
+    struct _pam_parallel par;
+    pthread_mutexattr_t attr;
+    int level = chain->handlers[depth].stack_level;
+    int n, i;
+
+    for (n = 0; n < _PAM_PARALLEL_MAX && depth + n < chain->count; n++) {
+	const struct handler *h = &chain->handlers[depth + n];
+
+	if (!h->parallel || h->func == NULL || h->stack_level != level
+	    || (h->handler_type != PAM_HT_MODULE
+		&& h->handler_type != PAM_HT_SILENT_MODULE)
+	    || _pam_broker_holds(pamh, h->mod_name))   /* one call at a time */
+	    break;
+    }
+    if (n < 2)
+	return depth;
+
+    if (pthread_once(&_pam_parallel_once, _pam_parallel_init) != 0
+	|| !_pam_parallel_key_ok || pthread_mutexattr_init(&attr) != 0)
+	return depth;
+    i = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE) != 0
+	|| pthread_mutex_init(&par.lock, &attr) != 0;
+    pthread_mutexattr_destroy(&attr);
+    if (i)
+	return depth;
+
+    D(("calling %d modules at once", n));
+
+    memset(calls, 0, sizeof(calls));
+    pamh->parallel = &par;
+    for (i = 0; i < n; i++) {
+	calls[i].pamh = pamh;
+	calls[i].h = &chain->handlers[depth + i];
+	calls[i].flags = flags;
+    }
+
+    /* the first module is called by this thread */
+    for (i = 1; i < n; i++) {
+	calls[i].started = pthread_create(&calls[i].thread, NULL,
+					  _pam_parallel_call, &calls[i]) == 0;
+    }
+    _pam_parallel_call(&calls[0]);
+
+    /* and so are those no thread could be started for */
+    for (i = 1; i < n; i++) {
+	if (calls[i].started)
+	    pthread_join(calls[i].thread, NULL);
+	else
+	    _pam_parallel_call(&calls[i]);
+    }
+
+    pamh->parallel = NULL;
+    pthread_mutex_destroy(&par.lock);
+
+    for (i = 0; i < n; i++)
+	retvals[i] = calls[i].retval;
+
+    return depth + n;
+}
+
+void _pam_parallel_lock(const pam_handle_t *pamh)
+{
+    if (pamh != NULL && pamh->parallel != NULL)
+	pthread_mutex_lock(&pamh->parallel->lock);
+}
+
+void _pam_parallel_unlock(const pam_handle_t *pamh)
+{
+    if (pamh != NULL && pamh->parallel != NULL)
+	pthread_mutex_unlock(&pamh->parallel->lock);
+}
+
+const char *_pam_module_name(const pam_handle_t *pamh)
+{
+    const struct _pam_parallel_call *call;
+
+    if (pamh->parallel != NULL
+	&& (call = pthread_getspecific(_pam_parallel_key)) != NULL)
+	return call->h->mod_name;
+
+    return pamh->mod_name;
+}
+
+int _pam_module_args(const pam_handle_t *pamh, char ***argv)
+{
+    const struct _pam_parallel_call *call;
+
+    if (pamh->parallel != NULL
+	&& (call = pthread_getspecific(_pam_parallel_key)) != NULL) {
+	*argv = call->h->argv;
+	return call->h->argc;
+    }
+
+    *argv = pamh->mod_argv;
+    return pamh->mod_argc;
+}
@@ -29,6 +29,9 @@ int pam_chauthtok(pam_handle_t *pamh, int flags)
       return PAM_SYSTEM_ERR;
     }
 
+    if ((retval = _pam_broker_call(pamh, PAM_CHAUTHTOK, flags)) != PAM_IGNORE)
+	return retval;
+
     if (pamh->former.choice == PAM_NOT_STACKED) {
 	_pam_start_timer(pamh);    /* we try to make the time for a failure
 				      independent of the time it takes to
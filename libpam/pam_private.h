@@ -16,6 +16,7 @@
 
 #include "config.h"
 
+#include <stddef.h>
 #include <syslog.h>
 
 #include <security/pam_appl.h>
@@ -34,6 +35,10 @@
 #define PAM_CONFIG_DIST2_DF VENDORDIR"/pam.d/%s"
 #endif
 
+/* the compiled configuration, see pam_conf_image.c */
+#define PAM_CONFIG_IMAGE_NAME ".image"
+#define PAM_CONFIG_IMAGE      PAM_CONFIG_D "/" PAM_CONFIG_IMAGE_NAME
+
 
 #define PAM_DEFAULT_SERVICE        "other"     /* lower case */
 
@@ -49,53 +54,102 @@
 
 #define _PAM_INVALID_RETVAL  -1    /* default value for cached_retval */
 
+struct loaded_module;
+
 struct handler {
     int handler_type;
     int (*func)(pam_handle_t *pamh, int flags, int argc, char **argv);
-    int actions[_PAM_RETURN_VALUES];
-    /* set by authenticate, open_session, chauthtok(1st)
-       consumed by setcred, close_session, chauthtok(2nd) */
-    int cached_retval; int *cached_retval_p;
+    struct loaded_module *module; /* NULL if the line names none */
+    int sym;                      /* PAM_SM_* function of the module */
+    int actions[_PAM_RETURN_VALUES];  /* jumps hold the index to go on at */
     int argc;
     char **argv;
-    struct handler *next;
     char *mod_name;
     int stack_level;
+    int substack_end;      /* index of the first handler after the substack */
+    int parallel;          /* "parallel" session line, see pam_parallel.c */
+};
+
+/* what a handle remembers about a handler between the calls */
+struct handler_state {
+    /* set by authenticate, open_session, chauthtok(1st)
+       consumed by setcred, close_session, chauthtok(2nd) */
+    int cached_retval;
     int grantor;
 };
 
+/*
+ * The handlers of one module function, in stack order.  Once the
+ * configuration is read, _pam_resolve_chains() turns the jump counts in
+ * the actions into indices, so _pam_dispatch_aux() walks the array
+ * without looking at the stack levels of the skipped handlers.
+ */
+struct handler_chain {
+    struct handler *handlers;
+    int count;
+    int allocated;         /* 0 if the handlers belong to a shared stack */
+    int loaded;            /* the functions of the handlers are resolved */
+    struct handler_state *state;   /* of the handle, one per handler */
+    struct handler_state *frozen;  /* whose cached_retval the chain follows */
+};
+
 #define PAM_HT_MODULE       0
 #define PAM_HT_MUST_FAIL    1
 #define PAM_HT_SUBSTACK     2
 #define PAM_HT_SILENT_MODULE 3
 
+typedef int (*servicefn)(pam_handle_t *, int, int, char **);
+
+/* the pam_sm_* functions a module may provide */
+#define PAM_SM_AUTHENTICATE   0
+#define PAM_SM_SETCRED        1
+#define PAM_SM_ACCT_MGMT      2
+#define PAM_SM_OPEN_SESSION   3
+#define PAM_SM_CLOSE_SESSION  4
+#define PAM_SM_CHAUTHTOK      5
+#define PAM_SM_FUNCS          6
+
+/* entry of the process-wide module table, see _pam_load_module() */
 struct loaded_module {
     char *name;
     int type; /* PAM_STATIC_MOD or PAM_DYNAMIC_MOD */
     void *dl_handle;
+    servicefn func[PAM_SM_FUNCS]; /* resolved when the module is loaded */
+    unsigned int refcount;        /* references from handles and stacks */
+    struct loaded_module *next;   /* next in the same hash bucket */
 };
 
 #define PAM_MT_DYNAMIC_MOD 0
 #define PAM_MT_STATIC_MOD  1
 #define PAM_MT_FAULTY_MOD 2
+#define PAM_MT_LAZY_MOD    3  /* not dlopen()ed before a chain needs it */
 
 struct handlers {
-    struct handler *authenticate;
-    struct handler *setcred;
-    struct handler *acct_mgmt;
-    struct handler *open_session;
-    struct handler *close_session;
-    struct handler *chauthtok;
+    struct handler_chain authenticate;
+    struct handler_chain setcred;
+    struct handler_chain acct_mgmt;
+    struct handler_chain open_session;
+    struct handler_chain close_session;
+    struct handler_chain chauthtok;
 };
 
+struct _pam_stack;                /* see pam_stack_cache.c */
+struct _pam_conf_record;          /* see pam_conf_image.c */
+
 struct service {
-    struct loaded_module *module; /* Array of modules */
+    struct loaded_module **module; /* Array of module references */
     int modules_allocated;
     int modules_used;
     int handlers_loaded;
 
     struct handlers conf;        /* the configured handlers */
     struct handlers other;       /* the default handlers */
+    struct handler_state *state; /* of all the handlers of the handle */
+
+    struct _pam_stack *stack;    /* cached stack the handlers belong to */
+    struct _pam_stack *pending;  /* stack being parsed for the cache */
+    struct _pam_conf_record *record; /* handlers being compiled */
+    int refresh;                 /* parse again, see pam_stack_cache_reload() */
 };
 
 /*
@@ -114,6 +168,7 @@ struct pam_environ {
 };
 
 #include <sys/time.h>
+#include <time.h>
 
 typedef enum { PAM_FALSE, PAM_TRUE } _pam_boolean;
 
@@ -122,8 +177,12 @@ struct _pam_fail_delay {
     unsigned int delay;
     time_t begin;
     const void *delay_fn_ptr;
+    _pam_boolean defer;          /* see pam_fail_delay_defer() */
+    struct timespec deadline;    /* CLOCK_MONOTONIC, zero if none */
 };
 
+#define PAM_SUBSTACK_MAX_LEVEL 16   /* maximum level of substacks */
+
 /* initial state in substack */
 struct _pam_substack_state {
     int impression;
@@ -138,7 +197,8 @@ struct _pam_former_state {
     int depth;             /* how deep in the stack were we? */
     int impression;        /* the impression at that time */
     int status;            /* the status before returning incomplete */
-    struct _pam_substack_state *substates; /* array of initial substack states */
+    struct _pam_substack_state substates[PAM_SUBSTACK_MAX_LEVEL];
+			   /* initial substack states */
 
 /* state info used by pam_get_user() function */
     int fail_user;
@@ -149,6 +209,37 @@ struct _pam_former_state {
     _pam_boolean update;
 };
 
+/* Module data is kept in a stack, which gives the order of the */
+/* cleanup calls, and in a hash table for looking it up by name. */
+
+struct pam_data {
+     char *name;
+     void *data;
+     void (*cleanup)(pam_handle_t *pamh, void *data, int error_status);
+     const char *module;          /* that set it, NULL for libpam */
+     struct pam_data *next;       /* the entry set before this one */
+     struct pam_data *hash_next;  /* next entry in the same bucket */
+     unsigned int hash;
+};
+
+struct pam_data_table {
+     struct pam_data **bucket;
+     unsigned int size;           /* number of buckets, a power of 2 */
+     unsigned int count;          /* number of entries */
+};
+
+/* see pam_arena.c */
+struct pam_arena_chunk;
+struct pam_arena {
+    struct pam_arena_chunk *chunk;   /* newest chunk, older ones linked */
+};
+
+/* see pam_async.c */
+struct pam_async;
+
+/* see pam_parallel.c */
+struct _pam_parallel;
+
 struct pam_handle {
     char *authtok;
     unsigned caller_is;
@@ -163,12 +254,16 @@ struct pam_handle {
     char *xdisplay;
     char *authtok_type;          /* PAM_AUTHTOK_TYPE */
     struct pam_data *data;
+    struct pam_data_table data_table;
+    struct pam_arena arena;      /* memory for the transaction */
+    struct pam_modutil_nss_entry *nss_cache; /* see pam_modutil_nsscache.c */
     struct pam_environ *env;      /* structure to maintain environment list */
     struct _pam_fail_delay fail_delay;   /* helper function for easy delays */
     struct pam_xauth_data xauth;        /* auth info for X display */
     struct service handlers;
     struct _pam_former_state former;  /* library state - support for
 					 event driven applications */
+    struct pam_async *async;    /* pam_authenticate_start() in progress */
     const char *mod_name;	/* Name of the module currently executed */
     int mod_argc;               /* Number of module arguments */
     char **mod_argv;            /* module arguments */
@@ -176,9 +271,13 @@ struct pam_handle {
 
 #ifdef HAVE_LIBAUDIT
     int audit_state;             /* keep track of reported audit messages */
+    struct pam_audit_event *audit_events; /* kept for PAM_AUDIT_COALESCE */
 #endif
     int authtok_verified;
     char *confdir;
+    int broker_fd;               /* see pam_broker.c, -1 if local */
+    char *broker_modules;        /* with data in the broker, "a\0b\0\0" */
+    struct _pam_parallel *parallel; /* see pam_parallel.c */
 };
 
 /* Values for select arg to _pam_dispatch() */
@@ -201,8 +300,8 @@ struct pam_handle {
  * need to change pam_tokens.h */
 #define _PAM_ACTION_UNDEF      -6   /* this is treated as an error
 				       ( = _PAM_ACTION_BAD) */
-
-#define PAM_SUBSTACK_MAX_LEVEL 16   /* maximum level of substacks */
+#define _PAM_ACTION_BAD_JUMP   -7   /* a jump past the end of its
+				       substack, set by _pam_resolve_chains() */
 
 /* character tables for parsing config files */
 extern const char * const _pam_token_actions[-_PAM_ACTION_UNDEF];
@@ -214,15 +313,115 @@ extern const char * const _pam_token_returns[_PAM_RETURN_VALUES+1];
  */
 int _pam_dispatch(pam_handle_t *pamh, int flags, int choice);
 
+/* Call only the module at depth of a stack, for the broker */
+int _pam_dispatch_module(pam_handle_t *pamh, int flags, int choice,
+			 int depth, const char *mod_name);
+
+/* pam_start_confdir(), leaving the handlers alone if !init_handlers */
+int _pam_start_internal(const char *service_name, const char *user,
+			const struct pam_conv *pam_conversation,
+			const char *confdir, pam_handle_t **pamh,
+			int init_handlers);
+
 /* Free various allocated structures and dlclose() the libs */
 int _pam_free_handlers(pam_handle_t *pamh);
 
-/* Parse config file, allocate handler structures, dlopen() */
+/* Parse config file, allocate handler structures */
 int _pam_init_handlers(pam_handle_t *pamh);
 
+/* dlopen() the modules of a chain and resolve its functions */
+void _pam_load_chain(pam_handle_t *pamh, struct handler_chain *chain);
+void _pam_load_chains(pam_handle_t *pamh, struct service *svc);
+
+/* Append a configuration line to the handler chains of pamh */
+int _pam_add_handler(pam_handle_t *pamh
+		     , int handler_type, int parallel, int other
+		     , int stack_level, int type
+		     , int *actions, const char *mod_path
+		     , int argc, char **argv, int argvlen);
+
 /* Set all handler stuff to 0/NULL - called once from pam_start() */
 void _pam_start_handlers(pam_handle_t *pamh);
 
+/* Forget the results of the modules saved for the next call */
+void _pam_reset_handlers(pam_handle_t *pamh);
+
+/* Free the handler chains and modules of a service structure */
+void _pam_free_service(struct service *svc, int shared);
+
+/* process-wide cache of parsed service stacks */
+
+struct stat;
+
+/* Copy the handlers of pamh from a cached stack if it is up to date */
+int _pam_stack_cache_attach(pam_handle_t *pamh);
+
+/* Record the files read by _pam_init_handlers() ... */
+void _pam_stack_cache_begin(pam_handle_t *pamh);
+void _pam_stack_cache_note(pam_handle_t *pamh, const char *path,
+			   const struct stat *st);
+
+/* ... and cache the result if the configuration was read successfully */
+void _pam_stack_cache_commit(pam_handle_t *pamh, int status);
+
+/* Drop the reference of pamh to its cached stack */
+void _pam_stack_cache_release(pam_handle_t *pamh);
+
+/* compiled configuration image, see pam_conf_image.c */
+
+/* Add the handlers of pamh from the image, PAM_IGNORE if there is none */
+int _pam_conf_image_load(pam_handle_t *pamh);
+
+/* Record what _pam_init_handlers() reads and adds while compiling */
+void _pam_conf_image_note(pam_handle_t *pamh, const char *path,
+			  const struct stat *st);
+int _pam_conf_image_add(pam_handle_t *pamh, int handler_type, int parallel,
+			int other, int stack_level, int type, const int *actions,
+			const char *mod_path, int argc, char **argv);
+
+/* transactions run by pam_brokerd, see pam_broker.c */
+
+/* Start the transaction of pamh in the broker, if one is enabled */
+void _pam_broker_start(pam_handle_t *pamh);
+
+/* Run a stack in the broker, PAM_IGNORE if pamh has to run it itself */
+int _pam_broker_call(pam_handle_t *pamh, int choice, int flags);
+
+/* Whether a module of the local stacks has its data in the broker */
+int _pam_broker_holds(const pam_handle_t *pamh, const char *mod_name);
+
+/* Call that module at depth of the current stack in the broker */
+int _pam_broker_module(pam_handle_t *pamh, int flags, int depth,
+		       const char *mod_name);
+
+/* Pass pam_reset() and pam_end() on to the broker */
+void _pam_broker_reset(pam_handle_t *pamh, int status);
+void _pam_broker_end(pam_handle_t *pamh, int status);
+
+/* session modules running at once, see pam_parallel.c */
+
+#define _PAM_PARALLEL_MAX 16    /* modules run at once */
+
+/* Run the "parallel" handlers from depth on, return the index after them */
+int _pam_parallel_run(pam_handle_t *pamh, int flags,
+		      const struct handler_chain *chain, int depth,
+		      int *retvals);
+
+/* Serialize the calls of the modules into the handle while they run */
+void _pam_parallel_lock(const pam_handle_t *pamh);
+void _pam_parallel_unlock(const pam_handle_t *pamh);
+
+/* The module of the calling thread, for the log messages */
+const char *_pam_module_name(const pam_handle_t *pamh);
+
+/* Its arguments, for the options of pam_get_authtok() */
+int _pam_module_args(const pam_handle_t *pamh, char ***argv);
+
+/* latency of the module calls, see pam_module_stats.c */
+int _pam_module_stats_enabled(void);
+void _pam_module_stats_record(pam_handle_t *pamh, const char *mod_name,
+			      const struct timespec *begin, int retval);
+
 /* environment helper functions */
 
 /* create the environment structure */
@@ -231,6 +430,9 @@ int _pam_make_env(pam_handle_t *pamh);
 /* delete the environment structure */
 void _pam_drop_env(pam_handle_t *pamh);
 
+/* delete the variables, but keep the environment structure */
+void _pam_clear_env(pam_handle_t *pamh);
+
 /* these functions deal with failure delays as required by the
    authentication modules and application. Their *interface* is likely
    to remain the same although their function is hopefully going to
@@ -246,25 +448,40 @@ void _pam_start_timer(pam_handle_t *pamh);
 void _pam_await_timer(pam_handle_t *pamh, int status);
 
 typedef void (*voidfunc(void))(void);
-typedef int (*servicefn)(pam_handle_t *, int, int, char **);
 
 void *_pam_dlopen (const char *mod_path);
 servicefn _pam_dlsym (void *handle, const char *symbol);
 void _pam_dlclose (void *handle);
 const char *_pam_dlerror (void);
 
-/* For now we just use a stack and linear search for module data. */
-/* If it becomes apparent that there is a lot of data, it should  */
-/* changed to either a sorted list or a hash table.               */
+void _pam_free_data(pam_handle_t *pamh, int status);
 
-struct pam_data {
-     char *name;
-     void *data;
-     void (*cleanup)(pam_handle_t *pamh, void *data, int error_status);
-     struct pam_data *next;
-};
+/* Free the entries of the pam_modutil_get*() cache */
+void _pam_modutil_cache_free(pam_handle_t *pamh);
 
-void _pam_free_data(pam_handle_t *pamh, int status);
+/* Memory that lives until the end of the transaction */
+void *_pam_arena_alloc(pam_handle_t *pamh, size_t size);
+char *_pam_arena_strdup(pam_handle_t *pamh, const char *s);
+char *_pam_arena_memdup(pam_handle_t *pamh, const char *s, int len);
+
+/* Give back memory from _pam_arena_alloc() or malloc() */
+void _pam_arena_free(pam_handle_t *pamh, void *p);
+
+#define _pam_arena_drop(pamh, X) \
+do {                             \
+    _pam_arena_free(pamh, X);    \
+    X = NULL;                    \
+} while (0)
+
+/* Wipe all of it, and keep or free the chunks */
+void _pam_arena_clear(pam_handle_t *pamh);
+void _pam_arena_release(pam_handle_t *pamh);
+
+/* Abandon a pam_authenticate_start() call, restoring the conversation */
+void _pam_async_end(pam_handle_t *pamh);
+
+/* Replace the conversation of the application, which takes conv */
+void _pam_async_set_conv(pam_handle_t *pamh, struct pam_conv *conv);
 
 char *_pam_StrTok(char *from, const char *format, char **next);
 
@@ -313,7 +530,7 @@ if ((pamh) == NULL) {                             \
         do { (pamh)->caller_is = _PAM_CALLED_FROM_APP; } while (0)
 
 #ifdef HAVE_LIBAUDIT
-extern int _pam_auditlog(pam_handle_t *pamh, int action, int retval, int flags, struct handler *h);
+extern int _pam_auditlog(pam_handle_t *pamh, int action, int retval, int flags, const struct handler_chain *chain);
 extern int _pam_audit_end(pam_handle_t *pamh, int pam_status);
 #endif
 
@@ -0,0 +1,555 @@
+/* pam_stack_cache.c -- process-wide cache of parsed service stacks */
+
+/*
+ * A long running application that calls pam_start() for every
+ * transaction can ask libpam to keep the parsed configuration of a
+ * service around.  The first handle for a (service, confdir) pair
+ * parses the configuration files and loads the modules as usual, the
+ * result is then moved into a cache entry and later handles only get
+ * their own copy of the handler arrays.  The argument vectors, module
+ * names and loaded modules are shared with the cache entry.
+ *
+ * Every file that was opened (or looked for) while parsing is recorded
+ * with its stat() information.  A cache entry is only used as long as
+ * all of these files are unchanged, so editing a file in /etc/pam.d,
+ * one of its @include or substack files, or adding a file that takes
+ * precedence over a vendor file makes the next pam_start() parse the
+ * configuration again.
+ *
+ * In the shared mode (PAM_STACK_CACHE_SHARED) the modules of an entry
+ * are all loaded when it is cached, and handles use its handler arrays
+ * as they are; a handle only has the state of its transaction, see
+ * struct handler_state.  An entry is not checked for changed files by
+ * every pam_start() but only by pam_stack_cache_reload(), which parses
+ * the configuration of a changed service again and replaces the entry.
+ * Handles that still use the old one keep it until they end, like the
+ * readers of RCU, so an entry never changes while it is used.  Looking
+ * up an entry only takes the lock of the cache for reading.
+ */
+
+#include "pam_private.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define DEPS_CHUNK                8
+
+struct _pam_stack_dep {
+    char *path;
+    int exists;
+    mode_t mode;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+};
+
+struct _pam_stack {
+    struct _pam_stack *next;
+    char *service_name;
+    char *confdir;
+    unsigned int refcount;       /* handles using it, +1 while cached */
+    int cached;                  /* linked into _pam_stack_cache.list */
+    int loaded;                  /* all modules loaded, see _pam_stack_load */
+    struct _pam_stack_dep *deps; /* files the stack was built from */
+    int deps_used;
+    int deps_allocated;
+    struct service handlers;     /* loaded modules and template chains */
+};
+
+static struct {
+    pthread_rwlock_t lock;       /* of the list, refcount is atomic */
+    int enabled;                 /* 0, 1 or PAM_STACK_CACHE_SHARED */
+    struct _pam_stack *list;
+} _pam_stack_cache = { PTHREAD_RWLOCK_INITIALIZER, 0, NULL };
+
+static int _pam_streq(const char *a, const char *b)
+{
+    if (a == NULL || b == NULL)
+	return a == b;
+    return !strcmp(a, b);
+}
+
+static void _pam_stack_free(struct _pam_stack *stack)
+{
+    int i;
+
+    D(("freeing cached stack for %s", stack->service_name));
+
+    _pam_free_service(&stack->handlers, 0);
+
+    for (i = 0; i < stack->deps_used; i++) {
+	_pam_drop(stack->deps[i].path);
+    }
+    _pam_drop(stack->deps);
+    _pam_drop(stack->service_name);
+    _pam_drop(stack->confdir);
+    free(stack);
+}
+
+static void _pam_stack_ref(struct _pam_stack *stack)
+{
+    __atomic_add_fetch(&stack->refcount, 1, __ATOMIC_RELAXED);
+}
+
+/* a stack still in the list has the reference of the list */
+static int _pam_stack_unref(struct _pam_stack *stack)
+{
+    return __atomic_sub_fetch(&stack->refcount, 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+/* must be called with _pam_stack_cache.lock held for writing */
+static void _pam_stack_unlink(struct _pam_stack *stack)
+{
+    struct _pam_stack **sp;
+
+    for (sp = &_pam_stack_cache.list; *sp != NULL; sp = &(*sp)->next) {
+	if (*sp == stack) {
+	    *sp = stack->next;
+	    stack->next = NULL;
+	    stack->cached = 0;
+	    return;
+	}
+    }
+}
+
+static void _pam_stack_fill_dep(struct _pam_stack_dep *dep,
+				const struct stat *st)
+{
+    if (st == NULL) {
+	dep->exists = 0;
+	return;
+    }
+    dep->exists = 1;
+    dep->mode = st->st_mode;
+    dep->dev = st->st_dev;
+    dep->ino = st->st_ino;
+    dep->size = st->st_size;
+    dep->mtime = st->st_mtim;
+    dep->ctime = st->st_ctim;
+}
+
+/* Is the file still the one the stack was built from? */
+static int _pam_stack_dep_valid(const struct _pam_stack_dep *dep)
+{
+    struct stat st;
+    struct _pam_stack_dep now;
+
+    _pam_stack_fill_dep(&now, stat(dep->path, &st) == 0 ? &st : NULL);
+
+    if (now.exists != dep->exists)
+	return 0;
+    if (!dep->exists)
+	return 1;
+
+    /* for directories only the presence matters */
+    if (S_ISDIR(dep->mode) || S_ISDIR(now.mode))
+	return S_ISDIR(dep->mode) && S_ISDIR(now.mode);
+
+    return now.dev == dep->dev && now.ino == dep->ino
+	&& now.size == dep->size
+	&& now.mtime.tv_sec == dep->mtime.tv_sec
+	&& now.mtime.tv_nsec == dep->mtime.tv_nsec
+	&& now.ctime.tv_sec == dep->ctime.tv_sec
+	&& now.ctime.tv_nsec == dep->ctime.tv_nsec;
+}
+
+static int _pam_stack_valid(const struct _pam_stack *stack)
+{
+    int i;
+
+    for (i = 0; i < stack->deps_used; i++) {
+	if (!_pam_stack_dep_valid(&stack->deps[i])) {
+	    D(("%s has changed", stack->deps[i].path));
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+/*
+ * Copy a template chain.  The argument vectors and module names stay
+ * owned by the template, only the per-handle state is private.  If
+ * primary is not NULL, it is the already cloned chain (authenticate or
+ * open_session) whose cached return values the handlers use.
+ */
+static int _pam_stack_clone_chain(struct handler_chain *dst,
+				  const struct handler_chain *src, int shared)
+{
+    memset(dst, 0, sizeof(*dst));
+    if (src->count == 0)
+	return PAM_SUCCESS;
+
+    /* the handlers of a loaded stack are never written to */
+    if (shared) {
+	dst->handlers = src->handlers;
+	dst->count = src->count;
+	dst->loaded = 1;
+	return PAM_SUCCESS;
+    }
+
+    if ((dst->handlers = malloc(src->count * sizeof(*dst->handlers))) == NULL)
+	return PAM_BUF_ERR;
+    memcpy(dst->handlers, src->handlers, src->count * sizeof(*dst->handlers));
+    dst->count = dst->allocated = src->count;
+
+    return PAM_SUCCESS;
+}
+
+static int _pam_stack_clone_handlers(struct handlers *dst,
+				     const struct handlers *src, int shared)
+{
+    int retval;
+
+    if ((retval = _pam_stack_clone_chain(&dst->authenticate,
+		     &src->authenticate, shared)) != PAM_SUCCESS
+	|| (retval = _pam_stack_clone_chain(&dst->setcred,
+		     &src->setcred, shared)) != PAM_SUCCESS
+	|| (retval = _pam_stack_clone_chain(&dst->acct_mgmt,
+		     &src->acct_mgmt, shared)) != PAM_SUCCESS
+	|| (retval = _pam_stack_clone_chain(&dst->open_session,
+		     &src->open_session, shared)) != PAM_SUCCESS
+	|| (retval = _pam_stack_clone_chain(&dst->close_session,
+		     &src->close_session, shared)) != PAM_SUCCESS
+	|| (retval = _pam_stack_clone_chain(&dst->chauthtok,
+		     &src->chauthtok, shared)) != PAM_SUCCESS)
+	return retval;
+
+    return PAM_SUCCESS;
+}
+
+/* Give pamh its handlers for the cached stack */
+static int _pam_stack_use(pam_handle_t *pamh, struct _pam_stack *stack)
+{
+    int shared = stack->loaded
+	&& _pam_stack_cache.enabled == PAM_STACK_CACHE_SHARED;
+    int retval;
+
+    pamh->handlers.stack = stack;
+    retval = _pam_stack_clone_handlers(&pamh->handlers.conf,
+				       &stack->handlers.conf, shared);
+    if (retval == PAM_SUCCESS)
+	retval = _pam_stack_clone_handlers(&pamh->handlers.other,
+					   &stack->handlers.other, shared);
+    if (retval != PAM_SUCCESS) {
+	pam_syslog(pamh, LOG_CRIT, "cannot copy cached stack for %s",
+		   stack->service_name);
+	_pam_free_handlers(pamh);
+    }
+
+    return retval;
+}
+
+/*
+ * Set up the handlers of pamh from the cache.  Returns PAM_SUCCESS if
+ * there is a cached stack for the service that is still up to date,
+ * anything else means the configuration has to be parsed.
+ */
+int _pam_stack_cache_attach(pam_handle_t *pamh)
+{
+    struct _pam_stack *stack;
+
+    if (!_pam_stack_cache.enabled)
+	return PAM_IGNORE;
+
+    pthread_rwlock_rdlock(&_pam_stack_cache.lock);
+    for (stack = _pam_stack_cache.list; stack != NULL; stack = stack->next) {
+	if (_pam_streq(stack->service_name, pamh->service_name)
+	    && _pam_streq(stack->confdir, pamh->confdir))
+	    break;
+    }
+    if (stack != NULL)
+	_pam_stack_ref(stack);
+    pthread_rwlock_unlock(&_pam_stack_cache.lock);
+
+    if (stack == NULL)
+	return PAM_IGNORE;
+
+    /* shared stacks are checked by pam_stack_cache_reload() */
+    if ((_pam_stack_cache.enabled == PAM_STACK_CACHE_SHARED && stack->loaded)
+	|| _pam_stack_valid(stack)) {
+	D(("using cached stack for %s", pamh->service_name));
+	return _pam_stack_use(pamh, stack);
+    }
+
+    D(("cached stack for %s is out of date", pamh->service_name));
+    pthread_rwlock_wrlock(&_pam_stack_cache.lock);
+    if (stack->cached) {
+	_pam_stack_unlink(stack);
+	_pam_stack_unref(stack);
+    }
+    pthread_rwlock_unlock(&_pam_stack_cache.lock);
+    if (_pam_stack_unref(stack))
+	_pam_stack_free(stack);
+
+    return PAM_IGNORE;
+}
+
+/* Start recording the files read for the configuration of pamh */
+void _pam_stack_cache_begin(pam_handle_t *pamh)
+{
+    struct _pam_stack *stack;
+
+    if (!_pam_stack_cache.enabled || pamh->handlers.pending != NULL)
+	return;
+
+    if ((stack = calloc(1, sizeof(*stack))) == NULL)
+	return;                        /* we simply do not cache it */
+
+    stack->service_name = _pam_strdup(pamh->service_name);
+    if (pamh->confdir != NULL)
+	stack->confdir = _pam_strdup(pamh->confdir);
+    if (stack->service_name == NULL
+	|| (pamh->confdir != NULL && stack->confdir == NULL)) {
+	_pam_stack_free(stack);
+	return;
+    }
+
+    pamh->handlers.pending = stack;
+}
+
+/*
+ * Remember that the configuration of pamh depends on path.  st is the
+ * stat() information of the file or NULL if it does not exist.
+ */
+void _pam_stack_cache_note(pam_handle_t *pamh, const char *path,
+			   const struct stat *st)
+{
+    struct _pam_stack *stack = pamh->handlers.pending;
+    struct _pam_stack_dep *dep;
+
+    if (stack == NULL)
+	return;
+
+    if (stack->deps_used == stack->deps_allocated) {
+	void *tmp = realloc(stack->deps,
+			    (stack->deps_allocated + DEPS_CHUNK)
+			    * sizeof(*stack->deps));
+	if (tmp == NULL)
+	    goto fail;
+	stack->deps = tmp;
+	stack->deps_allocated += DEPS_CHUNK;
+    }
+
+    dep = &stack->deps[stack->deps_used];
+    if ((dep->path = _pam_strdup(path)) == NULL)
+	goto fail;
+    _pam_stack_fill_dep(dep, st);
+    stack->deps_used++;
+    return;
+
+fail:
+    /* without a complete list of files the stack cannot be cached */
+    pamh->handlers.pending = NULL;
+    _pam_stack_free(stack);
+}
+
+/*
+ * The configuration of pamh has been parsed.  On success the loaded
+ * modules and handler chains move into a new cache entry, replacing an
+ * older one for the service, and pamh gets its own copy of the
+ * handlers.
+ */
+void _pam_stack_cache_commit(pam_handle_t *pamh, int status)
+{
+    struct _pam_stack *stack = pamh->handlers.pending, *old;
+
+    if (stack == NULL)
+	return;
+    pamh->handlers.pending = NULL;
+
+    if (status != PAM_SUCCESS || !_pam_stack_cache.enabled) {
+	_pam_stack_free(stack);
+	return;
+    }
+
+    /* the template takes over everything _pam_init_handlers built */
+    stack->handlers = pamh->handlers;
+    stack->handlers.stack = NULL;
+    stack->handlers.pending = NULL;
+    _pam_start_handlers(pamh);
+    pamh->handlers.handlers_loaded = 1;
+
+    /* nobody can see the stack yet, so its handlers can be resolved */
+    if (_pam_stack_cache.enabled == PAM_STACK_CACHE_SHARED) {
+	_pam_load_chains(pamh, &stack->handlers);
+	stack->loaded = 1;
+    }
+
+    pthread_rwlock_wrlock(&_pam_stack_cache.lock);
+    /* replace an out of date entry for the same service */
+    for (old = _pam_stack_cache.list; old != NULL; old = old->next) {
+	if (_pam_streq(old->service_name, stack->service_name)
+	    && _pam_streq(old->confdir, stack->confdir))
+	    break;
+    }
+    if (old != NULL) {
+	_pam_stack_unlink(old);
+	if (!_pam_stack_unref(old))
+	    old = NULL;
+    }
+    stack->refcount = 2;             /* the cache and pamh */
+    stack->cached = 1;
+    stack->next = _pam_stack_cache.list;
+    _pam_stack_cache.list = stack;
+    pthread_rwlock_unlock(&_pam_stack_cache.lock);
+
+    if (old != NULL)
+	_pam_stack_free(old);
+
+    if (_pam_stack_use(pamh, stack) != PAM_SUCCESS) {
+	/* the handle is left without handlers and will fail to dispatch */
+	D(("unable to use freshly cached stack"));
+    }
+}
+
+/* pamh no longer uses its stack, called by _pam_free_handlers() */
+void _pam_stack_cache_release(pam_handle_t *pamh)
+{
+    struct _pam_stack *stack = pamh->handlers.stack;
+
+    if (pamh->handlers.pending != NULL) {
+	_pam_stack_free(pamh->handlers.pending);
+	pamh->handlers.pending = NULL;
+    }
+
+    if (stack == NULL)
+	return;
+    pamh->handlers.stack = NULL;
+
+    if (_pam_stack_unref(stack))
+	_pam_stack_free(stack);
+}
+
+/* Drop all cached stacks, those still in use go with their last handle */
+void pam_stack_cache_flush(void)
+{
+    struct _pam_stack *stack, *unused = NULL;
+
+    pthread_rwlock_wrlock(&_pam_stack_cache.lock);
+    while ((stack = _pam_stack_cache.list) != NULL) {
+	_pam_stack_unlink(stack);
+	if (_pam_stack_unref(stack)) {
+	    stack->next = unused;
+	    unused = stack;
+	}
+    }
+    pthread_rwlock_unlock(&_pam_stack_cache.lock);
+
+    while ((stack = unused) != NULL) {
+	unused = stack->next;
+	_pam_stack_free(stack);
+    }
+}
+
+static int _pam_stack_null_conv(int num_msg, const struct pam_message **msg,
+				struct pam_response **resp, void *appdata_ptr)
+{
+    (void) num_msg; (void) msg; (void) resp; (void) appdata_ptr;
+    return PAM_CONV_ERR;
+}
+
+/*
+ * Parse the configuration of a service into the cache and load all of
+ * its modules, so that the first transaction of a server does not wait
+ * for them.
+ */
+int pam_stack_cache_preload(const char *service, const char *confdir)
+{
+    struct pam_conv conv = { _pam_stack_null_conv, NULL };
+    pam_handle_t *pamh;
+    int retval;
+
+    D(("called: %s", service));
+
+    if (!_pam_stack_cache.enabled)
+	return PAM_SYSTEM_ERR;
+
+    retval = pam_start_confdir(service, NULL, &conv, confdir, &pamh);
+    if (retval != PAM_SUCCESS)
+	return retval;
+
+    /* the modules are shared with the cached stack, which keeps them */
+    _pam_load_chains(pamh, &pamh->handlers);
+
+    return pam_end(pamh, PAM_SUCCESS);
+}
+
+/*
+ * Parse the configuration of every cached service whose files have
+ * changed again, and replace its entry.  The handles using the old
+ * entry keep it until they end.
+ */
+int pam_stack_cache_reload(void)
+{
+    struct pam_conv conv = { _pam_stack_null_conv, NULL };
+    struct _pam_stack *stack, **stacks = NULL;
+    pam_handle_t *pamh;
+    size_t i, n = 0, allocated = 0;
+    int retval = PAM_SUCCESS, status;
+
+    D(("called"));
+
+    /* hold on to the entries, the list may change meanwhile */
+    pthread_rwlock_rdlock(&_pam_stack_cache.lock);
+    for (stack = _pam_stack_cache.list; stack != NULL; stack = stack->next) {
+	if (n == allocated) {
+	    void *tmp = realloc(stacks, (allocated + DEPS_CHUNK)
+				* sizeof(*stacks));
+	    if (tmp == NULL) {
+		retval = PAM_BUF_ERR;
+		break;
+	    }
+	    stacks = tmp;
+	    allocated += DEPS_CHUNK;
+	}
+	_pam_stack_ref(stack);
+	stacks[n++] = stack;
+    }
+    pthread_rwlock_unlock(&_pam_stack_cache.lock);
+
+    for (i = 0; i < n; i++) {
+	stack = stacks[i];
+	if (_pam_stack_valid(stack))
+	    goto next;
+
+	D(("reloading %s", stack->service_name));
+	status = _pam_start_internal(stack->service_name, NULL, &conv,
+				     stack->confdir, &pamh, 0);
+	if (status == PAM_SUCCESS) {
+	    /* parse it even though it is cached, commit replaces it */
+	    pamh->handlers.refresh = 1;
+	    status = _pam_init_handlers(pamh);
+	    pam_end(pamh, status);
+	}
+	if (status != PAM_SUCCESS) {
+	    /* the old entry stays */
+	    pam_syslog(NULL, LOG_ERR, "cannot reload the stack of %s",
+		       stack->service_name);
+	    retval = status;
+	}
+next:
+	if (_pam_stack_unref(stack))
+	    _pam_stack_free(stack);
+    }
+    free(stacks);
+
+    return retval;
+}
+
+int pam_stack_cache_enable(int enable)
+{
+    D(("called: %d", enable));
+
+    if (enable == PAM_STACK_CACHE_SHARED)
+	_pam_stack_cache.enabled = PAM_STACK_CACHE_SHARED;
+    else
+	_pam_stack_cache.enabled = enable ? 1 : 0;
+    if (!enable)
+	pam_stack_cache_flush();
+
+    return PAM_SUCCESS;
+}
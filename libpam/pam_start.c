@@ -15,12 +15,13 @@
 #include <string.h>
 #include <syslog.h>
 
-static int _pam_start_internal (
+int _pam_start_internal (
     const char *service_name,
     const char *user,
     const struct pam_conv *pam_conversation,
     const char *confdir,
-    pam_handle_t **pamh)
+    pam_handle_t **pamh,
+    int init_handlers)
 {
     D(("called pam_start: [%s] [%s] [%p] [%p]"
        ,service_name, user, pam_conversation, pamh));
@@ -71,9 +72,9 @@ static int _pam_start_internal (
     }
 
     if (user) {
-	if (((*pamh)->user = _pam_strdup(user)) == NULL) {
+	if (((*pamh)->user = _pam_arena_strdup(*pamh, user)) == NULL) {
 	    pam_syslog(*pamh, LOG_CRIT,
-		       "pam_start: _pam_strdup failed for user");
+		       "pam_start: _pam_arena_strdup failed for user");
 	    _pam_drop((*pamh)->service_name);
 	    _pam_drop(*pamh);
 	    return (PAM_BUF_ERR);
@@ -86,7 +87,7 @@ static int _pam_start_internal (
 	    pam_syslog(*pamh, LOG_CRIT,
 		       "pam_start: _pam_strdup failed for confdir");
 	    _pam_drop((*pamh)->service_name);
-	    _pam_drop((*pamh)->user);
+	    _pam_arena_release(*pamh);
 	    _pam_drop(*pamh);
 	    return (PAM_BUF_ERR);
 	}
@@ -101,20 +102,22 @@ static int _pam_start_internal (
     (*pamh)->oldauthtok = NULL;
     (*pamh)->fail_delay.delay_fn_ptr = NULL;
     (*pamh)->former.choice = PAM_NOT_STACKED;
-    (*pamh)->former.substates = NULL;
 #ifdef HAVE_LIBAUDIT
     (*pamh)->audit_state = 0;
+    (*pamh)->audit_events = NULL;
 #endif
     (*pamh)->xdisplay = NULL;
     (*pamh)->authtok_type = NULL;
     (*pamh)->authtok_verified = 0;
+    (*pamh)->broker_fd = -1;
     memset (&((*pamh)->xauth), 0, sizeof ((*pamh)->xauth));
 
     if (((*pamh)->pam_conversation = (struct pam_conv *)
 	  malloc(sizeof(struct pam_conv))) == NULL) {
 	pam_syslog(*pamh, LOG_CRIT, "pam_start: malloc failed for pam_conv");
 	_pam_drop((*pamh)->service_name);
-	_pam_drop((*pamh)->user);
+	_pam_arena_release(*pamh);
+	_pam_drop((*pamh)->confdir);
 	_pam_drop(*pamh);
 	return (PAM_BUF_ERR);
     } else {
@@ -123,11 +126,14 @@ static int _pam_start_internal (
     }
 
     (*pamh)->data = NULL;
+    memset(&(*pamh)->data_table, 0, sizeof((*pamh)->data_table));
+    (*pamh)->nss_cache = NULL;
     if ( _pam_make_env(*pamh) != PAM_SUCCESS ) {
 	pam_syslog(*pamh,LOG_ERR,"pam_start: failed to initialize environment");
 	_pam_drop((*pamh)->pam_conversation);
 	_pam_drop((*pamh)->service_name);
-	_pam_drop((*pamh)->user);
+	_pam_arena_release(*pamh);
+	_pam_drop((*pamh)->confdir);
 	_pam_drop(*pamh);
 	return PAM_ABORT;
     }
@@ -139,16 +145,20 @@ static int _pam_start_internal (
     /* According to the SunOS man pages, loading modules and resolving
      * symbols happens on the first call from the application. */
 
-    if ( _pam_init_handlers(*pamh) != PAM_SUCCESS ) {
+    if ( init_handlers && _pam_init_handlers(*pamh) != PAM_SUCCESS ) {
 	pam_syslog(*pamh, LOG_ERR, "pam_start: failed to initialize handlers");
 	_pam_drop_env(*pamh);                 /* purge the environment */
 	_pam_drop((*pamh)->pam_conversation);
 	_pam_drop((*pamh)->service_name);
-	_pam_drop((*pamh)->user);
+	_pam_arena_release(*pamh);
+	_pam_drop((*pamh)->confdir);
 	_pam_drop(*pamh);
 	return PAM_ABORT;
     }
 
+    if (init_handlers)
+	_pam_broker_start(*pamh);
+
     D(("exiting pam_start successfully"));
 
     return PAM_SUCCESS;
@@ -162,7 +172,7 @@ int pam_start_confdir (
     pam_handle_t **pamh)
 {
     return _pam_start_internal(service_name, user, pam_conversation,
-			       confdir, pamh);
+			       confdir, pamh, 1);
 }
 
 int pam_start (
@@ -172,5 +182,5 @@ int pam_start (
     pam_handle_t **pamh)
 {
     return _pam_start_internal(service_name, user, pam_conversation,
-			       NULL, pamh);
+			       NULL, pamh, 1);
 }
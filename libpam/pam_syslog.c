@@ -38,6 +38,7 @@
 #include <unistd.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <security/pam_modules.h>
 #include <security/_pam_macros.h>
@@ -69,38 +70,216 @@ _pam_choice2str (int choice)
   return "";
 }
 
+/*
+ * A message is formatted into a buffer on the stack; only longer ones
+ * need the heap.  After pam_syslog_async(1), lines are queued for a
+ * thread that passes them to syslog(), so that a busy /dev/log does not
+ * stall the module.  The thread takes them in the order they were
+ * queued, and a caller waits if the queue is full.
+ */
+
+#define PAM_LOG_PREFIX_MAX 256
+#define PAM_LOG_LINE_MAX   1024   /* longer lines are not queued */
+#define PAM_LOG_QUEUE_SIZE 128
+
+struct _pam_log_entry {
+  int priority;
+  char line[PAM_LOG_LINE_MAX];
+};
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;         /* an entry was added or taken */
+  struct _pam_log_entry *queue;
+  unsigned int head;              /* oldest entry */
+  unsigned int count;
+  int enabled;
+  int stop;
+  pid_t pid;                      /* process the flusher runs in */
+  pthread_t flusher;
+} _pam_log = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+	       NULL, 0, 0, 0, 0, 0, 0 };
+
+static void *
+_pam_log_flush (void *arg UNUSED)
+{
+  pthread_mutex_lock (&_pam_log.lock);
+  for (;;)
+    {
+      struct _pam_log_entry *entry;
+
+      while (_pam_log.count == 0 && !_pam_log.stop)
+	pthread_cond_wait (&_pam_log.changed, &_pam_log.lock);
+      if (_pam_log.count == 0)
+	break;
+
+      /* only this thread frees the entry, so it can be read unlocked */
+      entry = &_pam_log.queue[_pam_log.head];
+      pthread_mutex_unlock (&_pam_log.lock);
+      syslog (entry->priority, "%s", entry->line);
+      pthread_mutex_lock (&_pam_log.lock);
+
+      _pam_log.head = (_pam_log.head + 1) % PAM_LOG_QUEUE_SIZE;
+      _pam_log.count--;
+      pthread_cond_broadcast (&_pam_log.changed);
+    }
+  pthread_mutex_unlock (&_pam_log.lock);
+
+  return NULL;
+}
+
+static void
+_pam_log_line (int priority, const char *prefix, const char *msg)
+{
+  struct _pam_log_entry *entry;
+  int len;
+
+  pthread_mutex_lock (&_pam_log.lock);
+  while (_pam_log.enabled && _pam_log.pid == getpid ()
+	 && _pam_log.count == PAM_LOG_QUEUE_SIZE)
+    pthread_cond_wait (&_pam_log.changed, &_pam_log.lock);
+  if (!_pam_log.enabled || _pam_log.pid != getpid ())
+    {
+      /* not asked for, stopped meanwhile, or in a child without the
+	 flusher */
+      pthread_mutex_unlock (&_pam_log.lock);
+      syslog (priority, "%s %s", prefix, msg);
+      return;
+    }
+
+  entry = &_pam_log.queue[(_pam_log.head + _pam_log.count)
+			  % PAM_LOG_QUEUE_SIZE];
+  len = snprintf (entry->line, sizeof (entry->line), "%s %s", prefix, msg);
+  if (len < 0 || (size_t) len >= sizeof (entry->line))
+    {
+      /* too long to queue; log it after the queued ones */
+      while (_pam_log.count != 0)
+	pthread_cond_wait (&_pam_log.changed, &_pam_log.lock);
+      syslog (priority, "%s %s", prefix, msg);
+    }
+  else
+    {
+      entry->priority = priority;
+      _pam_log.count++;
+      pthread_cond_broadcast (&_pam_log.changed);
+    }
+  pthread_mutex_unlock (&_pam_log.lock);
+}
+
+static void
+_pam_log_stop (void)
+{
+  pthread_mutex_lock (&_pam_log.lock);
+  if (!_pam_log.enabled || _pam_log.pid != getpid ())
+    {
+      pthread_mutex_unlock (&_pam_log.lock);
+      return;
+    }
+  _pam_log.enabled = 0;
+  _pam_log.stop = 1;
+  pthread_cond_broadcast (&_pam_log.changed);
+  pthread_mutex_unlock (&_pam_log.lock);
+
+  /* the flusher logs what is queued before it ends; the queue itself
+     is kept for the life of the process */
+  pthread_join (_pam_log.flusher, NULL);
+
+  pthread_mutex_lock (&_pam_log.lock);
+  _pam_log.head = _pam_log.count = 0;
+  _pam_log.stop = 0;
+  pthread_mutex_unlock (&_pam_log.lock);
+}
+
+/* do not lose the queued lines when the process exits */
+static void __attribute__ ((destructor))
+_pam_log_fini (void)
+{
+  _pam_log_stop ();
+}
+
+int
+pam_syslog_async (int enable)
+{
+  int ret = PAM_SUCCESS;
+
+  if (!enable)
+    {
+      _pam_log_stop ();
+      return PAM_SUCCESS;
+    }
+
+  pthread_mutex_lock (&_pam_log.lock);
+  if (!_pam_log.enabled || _pam_log.pid != getpid ())
+    {
+      /* a flusher of the parent process does not run here */
+      _pam_log.head = _pam_log.count = 0;
+      _pam_log.stop = 0;
+      if (_pam_log.queue == NULL)
+	_pam_log.queue = malloc (PAM_LOG_QUEUE_SIZE * sizeof (*_pam_log.queue));
+      if (_pam_log.queue == NULL)
+	ret = PAM_BUF_ERR;
+      else if (pthread_create (&_pam_log.flusher, NULL,
+			       _pam_log_flush, NULL) != 0)
+	ret = PAM_SYSTEM_ERR;
+      else
+	{
+	  _pam_log.pid = getpid ();
+	  _pam_log.enabled = 1;
+	}
+    }
+  pthread_mutex_unlock (&_pam_log.lock);
+
+  return ret;
+}
+
 void
 pam_vsyslog (const pam_handle_t *pamh, int priority,
 	     const char *fmt, va_list args)
 {
-  char *msgbuf1 = NULL, *msgbuf2 = NULL;
+  char prefix[PAM_LOG_PREFIX_MAX];
+  char msgbuf[PAM_LOG_LINE_MAX], *msg = msgbuf, *heap = NULL;
+  const char *mod_name = pamh ? _pam_module_name (pamh) : NULL;
   int save_errno = errno;
+  va_list copy;
+  int len;
 
-  if (pamh && pamh->mod_name)
-    {
-      if (asprintf (&msgbuf1, "%s(%s:%s):", pamh->mod_name,
+  if (mod_name)
+    len = snprintf (prefix, sizeof (prefix), "%s(%s:%s):", mod_name,
 		    pamh->service_name?pamh->service_name:"<unknown>",
-		    _pam_choice2str (pamh->choice)) < 0)
-	{
-	  syslog (LOG_AUTHPRIV|LOG_ERR, "asprintf: %m");
-	  return;
-	}
+		    _pam_choice2str (pamh->choice));
+  else
+    len = snprintf (prefix, sizeof (prefix), "%s", _PAM_SYSTEM_LOG_PREFIX);
+  if (len < 0)
+    {
+      syslog (LOG_AUTHPRIV|LOG_ERR, "snprintf: %m");
+      return;
     }
 
   errno = save_errno;
-  if (vasprintf (&msgbuf2, fmt, args) < 0)
+  va_copy (copy, args);
+  len = vsnprintf (msgbuf, sizeof (msgbuf), fmt, copy);
+  va_end (copy);
+  if (len < 0)
     {
-      syslog (LOG_AUTHPRIV|LOG_ERR, "vasprintf: %m");
-      _pam_drop (msgbuf1);
+      syslog (LOG_AUTHPRIV|LOG_ERR, "vsnprintf: %m");
       return;
     }
 
+  if ((size_t) len >= sizeof (msgbuf))
+    {
+      errno = save_errno;
+      if (vasprintf (&heap, fmt, args) < 0)
+	{
+	  syslog (LOG_AUTHPRIV|LOG_ERR, "vasprintf: %m");
+	  return;
+	}
+      msg = heap;
+    }
+
   errno = save_errno;
-  syslog (LOG_AUTHPRIV|priority, "%s %s",
-	  (msgbuf1 ? msgbuf1 : _PAM_SYSTEM_LOG_PREFIX), msgbuf2);
+  _pam_log_line (LOG_AUTHPRIV|priority, prefix, msg);
 
-  _pam_drop (msgbuf1);
-  _pam_drop (msgbuf2);
+  _pam_drop (heap);
 }
 
 void
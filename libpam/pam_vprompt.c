@@ -44,10 +44,11 @@
 #include <security/pam_ext.h>
 
 #include "pam_private.h"
+#include "pam_probes.h"
 
-int
-pam_vprompt (pam_handle_t *pamh, int style, char **response,
-	     const char *fmt, va_list args)
+static int
+_pam_vprompt (pam_handle_t *pamh, int style, char **response,
+	      const char *fmt, va_list args)
 {
   struct pam_message msg;
   struct pam_response *pam_resp = NULL;
@@ -80,7 +81,9 @@ pam_vprompt (pam_handle_t *pamh, int style, char **response,
   msg.msg = msgbuf;
   pmsg = &msg;
 
+  PAM_PROBE2 (libpam, conv__entry, 1, style);
   retval = conv->conv (1, &pmsg, &pam_resp, conv->appdata_ptr);
+  PAM_PROBE1 (libpam, conv__return, retval);
   if (retval != PAM_SUCCESS && pam_resp != NULL)
     pam_syslog(pamh, LOG_WARNING,
       "unexpected response from failed conversation function");
@@ -100,6 +103,19 @@ pam_vprompt (pam_handle_t *pamh, int style, char **response,
   return retval;
 }
 
+int
+pam_vprompt (pam_handle_t *pamh, int style, char **response,
+	     const char *fmt, va_list args)
+{
+  int retval;
+
+  _pam_parallel_lock (pamh);
+  retval = _pam_vprompt (pamh, style, response, fmt, args);
+  _pam_parallel_unlock (pamh);
+
+  return retval;
+}
+
 int
 pam_prompt (pam_handle_t *pamh, int style, char **response,
 	    const char *fmt, ...)
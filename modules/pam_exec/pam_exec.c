@@ -67,23 +67,72 @@ static struct {
   ENV_ITEM(PAM_RUSER),
 };
 
-/* move_fd_to_non_stdio copies the given file descriptor to something other
- * than stdin, stdout, or stderr.  Assumes that the caller will close all
- * unwanted fds after calling. */
-static int
-move_fd_to_non_stdio (pam_handle_t *pamh, int fd)
+/* free_env frees an environment list and its strings. */
+static void
+free_env (char **envlist)
+{
+  char **tmp;
+
+  for (tmp = envlist; *tmp != NULL; ++tmp)
+    free (*tmp);
+  free (envlist);
+}
+
+/*
+ * build_env sets up the environment list of the program.  It consists of
+ * the PAM environment, plus a few hand-picked PAM items.
+ */
+static char **
+build_env (pam_handle_t *pamh, const char *pam_type)
 {
-  while (fd < 3)
+  char **envlist, **tmp;
+  int envlen, nitems, i;
+  char *envstr;
+
+  envlist = pam_getenvlist(pamh);
+  if (envlist == NULL)
     {
-      fd = dup(fd);
-      if (fd == -1)
-	{
-	  int err = errno;
-	  pam_syslog (pamh, LOG_ERR, "dup failed: %m");
-	  _exit (err);
-	}
+      pam_syslog (pamh, LOG_CRIT, "prepare environment failed: %m");
+      return NULL;
     }
-  return fd;
+  for (envlen = 0; envlist[envlen] != NULL; ++envlen)
+    /* nothing */ ;
+  nitems = PAM_ARRAY_SIZE(env_items);
+  /* + 2 because of PAM_TYPE and NULL entry */
+  tmp = realloc(envlist, (envlen + nitems + 2) * sizeof(*envlist));
+  if (tmp == NULL)
+    {
+      free_env(envlist);
+      pam_syslog (pamh, LOG_CRIT, "realloc environment failed: %m");
+      return NULL;
+    }
+  envlist = tmp;
+  for (i = 0; i < nitems; ++i)
+    {
+      const void *item;
+
+      if (pam_get_item(pamh, env_items[i].item, &item) != PAM_SUCCESS || item == NULL)
+        continue;
+      if (asprintf(&envstr, "%s=%s", env_items[i].name, (const char *)item) < 0)
+        {
+          free_env(envlist);
+          pam_syslog (pamh, LOG_CRIT, "prepare environment failed: %m");
+          return NULL;
+        }
+      envlist[envlen++] = envstr;
+      envlist[envlen] = NULL;
+    }
+
+  if (asprintf(&envstr, "PAM_TYPE=%s", pam_type) < 0)
+    {
+      free_env(envlist);
+      pam_syslog (pamh, LOG_CRIT, "prepare environment failed: %m");
+      return NULL;
+    }
+  envlist[envlen++] = envstr;
+  envlist[envlen] = NULL;
+
+  return envlist;
 }
 
 static int
@@ -102,7 +151,13 @@ call_exec (const char *pam_type, pam_handle_t *pamh,
   int fds[2];
   int stdout_fds[2];
   FILE *stdout_file = NULL;
-  int retval;
+  int logfd = -1;
+  const char **arggv = NULL;
+  char **envlist = NULL;
+  struct pam_modutil_spawn_attr attr;
+  int status = 0;
+  pid_t rc;
+  int retval, i;
   const char *name;
 
   if (argc < 1) {
@@ -223,250 +278,159 @@ call_exec (const char *pam_type, pam_handle_t *pamh,
     return PAM_SERVICE_ERR;
   }
 
-  pid = fork();
-  if (pid == -1)
-    return PAM_SYSTEM_ERR;
-  if (pid > 0) /* parent */
+  /*
+   * Everything the program gets is set up here, it is started without a
+   * copy of this process, see pam_modutil_spawn_helper().
+   */
+  arggv = calloc (argc - optargc + 1, sizeof (*arggv));
+  if (arggv == NULL)
     {
-      int status = 0;
-      pid_t rc;
+      pam_syslog (pamh, LOG_CRIT, "calloc failed: %m");
+      retval = PAM_BUF_ERR;
+      goto out;
+    }
+  for (i = 0; i < (argc - optargc); i++)
+    arggv[i] = argv[i+optargc];
+  arggv[i] = NULL;
 
-      if (expose_authtok) /* send the password to the child */
-	{
-	  if (debug)
-	    pam_syslog (pamh, LOG_DEBUG, "send password to child");
-	  if (write(fds[1], authtok, strlen(authtok)) == -1)
-	    pam_syslog (pamh, LOG_ERR,
-			      "sending password to child failed: %m");
-
-          close(fds[0]);       /* close here to avoid possible SIGPIPE above */
-          close(fds[1]);
-	}
+  if ((envlist = build_env (pamh, pam_type)) == NULL)
+    {
+      retval = PAM_BUF_ERR;
+      goto out;
+    }
 
-      if (use_stdout)
-	{
-	  char buf[4096];
-	  close(stdout_fds[1]);
-	  while (fgets(buf, sizeof(buf), stdout_file) != NULL)
-	    {
-	      size_t len;
-	      len = strlen(buf);
-	      if (buf[len-1] == '\n')
-		buf[len-1] = '\0';
-	      pam_info(pamh, "%s", buf);
-	    }
-	  fclose(stdout_file);
-	}
+  if (!use_stdout && logfile)
+    {
+      time_t tm = time (NULL);
+      char *buffer = NULL;
 
-      while ((rc = waitpid (pid, &status, 0)) == -1 &&
-	     errno == EINTR);
-      if (rc == (pid_t)-1)
+      if ((logfd = open (logfile, O_CREAT|O_APPEND|O_WRONLY|O_CLOEXEC,
+			 S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH)) == -1)
 	{
-	  pam_syslog (pamh, LOG_ERR, "waitpid returns with -1: %m");
-	  return PAM_SYSTEM_ERR;
+	  pam_syslog (pamh, LOG_ERR, "open of %s failed: %m",
+		      logfile);
+	  retval = PAM_SYSTEM_ERR;
+	  goto out;
 	}
-      else if (status != 0)
+      if (asprintf (&buffer, "*** %s", ctime (&tm)) > 0)
 	{
-	  if (WIFEXITED(status))
-	    {
-	      pam_syslog (pamh, LOG_ERR, "%s failed: exit code %d",
-			  argv[optargc], WEXITSTATUS(status));
-		if (!quiet)
-	      pam_error (pamh, _("%s failed: exit code %d"),
-			 argv[optargc], WEXITSTATUS(status));
-	    }
-	  else if (WIFSIGNALED(status))
-	    {
-	      pam_syslog (pamh, LOG_ERR, "%s failed: caught signal %d%s",
-			  argv[optargc], WTERMSIG(status),
-			  WCOREDUMP(status) ? " (core dumped)" : "");
-		if (!quiet)
-	      pam_error (pamh, _("%s failed: caught signal %d%s"),
-			 argv[optargc], WTERMSIG(status),
-			 WCOREDUMP(status) ? " (core dumped)" : "");
-	    }
-	  else
-	    {
-	      pam_syslog (pamh, LOG_ERR, "%s failed: unknown status 0x%x",
-			  argv[optargc], status);
-		if (!quiet)
-	      pam_error (pamh, _("%s failed: unknown status 0x%x"),
-			 argv[optargc], status);
-	    }
-	  return PAM_SYSTEM_ERR;
+	  pam_modutil_write (logfd, buffer, strlen (buffer));
+	  free (buffer);
 	}
-      return PAM_SUCCESS;
     }
-  else /* child */
-    {
-      char **arggv;
-      int i;
-      char **envlist, **tmp;
-      int envlen, nitems;
-      char *envstr;
-      enum pam_modutil_redirect_fd redirect_stdin =
-	      expose_authtok ? PAM_MODUTIL_IGNORE_FD : PAM_MODUTIL_PIPE_FD;
-      enum pam_modutil_redirect_fd redirect_stdout =
-	      (use_stdout || logfile) ? PAM_MODUTIL_IGNORE_FD : PAM_MODUTIL_NULL_FD;
-
-      /* First, move all the pipes off of stdin, stdout, and stderr, to ensure
-       * that calls to dup2 won't close them. */
-
-      if (expose_authtok)
-	{
-	  fds[0] = move_fd_to_non_stdio(pamh, fds[0]);
-	  close(fds[1]);
-	}
 
-      if (use_stdout)
-	{
-	  stdout_fds[1] = move_fd_to_non_stdio(pamh, stdout_fds[1]);
-	  close(stdout_fds[0]);
-	}
+  /* stdin is the password or at EOF, stdout and stderr the output */
+  memset (&attr, 0, sizeof (attr));
+  attr.stdfd[0] = expose_authtok ? fds[0] : -1;
+  attr.stdfd[1] = attr.stdfd[2] = use_stdout ? stdout_fds[1] : logfd;
+  attr.redirect[0] = PAM_MODUTIL_PIPE_FD;
+  attr.redirect[1] = attr.redirect[2] = PAM_MODUTIL_NULL_FD;
+  attr.flags = PAM_MODUTIL_SPAWN_SETSID;
+  if (call_setuid)
+    attr.flags |= PAM_MODUTIL_SPAWN_EUID;
+
+  if (debug)
+    pam_syslog (pamh, LOG_DEBUG, "Calling %s ...", arggv[0]);
+
+  DIAG_PUSH_IGNORE_CAST_QUAL;
+  pid = pam_modutil_spawn_helper (pamh, arggv[0], (char *const *) arggv,
+				  envlist, &attr);
+  DIAG_POP_IGNORE_CAST_QUAL;
+  if (pid < 0)
+    {
+      retval = PAM_SYSTEM_ERR;
+      goto out;
+    }
+  free (arggv);
+  arggv = NULL;
+  free_env (envlist);
+  envlist = NULL;
+  if (logfd != -1)
+    close (logfd);
+
+  if (expose_authtok) /* send the password to the child */
+    {
+      if (debug)
+	pam_syslog (pamh, LOG_DEBUG, "send password to child");
+      if (write(fds[1], authtok, strlen(authtok)) == -1)
+	pam_syslog (pamh, LOG_ERR,
+			  "sending password to child failed: %m");
 
-      /* Set up stdin. */
+      close(fds[0]);       /* close here to avoid possible SIGPIPE above */
+      close(fds[1]);
+    }
 
-      if (expose_authtok)
+  if (use_stdout)
+    {
+      char buf[4096];
+      close(stdout_fds[1]);
+      while (fgets(buf, sizeof(buf), stdout_file) != NULL)
 	{
-	  /* reopen stdin as pipe */
-	  if (dup2(fds[0], STDIN_FILENO) == -1)
-	    {
-	      int err = errno;
-	      pam_syslog (pamh, LOG_ERR, "dup2 of STDIN failed: %m");
-	      _exit (err);
-	    }
+	  size_t len;
+	  len = strlen(buf);
+	  if (buf[len-1] == '\n')
+	    buf[len-1] = '\0';
+	  pam_info(pamh, "%s", buf);
 	}
+      fclose(stdout_file);
+    }
 
-      /* Set up stdout. */
-
-      if (use_stdout)
-	{
-	  if (dup2(stdout_fds[1], STDOUT_FILENO) == -1)
-	    {
-	      int err = errno;
-	      pam_syslog (pamh, LOG_ERR, "dup2 to stdout failed: %m");
-	      _exit (err);
-	    }
-	}
-      else if (logfile)
+  while ((rc = waitpid (pid, &status, 0)) == -1 &&
+	 errno == EINTR);
+  if (rc == (pid_t)-1)
+    {
+      pam_syslog (pamh, LOG_ERR, "waitpid returns with -1: %m");
+      return PAM_SYSTEM_ERR;
+    }
+  else if (status != 0)
+    {
+      if (WIFEXITED(status))
 	{
-	  time_t tm = time (NULL);
-	  char *buffer = NULL;
-
-	  close (STDOUT_FILENO);
-	  if ((i = open (logfile, O_CREAT|O_APPEND|O_WRONLY,
-			 S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH)) == -1)
-	    {
-	      int err = errno;
-	      pam_syslog (pamh, LOG_ERR, "open of %s failed: %m",
-			  logfile);
-	      _exit (err);
-	    }
-	  if (i != STDOUT_FILENO)
-	    {
-	      if (dup2 (i, STDOUT_FILENO) == -1)
-		{
-		  int err = errno;
-		  pam_syslog (pamh, LOG_ERR, "dup2 failed: %m");
-		  _exit (err);
-		}
-	      close (i);
-	    }
-	  if (asprintf (&buffer, "*** %s", ctime (&tm)) > 0)
-	    {
-	      pam_modutil_write (STDOUT_FILENO, buffer, strlen (buffer));
-	      free (buffer);
-	    }
+	  pam_syslog (pamh, LOG_ERR, "%s failed: exit code %d",
+		      argv[optargc], WEXITSTATUS(status));
+	    if (!quiet)
+	  pam_error (pamh, _("%s failed: exit code %d"),
+		     argv[optargc], WEXITSTATUS(status));
 	}
-
-      if ((use_stdout || logfile) &&
-	  dup2 (STDOUT_FILENO, STDERR_FILENO) == -1)
+      else if (WIFSIGNALED(status))
 	{
-	  int err = errno;
-	  pam_syslog (pamh, LOG_ERR, "dup2 failed: %m");
-	  _exit (err);
+	  pam_syslog (pamh, LOG_ERR, "%s failed: caught signal %d%s",
+		      argv[optargc], WTERMSIG(status),
+		      WCOREDUMP(status) ? " (core dumped)" : "");
+	    if (!quiet)
+	  pam_error (pamh, _("%s failed: caught signal %d%s"),
+		     argv[optargc], WTERMSIG(status),
+		     WCOREDUMP(status) ? " (core dumped)" : "");
 	}
-
-      if (pam_modutil_sanitize_helper_fds(pamh, redirect_stdin,
-					  redirect_stdout, redirect_stdout) < 0)
-	_exit(1);
-
-      if (call_setuid)
-	if (setuid (geteuid ()) == -1)
-	  {
-	    int err = errno;
-	    pam_syslog (pamh, LOG_ERR, "setuid(%lu) failed: %m",
-			(unsigned long) geteuid ());
-	    _exit (err);
-	  }
-
-      if (setsid () == -1)
+      else
 	{
-	  int err = errno;
-	  pam_syslog (pamh, LOG_ERR, "setsid failed: %m");
-	  _exit (err);
+	  pam_syslog (pamh, LOG_ERR, "%s failed: unknown status 0x%x",
+		      argv[optargc], status);
+	    if (!quiet)
+	  pam_error (pamh, _("%s failed: unknown status 0x%x"),
+		     argv[optargc], status);
 	}
-
-      arggv = calloc (argc + 4, sizeof (char *));
-      if (arggv == NULL)
-	_exit (ENOMEM);
-
-      for (i = 0; i < (argc - optargc); i++)
-	arggv[i] = strdup(argv[i+optargc]);
-      arggv[i] = NULL;
-
-      /*
-       * Set up the child's environment list.  It consists of the PAM
-       * environment, plus a few hand-picked PAM items.
-       */
-      envlist = pam_getenvlist(pamh);
-      for (envlen = 0; envlist[envlen] != NULL; ++envlen)
-        /* nothing */ ;
-      nitems = PAM_ARRAY_SIZE(env_items);
-      /* + 2 because of PAM_TYPE and NULL entry */
-      tmp = realloc(envlist, (envlen + nitems + 2) * sizeof(*envlist));
-      if (tmp == NULL)
-      {
-        free(envlist);
-        pam_syslog (pamh, LOG_CRIT, "realloc environment failed: %m");
-        _exit (ENOMEM);
-      }
-      envlist = tmp;
-      for (i = 0; i < nitems; ++i)
-      {
-        const void *item;
-
-        if (pam_get_item(pamh, env_items[i].item, &item) != PAM_SUCCESS || item == NULL)
-          continue;
-        if (asprintf(&envstr, "%s=%s", env_items[i].name, (const char *)item) < 0)
-        {
-          free(envlist);
-          pam_syslog (pamh, LOG_CRIT, "prepare environment failed: %m");
-          _exit (ENOMEM);
-        }
-        envlist[envlen++] = envstr;
-        envlist[envlen] = NULL;
-      }
-
-      if (asprintf(&envstr, "PAM_TYPE=%s", pam_type) < 0)
-        {
-          free(envlist);
-          pam_syslog (pamh, LOG_CRIT, "prepare environment failed: %m");
-          _exit (ENOMEM);
-        }
-      envlist[envlen++] = envstr;
-      envlist[envlen] = NULL;
-
-      if (debug)
-	pam_syslog (pamh, LOG_DEBUG, "Calling %s ...", arggv[0]);
-
-      execve (arggv[0], arggv, envlist);
-      i = errno;
-      pam_syslog (pamh, LOG_ERR, "execve(%s,...) failed: %m", arggv[0]);
-      free(envlist);
-      _exit (i);
+      return PAM_SYSTEM_ERR;
+    }
+  return PAM_SUCCESS;
+
+ out:
+  free (arggv);
+  if (envlist != NULL)
+    free_env (envlist);
+  if (logfd != -1)
+    close (logfd);
+  if (expose_authtok)
+    {
+      close (fds[0]);
+      close (fds[1]);
+    }
+  if (use_stdout)
+    {
+      close (stdout_fds[1]);
+      fclose (stdout_file);
     }
-  return PAM_SYSTEM_ERR; /* will never be reached. */
+  return retval;
 }
 
 int
@@ -99,6 +99,9 @@ static int
 create_homedir (pam_handle_t *pamh, options_t *opt,
 		const char *user, const char *dir)
 {
+   static char *envp[] = { NULL };
+   const char *args[] = { NULL, NULL, NULL, NULL, NULL };
+   struct pam_modutil_spawn_attr attr;
    int retval, child;
    struct sigaction newsa, oldsa;
 
@@ -122,31 +125,22 @@ create_homedir (pam_handle_t *pamh, options_t *opt,
         pam_syslog(pamh, LOG_DEBUG, "Executing mkhomedir_helper.");
    }
 
-   /* fork */
-   child = fork();
-   if (child == 0) {
-	static char *envp[] = { NULL };
-	const char *args[] = { NULL, NULL, NULL, NULL, NULL };
-
-	if (pam_modutil_sanitize_helper_fds(pamh, PAM_MODUTIL_PIPE_FD,
-					    PAM_MODUTIL_PIPE_FD,
-					    PAM_MODUTIL_PIPE_FD) < 0)
-		_exit(PAM_SYSTEM_ERR);
-
-	/* exec the mkhomedir helper */
-	args[0] = MKHOMEDIR_HELPER;
-	args[1] = user;
-	args[2] = opt->umask;
-	args[3] = opt->skeldir;
-
-	DIAG_PUSH_IGNORE_CAST_QUAL;
-	execve(MKHOMEDIR_HELPER, (char **)args, envp);
-	DIAG_POP_IGNORE_CAST_QUAL;
-
-	/* should not get here: exit with error */
-	D(("helper binary is not available"));
-	_exit(PAM_SYSTEM_ERR);
-   } else if (child > 0) {
+   /* the arguments of the mkhomedir helper */
+   args[0] = MKHOMEDIR_HELPER;
+   args[1] = user;
+   args[2] = opt->umask;
+   args[3] = opt->skeldir;
+
+   memset(&attr, 0, sizeof(attr));
+   attr.stdfd[0] = attr.stdfd[1] = attr.stdfd[2] = -1;
+   attr.redirect[0] = attr.redirect[1] = attr.redirect[2] =
+	PAM_MODUTIL_PIPE_FD;
+
+   DIAG_PUSH_IGNORE_CAST_QUAL;
+   child = pam_modutil_spawn_helper(pamh, MKHOMEDIR_HELPER,
+				    (char *const *) args, envp, &attr);
+   DIAG_POP_IGNORE_CAST_QUAL;
+   if (child > 0) {
 	int rc;
 	while ((rc=waitpid(child, &retval, 0)) < 0 && errno == EINTR);
 	if (rc < 0) {
@@ -159,8 +153,7 @@ create_homedir (pam_handle_t *pamh, options_t *opt,
 	  retval = WEXITSTATUS(retval);
 	}
    } else {
-	D(("fork failed"));
-	pam_syslog(pamh, LOG_ERR, "fork failed: %m");
+	D(("helper binary is not available"));
 	retval = PAM_SYSTEM_ERR;
    }
 
@@ -0,0 +1,189 @@
+/*
+ * Measure changing a password in the middle of large passwd and shadow
+ * files by rewriting them entry by entry, as unix_update_passwd() and
+ * unix_update_shadow() did before, and with them.
+ *
+ * usage: bench-unix_update [users ...]
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pwd.h>
+#include <shadow.h>
+
+#include "passverify.h"
+
+#define RUNS 5
+#define HASH "$6$0123456789abcdef$" \
+	"0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ./" \
+	"0123456789abcdefghijklmnopqrstu"
+
+static double
+now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* what unix_update_passwd() did before */
+static int
+rewrite_passwd (const char *forwho, char *towhat)
+{
+  struct passwd *pwd;
+  FILE *in, *out;
+  int found = 0;
+
+  if ((in = fopen (PASSWD_FILE, "r")) == NULL)
+    return -1;
+  if ((out = fopen (PW_TMPFILE, "w")) == NULL)
+    {
+      fclose (in);
+      return -1;
+    }
+  while ((pwd = fgetpwent (in)) != NULL)
+    {
+      if (strcmp (pwd->pw_name, forwho) == 0)
+	{
+	  pwd->pw_passwd = towhat;
+	  found = 1;
+	}
+      if (putpwent (pwd, out))
+	break;
+    }
+  fclose (in);
+  if (fflush (out) || fsync (fileno (out)) || fclose (out) || !found)
+    return -1;
+  return rename (PW_TMPFILE, PASSWD_FILE);
+}
+
+/* what unix_update_shadow() did before */
+static int
+rewrite_shadow (const char *forwho, char *towhat)
+{
+  struct spwd *spwd;
+  FILE *in, *out;
+  int found = 0;
+
+  if ((in = fopen (SHADOW_FILE, "r")) == NULL)
+    return -1;
+  if ((out = fopen (SH_TMPFILE, "w")) == NULL)
+    {
+      fclose (in);
+      return -1;
+    }
+  while ((spwd = fgetspent (in)) != NULL)
+    {
+      if (strcmp (spwd->sp_namp, forwho) == 0)
+	{
+	  spwd->sp_pwdp = towhat;
+	  spwd->sp_lstchg = time (NULL) / (60 * 60 * 24);
+	  found = 1;
+	}
+      if (putspent (spwd, out))
+	break;
+    }
+  fclose (in);
+  if (fflush (out) || fsync (fileno (out)) || fclose (out) || !found)
+    return -1;
+  return rename (SH_TMPFILE, SHADOW_FILE);
+}
+
+static int
+write_files (unsigned int users)
+{
+  FILE *pw, *sp;
+  unsigned int i;
+
+  if ((pw = fopen (PASSWD_FILE, "w")) == NULL)
+    return -1;
+  if ((sp = fopen (SHADOW_FILE, "w")) == NULL)
+    {
+      fclose (pw);
+      return -1;
+    }
+  for (i = 0; i < users; i++)
+    {
+      fprintf (pw, "user%u:x:%u:%u:User %u:/home/user%u:/bin/sh\n",
+	       i, i + 1000, i + 1000, i, i);
+      fprintf (sp, "user%u:%s:19000:0:99999:7:::\n", i, HASH);
+    }
+  return (fclose (pw) | fclose (sp)) ? -1 : 0;
+}
+
+static double
+measure (int (*change) (const char *, char *), const char *forwho)
+{
+  static char towhat[] = HASH;
+  double begin = now ();
+  int i;
+
+  for (i = 0; i < RUNS; i++)
+    if (change (forwho, towhat) != 0)
+      return -1;
+  return (now () - begin) * 1e3 / RUNS;
+}
+
+static int
+new_passwd (const char *forwho, char *towhat)
+{
+  return unix_update_passwd (forwho, towhat) == PAM_SUCCESS ? 0 : -1;
+}
+
+static int
+new_shadow (const char *forwho, char *towhat)
+{
+  return unix_update_shadow (forwho, towhat) == PAM_SUCCESS ? 0 : -1;
+}
+
+static int
+run (unsigned int users)
+{
+  double passwd_old, passwd_new, shadow_old, shadow_new;
+  char forwho[32];
+
+  if (users == 0 || write_files (users) != 0)
+    return -1;
+  snprintf (forwho, sizeof (forwho), "user%u", users / 2);
+
+  passwd_old = measure (rewrite_passwd, forwho);
+  passwd_new = measure (new_passwd, forwho);
+  shadow_old = measure (rewrite_shadow, forwho);
+  shadow_new = measure (new_shadow, forwho);
+  unlink (PASSWD_FILE);
+  unlink (SHADOW_FILE);
+
+  if (passwd_old < 0 || passwd_new < 0 || shadow_old < 0 || shadow_new < 0)
+    return -1;
+  printf ("%7u users: passwd %8.2f ms -> %7.2f ms,"
+	  " shadow %8.2f ms -> %7.2f ms per change\n",
+	  users, passwd_old, passwd_new, shadow_old, shadow_new);
+  return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+  static const unsigned int defaults[] = { 1000, 100000, 500000 };
+  unsigned int i;
+
+  if (argc > 1)
+    {
+      for (i = 1; i < (unsigned int) argc; i++)
+	if (run (strtoul (argv[i], NULL, 10)) != 0)
+	  return 1;
+      return 0;
+    }
+
+  for (i = 0; i < sizeof (defaults) / sizeof (defaults[0]); i++)
+    if (run (defaults[i]) != 0)
+      return 1;
+
+  return 0;
+}
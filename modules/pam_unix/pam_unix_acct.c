@@ -58,16 +58,25 @@
 #include <security/pam_modutil.h>
 
 #include "pam_cc_compat.h"
+#include "pam_probes.h"
 #include "support.h"
 #include "passverify.h"
 
 int _unix_run_verify_binary(pam_handle_t *pamh, unsigned long long ctrl,
 	const char *user, int *daysleft)
 {
+  static char *envp[] = { NULL };
+  const char *args[] = { NULL, NULL, NULL, NULL };
+  struct pam_modutil_spawn_attr attr;
   int retval=0, child, fds[2];
   struct sigaction newsa, oldsa;
   D(("running verify_binary"));
 
+  /* known from the password check, or asked from the worker */
+  if ((retval = _unix_helper_expiry(pamh, ctrl, user, daysleft)) >= 0)
+    return retval;
+  retval = 0;
+
   /* create a pipe for the messages */
   if (pipe(fds) != 0) {
     D(("could not make pipe"));
@@ -90,85 +99,62 @@ int _unix_run_verify_binary(pam_handle_t *pamh, unsigned long long ctrl,
      sigaction(SIGCHLD, &newsa, &oldsa);
   }
 
-  /* fork */
-  child = fork();
-  if (child == 0) {
-    static char *envp[] = { NULL };
-    const char *args[] = { NULL, NULL, NULL, NULL };
-
-    /* XXX - should really tidy up PAM here too */
-
-    /* reopen stdout as pipe */
-    if (dup2(fds[1], STDOUT_FILENO) != STDOUT_FILENO) {
-      pam_syslog(pamh, LOG_ERR, "dup2 of %s failed: %m", "stdout");
-      _exit(PAM_AUTHINFO_UNAVAIL);
-    }
+  /* the pipe becomes stdout of the helper */
+  memset(&attr, 0, sizeof(attr));
+  attr.stdfd[0] = attr.stdfd[2] = -1;
+  attr.stdfd[1] = fds[1];
+  attr.redirect[0] = attr.redirect[2] = PAM_MODUTIL_PIPE_FD;
+  if (geteuid() == 0) {
+    /* must set the real uid to 0 so the helper will not error
+       out if pam is called from setuid binary (su, sudo...) */
+    attr.flags = PAM_MODUTIL_SPAWN_EUID;
+  }
 
-    if (pam_modutil_sanitize_helper_fds(pamh, PAM_MODUTIL_PIPE_FD,
-					PAM_MODUTIL_IGNORE_FD,
-					PAM_MODUTIL_PIPE_FD) < 0) {
-      _exit(PAM_AUTHINFO_UNAVAIL);
-    }
+  args[0] = CHKPWD_HELPER;
+  args[1] = user;
+  args[2] = "chkexpiry";
 
-    if (geteuid() == 0) {
-      /* must set the real uid to 0 so the helper will not error
-         out if pam is called from setuid binary (su, sudo...) */
-      if (setuid(0) == -1) {
-          pam_syslog(pamh, LOG_ERR, "setuid failed: %m");
-          printf("-1\n");
-          fflush(stdout);
-          _exit(PAM_AUTHINFO_UNAVAIL);
-      }
+  PAM_PROBE1(pam_unix, helper__fork, CHKPWD_HELPER);
+  DIAG_PUSH_IGNORE_CAST_QUAL;
+  child = pam_modutil_spawn_helper(pamh, CHKPWD_HELPER,
+				   (char *const *) args, envp, &attr);
+  DIAG_POP_IGNORE_CAST_QUAL;
+  close(fds[1]);
+  if (child > 0) {
+    char buf[32];
+    int rc=0;
+    PAM_PROBE1(pam_unix, helper__exec, CHKPWD_HELPER);
+    /* wait for helper to complete: */
+    while ((rc=waitpid(child, &retval, 0)) < 0 && errno == EINTR);
+    PAM_PROBE3(pam_unix, helper__wait, CHKPWD_HELPER, child, retval);
+    if (rc<0) {
+      pam_syslog(pamh, LOG_ERR, "unix_chkpwd waitpid returned %d: %m", rc);
+      retval = PAM_AUTH_ERR;
+    } else if (!WIFEXITED(retval)) {
+      pam_syslog(pamh, LOG_ERR, "unix_chkpwd abnormal exit: %d", retval);
+      retval = PAM_AUTH_ERR;
+    } else {
+      retval = WEXITSTATUS(retval);
+      rc = pam_modutil_read(fds[0], buf, sizeof(buf) - 1);
+      if(rc > 0) {
+            buf[rc] = '\0';
+            if (sscanf(buf,"%d", daysleft) != 1 )
+              retval = PAM_AUTH_ERR;
+          }
+      else {
+          pam_syslog(pamh, LOG_ERR, "read unix_chkpwd output error %d: %m", rc);
+          retval = PAM_AUTH_ERR;
+        }
     }
-
-    /* exec binary helper */
-    args[0] = CHKPWD_HELPER;
-    args[1] = user;
-    args[2] = "chkexpiry";
-
-    DIAG_PUSH_IGNORE_CAST_QUAL;
-    execve(CHKPWD_HELPER, (char *const *) args, envp);
-    DIAG_POP_IGNORE_CAST_QUAL;
-
-    pam_syslog(pamh, LOG_ERR, "helper binary execve failed: %m");
-    /* should not get here: exit with error */
+  } else if (child == -2) {
     D(("helper binary is not available"));
-    printf("-1\n");
-    fflush(stdout);
-    _exit(PAM_AUTHINFO_UNAVAIL);
+    *daysleft = -1;
+    retval = PAM_AUTHINFO_UNAVAIL;
   } else {
-    close(fds[1]);
-    if (child > 0) {
-      char buf[32];
-      int rc=0;
-      /* wait for helper to complete: */
-      while ((rc=waitpid(child, &retval, 0)) < 0 && errno == EINTR);
-      if (rc<0) {
-	pam_syslog(pamh, LOG_ERR, "unix_chkpwd waitpid returned %d: %m", rc);
-	retval = PAM_AUTH_ERR;
-      } else if (!WIFEXITED(retval)) {
-        pam_syslog(pamh, LOG_ERR, "unix_chkpwd abnormal exit: %d", retval);
-        retval = PAM_AUTH_ERR;
-      } else {
-	retval = WEXITSTATUS(retval);
-        rc = pam_modutil_read(fds[0], buf, sizeof(buf) - 1);
-	if(rc > 0) {
-	      buf[rc] = '\0';
-	      if (sscanf(buf,"%d", daysleft) != 1 )
-	        retval = PAM_AUTH_ERR;
-	    }
-	else {
-	    pam_syslog(pamh, LOG_ERR, "read unix_chkpwd output error %d: %m", rc);
-	    retval = PAM_AUTH_ERR;
-	  }
-      }
-    } else {
-      pam_syslog(pamh, LOG_ERR, "Fork failed: %m");
-      D(("fork failed"));
-      retval = PAM_AUTH_ERR;
-    }
-    close(fds[0]);
+    D(("could not start the helper"));
+    retval = PAM_AUTH_ERR;
   }
+  close(fds[0]);
 
   if (off(UNIX_NOREAP, ctrl)) {
         sigaction(SIGCHLD, &oldsa, NULL);   /* restore old signal handler */
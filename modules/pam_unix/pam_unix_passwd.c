@@ -67,6 +67,7 @@
 #include <security/pam_modutil.h>
 
 #include "pam_cc_compat.h"
+#include "pam_probes.h"
 #include "md5.h"
 #include "support.h"
 #include "passverify.h"
@@ -233,6 +234,10 @@ static char *getNISserver(pam_handle_t *pamh, unsigned long long ctrl)
 static int _unix_run_update_binary(pam_handle_t *pamh, unsigned long long ctrl, const char *user,
     const char *fromwhat, const char *towhat, int remember)
 {
+    static char *envp[] = { NULL };
+    const char *args[] = { NULL, NULL, NULL, NULL, NULL, NULL };
+    char buffer[16];
+    struct pam_modutil_spawn_attr attr;
     int retval, child, fds[2];
     struct sigaction newsa, oldsa;
 
@@ -257,50 +262,34 @@ static int _unix_run_update_binary(pam_handle_t *pamh, unsigned long long ctrl,
         sigaction(SIGCHLD, &newsa, &oldsa);
     }
 
-    /* fork */
-    child = fork();
-    if (child == 0) {
-	static char *envp[] = { NULL };
-	const char *args[] = { NULL, NULL, NULL, NULL, NULL, NULL };
-        char buffer[16];
-
-	/* XXX - should really tidy up PAM here too */
-
-	/* reopen stdin as pipe */
-	if (dup2(fds[0], STDIN_FILENO) != STDIN_FILENO) {
-		pam_syslog(pamh, LOG_ERR, "dup2 of %s failed: %m", "stdin");
-		_exit(PAM_AUTHINFO_UNAVAIL);
-	}
-
-	if (pam_modutil_sanitize_helper_fds(pamh, PAM_MODUTIL_IGNORE_FD,
-					    PAM_MODUTIL_PIPE_FD,
-					    PAM_MODUTIL_PIPE_FD) < 0) {
-		_exit(PAM_AUTHINFO_UNAVAIL);
-	}
-
-	/* exec binary helper */
-	args[0] = UPDATE_HELPER;
-	args[1] = user;
-	args[2] = "update";
-	if (on(UNIX_SHADOW, ctrl))
-		args[3] = "1";
-	else
-		args[3] = "0";
-
-        snprintf(buffer, sizeof(buffer), "%d", remember);
-        args[4] = buffer;
-
-	DIAG_PUSH_IGNORE_CAST_QUAL;
-	execve(UPDATE_HELPER, (char *const *) args, envp);
-	DIAG_POP_IGNORE_CAST_QUAL;
-
-	/* should not get here: exit with error */
-	D(("helper binary is not available"));
-	_exit(PAM_AUTHINFO_UNAVAIL);
-    } else if (child > 0) {
+    /* the pipe becomes stdin of the helper */
+    memset(&attr, 0, sizeof(attr));
+    attr.stdfd[0] = fds[0];
+    attr.stdfd[1] = attr.stdfd[2] = -1;
+    attr.redirect[1] = attr.redirect[2] = PAM_MODUTIL_PIPE_FD;
+
+    args[0] = UPDATE_HELPER;
+    args[1] = user;
+    args[2] = "update";
+    if (on(UNIX_SHADOW, ctrl))
+	args[3] = "1";
+    else
+	args[3] = "0";
+
+    snprintf(buffer, sizeof(buffer), "%d", remember);
+    args[4] = buffer;
+
+    PAM_PROBE1(pam_unix, helper__fork, UPDATE_HELPER);
+    DIAG_PUSH_IGNORE_CAST_QUAL;
+    child = pam_modutil_spawn_helper(pamh, UPDATE_HELPER,
+				     (char *const *) args, envp, &attr);
+    DIAG_POP_IGNORE_CAST_QUAL;
+    if (child > 0) {
 	/* wait for child */
 	/* if the stored password is NULL */
         int rc=0;
+
+	PAM_PROBE1(pam_unix, helper__exec, UPDATE_HELPER);
 	if (fromwhat) {
 	    int len = strlen(fromwhat);
 
@@ -322,6 +311,7 @@ static int _unix_run_update_binary(pam_handle_t *pamh, unsigned long long ctrl,
 	close(fds[1]);
 	/* wait for helper to complete: */
 	while ((rc=waitpid(child, &retval, 0)) < 0 && errno == EINTR);
+	PAM_PROBE3(pam_unix, helper__wait, UPDATE_HELPER, child, retval);
 	if (rc<0) {
 	  pam_syslog(pamh, LOG_ERR, "unix_update waitpid failed: %m");
 	  retval = PAM_AUTHTOK_ERR;
@@ -332,10 +322,15 @@ static int _unix_run_update_binary(pam_handle_t *pamh, unsigned long long ctrl,
 	  retval = WEXITSTATUS(retval);
 	}
     } else {
-	D(("fork failed"));
 	close(fds[0]);
 	close(fds[1]);
-	retval = PAM_AUTH_ERR;
+	if (child == -2) {
+	    D(("helper binary is not available"));
+	    retval = PAM_AUTHINFO_UNAVAIL;
+	} else {
+	    D(("could not start the helper"));
+	    retval = PAM_AUTH_ERR;
+	}
     }
 
     if (off(UNIX_NOREAP, ctrl)) {
@@ -860,6 +855,8 @@ pam_sm_chauthtok(pam_handle_t *pamh, int flags, int argc, const char **argv)
 		retval = _do_setpass(pamh, user, pass_old, tpass, ctrl,
 		                     remember);
 	        /* _do_setpass has called unlock_pwdf for us */
+		/* the expiry the helper reported is out of date now */
+		_unix_forget_helper_status(pamh);
 
 		_pam_delete(tpass);
 		pass_old = pass_new = NULL;
@@ -5,7 +5,9 @@
 #include <security/_pam_macros.h>
 #include <security/pam_modules.h>
 #include "support.h"
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -17,6 +19,7 @@
 #include <errno.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #ifdef HAVE_LIBXCRYPT
@@ -337,8 +340,13 @@ PAMH_ARG_DECL(int check_shadow_expiry,
 
 /* passwd/salt conversion macros */
 
+/* the benchmark changes copies of them */
+#ifndef PASSWD_FILE
+#define PASSWD_FILE             "/etc/passwd"
+#define SHADOW_FILE             "/etc/shadow"
 #define PW_TMPFILE              "/etc/npasswd"
 #define SH_TMPFILE              "/etc/nshadow"
+#endif
 #define OPW_TMPFILE             "/etc/security/nopasswd"
 
 /*
@@ -812,23 +820,202 @@ done:
     }
 }
 
+/* Writes all of buf, returns 0 or -1. */
+static int
+write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+	if ((n = write(fd, buf, len)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	buf += n;
+	len -= n;
+    }
+    return 0;
+}
+
+/* Copies len bytes at off of the file in ifd, mapped at map, to ofd. */
+static int
+copy_span(int ifd, int ofd, const char *map, off_t off, size_t len)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+    ssize_t n;
+
+    /* in the kernel, or even shared on the disk */
+    while (len > 0 && (n = copy_file_range(ifd, &off, ofd, NULL, len, 0)) > 0)
+	len -= n;
+#else
+    (void) ifd;
+#endif
+    return write_all(ofd, map + off, len);
+}
+
+/*
+ * Copies path to tmp with the lines of forwho replaced by what update()
+ * writes for them, without the newline.  The lines are looked for in a
+ * mapping of the file, everything between them is copied as it is, so
+ * that only the changed entries are parsed and written again.  If there
+ * is no line of forwho, update() is called once with line NULL to add
+ * one.  Returns the number of lines of forwho, or -1.
+ */
+static int
+rewrite_entries(const char *path, const char *tmp, const char *forwho,
+		int (*update)(int fd, const char *line, size_t len, void *arg),
+		void *arg)
+{
+    size_t len = strlen(forwho);
+    char *map = NULL;
+    const char *end, *p, *eol, *span;
+    struct stat st;
+    int ifd, ofd, found = 0;
+
+    if ((ifd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+	return -1;
+    if (fstat(ifd, &st) < 0
+	|| (ofd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		       0600)) < 0) {
+	close(ifd);
+	return -1;
+    }
+    if (fchown(ofd, st.st_uid, st.st_gid) < 0
+	|| fchmod(ofd, st.st_mode) < 0)
+	goto fail;
+
+    /*
+     * A mapping of a file truncated in place faults with SIGBUS, unlike
+     * the copy pam_modutil_search_passwd() reads.  It is only safe
+     * because the callers hold lckpwdf(), see lock_pwdf(), and the
+     * tools that change the files do as well.  One that skips the lock
+     * and truncates the file can crash the helper, which leaves the file
+     * as it was.
+     */
+    if (st.st_size > 0) {
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, ifd, 0);
+	if (map == MAP_FAILED) {
+	    map = NULL;
+	    goto fail;
+	}
+	end = map + st.st_size;
+	for (span = p = map;
+	     (p = memmem(p, end - p, forwho, len)) != NULL; p = eol) {
+	    if ((p != map && p[-1] != '\n') || end - p <= (ptrdiff_t) len
+		|| p[len] != ':') {
+		eol = p + 1;
+		continue;
+	    }
+	    if ((eol = memchr(p, '\n', end - p)) == NULL)
+		eol = end;
+	    if (copy_span(ifd, ofd, map, span - map, p - span)
+		|| update(ofd, p, eol - p, arg))
+		goto fail;
+	    span = eol;
+	    found++;
+	}
+	if (copy_span(ifd, ofd, map, span - map, end - span)
+	    || (end[-1] != '\n' && write_all(ofd, "\n", 1)))
+	    goto fail;
+    }
+    if (!found && update(ofd, NULL, 0, arg))
+	goto fail;
+
+    if (fsync(ofd)) {
+	D(("fsync error writing entries to %s: %m", tmp));
+	goto fail;
+    }
+    if (map != NULL)
+	munmap(map, st.st_size);
+    close(ifd);
+    if (close(ofd)) {
+	D(("close error writing entries to %s: %m", tmp));
+	return -1;
+    }
+    return found;
+
+fail:
+    D(("error writing entries to %s: %m", tmp));
+    if (map != NULL)
+	munmap(map, st.st_size);
+    close(ifd);
+    close(ofd);
+    return -1;
+}
+
+/* Writes name:passwd, then more and rest, which start with a colon. */
+static int
+write_entry(int fd, const char *name, size_t name_len, const char *passwd,
+	    const char *more, const char *rest, size_t rest_len)
+{
+    size_t passwd_len = strlen(passwd), more_len = strlen(more);
+    char *buf, *p;
+    int rc;
+
+    /* the rest of the line is copied as it is, even with a NUL in it */
+    if ((buf = malloc(name_len + 1 + passwd_len + more_len + rest_len))
+	== NULL)
+	return -1;
+    p = buf;
+    memcpy(p, name, name_len);
+    p += name_len;
+    *p++ = ':';
+    memcpy(p, passwd, passwd_len);
+    p += passwd_len;
+    memcpy(p, more, more_len);
+    p += more_len;
+    memcpy(p, rest, rest_len);
+    p += rest_len;
+    rc = write_all(fd, buf, p - buf);
+    free(buf);
+    return rc;
+}
+
+/* The colon before the field after n more, or the end of the line. */
+static const char *
+skip_fields(const char *p, const char *end, int n)
+{
+    while (n-- > 0 && p < end) {
+	if ((p = memchr(p + 1, ':', end - p - 1)) == NULL)
+	    return end;
+    }
+    return p;
+}
+
+struct passwd_update {
+    const char *towhat;
+};
+
+static int
+update_passwd_entry(int fd, const char *line, size_t len, void *arg)
+{
+    const struct passwd_update *u = arg;
+    const char *end = line + len, *colon, *rest;
+
+    if (line == NULL)
+	return 0;
+
+    /* name:passwd:... */
+    colon = memchr(line, ':', len);
+    rest = skip_fields(colon, end, 1);
+    return write_entry(fd, line, colon - line, u->towhat, "",
+		       rest, end - rest);
+}
+
 PAMH_ARG_DECL(int unix_update_passwd,
 	const char *forwho, const char *towhat)
 {
-    struct passwd *tmpent = NULL;
-    struct stat st;
-    FILE *pwfile, *opwfile;
+    struct passwd_update u;
     int err = 1;
-    int oldmask;
 #ifdef WITH_SELINUX
     char *prev_context_raw = NULL;
 #endif
 
-    oldmask = umask(077);
 #ifdef WITH_SELINUX
     if (SELINUX_ENABLED) {
       char *passwd_context_raw = NULL;
-      if (getfilecon_raw("/etc/passwd",&passwd_context_raw)<0) {
+      if (getfilecon_raw(PASSWD_FILE,&passwd_context_raw)<0) {
 	return PAM_AUTHTOK_ERR;
       };
       if (getfscreatecon_raw(&prev_context_raw)<0) {
@@ -843,75 +1030,13 @@ PAMH_ARG_DECL(int unix_update_passwd,
       freecon(passwd_context_raw);
     }
 #endif
-    pwfile = fopen(PW_TMPFILE, "w");
-    umask(oldmask);
-    if (pwfile == NULL) {
-      err = 1;
-      goto done;
-    }
-
-    opwfile = fopen("/etc/passwd", "r");
-    if (opwfile == NULL) {
-	fclose(pwfile);
-	err = 1;
-	goto done;
-    }
-
-    if (fstat(fileno(opwfile), &st) == -1) {
-	fclose(opwfile);
-	fclose(pwfile);
-	err = 1;
-	goto done;
-    }
-
-    if (fchown(fileno(pwfile), st.st_uid, st.st_gid) == -1) {
-	fclose(opwfile);
-	fclose(pwfile);
-	err = 1;
-	goto done;
-    }
-    if (fchmod(fileno(pwfile), st.st_mode) == -1) {
-	fclose(opwfile);
-	fclose(pwfile);
-	err = 1;
-	goto done;
-    }
-
-    tmpent = fgetpwent(opwfile);
-    while (tmpent) {
-	if (!strcmp(tmpent->pw_name, forwho)) {
-	    /* To shut gcc up */
-	    union {
-		const char *const_charp;
-		char *charp;
-	    } assigned_passwd;
-	    assigned_passwd.const_charp = towhat;
-
-	    tmpent->pw_passwd = assigned_passwd.charp;
-	    err = 0;
-	}
-	if (putpwent(tmpent, pwfile)) {
-	    D(("error writing entry to password file: %m"));
-	    err = 1;
-	    break;
-	}
-	tmpent = fgetpwent(opwfile);
-    }
-    fclose(opwfile);
+    u.towhat = towhat;
+    if (rewrite_entries(PASSWD_FILE, PW_TMPFILE, forwho,
+			update_passwd_entry, &u) > 0)
+	err = 0;
 
-    if (fflush(pwfile) || fsync(fileno(pwfile))) {
-	D(("fflush or fsync error writing entries to password file: %m"));
-	err = 1;
-    }
-
-    if (fclose(pwfile)) {
-	D(("fclose error writing entries to password file: %m"));
-	err = 1;
-    }
-
-done:
     if (!err) {
-	if (!rename(PW_TMPFILE, "/etc/passwd"))
+	if (!rename(PW_TMPFILE, PASSWD_FILE))
 	    pam_syslog(pamh,
 		LOG_NOTICE, "password changed for %s", forwho);
 	else
@@ -935,25 +1060,46 @@ done:
     }
 }
 
+struct shadow_update {
+    const char *forwho;
+    const char *towhat;
+    char lstchg[32];		/* :lastchg */
+};
+
+static int
+update_shadow_entry(int fd, const char *line, size_t len, void *arg)
+{
+    const struct shadow_update *u = arg;
+    const char *end = line + len, *colon, *rest;
+
+    /* the fields after the date of the last change, as putspent() would */
+    if (line == NULL)
+	return write_entry(fd, u->forwho, strlen(u->forwho), u->towhat,
+			   u->lstchg, "::::::\n", 7);
+
+    /* name:passwd:lastchg:... */
+    colon = memchr(line, ':', len);
+    rest = skip_fields(colon, end, 2);
+    if (rest == end)
+	rest = "::::::", end = rest + 6;
+    return write_entry(fd, line, colon - line, u->towhat, u->lstchg,
+		       rest, end - rest);
+}
+
 PAMH_ARG_DECL(int unix_update_shadow,
 	const char *forwho, char *towhat)
 {
-    struct spwd spwdent, *stmpent = NULL;
-    struct stat st;
-    FILE *pwfile, *opwfile;
+    struct shadow_update u;
+    long lstchg;
     int err = 0;
-    int oldmask;
-    int wroteentry = 0;
 #ifdef WITH_SELINUX
     char *prev_context_raw = NULL;
 #endif
 
-    oldmask = umask(077);
-
 #ifdef WITH_SELINUX
     if (SELINUX_ENABLED) {
       char *shadow_context_raw = NULL;
-      if (getfilecon_raw("/etc/shadow",&shadow_context_raw)<0) {
+      if (getfilecon_raw(SHADOW_FILE,&shadow_context_raw)<0) {
 	return PAM_AUTHTOK_ERR;
       };
       if (getfscreatecon_raw(&prev_context_raw)<0) {
@@ -968,95 +1114,22 @@ PAMH_ARG_DECL(int unix_update_shadow,
       freecon(shadow_context_raw);
     }
 #endif
-    pwfile = fopen(SH_TMPFILE, "w");
-    umask(oldmask);
-    if (pwfile == NULL) {
-	err = 1;
-	goto done;
-    }
-
-    opwfile = fopen("/etc/shadow", "r");
-    if (opwfile == NULL) {
-	fclose(pwfile);
-	err = 1;
-	goto done;
-    }
-
-    if (fstat(fileno(opwfile), &st) == -1) {
-	fclose(opwfile);
-	fclose(pwfile);
-	err = 1;
-	goto done;
-    }
-
-    if (fchown(fileno(pwfile), st.st_uid, st.st_gid) == -1) {
-	fclose(opwfile);
-	fclose(pwfile);
+    u.forwho = forwho;
+    u.towhat = towhat;
+    lstchg = time(NULL) / (60 * 60 * 24);
+    if (lstchg == 0)
+	strcpy(u.lstchg, ":"); /* Don't request passwort change
+				   only because time isn't set yet. */
+    else
+	snprintf(u.lstchg, sizeof(u.lstchg), ":%ld", lstchg);
+    D(("Set password %s for %s", towhat, forwho));
+
+    if (rewrite_entries(SHADOW_FILE, SH_TMPFILE, forwho,
+			update_shadow_entry, &u) < 0)
 	err = 1;
-	goto done;
-    }
-    if (fchmod(fileno(pwfile), st.st_mode) == -1) {
-	fclose(opwfile);
-	fclose(pwfile);
-	err = 1;
-	goto done;
-    }
-
-    stmpent = fgetspent(opwfile);
-    while (stmpent) {
-
-	if (!strcmp(stmpent->sp_namp, forwho)) {
-	    stmpent->sp_pwdp = towhat;
-	    stmpent->sp_lstchg = time(NULL) / (60 * 60 * 24);
-	    if (stmpent->sp_lstchg == 0)
-	        stmpent->sp_lstchg = -1; /* Don't request passwort change
-					    only because time isn't set yet. */
-	    wroteentry = 1;
-	    D(("Set password %s for %s", stmpent->sp_pwdp, forwho));
-	}
-
-	if (putspent(stmpent, pwfile)) {
-	    D(("error writing entry to shadow file: %m"));
-	    err = 1;
-	    break;
-	}
-
-	stmpent = fgetspent(opwfile);
-    }
-
-    fclose(opwfile);
-
-    if (!wroteentry && !err) {
-	DIAG_PUSH_IGNORE_CAST_QUAL;
-	spwdent.sp_namp = (char *)forwho;
-	DIAG_POP_IGNORE_CAST_QUAL;
-	spwdent.sp_pwdp = towhat;
-	spwdent.sp_lstchg = time(NULL) / (60 * 60 * 24);
-	if (spwdent.sp_lstchg == 0)
-	    spwdent.sp_lstchg = -1; /* Don't request passwort change
-				       only because time isn't set yet. */
-	spwdent.sp_min = spwdent.sp_max = spwdent.sp_warn = spwdent.sp_inact =
-	    spwdent.sp_expire = -1;
-	spwdent.sp_flag = (unsigned long)-1l;
-	if (putspent(&spwdent, pwfile)) {
-	    D(("error writing entry to shadow file: %m"));
-	    err = 1;
-	}
-    }
-
-    if (fflush(pwfile) || fsync(fileno(pwfile))) {
-	D(("fflush or fsync error writing entries to shadow file: %m"));
-	err = 1;
-    }
-
-    if (fclose(pwfile)) {
-	D(("fclose error writing entries to shadow file: %m"));
-	err = 1;
-    }
 
- done:
     if (!err) {
-	if (!rename(SH_TMPFILE, "/etc/shadow"))
+	if (!rename(SH_TMPFILE, SHADOW_FILE))
 	    pam_syslog(pamh,
 		LOG_NOTICE, "password changed for %s", forwho);
 	else
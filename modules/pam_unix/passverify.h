@@ -2,6 +2,7 @@
  * Copyright information at end of file.
  */
 
+#include <stdint.h>
 #include <sys/types.h>
 #include <pwd.h>
 #include <security/pam_modules.h>
@@ -10,6 +11,37 @@
 
 #define OLD_PASSWORDS_FILE      "/etc/security/opasswd"
 
+/*
+ * A request to "unix_chkpwd serve", followed by user_len bytes of the
+ * user name and pass_len bytes of the password.  The helper answers
+ * every request with a struct chkpwd_reply.
+ */
+struct chkpwd_request {
+	uint32_t user_len;
+	uint32_t pass_len;
+	uint32_t flags;
+};
+
+#define CHKPWD_VERIFY           0x1     /* check the password */
+#define CHKPWD_NULLOK           0x2     /* accept an empty one */
+#define CHKPWD_EXPIRY           0x4     /* check the expiry of the account */
+
+/*
+ * retval is the exit status "unix_chkpwd <user> nullok|nonull" would
+ * have had, PAM_SUCCESS without CHKPWD_VERIFY.  The rest is what
+ * "unix_chkpwd <user> nullok,chkexpiry" prints on stdout: whether the
+ * user has no password, the result of the expiry check and the days
+ * left before the password expires.
+ */
+struct chkpwd_reply {
+	int32_t retval;
+	int32_t blank;
+	int32_t expiry;
+	int32_t daysleft;
+};
+
+#define CHKPWD_USER_MAX         256
+
 int
 is_pwd_shadowed(const struct passwd *pwd);
 
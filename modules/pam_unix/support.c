@@ -30,6 +30,7 @@
 
 #include "pam_cc_compat.h"
 #include "pam_inline.h"
+#include "pam_probes.h"
 #include "support.h"
 #include "passverify.h"
 
@@ -308,7 +309,6 @@ static void _unix_cleanup(pam_handle_t *pamh UNUSED, void *data, int error_statu
 int _unix_getpwnam(pam_handle_t *pamh, const char *name,
 		   int files, int nis, struct passwd **ret)
 {
-	FILE *passwd;
 	char buf[16384];
 	int matched = 0, buflen;
 	char *slogin, *spasswd, *suid, *sgid, *sgecos, *shome, *sshell, *p;
@@ -316,21 +316,14 @@ int _unix_getpwnam(pam_handle_t *pamh, const char *name,
 	memset(buf, 0, sizeof(buf));
 
 	if (!matched && files) {
-		int userlen = strlen(name);
-		passwd = fopen("/etc/passwd", "r");
-		if (passwd != NULL) {
-			while (fgets(buf, sizeof(buf), passwd) != NULL) {
-				if ((buf[userlen] == ':') &&
-				    (strncmp(name, buf, userlen) == 0)) {
-					p = buf + strlen(buf) - 1;
-					while (isspace(*p) && (p >= buf)) {
-						*p-- = '\0';
-					}
-					matched = 1;
-					break;
-				}
+		/* the line out of the index of /etc/passwd in libpam */
+		if (pam_modutil_search_passwd(pamh, name, NULL, buf,
+					      sizeof(buf)) == PAM_SUCCESS) {
+			p = buf + strlen(buf) - 1;
+			while ((p >= buf) && isspace(*p)) {
+				*p-- = '\0';
 			}
-			fclose(passwd);
+			matched = 1;
 		}
 	}
 
@@ -463,85 +456,356 @@ int _unix_comesfromsource(pam_handle_t *pamh,
  * verify the password of a user
  */
 
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
-static int _unix_run_helper_binary(pam_handle_t *pamh, const char *passwd,
-				   unsigned long long ctrl, const char *user)
+/*
+ * With the chkpwd_worker option the helper is started once in a
+ * process, as "unix_chkpwd serve" on one end of a socketpair, and the
+ * passwords are sent to it one after the other.  It checks them with
+ * the real uid the process had when it was started, so a process that
+ * has changed its ids, or a child of a fork, starts a worker of its
+ * own.
+ */
+static struct {
+    pthread_mutex_t lock;
+    int fd;                 /* our end of the socketpair, -1 if none */
+    pid_t pid;              /* 0 once it has been waited for */
+    pid_t owner;            /* the process that started it */
+    uid_t uid, euid;        /* the ids that process had then */
+} chkpwd_worker = { PTHREAD_MUTEX_INITIALIZER, -1, 0, 0, 0, 0 };
+
+static void _unix_stop_worker(void)
 {
-    int retval, child, fds[2];
-    struct sigaction newsa, oldsa;
+    close(chkpwd_worker.fd);
+    chkpwd_worker.fd = -1;
 
-    D(("called."));
-    /* create a pipe for the password */
-    if (pipe(fds) != 0) {
-	D(("could not make pipe"));
-	return PAM_AUTH_ERR;
+    /* it exits when the socket is closed; only its parent can wait */
+    if (chkpwd_worker.pid > 0 && chkpwd_worker.owner == getpid()) {
+	while (waitpid(chkpwd_worker.pid, NULL, 0) < 0 && errno == EINTR)
+	    ;
+    }
+    chkpwd_worker.pid = 0;
+}
+
+/*
+ * Whether the worker has exited, or the application has already reaped
+ * it with a SIGCHLD handler or waitpid(-1, ...) of its own.
+ */
+static int _unix_worker_gone(void)
+{
+    pid_t pid;
+
+    while ((pid = waitpid(chkpwd_worker.pid, NULL, WNOHANG)) < 0
+	   && errno == EINTR)
+	;
+    if (pid == chkpwd_worker.pid || (pid < 0 && errno == ECHILD)) {
+	chkpwd_worker.pid = 0;
+	return 1;
+    }
+    return 0;
+}
+
+static int _unix_start_worker(pam_handle_t *pamh)
+{
+    static char *envp[] = { NULL };
+    const char *args[] = { CHKPWD_HELPER, "serve", NULL };
+    struct pam_modutil_spawn_attr attr;
+    Dl_info info;
+    int fds[2];
+    pid_t child;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+	pam_syslog(pamh, LOG_ERR, "cannot create socket for helper: %m");
+	return -1;
+    }
+
+    /* stdin is the socket, see _unix_run_helper_binary() for the rest */
+    memset(&attr, 0, sizeof(attr));
+    attr.stdfd[0] = fds[1];
+    attr.stdfd[1] = attr.stdfd[2] = -1;
+    attr.redirect[1] = attr.redirect[2] = PAM_MODUTIL_PIPE_FD;
+    if (geteuid() == 0)
+	attr.flags = PAM_MODUTIL_SPAWN_EUID;
+
+    PAM_PROBE1(pam_unix, helper__fork, CHKPWD_HELPER);
+    DIAG_PUSH_IGNORE_CAST_QUAL;
+    child = pam_modutil_spawn_helper(pamh, CHKPWD_HELPER,
+				     (char *const *) args, envp, &attr);
+    DIAG_POP_IGNORE_CAST_QUAL;
+
+    close(fds[1]);
+    if (child < 0) {
+	close(fds[0]);
+	return -1;
+    }
+    PAM_PROBE1(pam_unix, helper__exec, CHKPWD_HELPER);
+
+    chkpwd_worker.fd = fds[0];
+    chkpwd_worker.pid = child;
+    chkpwd_worker.owner = getpid();
+    chkpwd_worker.uid = getuid();
+    chkpwd_worker.euid = geteuid();
+
+    /* the worker outlives the handle, so the module has to stay loaded */
+    if (dladdr(&chkpwd_worker, &info) != 0 && info.dli_fname != NULL)
+	(void) dlopen(info.dli_fname, RTLD_NOW | RTLD_NOLOAD | RTLD_NODELETE);
+
+    return 0;
+}
+
+/*
+ * Send one request to the worker, -1 if it could not be asked.  errno
+ * is EPIPE if the worker went away.
+ */
+static int _unix_worker_request(const char *passwd, unsigned int flags,
+				const char *user, struct chkpwd_reply *reply)
+{
+    char buf[sizeof(struct chkpwd_request) + CHKPWD_USER_MAX
+	     + PAM_MAX_RESP_SIZE];
+    struct chkpwd_request req;
+    size_t len, done;
+    ssize_t n;
+
+    req.user_len = strlen(user);
+    req.pass_len = passwd != NULL ? strlen(passwd) : 0;
+    if (req.pass_len > PAM_MAX_RESP_SIZE)
+	req.pass_len = PAM_MAX_RESP_SIZE;
+    req.flags = flags;
+
+    memcpy(buf, &req, sizeof(req));
+    len = sizeof(req);
+    memcpy(buf + len, user, req.user_len);
+    len += req.user_len;
+    if (req.pass_len > 0)
+	memcpy(buf + len, passwd, req.pass_len);
+    len += req.pass_len;
+
+    for (done = 0; done < len; done += n) {
+	if ((n = send(chkpwd_worker.fd, buf + done, len - done,
+		      MSG_NOSIGNAL)) < 0) {
+	    if (errno == EINTR) {
+		n = 0;
+		continue;
+	    }
+	    break;
+	}
+    }
+    if (done < len) {
+	if (errno == ECONNRESET)
+	    errno = EPIPE;
+	_pam_overwrite_n(buf, sizeof(buf));
+	return -1;
+    }
+    _pam_overwrite_n(buf, sizeof(buf));
+
+    for (done = 0; done < sizeof(*reply); done += n) {
+	if ((n = read(chkpwd_worker.fd, (char *) reply + done,
+		      sizeof(*reply) - done)) <= 0) {
+	    if (n < 0 && errno == EINTR) {
+		n = 0;
+		continue;
+	    }
+	    if (n == 0 || errno == ECONNRESET)
+		errno = EPIPE;
+	    return -1;
+	}
     }
 
+    return 0;
+}
+
+/* Ask the worker, -1 if the helper has to be run instead */
+static int _unix_run_helper_worker(pam_handle_t *pamh, const char *passwd,
+				   unsigned long long ctrl, const char *user,
+				   unsigned int flags,
+				   struct chkpwd_reply *reply)
+{
+    struct sigaction newsa, oldsa;
+    size_t len = strlen(user);
+    int retval = -1, tries, err;
+
+    if (len == 0 || len > CHKPWD_USER_MAX)
+	return -1;
+
     if (off(UNIX_NOREAP, ctrl)) {
-	/*
-	 * This code arranges that the demise of the child does not cause
-	 * the application to receive a signal it is not expecting - which
-	 * may kill the application or worse.
-	 *
-	 * The "noreap" module argument is provided so that the admin can
-	 * override this behavior.
-	 */
-        memset(&newsa, '\0', sizeof(newsa));
+	/* see _unix_run_helper_binary() */
+	memset(&newsa, '\0', sizeof(newsa));
 	newsa.sa_handler = SIG_DFL;
 	sigaction(SIGCHLD, &newsa, &oldsa);
     }
 
-    /* fork */
-    child = fork();
-    if (child == 0) {
-	static char *envp[] = { NULL };
-	const char *args[] = { NULL, NULL, NULL, NULL };
+    pthread_mutex_lock(&chkpwd_worker.lock);
+
+    if (chkpwd_worker.fd >= 0
+	&& (chkpwd_worker.owner != getpid()
+	    || chkpwd_worker.uid != getuid()
+	    || chkpwd_worker.euid != geteuid()))
+	_unix_stop_worker();
+
+    /*
+     * A worker that has gone away, also when the application reaped
+     * it, is started again once; any other failure is final.
+     */
+    for (tries = 0; tries < 2; tries++) {
+	if (chkpwd_worker.fd >= 0 && _unix_worker_gone())
+	    _unix_stop_worker();
+	if (chkpwd_worker.fd < 0 && _unix_start_worker(pamh) != 0)
+	    break;
+	if ((retval = _unix_worker_request(passwd, flags, user, reply)) == 0)
+	    break;
+	err = errno;
+	_unix_stop_worker();
+	if (err != EPIPE) {
+	    pam_syslog(pamh, LOG_ERR, "helper worker failed: %s",
+		       strerror(err));
+	    break;
+	}
+    }
 
-	/* XXX - should really tidy up PAM here too */
+    pthread_mutex_unlock(&chkpwd_worker.lock);
 
-	/* reopen stdin as pipe */
-	if (dup2(fds[0], STDIN_FILENO) != STDIN_FILENO) {
-		pam_syslog(pamh, LOG_ERR, "dup2 of %s failed: %m", "stdin");
-		_exit(PAM_AUTHINFO_UNAVAIL);
-	}
+    if (off(UNIX_NOREAP, ctrl)) {
+	sigaction(SIGCHLD, &oldsa, NULL);
+    }
 
-	if (pam_modutil_sanitize_helper_fds(pamh, PAM_MODUTIL_IGNORE_FD,
-					    PAM_MODUTIL_PIPE_FD,
-					    PAM_MODUTIL_PIPE_FD) < 0) {
-		_exit(PAM_AUTHINFO_UNAVAIL);
-	}
+    D(("worker returned %d", retval));
+    return retval;
+}
 
-	if (geteuid() == 0) {
-          /* must set the real uid to 0 so the helper will not error
-	     out if pam is called from setuid binary (su, sudo...) */
-	  if (setuid(0) == -1) {
-             D(("setuid failed"));
-	     _exit(PAM_AUTHINFO_UNAVAIL);
-          }
-	}
+/*
+ * Every run of the helper also reports the expiry of the account and
+ * whether the user has a password, which is kept in the handle for
+ * pam_sm_acct_mgmt() and the next runs, see _unix_helper_expiry() and
+ * _unix_blankpasswd().
+ */
 
-	/* exec binary helper */
-	args[0] = CHKPWD_HELPER;
-	args[1] = user;
-	if (off(UNIX__NONULL, ctrl)) {	/* this means we've succeeded */
-	  args[2]="nullok";
-	} else {
-	  args[2]="nonull";
-	}
+#define HELPER_STATUS "-UN*X-HELPER-STATUS"
 
-	DIAG_PUSH_IGNORE_CAST_QUAL;
-	execve(CHKPWD_HELPER, (char *const *) args, envp);
-	DIAG_POP_IGNORE_CAST_QUAL;
+/* what the last run of unix_chkpwd told about a user */
+struct _unix_helper_status {
+    int blank;			/* the user has no password */
+    int expiry;			/* result of the expiry check */
+    int daysleft;
+    char user[];
+};
 
-	/* should not get here: exit with error */
-	D(("helper binary is not available"));
-	_exit(PAM_AUTHINFO_UNAVAIL);
-    } else if (child > 0) {
+static void _unix_keep_helper_status(pam_handle_t *pamh, const char *user,
+				     const struct chkpwd_reply *reply)
+{
+    struct _unix_helper_status *status;
+    size_t len = strlen(user);
+
+    if ((status = malloc(sizeof(*status) + len + 1)) == NULL)
+	return;
+    status->blank = reply->blank;
+    status->expiry = reply->expiry;
+    status->daysleft = reply->daysleft;
+    memcpy(status->user, user, len + 1);
+
+    if (pam_set_data(pamh, HELPER_STATUS, status,
+		     _unix_cleanup) != PAM_SUCCESS)
+	free(status);
+}
+
+static const struct _unix_helper_status *
+_unix_helper_status(pam_handle_t *pamh, const char *user)
+{
+    const void *data;
+    const struct _unix_helper_status *status;
+
+    if (pam_get_data(pamh, HELPER_STATUS, &data) != PAM_SUCCESS
+	|| data == NULL)
+	return NULL;
+    status = data;
+
+    return strcmp(status->user, user) == 0 ? status : NULL;
+}
+
+void _unix_forget_helper_status(pam_handle_t *pamh)
+{
+    (void) pam_set_data(pamh, HELPER_STATUS, NULL, NULL);
+}
+
+int _unix_helper_expiry(pam_handle_t *pamh, unsigned long long ctrl,
+			const char *user, int *daysleft)
+{
+    const struct _unix_helper_status *status;
+    struct chkpwd_reply reply;
+
+    if ((status = _unix_helper_status(pamh, user)) == NULL
+	&& on(UNIX_CHKPWD_WORKER, ctrl)
+	&& _unix_run_helper_worker(pamh, NULL, ctrl, user, CHKPWD_EXPIRY,
+				   &reply) == 0) {
+	_unix_keep_helper_status(pamh, user, &reply);
+	status = _unix_helper_status(pamh, user);
+    }
+    if (status == NULL)
+	return -1;
+
+    *daysleft = status->daysleft;
+    return status->expiry;
+}
+
+/*
+ * Run "unix_chkpwd <user> <option>" once.  *reported is set if it
+ * printed the status of the account into *reply.
+ */
+static int _unix_spawn_chkpwd(pam_handle_t *pamh, const char *passwd,
+			      const char *user, const char *option,
+			      struct chkpwd_reply *reply, int *reported)
+{
+    static char *envp[] = { NULL };
+    const char *args[] = { NULL, NULL, NULL, NULL };
+    struct pam_modutil_spawn_attr attr;
+    int retval, child, fds[2], out[2];
+
+    *reported = 0;
+
+    /* create a pipe for the password, and one for the account status */
+    if (pipe(fds) != 0) {
+	D(("could not make pipe"));
+	return PAM_AUTH_ERR;
+    }
+    if (pipe(out) != 0) {
+	D(("could not make pipe"));
+	close(fds[0]);
+	close(fds[1]);
+	return PAM_AUTH_ERR;
+    }
+
+    /* the pipes become stdin and stdout of the helper */
+    memset(&attr, 0, sizeof(attr));
+    attr.stdfd[0] = fds[0];
+    attr.stdfd[1] = out[1];
+    attr.stdfd[2] = -1;
+    attr.redirect[2] = PAM_MODUTIL_PIPE_FD;
+    if (geteuid() == 0) {
+	/* must set the real uid to 0 so the helper will not error
+	   out if pam is called from setuid binary (su, sudo...) */
+	attr.flags = PAM_MODUTIL_SPAWN_EUID;
+    }
+
+    args[0] = CHKPWD_HELPER;
+    args[1] = user;
+    args[2] = option;
+
+    PAM_PROBE1(pam_unix, helper__fork, CHKPWD_HELPER);
+    DIAG_PUSH_IGNORE_CAST_QUAL;
+    child = pam_modutil_spawn_helper(pamh, CHKPWD_HELPER,
+				     (char *const *) args, envp, &attr);
+    DIAG_POP_IGNORE_CAST_QUAL;
+    if (child > 0) {
 	/* wait for child */
 	/* if the stored password is NULL */
-        int rc=0;
+        int rc=0, n;
+	char buf[64];
+
+	PAM_PROBE1(pam_unix, helper__exec, CHKPWD_HELPER);
+
 	if (passwd != NULL) {            /* send the password to the child */
 	    int len = strlen(passwd);
 
@@ -561,8 +825,13 @@ static int _unix_run_helper_binary(pam_handle_t *pamh, const char *passwd,
 	}
 	close(fds[0]);       /* close here to avoid possible SIGPIPE above */
 	close(fds[1]);
+	close(out[1]);
+	/* the status of the account comes before the exit */
+	n = pam_modutil_read(out[0], buf, sizeof(buf) - 1);
+	close(out[0]);
 	/* wait for helper to complete: */
 	while ((rc=waitpid(child, &retval, 0)) < 0 && errno == EINTR);
+	PAM_PROBE3(pam_unix, helper__wait, CHKPWD_HELPER, child, retval);
 	if (rc<0) {
 	  pam_syslog(pamh, LOG_ERR, "unix_chkpwd waitpid returned %d: %m", rc);
 	  retval = PAM_AUTH_ERR;
@@ -571,13 +840,74 @@ static int _unix_run_helper_binary(pam_handle_t *pamh, const char *passwd,
 	  retval = PAM_AUTH_ERR;
 	} else {
 	  retval = WEXITSTATUS(retval);
+	  if (n > 0) {
+	    buf[n] = '\0';
+	    *reported = sscanf(buf, "%d %d %d", &reply->blank,
+			       &reply->expiry, &reply->daysleft) == 3;
+	  }
 	}
     } else {
-	D(("fork failed"));
 	close(fds[0]);
 	close(fds[1]);
-	retval = PAM_AUTH_ERR;
+	close(out[0]);
+	close(out[1]);
+	if (child == -2) {
+	    D(("helper binary is not available"));
+	    retval = PAM_AUTHINFO_UNAVAIL;
+	} else {
+	    D(("could not start the helper"));
+	    retval = PAM_AUTH_ERR;
+	}
+    }
+
+    return retval;
+}
+
+static int _unix_run_helper_binary(pam_handle_t *pamh, const char *passwd,
+				   unsigned long long ctrl, const char *user)
+{
+    const char *option = off(UNIX__NONULL, ctrl) ? "nullok" : "nonull";
+    struct sigaction newsa, oldsa;
+    struct chkpwd_reply reply;
+    char combined[32];
+    int retval, reported;
+
+    D(("called."));
+
+    if (on(UNIX_CHKPWD_WORKER, ctrl)
+	&& _unix_run_helper_worker(pamh, passwd, ctrl, user,
+				   CHKPWD_VERIFY | CHKPWD_EXPIRY
+				   | (off(UNIX__NONULL, ctrl) ? CHKPWD_NULLOK : 0),
+				   &reply) == 0) {
+	_unix_keep_helper_status(pamh, user, &reply);
+	return reply.retval;
+    }
+
+    if (off(UNIX_NOREAP, ctrl)) {
+	/*
+	 * This code arranges that the demise of the child does not cause
+	 * the application to receive a signal it is not expecting - which
+	 * may kill the application or worse.
+	 *
+	 * The "noreap" module argument is provided so that the admin can
+	 * override this behavior.
+	 */
+        memset(&newsa, '\0', sizeof(newsa));
+	newsa.sa_handler = SIG_DFL;
+	sigaction(SIGCHLD, &newsa, &oldsa);
+    }
+
+    snprintf(combined, sizeof(combined), "%s,chkexpiry", option);
+    retval = _unix_spawn_chkpwd(pamh, passwd, user, combined, &reply,
+				&reported);
+    /* a helper older than the combined option fails without a word */
+    if (retval == PAM_SYSTEM_ERR && !reported) {
+	D(("unix_chkpwd does not know %s", combined));
+	retval = _unix_spawn_chkpwd(pamh, passwd, user, option, &reply,
+				    &reported);
     }
+    if (reported)
+	_unix_keep_helper_status(pamh, user, &reply);
 
     if (off(UNIX_NOREAP, ctrl)) {
         sigaction(SIGCHLD, &oldsa, NULL);   /* restore old signal handler */
@@ -597,6 +927,7 @@ static int _unix_run_helper_binary(pam_handle_t *pamh, const char *passwd,
 int
 _unix_blankpasswd (pam_handle_t *pamh, unsigned long long ctrl, const char *name)
 {
+	const struct _unix_helper_status *status;
 	struct passwd *pwd = NULL;
 	char *salt = NULL;
 	int daysleft;
@@ -641,6 +972,8 @@ _unix_blankpasswd (pam_handle_t *pamh, unsigned long long ctrl, const char *name
 				get_pwd_hash(pamh, "pam_unix_non_existent:", &pwd, &salt);
 			}
 			/* salt will not be set here so we can return immediately */
+			if ((status = _unix_helper_status(pamh, name)) != NULL)
+				return status->blank;
 			if (_unix_run_helper_binary(pamh, NULL, ctrl, name) == PAM_SUCCESS)
 				return 1;
 			else
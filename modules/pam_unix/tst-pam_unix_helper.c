@@ -0,0 +1,438 @@
+/*
+ * Check how pam_unix runs unix_chkpwd: "unix_chkpwd serve" only
+ * answers the process that started it, and with the chkpwd_worker
+ * option a child of a fork starts a worker of its own, as does a
+ * process whose worker the application has reaped.  "nullok,chkexpiry"
+ * tells in one run what "nullok" and "chkexpiry" tell, pam_unix asks a
+ * helper without it again with "nullok", and pam_acct_mgmt() uses the
+ * expiry told during pam_authenticate() until pam_chauthtok().  A
+ * helper that is not there is told from one that cannot be started.
+ *
+ * The module is a copy of pam_unix that runs the helper in the
+ * directory of the test, see Makefile.am.  pam_unix only runs the
+ * helper when it is not root, so as root the checks run as nobody.
+ */
+
+#include "config.h"
+
+#include <dirent.h>
+#include <grp.h>
+#include <pwd.h>
+#include <shadow.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <security/pam_appl.h>
+
+#include "test_assert.h"
+#include "tst-confdir.h"
+#include "passverify.h"
+
+#define TEST_NAME "tst-pam_unix_helper"
+#define MODULE ".libs/tst-pam_unix_module.so"
+#define CHKPWD "unix_chkpwd"
+
+static const char confdir[] = TEST_NAME ".d";
+static const char service[] = "service";
+
+/* Answer every prompt for a password, the new one is another */
+static int
+tst_conv (int num_msg, const struct pam_message **msg,
+	  struct pam_response **resp, void *appdata_ptr UNUSED)
+{
+  int i;
+
+  ASSERT_NE (NULL, *resp = calloc (num_msg, sizeof (**resp)));
+  for (i = 0; i < num_msg; i++)
+    if (msg[i]->msg_style == PAM_PROMPT_ECHO_OFF)
+      ASSERT_NE (NULL, (*resp)[i].resp =
+		 strdup (strstr (msg[i]->msg, "ew ") ? "n3w-secret" : "secret"));
+  return PAM_SUCCESS;
+}
+
+/*
+ * Only root may lock the password files, these let pam_chauthtok() go
+ * on to writing them, which fails all the same.  The module finds
+ * them, see Makefile.am.
+ */
+int
+lckpwdf (void)
+{
+  return 0;
+}
+
+int
+ulckpwdf (void)
+{
+  return 0;
+}
+
+static struct pam_conv conv = { tst_conv, NULL };
+
+/* The unix_chkpwd child of parent, 0 if it has none */
+static pid_t
+worker_of (pid_t parent)
+{
+  char path[300], comm[32];
+  struct dirent *d;
+  pid_t pid = 0;
+  int ppid;
+  FILE *fp;
+  DIR *dp;
+
+  ASSERT_NE (NULL, dp = opendir ("/proc"));
+  while (pid == 0 && (d = readdir (dp)) != NULL)
+    {
+      if (d->d_name[0] < '0' || d->d_name[0] > '9')
+	continue;
+      snprintf (path, sizeof (path), "/proc/%s/stat", d->d_name);
+      if ((fp = fopen (path, "r")) == NULL)
+	continue;
+      if (fscanf (fp, "%*d (%31[^)]) %*c %d", comm, &ppid) == 2
+	  && ppid == parent && strcmp (comm, CHKPWD) == 0)
+	pid = atoi (d->d_name);
+      fclose (fp);
+    }
+  closedir (dp);
+  return pid;
+}
+
+/* Ask "unix_chkpwd serve" on fd about user, -1 if it did not answer */
+static int
+ask (int fd, const char *user, struct chkpwd_reply *reply)
+{
+  struct chkpwd_request req;
+  char buf[sizeof (req) + CHKPWD_USER_MAX];
+
+  req.user_len = strlen (user);
+  req.pass_len = 0;
+  req.flags = CHKPWD_EXPIRY;
+  memcpy (buf, &req, sizeof (req));
+  memcpy (buf + sizeof (req), user, req.user_len);
+  if (send (fd, buf, sizeof (req) + req.user_len, MSG_NOSIGNAL) < 0)
+    return -1;
+  return read (fd, reply, sizeof (*reply)) == sizeof (*reply) ? 0 : -1;
+}
+
+/*
+ * Run "unix_chkpwd serve" on the end fds[1] of a socketpair, in a
+ * grandchild if not_parent.  fds[1] is closed here.
+ */
+static pid_t
+serve (int fds[2], int not_parent)
+{
+  pid_t pid;
+  int status;
+
+  ASSERT_LE (0, pid = fork ());
+  if (pid != 0)
+    {
+      ASSERT_EQ (0, close (fds[1]));
+      return pid;
+    }
+  if (not_parent)
+    {
+      ASSERT_LE (0, pid = fork ());
+      if (pid != 0)
+	{
+	  close (fds[0]);
+	  close (fds[1]);
+	  ASSERT_EQ (pid, waitpid (pid, &status, 0));
+	  _exit (WIFEXITED (status) ? WEXITSTATUS (status) : 127);
+	}
+    }
+  ASSERT_EQ (0, dup2 (fds[1], STDIN_FILENO));
+  execl (CHKPWD, CHKPWD, "serve", (char *) NULL);
+  _exit (127);
+}
+
+/*
+ * Run "unix_chkpwd user option" with an empty password, returns its
+ * exit status, what it printed is in out.
+ */
+static int
+chkpwd (const char *user, const char *option, char *out, size_t size)
+{
+  int in[2], fds[2], status;
+  ssize_t n;
+  pid_t pid;
+
+  ASSERT_EQ (0, pipe (in));
+  ASSERT_EQ (0, pipe (fds));
+  ASSERT_LE (0, pid = fork ());
+  if (pid == 0)
+    {
+      ASSERT_EQ (STDIN_FILENO, dup2 (in[0], STDIN_FILENO));
+      ASSERT_EQ (STDOUT_FILENO, dup2 (fds[1], STDOUT_FILENO));
+      close (in[0]);
+      close (in[1]);
+      close (fds[0]);
+      close (fds[1]);
+      execl (CHKPWD, CHKPWD, user, option, (char *) NULL);
+      _exit (127);
+    }
+  ASSERT_EQ (0, close (in[0]));
+  ASSERT_EQ (0, close (fds[1]));
+  ASSERT_EQ (1, write (in[1], "", 1));
+  ASSERT_EQ (0, close (in[1]));
+  ASSERT_LE (0, n = read (fds[0], out, size - 1));
+  out[n] = '\0';
+  ASSERT_EQ (0, close (fds[0]));
+  ASSERT_EQ (pid, waitpid (pid, &status, 0));
+  ASSERT_NE (0, WIFEXITED (status));
+  return WEXITSTATUS (status);
+}
+
+/*
+ * Put a shell script in place of the helper, which notes its option in
+ * the file calls and then runs the case patterns and commands cases.
+ */
+static void
+fake_chkpwd (const char *dir, const char *cases)
+{
+  unlink (TEST_NAME ".d/" CHKPWD);
+  unlink (TEST_NAME ".d/calls");
+  ASSERT_EQ (0, tst_confdir_write (confdir, CHKPWD,
+				   "#!/bin/sh\n"
+				   "echo \"$2\" >> %s/calls\n"
+				   "case \"$2\" in\n%s\nesac\n"
+				   "exit 0\n", dir, cases));
+  ASSERT_EQ (0, chmod (TEST_NAME ".d/" CHKPWD, 0755));
+}
+
+/* Check the options the helper was run with since the last check */
+static void
+check_calls (const char *expected)
+{
+  char buf[256];
+  size_t n = 0;
+  FILE *fp;
+
+  if ((fp = fopen (TEST_NAME ".d/calls", "r")) != NULL)
+    {
+      n = fread (buf, 1, sizeof (buf) - 1, fp);
+      fclose (fp);
+    }
+  buf[n] = '\0';
+  if (strcmp (buf, expected) != 0)
+    {
+      fprintf (stderr, "helper calls:\n%sexpected:\n%s", buf, expected);
+      abort ();
+    }
+  unlink (TEST_NAME ".d/calls");
+}
+
+/* The result of pam_authenticate() for user in a new handle */
+static int
+authenticate (const char *user)
+{
+  pam_handle_t *pamh = NULL;
+  int retval;
+
+  ASSERT_EQ (PAM_SUCCESS,
+	     pam_start_confdir (service, user, &conv, confdir, &pamh));
+  retval = pam_authenticate (pamh, 0);
+  ASSERT_EQ (PAM_SUCCESS, pam_end (pamh, retval));
+  return retval;
+}
+
+/* The result of pam_acct_mgmt() for user in a new handle */
+static int
+acct_mgmt (const char *user)
+{
+  pam_handle_t *pamh = NULL;
+  int retval;
+
+  ASSERT_EQ (PAM_SUCCESS,
+	     pam_start_confdir (service, user, &conv, confdir, &pamh));
+  retval = pam_acct_mgmt (pamh, 0);
+  ASSERT_EQ (PAM_SUCCESS, pam_end (pamh, retval));
+  return retval;
+}
+
+static int
+run (void)
+{
+  static const char *const options[] = { "nullok", "nonull" };
+  char out[64], option[32], cases[128];
+  struct chkpwd_reply reply;
+  pam_handle_t *pamh = NULL;
+  struct passwd *pw;
+  pid_t pid, worker;
+  int fds[2], status, retval, expiry, daysleft, i, n;
+  struct rlimit rlim;
+  rlim_t cur;
+  char *user, *path;
+
+  if (getuid () == 0)
+    {
+      if ((pw = getpwnam ("nobody")) == NULL)
+	return 77;
+      ASSERT_EQ (0, chown (confdir, pw->pw_uid, pw->pw_gid));
+      ASSERT_EQ (0, setgroups (0, NULL));
+      ASSERT_EQ (0, setgid (pw->pw_gid));
+      ASSERT_EQ (0, setuid (pw->pw_uid));
+    }
+  /* the helper is only run for a user in the shadow file */
+  if ((pw = getpwuid (getuid ())) == NULL || strcmp (pw->pw_passwd, "x") != 0
+      || access (MODULE, R_OK) != 0 || access (CHKPWD, X_OK) != 0)
+    return 77;
+  ASSERT_NE (NULL, user = strdup (pw->pw_name));
+
+  /* 1: serve answers the process holding the other end of the socket */
+  ASSERT_EQ (0, socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds));
+  pid = serve (fds, 0);
+  ASSERT_EQ (0, ask (fds[0], user, &reply));
+  ASSERT_EQ (PAM_SUCCESS, reply.retval);
+  ASSERT_EQ (0, close (fds[0]));
+  ASSERT_EQ (pid, waitpid (pid, &status, 0));
+  ASSERT_EQ (PAM_SUCCESS, WEXITSTATUS (status));
+
+  /* 2: but not when that process is not its parent */
+  ASSERT_EQ (0, socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds));
+  pid = serve (fds, 1);
+  ASSERT_NE (0, ask (fds[0], user, &reply));
+  ASSERT_EQ (0, close (fds[0]));
+  ASSERT_EQ (pid, waitpid (pid, &status, 0));
+  ASSERT_EQ (PAM_SYSTEM_ERR, WEXITSTATUS (status));
+
+  /* 3: the worker stays for the next handles */
+  ASSERT_NE (NULL, path = realpath (MODULE, NULL));
+  ASSERT_EQ (0, tst_confdir_write (confdir, service,
+				   "auth required %s chkpwd_worker nodelay\n",
+				   path));
+  free (path);
+  ASSERT_NE (NULL, path = realpath (CHKPWD, NULL));
+  ASSERT_EQ (0, symlink (path, TEST_NAME ".d/" CHKPWD));
+  free (path);
+  ASSERT_EQ (0, worker_of (getpid ()));
+  retval = authenticate (user);
+  ASSERT_NE (0, worker = worker_of (getpid ()));
+  ASSERT_EQ (retval, authenticate (user));
+  ASSERT_EQ (worker, worker_of (getpid ()));
+
+  /* 4: a child of a fork starts its own, and leaves ours alone */
+  ASSERT_LE (0, pid = fork ());
+  if (pid == 0)
+    {
+      ASSERT_EQ (retval, authenticate (user));
+      ASSERT_NE (0, worker_of (getpid ()));
+      ASSERT_NE (worker, worker_of (getpid ()));
+      _exit (0);
+    }
+  ASSERT_EQ (pid, waitpid (pid, &status, 0));
+  ASSERT_EQ (0, status);
+  ASSERT_EQ (retval, authenticate (user));
+  ASSERT_EQ (worker, worker_of (getpid ()));
+
+  /* 5: one the application reaped is started again */
+  ASSERT_EQ (0, kill (worker, SIGKILL));
+  ASSERT_EQ (worker, waitpid (-1, &status, 0));
+  ASSERT_EQ (retval, authenticate (user));
+  ASSERT_NE (0, pid = worker_of (getpid ()));
+  ASSERT_NE (worker, pid);
+
+  /* 6: "nullok,chkexpiry" tells what "nullok" and "chkexpiry" tell */
+  expiry = chkpwd (user, "chkexpiry", out, sizeof (out));
+  ASSERT_EQ (1, sscanf (out, "%d", &daysleft));
+  for (i = 0; i < 2; i++)
+    {
+      retval = chkpwd (user, options[i], out, sizeof (out));
+      ASSERT_EQ ('\0', out[0]);
+      snprintf (option, sizeof (option), "%s,chkexpiry", options[i]);
+      ASSERT_EQ (retval, chkpwd (user, option, out, sizeof (out)));
+      ASSERT_EQ (3, sscanf (out, "%d %d %d%n", &reply.blank, &reply.expiry,
+			    &reply.daysleft, &n));
+      ASSERT_EQ (0, strcmp (out + n, "\n"));
+      ASSERT_EQ (expiry, reply.expiry);
+      ASSERT_EQ (daysleft, reply.daysleft);
+      ASSERT_EQ (0, reply.blank & ~1);
+    }
+  ASSERT_EQ (PAM_SYSTEM_ERR, chkpwd (user, "nullok,other", out, sizeof (out)));
+  ASSERT_EQ ('\0', out[0]);
+
+  /* 7: a helper without it is asked again with the plain option */
+  ASSERT_NE (NULL, path = realpath (MODULE, NULL));
+  ASSERT_EQ (0, tst_confdir_write (confdir, service,
+				   "auth required %s nodelay\n"
+				   "account required %s\n"
+				   "password required %s nodelay\n",
+				   path, path, path));
+  free (path);
+  ASSERT_NE (NULL, path = realpath (confdir, NULL));
+  snprintf (cases, sizeof (cases), "*,chkexpiry) exit %d ;;", PAM_SYSTEM_ERR);
+  fake_chkpwd (path, cases);
+  ASSERT_EQ (PAM_SUCCESS, authenticate (user));
+  check_calls ("nonull,chkexpiry\nnonull\n");
+
+  /* 8: the expiry it tells is used by pam_acct_mgmt() */
+  snprintf (cases, sizeof (cases),
+	    "*,chkexpiry) echo 0 %d 3 ;;\n"
+	    "chkexpiry) echo 3; exit %d ;;",
+	    PAM_NEW_AUTHTOK_REQD, PAM_NEW_AUTHTOK_REQD);
+  fake_chkpwd (path, cases);
+  ASSERT_EQ (PAM_SUCCESS,
+	     pam_start_confdir (service, user, &conv, confdir, &pamh));
+  ASSERT_EQ (PAM_SUCCESS, pam_authenticate (pamh, 0));
+  check_calls ("nonull,chkexpiry\n");
+  ASSERT_EQ (PAM_NEW_AUTHTOK_REQD, pam_acct_mgmt (pamh, 0));
+  check_calls ("");
+
+  /* 9: but not once the password has been changed */
+#if !defined (USE_LCKPWDF) || defined (HAVE_LCKPWDF)
+  ASSERT_EQ (PAM_AUTHTOK_ERR,
+	     pam_chauthtok (pamh, PAM_CHANGE_EXPIRED_AUTHTOK));
+  check_calls ("nullok,chkexpiry\nnullok,chkexpiry\n");
+  ASSERT_EQ (PAM_NEW_AUTHTOK_REQD, pam_acct_mgmt (pamh, 0));
+  check_calls ("chkexpiry\n");
+#endif
+  ASSERT_EQ (PAM_SUCCESS, pam_end (pamh, PAM_SUCCESS));
+
+  /*
+   * 10: a helper that is not there is unavailable, one that cannot be
+   * started for the limit of processes fails the check
+   */
+  ASSERT_EQ (0, unlink (TEST_NAME ".d/" CHKPWD));
+  ASSERT_EQ (PAM_AUTHINFO_UNAVAIL, authenticate (user));
+  ASSERT_EQ (PAM_AUTHINFO_UNAVAIL, acct_mgmt (user));
+  fake_chkpwd (path, "*,chkexpiry) echo 0 0 3 ;;\nchkexpiry) echo 3 ;;");
+  ASSERT_EQ (PAM_SUCCESS, authenticate (user));
+  ASSERT_EQ (PAM_SUCCESS, acct_mgmt (user));
+  ASSERT_EQ (0, getrlimit (RLIMIT_NPROC, &rlim));
+  cur = rlim.rlim_cur;
+  rlim.rlim_cur = 0;
+  ASSERT_EQ (0, setrlimit (RLIMIT_NPROC, &rlim));
+  ASSERT_EQ (PAM_AUTH_ERR, authenticate (user));
+  ASSERT_EQ (PAM_AUTH_ERR, acct_mgmt (user));
+  rlim.rlim_cur = cur;
+  ASSERT_EQ (0, setrlimit (RLIMIT_NPROC, &rlim));
+  free (path);
+
+  free (user);
+  return 0;
+}
+
+int
+main (void)
+{
+  pid_t pid;
+  int status;
+
+  ASSERT_EQ (0, tst_confdir_create (confdir));
+
+  /* the child may give up root, the directory is removed here */
+  ASSERT_LE (0, pid = fork ());
+  if (pid == 0)
+    _exit (run ());
+  ASSERT_EQ (pid, waitpid (pid, &status, 0));
+  if (!WIFEXITED (status))
+    return 1;
+
+  return WEXITSTATUS (status);
+}
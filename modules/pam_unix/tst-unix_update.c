@@ -0,0 +1,138 @@
+/*
+ * Check the passwd and shadow files unix_update_passwd() and
+ * unix_update_shadow() write: only the lines of the user change, even
+ * next to a user whose name starts with the same letters, or with the
+ * name in another field or a comment, every line of the user changes,
+ * a short shadow line gets its missing fields, a last line without a
+ * newline gets one, and a user without a shadow line gets one appended.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pwd.h>
+#include <shadow.h>
+#include <sys/stat.h>
+
+#include "test_assert.h"
+#include "passverify.h"
+
+static char towhat[] = "$6$new";
+
+static void
+write_file (const char *path, const char *content)
+{
+  FILE *fp;
+
+  ASSERT_NE (NULL, fp = fopen (path, "w"));
+  ASSERT_EQ (strlen (content), fwrite (content, 1, strlen (content), fp));
+  ASSERT_EQ (0, fclose (fp));
+}
+
+static void
+check_file (const char *path, const char *expected)
+{
+  char buf[4096];
+  size_t n;
+  FILE *fp;
+
+  ASSERT_NE (NULL, fp = fopen (path, "r"));
+  n = fread (buf, 1, sizeof (buf) - 1, fp);
+  ASSERT_EQ (0, fclose (fp));
+  buf[n] = '\0';
+  if (strcmp (buf, expected) != 0)
+    {
+      fprintf (stderr, "%s:\n%s\nexpected:\n%s\n", path, buf, expected);
+      abort ();
+    }
+}
+
+/* The shadow line "name:hash:lastchg" followed by rest */
+static const char *
+shadow_line (char *buf, size_t size, const char *name, const char *rest)
+{
+  snprintf (buf, size, "%s:%s:%ld%s", name, towhat,
+	    (long) (time (NULL) / (60 * 60 * 24)), rest);
+  return buf;
+}
+
+int
+main (void)
+{
+  struct stat st;
+  char expected[4096], line[2][256];
+
+  /* 1: passwd, the entries of bob only */
+  write_file (PASSWD_FILE,
+	      "bobby:x:1001:1001:bob:/home/bobby:/bin/sh\n"
+	      "# bob:x:0:0:a comment:/:/bin/sh\n"
+	      "alice:x:1002:1002:bob:/home/bob:/bin/sh\n"
+	      "bob:x:1000:1000::/home/bob:/bin/sh\n"
+	      "bob:x:1003:1003:twice:/:/bin/sh\n"
+	      "carol:x:1004:1004::/:/bin/sh");
+  ASSERT_EQ (PAM_SUCCESS, unix_update_passwd ("bob", towhat));
+  check_file (PASSWD_FILE,
+	      "bobby:x:1001:1001:bob:/home/bobby:/bin/sh\n"
+	      "# bob:x:0:0:a comment:/:/bin/sh\n"
+	      "alice:x:1002:1002:bob:/home/bob:/bin/sh\n"
+	      "bob:$6$new:1000:1000::/home/bob:/bin/sh\n"
+	      "bob:$6$new:1003:1003:twice:/:/bin/sh\n"
+	      "carol:x:1004:1004::/:/bin/sh\n");
+  ASSERT_NE (0, stat (PW_TMPFILE, &st));
+
+  /* 2: the last line without a newline */
+  write_file (PASSWD_FILE, "root:x:0:0::/:/bin/sh\nbob:x:1000:1000::/:");
+  ASSERT_EQ (PAM_SUCCESS, unix_update_passwd ("bob", towhat));
+  check_file (PASSWD_FILE,
+	      "root:x:0:0::/:/bin/sh\nbob:$6$new:1000:1000::/:\n");
+
+  /* 3: a user without an entry leaves passwd alone */
+  write_file (PASSWD_FILE, "bobby:x:1001:1001:bob:/:/bin/sh\n");
+  ASSERT_EQ (PAM_AUTHTOK_ERR, unix_update_passwd ("bob", towhat));
+  check_file (PASSWD_FILE, "bobby:x:1001:1001:bob:/:/bin/sh\n");
+  ASSERT_NE (0, stat (PW_TMPFILE, &st));
+
+  /* 4: shadow, a short line and a second line of bob */
+  write_file (SHADOW_FILE,
+	      "bobby:$1$x:19000:0:99999:7:::\n"
+	      "bob:old\n"
+	      "bob:$1$y:19000:0:99999:7:::\n"
+	      "carol:$1$z:19000:0:99999:7:::");
+  ASSERT_EQ (PAM_SUCCESS, unix_update_shadow ("bob", towhat));
+  snprintf (expected, sizeof (expected),
+	    "bobby:$1$x:19000:0:99999:7:::\n%s\n%s\n"
+	    "carol:$1$z:19000:0:99999:7:::\n",
+	    shadow_line (line[0], sizeof (line[0]), "bob", "::::::"),
+	    shadow_line (line[1], sizeof (line[1]), "bob", ":0:99999:7:::"));
+  check_file (SHADOW_FILE, expected);
+  ASSERT_NE (0, stat (SH_TMPFILE, &st));
+
+  /* 5: a user without a shadow line gets one at the end */
+  write_file (SHADOW_FILE, "bobby:$1$x:19000:0:99999:7:::");
+  ASSERT_EQ (PAM_SUCCESS, unix_update_shadow ("bob", towhat));
+  snprintf (expected, sizeof (expected),
+	    "bobby:$1$x:19000:0:99999:7:::\n%s\n",
+	    shadow_line (line[0], sizeof (line[0]), "bob", "::::::"));
+  check_file (SHADOW_FILE, expected);
+
+  /* 6: also in an empty shadow */
+  write_file (SHADOW_FILE, "");
+  ASSERT_EQ (PAM_SUCCESS, unix_update_shadow ("bob", towhat));
+  snprintf (expected, sizeof (expected), "%s\n",
+	    shadow_line (line[0], sizeof (line[0]), "bob", "::::::"));
+  check_file (SHADOW_FILE, expected);
+
+  /* 7: but a missing shadow is not created */
+  ASSERT_EQ (0, unlink (SHADOW_FILE));
+  ASSERT_EQ (PAM_AUTHTOK_ERR, unix_update_shadow ("bob", towhat));
+  ASSERT_NE (0, stat (SHADOW_FILE, &st));
+  ASSERT_NE (0, stat (SH_TMPFILE, &st));
+
+  ASSERT_EQ (0, unlink (PASSWD_FILE));
+
+  return 0;
+}
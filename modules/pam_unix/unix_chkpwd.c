@@ -6,6 +6,9 @@
  *
  * The password is read from the standard input. The exit status of
  * this program indicates whether the user is authenticated or not.
+ * With "nullok,chkexpiry" or "nonull,chkexpiry" it also prints the
+ * expiry of the account.  Run as "unix_chkpwd serve" on a socket, it
+ * answers one request after the other instead, see _serve().
  *
  * Copyright information is located at the end of the file.
  *
@@ -19,7 +22,9 @@
 #include <syslog.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <pwd.h>
 #include <shadow.h>
 #include <signal.h>
@@ -59,6 +64,31 @@ static int _check_expiry(const char *uname)
 	return retval;
 }
 
+/*
+ * The result of the expiry check of the account of uname, the days left
+ * and whether the account has no password, reported together with the
+ * result of the password check
+ */
+static int _account_status(const char *uname, int *blank, int *daysleft)
+{
+	struct spwd *spent;
+	struct passwd *pwent;
+	int retval;
+
+	*blank = 0;
+	*daysleft = -1;
+
+	retval = get_account_info(uname, &pwent, &spent);
+	if (retval != PAM_SUCCESS)
+		return retval;
+
+	*blank = (spent != NULL ? spent->sp_pwdp : pwent->pw_passwd)[0] == '\0';
+	if (spent == NULL)
+		return PAM_SUCCESS;
+
+	return check_shadow_expiry(spent, daysleft);
+}
+
 #ifdef HAVE_LIBAUDIT
 static int _audit_log(int type, const char *uname, int rc)
 {
@@ -88,12 +118,182 @@ static int _audit_log(int type, const char *uname, int rc)
 }
 #endif
 
+/*
+ * Check the password of user and log the result, returns the exit
+ * status of the helper
+ */
+static int _check_password(const char *user, const char *pass, int nullok)
+{
+	int retval;
+
+	retval = helper_verify_password(user, pass, nullok);
+
+	/* return pass or fail */
+
+	if (retval != PAM_SUCCESS) {
+		if (!nullok || *pass != '\0') {
+			/* no need to log blank pass test */
+#ifdef HAVE_LIBAUDIT
+			if (getuid() != 0)
+				_audit_log(AUDIT_USER_AUTH, user, PAM_AUTH_ERR);
+#endif
+			helper_log_err(LOG_NOTICE, "password check failed for user (%s)", user);
+		}
+		/* if helper_verify_password() returned PAM_USER_UNKNOWN, the
+		   most appropriate error to propagate to
+		   _unix_verify_password() is PAM_AUTHINFO_UNAVAIL; otherwise
+		   return general failure */
+		if (retval == PAM_USER_UNKNOWN)
+			return PAM_AUTHINFO_UNAVAIL;
+		else
+			return PAM_AUTH_ERR;
+	} else {
+	        if (getuid() != 0) {
+#ifdef HAVE_LIBAUDIT
+			return _audit_log(AUDIT_USER_AUTH, user, PAM_SUCCESS);
+#else
+		        return PAM_SUCCESS;
+#endif
+	        }
+		return PAM_SUCCESS;
+	}
+}
+
+static int _read_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = read(fd, p, len)) <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Answer a request of _serve() with our privileges */
+static void _answer(const struct chkpwd_request *req, const char *user,
+		    const char *pass, struct chkpwd_reply *reply)
+{
+	int blank, daysleft;
+
+	memset(reply, 0, sizeof(*reply));
+	reply->daysleft = -1;
+
+	if (req->flags & CHKPWD_VERIFY)
+		reply->retval = _check_password(user, pass,
+						(req->flags & CHKPWD_NULLOK) != 0);
+	if (req->flags & CHKPWD_EXPIRY) {
+		reply->expiry = _account_status(user, &blank, &daysleft);
+		reply->blank = blank;
+		reply->daysleft = daysleft;
+	}
+}
+
+/*
+ * The requests for another user are answered with the privileges of the
+ * real user only, in a child so that the next requests keep ours.
+ */
+static void _answer_other(const struct chkpwd_request *req, const char *user,
+			  const char *pass, struct chkpwd_reply *reply)
+{
+	int fds[2], status;
+	pid_t pid;
+
+	memset(reply, 0, sizeof(*reply));
+	reply->retval = PAM_AUTH_ERR;
+	reply->expiry = PAM_AUTH_ERR;
+	reply->daysleft = -1;
+
+	if (pipe(fds) != 0)
+		return;
+	if ((pid = fork()) == 0) {
+		struct chkpwd_reply answer;
+
+		close(fds[0]);
+		if (setuid(getuid()) != 0)
+			_exit(PAM_AUTH_ERR);
+		_answer(req, user, pass, &answer);
+		_exit(write(fds[1], &answer, sizeof(answer)) == sizeof(answer)
+		      ? PAM_SUCCESS : PAM_AUTH_ERR);
+	}
+	close(fds[1]);
+	if (pid > 0) {
+		if (_read_all(fds[0], reply, sizeof(*reply)) != 0) {
+			reply->retval = PAM_AUTH_ERR;
+			reply->expiry = PAM_AUTH_ERR;
+			reply->daysleft = -1;
+		}
+		while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+			;
+	}
+	close(fds[0]);
+}
+
+/*
+ * "unix_chkpwd serve": answer the requests the process that started us
+ * sends over the socket on stdin, see struct chkpwd_request, until it
+ * closes the socket.  This saves the process creation of the helper
+ * for every password; the checks are the same.
+ */
+static int _serve(void)
+{
+	char user[CHKPWD_USER_MAX + 1], pass[PAM_MAX_RESP_SIZE + 1];
+	char self[CHKPWD_USER_MAX + 1] = "";
+	struct chkpwd_request req;
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	const char *name;
+	struct chkpwd_reply reply;
+
+	/* only for the process holding the other end of the socketpair */
+	if (getsockopt(STDIN_FILENO, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0
+	    || cred.pid != getppid() || cred.uid != getuid()) {
+		helper_log_err(LOG_NOTICE,
+			       "inappropriate use of Unix helper binary [UID=%d]",
+			       getuid());
+#ifdef HAVE_LIBAUDIT
+		_audit_log(AUDIT_ANOM_EXEC, getuidname(getuid()), PAM_SYSTEM_ERR);
+#endif
+		return PAM_SYSTEM_ERR;
+	}
+
+	if (getuid() != 0 && (name = getuidname(getuid())) != NULL)
+		strncpy(self, name, sizeof(self) - 1);
+
+	while (_read_all(STDIN_FILENO, &req, sizeof(req)) == 0) {
+		if (req.user_len == 0 || req.user_len > CHKPWD_USER_MAX
+		    || req.pass_len > PAM_MAX_RESP_SIZE
+		    || _read_all(STDIN_FILENO, user, req.user_len) != 0
+		    || _read_all(STDIN_FILENO, pass, req.pass_len) != 0)
+			break;
+		user[req.user_len] = '\0';
+		pass[req.pass_len] = '\0';
+
+		if (getuid() == 0 || strcmp(self, user) == 0)
+			_answer(&req, user, pass, &reply);
+		else
+			_answer_other(&req, user, pass, &reply);
+		memset(pass, '\0', sizeof(pass));
+
+		if (write(STDIN_FILENO, &reply, sizeof(reply)) != sizeof(reply))
+			break;
+	}
+	memset(pass, '\0', sizeof(pass));
+
+	return PAM_SUCCESS;
+}
+
 int main(int argc, char *argv[])
 {
 	char pass[PAM_MAX_RESP_SIZE + 1];
-	char *option;
+	char *option, *report;
 	int npass, nullok;
-	int blankpass = 0;
 	int retval = PAM_AUTH_ERR;
 	char *user;
 	char *passwords[] = { pass };
@@ -112,7 +312,8 @@ int main(int argc, char *argv[])
 	 * account).
 	 */
 
-	if (isatty(STDIN_FILENO) || argc != 3 ) {
+	if (isatty(STDIN_FILENO) || (argc != 3 &&
+	    (argc != 2 || strcmp(argv[1], "serve") != 0))) {
 		helper_log_err(LOG_NOTICE
 		      ,"inappropriate use of Unix helper binary [UID=%d]"
 			 ,getuid());
@@ -126,6 +327,9 @@ int main(int argc, char *argv[])
 		return PAM_SYSTEM_ERR;
 	}
 
+	if (argc == 2)
+		return _serve();
+
 	/*
 	 * Determine what the current user's name is.
 	 * We must thus skip the check if the real uid is 0.
@@ -137,7 +341,7 @@ int main(int argc, char *argv[])
 	  user = getuidname(getuid());
 	  /* if the caller specifies the username, verify that user
 	     matches it */
-	  if (strcmp(user, argv[1])) {
+	  if (user == NULL || strcmp(user, argv[1])) {
 	    user = argv[1];
 	    /* no match -> permanently change to the real user and proceed */
 	    if (setuid(getuid()) != 0)
@@ -150,8 +354,20 @@ int main(int argc, char *argv[])
 	if (strcmp(option, "chkexpiry") == 0)
 	  /* Check account information from the shadow file */
 	  return _check_expiry(argv[1]);
+
+	/* "nullok,chkexpiry" checks both in one run */
+	if ((report = strchr(option, ',')) != NULL) {
+	  if (strcmp(report, ",chkexpiry") != 0) {
+#ifdef HAVE_LIBAUDIT
+	    _audit_log(AUDIT_ANOM_EXEC, getuidname(getuid()), PAM_SYSTEM_ERR);
+#endif
+	    return PAM_SYSTEM_ERR;
+	  }
+	  *report = '\0';
+	}
+
 	/* read the nullok/nonull option */
-	else if (strcmp(option, "nullok") == 0)
+	if (strcmp(option, "nullok") == 0)
 	  nullok = 1;
 	else if (strcmp(option, "nonull") == 0)
 	  nullok = 0;
@@ -170,43 +386,18 @@ int main(int argc, char *argv[])
 		*pass = '\0';
 	}
 
-	if (*pass == '\0') {
-		blankpass = 1;
-	}
-
-	retval = helper_verify_password(user, pass, nullok);
+	retval = _check_password(user, pass, nullok);
 
 	memset(pass, '\0', PAM_MAX_RESP_SIZE);	/* clear memory of the password */
 
-	/* return pass or fail */
+	if (report != NULL) {
+	  int blank, expiry, daysleft;
 
-	if (retval != PAM_SUCCESS) {
-		if (!nullok || !blankpass) {
-			/* no need to log blank pass test */
-#ifdef HAVE_LIBAUDIT
-			if (getuid() != 0)
-				_audit_log(AUDIT_USER_AUTH, user, PAM_AUTH_ERR);
-#endif
-			helper_log_err(LOG_NOTICE, "password check failed for user (%s)", user);
-		}
-		/* if helper_verify_password() returned PAM_USER_UNKNOWN, the
-		   most appropriate error to propagate to
-		   _unix_verify_password() is PAM_AUTHINFO_UNAVAIL; otherwise
-		   return general failure */
-		if (retval == PAM_USER_UNKNOWN)
-			return PAM_AUTHINFO_UNAVAIL;
-		else
-			return PAM_AUTH_ERR;
-	} else {
-	        if (getuid() != 0) {
-#ifdef HAVE_LIBAUDIT
-			return _audit_log(AUDIT_USER_AUTH, user, PAM_SUCCESS);
-#else
-		        return PAM_SUCCESS;
-#endif
-	        }
-		return PAM_SUCCESS;
+	  expiry = _account_status(user, &blank, &daysleft);
+	  printf("%d %d %d\n", blank, expiry, daysleft);
 	}
+
+	return retval;
 }
 
 /*
@@ -95,6 +95,9 @@ run_coprocess(pam_handle_t *pamh, const char *input, char **output,
 {
 	int ipipe[2], opipe[2], i;
 	char buf[LINE_MAX];
+	struct pam_modutil_spawn_attr attr;
+	const char *args[10];
+	size_t j;
 	pid_t child;
 	char *buffer = NULL;
 	size_t buffer_size = 0;
@@ -114,10 +117,34 @@ run_coprocess(pam_handle_t *pamh, const char *input, char **output,
 		return -1;
 	}
 
-	/* Fork off a child. */
-	child = fork();
-	if (child == -1) {
-		pam_syslog(pamh, LOG_ERR, "Could not fork: %m");
+	/* Convert the varargs list into a regular array of strings. */
+	memset(args, 0, sizeof(args));
+	va_start(ap, command);
+	args[0] = command;
+	for (j = 1; j < PAM_ARRAY_SIZE(args) - 1; j++) {
+		args[j] = va_arg(ap, const char*);
+		if (args[j] == NULL) {
+			break;
+		}
+	}
+	va_end(ap);
+
+	/* Run the command without privileges, with the pipe descriptors
+	 * as stdin and stdout and everything else closed. */
+	memset(&attr, 0, sizeof(attr));
+	attr.stdfd[0] = ipipe[0];
+	attr.stdfd[1] = opipe[1];
+	attr.stdfd[2] = -1;
+	attr.redirect[2] = PAM_MODUTIL_NULL_FD;
+	attr.flags = PAM_MODUTIL_SPAWN_IDS;
+	attr.uid = uid;
+	attr.gid = gid;
+
+	DIAG_PUSH_IGNORE_CAST_QUAL;
+	child = pam_modutil_spawn_helper(pamh, command, (char *const *) args,
+					 environ, &attr);
+	DIAG_POP_IGNORE_CAST_QUAL;
+	if (child < 0) {
 		close(ipipe[0]);
 		close(ipipe[1]);
 		close(opipe[0]);
@@ -125,68 +152,6 @@ run_coprocess(pam_handle_t *pamh, const char *input, char **output,
 		return -1;
 	}
 
-	if (child == 0) {
-		/* We're the child. */
-		size_t j;
-		const char *args[10];
-		/* Drop privileges. */
-		if (setgid(gid) == -1)
-		  {
-		    int err = errno;
-		    pam_syslog (pamh, LOG_ERR, "setgid(%lu) failed: %m",
-				(unsigned long) getegid ());
-		    _exit (err);
-		  }
-		if (setgroups(0, NULL) == -1)
-		  {
-		    int err = errno;
-		    pam_syslog (pamh, LOG_ERR, "setgroups() failed: %m");
-		    _exit (err);
-		  }
-		if (setuid(uid) == -1)
-		  {
-		    int err = errno;
-		    pam_syslog (pamh, LOG_ERR, "setuid(%lu) failed: %m",
-				(unsigned long) geteuid ());
-		    _exit (err);
-		  }
-		/* Set the pipe descriptors up as stdin and stdout, and close
-		 * everything else, including the original values for the
-		 * descriptors. */
-		if (dup2(ipipe[0], STDIN_FILENO) != STDIN_FILENO) {
-		    int err = errno;
-		    pam_syslog(pamh, LOG_ERR, "dup2 of %s failed: %m", "stdin");
-		    _exit(err);
-		}
-		if (dup2(opipe[1], STDOUT_FILENO) != STDOUT_FILENO) {
-		    int err = errno;
-		    pam_syslog(pamh, LOG_ERR, "dup2 of %s failed: %m", "stdout");
-		    _exit(err);
-		}
-		if (pam_modutil_sanitize_helper_fds(pamh, PAM_MODUTIL_IGNORE_FD,
-						    PAM_MODUTIL_IGNORE_FD,
-						    PAM_MODUTIL_NULL_FD) < 0) {
-		    _exit(1);
-		}
-		/* Initialize the argument list. */
-		memset(args, 0, sizeof(args));
-		/* Convert the varargs list into a regular array of strings. */
-		va_start(ap, command);
-		args[0] = command;
-		for (j = 1; j < PAM_ARRAY_SIZE(args) - 1; j++) {
-			args[j] = va_arg(ap, const char*);
-			if (args[j] == NULL) {
-				break;
-			}
-		}
-		/* Run the command. */
-		DIAG_PUSH_IGNORE_CAST_QUAL;
-		execv(command, (char *const *) args);
-		DIAG_POP_IGNORE_CAST_QUAL;
-		/* Never reached. */
-		_exit(1);
-	}
-
 	/* We're the parent, so close the other ends of the pipes. */
 	close(opipe[1]);
 	/* Send input to the process (if we have any), then send an EOF. */
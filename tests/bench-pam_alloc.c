@@ -0,0 +1,193 @@
+/*
+ * Count the heap allocations of a PAM transaction.
+ *
+ * usage: bench-pam_alloc [-n transactions] [module.so]
+ *
+ * The transaction sets a few items and environment variables, runs
+ * the authentication, account and session stacks of the given module
+ * (pam_permit from the build tree by default) and stores module data
+ * the way modules do.  The allocations are counted by replacing
+ * malloc() and friends, which works with the GNU C library only.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "tst-confdir.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <security/pam_appl.h>
+#include <security/pam_ext.h>
+#include <security/pam_modules.h>
+#include <pam_private.h>
+
+#define DEFAULT_MODULE "../modules/pam_permit/.libs/pam_permit.so"
+#define ENV_VARS 8
+#define DATA_ENTRIES 8
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long allocs;
+
+void *
+malloc(size_t size)
+{
+	allocs++;
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	allocs++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	allocs++;
+	return __libc_realloc(ptr, size);
+}
+
+void
+free(void *ptr)
+{
+	__libc_free(ptr);
+}
+
+static const char confdir[] = "bench-pam_alloc.d";
+static const char service[] = "bench";
+static struct pam_conv conv;
+
+static int
+write_service(const char *module)
+{
+	char *path;
+	int rc = 0;
+
+	/* relative module paths are taken from the module directory */
+	if ((path = realpath(module, NULL)) == NULL) {
+		perror(module);
+		return -1;
+	}
+	if (tst_confdir_create(confdir) != 0 ||
+	    tst_confdir_write(confdir, service,
+			      "auth required %s\naccount required %s\n"
+			      "session required %s\n", path, path, path) != 0)
+		rc = -1;
+	free(path);
+	return rc;
+}
+
+static int
+transaction(pam_handle_t *pamh)
+{
+	char buf[64];
+	unsigned int i;
+	int rc = 0;
+
+	pam_set_item(pamh, PAM_TTY, "pts/0");
+	pam_set_item(pamh, PAM_RHOST, "client.example.org");
+	pam_set_item(pamh, PAM_RUSER, "nobody");
+	for (i = 0; i < ENV_VARS; i++) {
+		snprintf(buf, sizeof(buf), "BENCH_VAR%u=value %u", i, i);
+		pam_putenv(pamh, buf);
+	}
+
+	if (pam_authenticate(pamh, 0) != PAM_SUCCESS ||
+	    pam_acct_mgmt(pamh, 0) != PAM_SUCCESS ||
+	    pam_open_session(pamh, 0) != PAM_SUCCESS ||
+	    pam_close_session(pamh, 0) != PAM_SUCCESS)
+		rc = -1;
+
+	/* what modules keep during a transaction */
+	__PAM_TO_MODULE(pamh);
+	pam_set_item(pamh, PAM_AUTHTOK, "secret");
+	for (i = 0; i < DATA_ENTRIES; i++) {
+		snprintf(buf, sizeof(buf), "bench_module_data_%u", i);
+		pam_set_data(pamh, buf, NULL, NULL);
+	}
+	__PAM_TO_APP(pamh);
+
+	return rc;
+}
+
+static void
+report(const char *what, unsigned int n, unsigned long count)
+{
+	printf("%-32s %8u %10.1f allocations/transaction\n",
+	       what, n, (double) count / n);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *module = DEFAULT_MODULE;
+	unsigned int n = 1000, i;
+	unsigned long start;
+	pam_handle_t *pamh;
+	int opt, rc = 0;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			n = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n transactions] "
+				"[module.so]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (n == 0)
+		return 2;
+	if (optind < argc)
+		module = argv[optind];
+	if (access(module, R_OK) != 0) {
+		fprintf(stderr, "%s not found, pass a module\n", module);
+		return 77;
+	}
+	if (write_service(module) != 0)
+		return 1;
+
+	/* load the module once, so that the counts do not include it */
+	if (pam_start_confdir(service, "nobody", &conv, confdir,
+			      &pamh) != PAM_SUCCESS)
+		return 1;
+
+	start = allocs;
+	for (i = 0; i < n && rc == 0; i++) {
+		pam_handle_t *pamh2;
+
+		if (pam_start_confdir(service, "nobody", &conv, confdir,
+				      &pamh2) != PAM_SUCCESS)
+			return 1;
+		if (transaction(pamh2) != 0)
+			rc = 1;
+		pam_end(pamh2, PAM_SUCCESS);
+	}
+	report("pam_start ... pam_end", n, allocs - start);
+
+	start = allocs;
+	for (i = 0; i < n && rc == 0; i++) {
+		if (transaction(pamh) != 0 ||
+		    pam_reset(pamh, "nobody", PAM_SUCCESS) != PAM_SUCCESS)
+			rc = 1;
+	}
+	report("transaction ... pam_reset", n, allocs - start);
+
+	pam_end(pamh, PAM_SUCCESS);
+	if (rc != 0)
+		fprintf(stderr, "transaction failed\n");
+
+	return rc;
+}
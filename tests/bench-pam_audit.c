@@ -0,0 +1,199 @@
+/*
+ * Count the socket calls libpam makes for the audit records of a login.
+ *
+ * usage: bench-pam_audit [-n iterations] [pam_permit.so]
+ *
+ * A login is pam_start(), authenticate, acct_mgmt, setcred, open and
+ * close session, setcred and pam_end() on a stack of pam_permit.  The
+ * program interposes socket(), sendto(), recvfrom() and close() to count
+ * them, and times the logins with every pam_audit_mode().  It is skipped
+ * when libpam is built without libaudit; without audit support in the
+ * kernel no records are sent, run it as root or with CAP_AUDIT_WRITE to
+ * have them accepted.  strace -c -f shows all the system calls.
+ */
+
+#include "tst-confdir.h"
+
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <security/pam_appl.h>
+#include <security/pam_ext.h>
+
+#define PERMIT "../modules/pam_permit/.libs/pam_permit.so"
+
+static const char confdir[] = "bench-pam_audit.d";
+static const char service[] = "bench";
+static struct pam_conv conv;
+
+static unsigned long calls;
+
+int
+socket(int domain, int type, int protocol)
+{
+	static int (*next)(int, int, int);
+
+	if (next == NULL)
+		next = (int (*)(int, int, int)) dlsym(RTLD_NEXT, "socket");
+	calls++;
+	return next(domain, type, protocol);
+}
+
+ssize_t
+sendto(int fd, const void *buf, size_t len, int flags,
+       const struct sockaddr *addr, socklen_t addrlen)
+{
+	static ssize_t (*next)(int, const void *, size_t, int,
+			       const struct sockaddr *, socklen_t);
+
+	if (next == NULL)
+		next = (ssize_t (*)(int, const void *, size_t, int,
+				    const struct sockaddr *, socklen_t))
+			dlsym(RTLD_NEXT, "sendto");
+	calls++;
+	return next(fd, buf, len, flags, addr, addrlen);
+}
+
+ssize_t
+recvfrom(int fd, void *buf, size_t len, int flags,
+	 struct sockaddr *addr, socklen_t *addrlen)
+{
+	static ssize_t (*next)(int, void *, size_t, int,
+			       struct sockaddr *, socklen_t *);
+
+	if (next == NULL)
+		next = (ssize_t (*)(int, void *, size_t, int,
+				    struct sockaddr *, socklen_t *))
+			dlsym(RTLD_NEXT, "recvfrom");
+	calls++;
+	return next(fd, buf, len, flags, addr, addrlen);
+}
+
+int
+close(int fd)
+{
+	static int (*next)(int);
+
+	if (next == NULL)
+		next = (int (*)(int)) dlsym(RTLD_NEXT, "close");
+	calls++;
+	return next(fd);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+write_service(const char *module)
+{
+	char *path;
+	int rc = 0;
+
+	if ((path = realpath(module, NULL)) == NULL) {
+		perror(module);
+		return -1;
+	}
+	if (tst_confdir_create(confdir) != 0 ||
+	    tst_confdir_write(confdir, service,
+			      "auth required %s\naccount required %s\n"
+			      "session required %s\n", path, path, path) != 0)
+		rc = -1;
+	free(path);
+	return rc;
+}
+
+static int
+login(void)
+{
+	pam_handle_t *pamh;
+	int retval;
+
+	if (pam_start_confdir(service, "nobody", &conv, confdir,
+			      &pamh) != PAM_SUCCESS)
+		return -1;
+	retval = pam_authenticate(pamh, 0);
+	if (retval == PAM_SUCCESS)
+		retval = pam_acct_mgmt(pamh, 0);
+	if (retval == PAM_SUCCESS)
+		retval = pam_setcred(pamh, PAM_ESTABLISH_CRED);
+	if (retval == PAM_SUCCESS)
+		retval = pam_open_session(pamh, 0);
+	if (retval == PAM_SUCCESS)
+		retval = pam_close_session(pamh, 0);
+	if (retval == PAM_SUCCESS)
+		retval = pam_setcred(pamh, PAM_DELETE_CRED);
+	pam_end(pamh, retval);
+	return retval == PAM_SUCCESS ? 0 : -1;
+}
+
+static int
+run(const char *what, int mode, unsigned int n)
+{
+	unsigned long before;
+	unsigned int i;
+	double start;
+
+	if (pam_audit_mode(mode) != PAM_SUCCESS)
+		return -1;
+	/* the first login opens the socket that the others reuse */
+	if (login() != 0)
+		return -1;
+	before = calls;
+	start = now();
+	for (i = 0; i < n; i++) {
+		if (login() != 0)
+			return -1;
+	}
+	printf("%-24s %8u %10.2f us/login %6.2f calls/login\n", what, n,
+	       (now() - start) * 1e6 / n, (double) (calls - before) / n);
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned int n = 2000;
+	int opt, rc = 0;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			n = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n iterations] "
+				"[pam_permit.so]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (n == 0)
+		return 2;
+#ifndef HAVE_LIBAUDIT
+	fprintf(stderr, "libpam is built without libaudit\n");
+	return 77;
+#endif
+
+	if (write_service(optind < argc ? argv[optind] : PERMIT) != 0)
+		return 77;
+
+	if (run("one socket per record", 0, n) != 0 ||
+	    run("PAM_AUDIT_REUSE_FD", PAM_AUDIT_REUSE_FD, n) != 0 ||
+	    run("PAM_AUDIT_COALESCE", PAM_AUDIT_COALESCE, n) != 0 ||
+	    run("both", PAM_AUDIT_REUSE_FD | PAM_AUDIT_COALESCE, n) != 0) {
+		fprintf(stderr, "login failed\n");
+		rc = 1;
+	}
+	pam_audit_mode(0);
+
+	return rc;
+}
@@ -0,0 +1,99 @@
+/*
+ * Measure pam_set_data() and pam_get_data() with many entries.
+ *
+ * usage: bench-pam_data [entries ...]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <security/pam_appl.h>
+#include <security/pam_modules.h>
+#include <pam_private.h>
+
+#define LOOKUPS 1000000
+
+static struct pam_conv conv;
+
+static double
+now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+cleanup (pam_handle_t *pamh UNUSED, void *data UNUSED, int error_status UNUSED)
+{
+}
+
+static int
+run (unsigned int entries)
+{
+  pam_handle_t *pamh;
+  const void *data;
+  char (*names)[32];
+  double start, set, get, end;
+  unsigned int i;
+
+  if (entries == 0)
+    return -1;
+  if ((names = malloc (entries * sizeof (*names))) == NULL)
+    return -1;
+  for (i = 0; i < entries; i++)
+    sprintf (names[i], "bench-pam_data-%u", i);
+
+  if (pam_start ("dummy", "root", &conv, &pamh) != PAM_SUCCESS)
+    return -1;
+  __PAM_TO_MODULE (pamh);
+
+  start = now ();
+  for (i = 0; i < entries; i++)
+    if (pam_set_data (pamh, names[i], names[i], cleanup) != PAM_SUCCESS)
+      return -1;
+  set = now ();
+  for (i = 0; i < LOOKUPS; i++)
+    if (pam_get_data (pamh, names[i % entries], &data) != PAM_SUCCESS
+	|| data != names[i % entries])
+      return -1;
+  get = now ();
+
+  __PAM_TO_APP (pamh);
+  pam_end (pamh, PAM_SUCCESS);
+  end = now ();
+
+  printf ("%8u entries: set %8.1f ns, get %8.1f ns, pam_end %8.1f ns"
+	  " per entry\n", entries,
+	  (set - start) * 1e9 / entries, (get - set) * 1e9 / LOOKUPS,
+	  (end - get) * 1e9 / entries);
+  free (names);
+  return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+  static const unsigned int defaults[] = { 10, 100, 1000, 10000 };
+  unsigned int i;
+
+  if (argc > 1)
+    {
+      for (i = 1; i < (unsigned int) argc; i++)
+	if (run (strtoul (argv[i], NULL, 10)) != 0)
+	  return 1;
+      return 0;
+    }
+
+  for (i = 0; i < sizeof (defaults) / sizeof (defaults[0]); i++)
+    if (run (defaults[i]) != 0)
+      return 1;
+
+  return 0;
+}
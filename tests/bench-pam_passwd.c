@@ -0,0 +1,131 @@
+/*
+ * Measure looking users up in a large passwd file line by line, as
+ * pam_unix and pam_localuser did before, and with
+ * pam_modutil_search_passwd().
+ *
+ * usage: bench-pam_passwd [users ...]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <security/pam_appl.h>
+#include <security/pam_modutil.h>
+
+#define PASSWD_FILE "bench-pam_passwd.passwd"
+#define LOOKUPS 200
+
+static struct pam_conv conv;
+
+static double
+now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* what the modules did before */
+static int
+scan (const char *name)
+{
+  size_t len = strlen (name);
+  char line[BUFSIZ];
+  int found = 0;
+  FILE *fp;
+
+  if ((fp = fopen (PASSWD_FILE, "r")) == NULL)
+    return -1;
+  while (fgets (line, sizeof (line), fp) != NULL)
+    if (strncmp (name, line, len) == 0 && line[len] == ':')
+      {
+	found = 1;
+	break;
+      }
+  fclose (fp);
+  return found;
+}
+
+static int
+run (unsigned int users)
+{
+  pam_handle_t *pamh;
+  double begin, scanned, first, indexed;
+  char name[32], line[BUFSIZ];
+  unsigned int i;
+  FILE *fp;
+
+  if ((fp = fopen (PASSWD_FILE, "w")) == NULL)
+    return -1;
+  for (i = 0; i < users; i++)
+    fprintf (fp, "user%u:x:%u:%u:User %u:/home/user%u:/bin/sh\n",
+	     i, i + 1000, i + 1000, i, i);
+  if (fclose (fp) != 0)
+    return -1;
+  if (pam_start ("dummy", "root", &conv, &pamh) != PAM_SUCCESS)
+    return -1;
+
+  /* users spread over the whole file */
+  srand (1);
+  begin = now ();
+  for (i = 0; i < LOOKUPS; i++)
+    {
+      sprintf (name, "user%u", (unsigned int) rand () % users);
+      if (scan (name) != 1)
+	return -1;
+    }
+  scanned = (now () - begin) * 1e6 / LOOKUPS;
+
+  begin = now ();
+  if (pam_modutil_search_passwd (pamh, "user0", PASSWD_FILE,
+				 line, sizeof (line)) != PAM_SUCCESS)
+    return -1;
+  first = (now () - begin) * 1e6;
+
+  srand (1);
+  begin = now ();
+  for (i = 0; i < LOOKUPS; i++)
+    {
+      sprintf (name, "user%u", (unsigned int) rand () % users);
+      if (pam_modutil_search_passwd (pamh, name, PASSWD_FILE,
+				     line, sizeof (line)) != PAM_SUCCESS)
+	return -1;
+    }
+  indexed = (now () - begin) * 1e6 / LOOKUPS;
+
+  pam_end (pamh, PAM_SUCCESS);
+  unlink (PASSWD_FILE);
+
+  printf ("%7u users: scan %9.1f us, index %6.1f us per lookup"
+	  " (built in %.1f us)\n", users, scanned, indexed, first);
+  return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+  static const unsigned int defaults[] = { 100, 10000, 200000 };
+  unsigned int i;
+
+  if (argc > 1)
+    {
+      for (i = 1; i < (unsigned int) argc; i++)
+	if (run (strtoul (argv[i], NULL, 10)) != 0)
+	  return 1;
+      return 0;
+    }
+
+  for (i = 0; i < sizeof (defaults) / sizeof (defaults[0]); i++)
+    if (run (defaults[i]) != 0)
+      return 1;
+
+  return 0;
+}
@@ -0,0 +1,138 @@
+/*
+ * Measure starting a helper with fork() and with
+ * pam_modutil_spawn_helper() while the process has a lot of memory.
+ *
+ * usage: bench-pam_spawn [megabytes ...]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <security/pam_appl.h>
+#include <security/pam_modutil.h>
+
+#define HELPER "/bin/true"
+#define RUNS 100
+
+static struct pam_conv conv;
+static char helper[] = HELPER;
+static char *helper_argv[] = { helper, NULL };
+static char *helper_envp[] = { NULL };
+
+static double
+now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* what the modules did before */
+static pid_t
+run_fork (pam_handle_t *pamh)
+{
+  pid_t pid = fork ();
+
+  if (pid == 0)
+    {
+      if (pam_modutil_sanitize_helper_fds (pamh, PAM_MODUTIL_PIPE_FD,
+					   PAM_MODUTIL_PIPE_FD,
+					   PAM_MODUTIL_PIPE_FD) < 0)
+	_exit (1);
+      execve (HELPER, helper_argv, helper_envp);
+      _exit (1);
+    }
+  return pid;
+}
+
+static pid_t
+run_spawn (pam_handle_t *pamh)
+{
+  struct pam_modutil_spawn_attr attr;
+
+  memset (&attr, 0, sizeof (attr));
+  attr.stdfd[0] = attr.stdfd[1] = attr.stdfd[2] = -1;
+  attr.redirect[0] = attr.redirect[1] = attr.redirect[2] =
+    PAM_MODUTIL_PIPE_FD;
+  return pam_modutil_spawn_helper (pamh, HELPER, helper_argv, helper_envp,
+				   &attr);
+}
+
+static double
+measure (pam_handle_t *pamh, pid_t (*start) (pam_handle_t *))
+{
+  double begin = now ();
+  int i, status;
+  pid_t pid;
+
+  for (i = 0; i < RUNS; i++)
+    {
+      if ((pid = start (pamh)) < 0
+	  || waitpid (pid, &status, 0) != pid
+	  || !WIFEXITED (status) || WEXITSTATUS (status) != 0)
+	return -1;
+    }
+  return (now () - begin) * 1e6 / RUNS;
+}
+
+static int
+run (unsigned int megabytes)
+{
+  pam_handle_t *pamh;
+  size_t size = (size_t) megabytes << 20;
+  double forked, spawned;
+  char *memory = NULL;
+
+  if (size > 0)
+    {
+      if ((memory = malloc (size)) == NULL)
+	return -1;
+      memset (memory, 1, size);
+    }
+
+  if (pam_start ("dummy", "root", &conv, &pamh) != PAM_SUCCESS)
+    return -1;
+  forked = measure (pamh, run_fork);
+  spawned = measure (pamh, run_spawn);
+  pam_end (pamh, PAM_SUCCESS);
+  free (memory);
+
+  if (forked < 0 || spawned < 0)
+    return -1;
+  printf ("%6u MB: fork %9.1f us, spawn %9.1f us per helper\n",
+	  megabytes, forked, spawned);
+  return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+  static const unsigned int defaults[] = { 0, 256, 1024 };
+  unsigned int i;
+
+  if (access (HELPER, X_OK) != 0)
+    return 77;
+
+  if (argc > 1)
+    {
+      for (i = 1; i < (unsigned int) argc; i++)
+	if (run (strtoul (argv[i], NULL, 10)) != 0)
+	  return 1;
+      return 0;
+    }
+
+  for (i = 0; i < sizeof (defaults) / sizeof (defaults[0]); i++)
+    if (run (defaults[i]) != 0)
+      return 1;
+
+  return 0;
+}
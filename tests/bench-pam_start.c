@@ -0,0 +1,203 @@
+/*
+ * Measure pam_start()/pam_end() for a service stack of many modules.
+ *
+ * usage: bench-pam_start [-n iterations] [-k handles] [module.so ...]
+ *
+ * Without module arguments up to MAX_MODULES of the modules found in
+ * the build tree are used.  Handles are timed when started and ended one
+ * after the other, when kept open at the same time, both again with the
+ * stack cache enabled, and a single handle reused with pam_reset().
+ */
+
+#include "tst-confdir.h"
+
+#include <glob.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <security/pam_appl.h>
+#include <security/pam_ext.h>
+
+#define MAX_MODULES 20
+#define MODULE_GLOB "../modules/pam_*/.libs/pam_*.so"
+
+static const char confdir[] = "bench-pam_start.d";
+static const char service[] = "bench";
+static struct pam_conv conv;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+write_service(char **modules, size_t count)
+{
+	static const char * const types[] = {
+		"auth", "account", "password", "session"
+	};
+	char *path;
+	FILE *fp;
+	size_t i, t;
+
+	if (tst_confdir_create(confdir) != 0 ||
+	    (fp = tst_confdir_open(confdir, service)) == NULL)
+		return -1;
+	/* relative module paths are taken from the module directory */
+	for (t = 0; t < sizeof(types) / sizeof(types[0]); t++) {
+		for (i = 0; i < count; i++) {
+			if ((path = realpath(modules[i], NULL)) == NULL) {
+				perror(modules[i]);
+				fclose(fp);
+				return -1;
+			}
+			fprintf(fp, "%s optional %s\n", types[t], path);
+			free(path);
+		}
+	}
+	return fclose(fp);
+}
+
+static void
+report(const char *what, unsigned int n, double elapsed)
+{
+	printf("%-32s %8u %10.2f us/handle\n", what, n, elapsed * 1e6 / n);
+}
+
+static int
+run_sequential(const char *what, unsigned int n)
+{
+	pam_handle_t *pamh;
+	unsigned int i;
+	double start = now();
+
+	for (i = 0; i < n; i++) {
+		if (pam_start_confdir(service, "nobody", &conv, confdir,
+				      &pamh) != PAM_SUCCESS)
+			return -1;
+		pam_end(pamh, PAM_SUCCESS);
+	}
+	report(what, n, now() - start);
+	return 0;
+}
+
+static int
+run_concurrent(const char *what, unsigned int n, unsigned int k)
+{
+	pam_handle_t **pamh;
+	unsigned int i, j, done = 0;
+	double start = now();
+
+	if ((pamh = calloc(k, sizeof(*pamh))) == NULL)
+		return -1;
+	while (done < n) {
+		for (j = 0; j < k; j++)
+			if (pam_start_confdir(service, "nobody", &conv,
+					      confdir, &pamh[j]) != PAM_SUCCESS)
+				break;
+		for (i = 0; i < j; i++)
+			pam_end(pamh[i], PAM_SUCCESS);
+		if (j < k) {
+			free(pamh);
+			return -1;
+		}
+		done += k;
+	}
+	report(what, done, now() - start);
+	free(pamh);
+	return 0;
+}
+
+static int
+run_reset(const char *what, unsigned int n)
+{
+	pam_handle_t *pamh;
+	unsigned int i;
+	double start;
+
+	if (pam_start_confdir(service, "nobody", &conv, confdir,
+			      &pamh) != PAM_SUCCESS)
+		return -1;
+	start = now();
+	for (i = 0; i < n; i++) {
+		if (pam_reset(pamh, "nobody", PAM_SUCCESS) != PAM_SUCCESS) {
+			pam_end(pamh, PAM_SUCCESS);
+			return -1;
+		}
+	}
+	report(what, n, now() - start);
+	pam_end(pamh, PAM_SUCCESS);
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned int n = 2000, k = 16;
+	char what[64];
+	glob_t gl;
+	char **modules;
+	size_t count;
+	int opt, rc = 0;
+
+	while ((opt = getopt(argc, argv, "n:k:")) != -1) {
+		switch (opt) {
+		case 'n':
+			n = strtoul(optarg, NULL, 10);
+			break;
+		case 'k':
+			k = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n iterations] "
+				"[-k handles] [module.so ...]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (n == 0 || k == 0)
+		return 2;
+
+	memset(&gl, 0, sizeof(gl));
+	if (optind < argc) {
+		modules = argv + optind;
+		count = argc - optind;
+	} else if (glob(MODULE_GLOB, 0, NULL, &gl) == 0) {
+		modules = gl.gl_pathv;
+		count = gl.gl_pathc;
+	} else {
+		fprintf(stderr, "no modules found, pass them as arguments\n");
+		return 77;
+	}
+	if (count > MAX_MODULES)
+		count = MAX_MODULES;
+
+	if (write_service(modules, count) != 0)
+		return 1;
+	printf("%zu modules, %zu handler lines\n", count, 4 * count);
+
+	if (run_sequential("pam_start/pam_end", n) != 0)
+		rc = 1;
+	snprintf(what, sizeof(what), "%u handles open", k);
+	if (rc == 0 && run_concurrent(what, n, k) != 0)
+		rc = 1;
+	pam_stack_cache_enable(1);
+	if (rc == 0 && run_sequential("pam_start/pam_end, cached", n) != 0)
+		rc = 1;
+	snprintf(what, sizeof(what), "%u handles open, cached", k);
+	if (rc == 0 && run_concurrent(what, n, k) != 0)
+		rc = 1;
+	pam_stack_cache_enable(0);
+	if (rc == 0 && run_reset("pam_reset", n) != 0)
+		rc = 1;
+	if (rc != 0)
+		fprintf(stderr, "pam_start_confdir or pam_reset failed\n");
+
+	globfree(&gl);
+	return rc;
+}
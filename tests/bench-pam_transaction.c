@@ -0,0 +1,506 @@
+/*
+ * Measure whole PAM transactions on generated service stacks.
+ *
+ * usage: bench-pam_transaction [-n transactions] [-t threads]
+ *                              [-m modules] [-r rules] [stack ...]
+ *
+ * A transaction is pam_start(), authenticate, acct_mgmt, setcred,
+ * open_session, close_session, setcred and pam_end().  The stacks are
+ *
+ *   permit  the given number of pam_permit lines for every type
+ *   unix    pam_unix for a user in a fixture passwd and shadow file
+ *   access  pam_unix and pam_access with a rule file of the given size
+ *   limits  pam_unix and pam_limits with a file of the given size
+ *
+ * all of them by default.  Every stack runs in one thread and then in
+ * the given number of threads, each with handles of its own.  The
+ * program prints the transactions per second, the allocations per
+ * transaction and the median and 99th percentile latency of every
+ * step.
+ *
+ * The fixture user is served by replacements of getpwnam_r(),
+ * getpwuid_r() and getspnam_r(), which read the fixture files and pass
+ * other names on to the C library; malloc() and friends are replaced to
+ * count the allocations.  Both work with the GNU C library only.  The
+ * password hash is SHA-512 with the default rounds, so the unix stacks
+ * mostly measure crypt().
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "tst-confdir.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <shadow.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <security/pam_appl.h>
+
+#define MODULES "../modules"
+#define USER "pambench"
+#define PASSWORD "bench"
+#define HASH "$6$pambenchsalt$afrLAm0bYaXsrlTImd8gYSJ29sRWxu58P13sfmBU." \
+	"IfGbqPWVceXeF40FQmnRRn5/A6U.rm9Yx4ae0PlBgA.W/"
+#define UID 4242
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long allocs;
+
+void *
+malloc(size_t size)
+{
+	__atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	__atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	__atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+void
+free(void *ptr)
+{
+	__libc_free(ptr);
+}
+
+static const char confdir[] = "bench-pam_transaction.d";
+static const char service[] = "bench";
+static char passwd_file[sizeof(confdir) + 16];
+static char shadow_file[sizeof(confdir) + 16];
+
+static int
+lookup_passwd(const char *name, uid_t uid, struct passwd *pwd,
+	      char *buf, size_t buflen, struct passwd **result)
+{
+	FILE *fp;
+	int err;
+
+	if ((fp = fopen(passwd_file, "r")) == NULL)
+		return -1;
+	while ((err = fgetpwent_r(fp, pwd, buf, buflen, result)) == 0) {
+		if (name ? !strcmp(pwd->pw_name, name) : pwd->pw_uid == uid)
+			break;
+	}
+	fclose(fp);
+	if (err != 0)
+		*result = NULL;
+	return err == ENOENT ? 0 : err;
+}
+
+int
+getpwnam_r(const char *name, struct passwd *pwd, char *buf, size_t buflen,
+	   struct passwd **result)
+{
+	static int (*next)(const char *, struct passwd *, char *, size_t,
+			   struct passwd **);
+
+	if (strcmp(name, USER) == 0)
+		return lookup_passwd(name, 0, pwd, buf, buflen, result);
+	if (next == NULL)
+		next = (int (*)(const char *, struct passwd *, char *, size_t,
+				struct passwd **)) dlsym(RTLD_NEXT,
+							 "getpwnam_r");
+	return next(name, pwd, buf, buflen, result);
+}
+
+int
+getpwuid_r(uid_t uid, struct passwd *pwd, char *buf, size_t buflen,
+	   struct passwd **result)
+{
+	static int (*next)(uid_t, struct passwd *, char *, size_t,
+			   struct passwd **);
+
+	if (uid == UID)
+		return lookup_passwd(NULL, uid, pwd, buf, buflen, result);
+	if (next == NULL)
+		next = (int (*)(uid_t, struct passwd *, char *, size_t,
+				struct passwd **)) dlsym(RTLD_NEXT,
+							 "getpwuid_r");
+	return next(uid, pwd, buf, buflen, result);
+}
+
+int
+getspnam_r(const char *name, struct spwd *spwd, char *buf, size_t buflen,
+	   struct spwd **result)
+{
+	static int (*next)(const char *, struct spwd *, char *, size_t,
+			   struct spwd **);
+	FILE *fp;
+	int err;
+
+	if (strcmp(name, USER) != 0) {
+		if (next == NULL)
+			next = (int (*)(const char *, struct spwd *, char *,
+					size_t, struct spwd **))
+				dlsym(RTLD_NEXT, "getspnam_r");
+		return next(name, spwd, buf, buflen, result);
+	}
+
+	if ((fp = fopen(shadow_file, "r")) == NULL)
+		return -1;
+	while ((err = fgetspent_r(fp, spwd, buf, buflen, result)) == 0) {
+		if (!strcmp(spwd->sp_namp, name))
+			break;
+	}
+	fclose(fp);
+	if (err != 0)
+		*result = NULL;
+	return err == ENOENT ? 0 : err;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+conv(int num_msg, const struct pam_message **msg,
+     struct pam_response **resp, void *appdata_ptr)
+{
+	struct pam_response *reply;
+	int i;
+
+	(void) appdata_ptr;
+	if ((reply = calloc(num_msg, sizeof(*reply))) == NULL)
+		return PAM_BUF_ERR;
+	for (i = 0; i < num_msg; i++) {
+		if (msg[i]->msg_style == PAM_PROMPT_ECHO_OFF)
+			reply[i].resp = strdup(PASSWORD);
+	}
+	*resp = reply;
+	return PAM_SUCCESS;
+}
+
+static struct pam_conv pconv = { conv, NULL };
+
+static char *
+module(const char *name)
+{
+	char path[256];
+
+	snprintf(path, sizeof(path), MODULES "/%s/.libs/%s.so", name, name);
+	return realpath(path, NULL);
+}
+
+static int
+write_fixtures(unsigned int rules)
+{
+	FILE *fp;
+	unsigned int i;
+	int shadowed = geteuid() == 0;
+
+	snprintf(passwd_file, sizeof(passwd_file), "%s/passwd", confdir);
+	snprintf(shadow_file, sizeof(shadow_file), "%s/shadow", confdir);
+
+	/* without root pam_unix would ask unix_chkpwd for the shadow hash */
+	if ((fp = tst_confdir_open(confdir, "passwd")) == NULL)
+		return -1;
+	fprintf(fp, "%s:%s:%u:%u:PAM benchmark:/nonexistent:/bin/sh\n",
+		USER, shadowed ? "x" : HASH, UID, UID);
+	if (fclose(fp) != 0 ||
+	    (fp = tst_confdir_open(confdir, "shadow")) == NULL)
+		return -1;
+	fprintf(fp, "%s:%s:19000:0:99999:7:::\n", USER, HASH);
+	if (fclose(fp) != 0 ||
+	    (fp = tst_confdir_open(confdir, "access.conf")) == NULL)
+		return -1;
+	/* every tenth rule names a group, which is looked up for the user */
+	for (i = 0; i < rules; i++)
+		fprintf(fp, i % 10 ? "-:user%u:ALL\n" : "-:(group%u):ALL\n", i);
+	fprintf(fp, "+:ALL:ALL\n");
+	if (fclose(fp) != 0 ||
+	    (fp = tst_confdir_open(confdir, "limits.conf")) == NULL)
+		return -1;
+	for (i = 0; i < rules; i++)
+		fprintf(fp, "user%u hard nofile %u\n", i, 1024 + i);
+	fprintf(fp, "%s soft core 0\n", USER);
+	return fclose(fp);
+}
+
+static int
+write_service(const char *stack, unsigned int modules)
+{
+	static const char * const types[] = {
+		"auth", "account", "password", "session"
+	};
+	char *permit, *unix_mod, *extra = NULL;
+	const char *extra_type = NULL, *extra_arg = "";
+	char arg[256];
+	FILE *fp;
+	size_t t;
+	unsigned int i;
+	int ret = -1;
+
+	if (strcmp(stack, "permit") != 0 && strcmp(stack, "unix") != 0 &&
+	    strcmp(stack, "access") != 0 && strcmp(stack, "limits") != 0) {
+		fprintf(stderr, "unknown stack %s\n", stack);
+		return -1;
+	}
+
+	permit = module("pam_permit");
+	unix_mod = module("pam_unix");
+	if (strcmp(stack, "access") == 0) {
+		extra = module("pam_access");
+		extra_type = "account";
+		snprintf(arg, sizeof(arg), "accessfile=%s/access.conf",
+			 confdir);
+		extra_arg = arg;
+	} else if (strcmp(stack, "limits") == 0) {
+		extra = module("pam_limits");
+		extra_type = "session";
+		snprintf(arg, sizeof(arg), "conf=%s/limits.conf", confdir);
+		extra_arg = arg;
+	}
+	if (permit == NULL || unix_mod == NULL ||
+	    (extra_type != NULL && extra == NULL)) {
+		fprintf(stderr, "%s: modules not built\n", stack);
+		goto out;
+	}
+	if ((fp = tst_confdir_open(confdir, service)) == NULL)
+		goto out;
+
+	for (t = 0; t < sizeof(types) / sizeof(types[0]); t++) {
+		if (strcmp(stack, "permit") == 0) {
+			for (i = 0; i < modules; i++)
+				fprintf(fp, "%s required %s\n",
+					types[t], permit);
+			continue;
+		}
+		fprintf(fp, "%s required %s nodelay\n", types[t], unix_mod);
+		if (extra_type != NULL && strcmp(types[t], extra_type) == 0)
+			fprintf(fp, "%s required %s %s\n",
+				types[t], extra, extra_arg);
+	}
+	ret = fclose(fp);
+out:
+	free(permit);
+	free(unix_mod);
+	free(extra);
+	return ret;
+}
+
+#define STEPS 8
+
+static const char * const step_names[STEPS] = {
+	"pam_start", "pam_authenticate", "pam_acct_mgmt", "pam_setcred",
+	"pam_open_session", "pam_close_session", "pam_setcred delete",
+	"pam_end"
+};
+
+struct worker {
+	pthread_t thread;
+	unsigned int n;
+	double *latency[STEPS];
+	int failed;
+};
+
+static int
+transaction(double *latency)
+{
+	pam_handle_t *pamh;
+	double t0, t1;
+	int retval, step = 0;
+
+	t0 = now();
+	retval = pam_start_confdir(service, USER, &pconv, confdir, &pamh);
+	if (retval != PAM_SUCCESS)
+		return retval;
+	pam_set_item(pamh, PAM_TTY, "pts/0");
+
+#define STEP(call)						\
+	if (retval == PAM_SUCCESS) {				\
+		t1 = now();					\
+		latency[step++] = t1 - t0;			\
+		t0 = t1;					\
+		retval = (call);				\
+	}
+	STEP(pam_authenticate(pamh, 0));
+	STEP(pam_acct_mgmt(pamh, 0));
+	STEP(pam_setcred(pamh, PAM_ESTABLISH_CRED));
+	STEP(pam_open_session(pamh, 0));
+	STEP(pam_close_session(pamh, 0));
+	STEP(pam_setcred(pamh, PAM_DELETE_CRED));
+	STEP(pam_end(pamh, retval));
+#undef STEP
+	if (step != STEPS - 1) {
+		pam_end(pamh, retval);
+		return retval;
+	}
+	latency[step] = now() - t0;
+	return retval;
+}
+
+static void *
+run_worker(void *arg)
+{
+	struct worker *w = arg;
+	double latency[STEPS];
+	unsigned int i, s;
+
+	for (i = 0; i < w->n; i++) {
+		if (transaction(latency) != PAM_SUCCESS) {
+			w->failed = 1;
+			break;
+		}
+		for (s = 0; s < STEPS; s++)
+			w->latency[s][i] = latency[s];
+	}
+	return NULL;
+}
+
+static int
+compare(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int
+run(const char *what, unsigned int n, unsigned int threads)
+{
+	struct worker *w;
+	double *all, start, elapsed;
+	unsigned long before;
+	unsigned int i, s, total = n * threads;
+	int ret = -1;
+
+	w = calloc(threads, sizeof(*w));
+	all = malloc(total * sizeof(*all));
+	if (w == NULL || all == NULL)
+		goto out;
+	for (i = 0; i < threads; i++) {
+		w[i].n = n;
+		for (s = 0; s < STEPS; s++)
+			if ((w[i].latency[s] = malloc(n * sizeof(double))) ==
+			    NULL)
+				goto out;
+	}
+
+	before = allocs;
+	start = now();
+	for (i = 0; i < threads; i++)
+		if (pthread_create(&w[i].thread, NULL, run_worker, &w[i]))
+			break;
+	while (i > 0)
+		pthread_join(w[--i].thread, NULL);
+	elapsed = now() - start;
+	for (i = 0; i < threads; i++) {
+		if (w[i].failed) {
+			fprintf(stderr, "%s: transaction failed\n", what);
+			goto out;
+		}
+	}
+
+	printf("%s, %u thread%s: %.0f transactions/s, "
+	       "%.1f allocations/transaction\n", what, threads,
+	       threads == 1 ? "" : "s", total / elapsed,
+	       (double) (allocs - before) / total);
+	for (s = 0; s < STEPS; s++) {
+		for (i = 0; i < total; i++)
+			all[i] = w[i / n].latency[s][i % n];
+		qsort(all, total, sizeof(*all), compare);
+		printf("  %-20s p50 %10.2f us  p99 %10.2f us\n", step_names[s],
+		       all[total / 2] * 1e6, all[total * 99 / 100] * 1e6);
+	}
+	ret = 0;
+out:
+	for (i = 0; w != NULL && i < threads; i++)
+		for (s = 0; s < STEPS; s++)
+			free(w[i].latency[s]);
+	free(w);
+	free(all);
+	return ret;
+}
+
+int
+main(int argc, char **argv)
+{
+	static const char * const stacks[] = {
+		"permit", "unix", "access", "limits"
+	};
+	unsigned int n = 200, threads = 4, modules = 10, rules = 200;
+	const char * const *run_stacks = stacks;
+	char what[64];
+	size_t i, count = sizeof(stacks) / sizeof(stacks[0]);
+	int opt, rc = 0;
+
+	while ((opt = getopt(argc, argv, "n:t:m:r:")) != -1) {
+		switch (opt) {
+		case 'n':
+			n = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			threads = strtoul(optarg, NULL, 10);
+			break;
+		case 'm':
+			modules = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			rules = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n transactions] "
+				"[-t threads] [-m modules] [-r rules] "
+				"[stack ...]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (n == 0 || threads == 0)
+		return 2;
+	if (optind < argc) {
+		run_stacks = (const char * const *) argv + optind;
+		count = argc - optind;
+	}
+
+	if (tst_confdir_create(confdir) != 0)
+		return 1;
+	if (write_fixtures(rules) != 0)
+		rc = 1;
+
+	for (i = 0; rc == 0 && i < count; i++) {
+		if (write_service(run_stacks[i], modules) != 0) {
+			rc = 77;
+			break;
+		}
+		if (strcmp(run_stacks[i], "permit") == 0)
+			snprintf(what, sizeof(what), "%u x pam_permit", modules);
+		else if (strcmp(run_stacks[i], "unix") == 0)
+			snprintf(what, sizeof(what), "pam_unix");
+		else
+			snprintf(what, sizeof(what), "pam_unix, pam_%s %u rules",
+				 run_stacks[i], rules);
+		if (run(what, n, 1) != 0 ||
+		    (threads > 1 && run(what, n, threads) != 0))
+			rc = 1;
+	}
+
+	return rc;
+}
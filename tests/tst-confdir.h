@@ -0,0 +1,117 @@
+/*
+ * The configuration directory of a test or a benchmark.
+ *
+ * tst_confdir_create() removes what an earlier run left behind, then
+ * creates the directory, which is removed with the files in it when the
+ * process exits, also when an assertion aborts it.  A child process
+ * leaves it to the parent.
+ */
+
+#ifndef TST_CONFDIR_H
+# define TST_CONFDIR_H
+
+# ifdef HAVE_CONFIG_H
+#  include <config.h>
+# endif
+
+# include <dirent.h>
+# include <signal.h>
+# include <stdarg.h>
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <unistd.h>
+# include <sys/stat.h>
+
+static const char *tst_confdir;
+static pid_t tst_confdir_pid;
+
+/* Remove dir and the files in it */
+static UNUSED void
+tst_confdir_remove(const char *dir)
+{
+	char path[4096];
+	struct dirent *d;
+	DIR *dp;
+
+	if ((dp = opendir(dir)) == NULL)
+		return;
+	while ((d = readdir(dp)) != NULL) {
+		if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, d->d_name);
+		unlink(path);
+	}
+	closedir(dp);
+	rmdir(dir);
+}
+
+static UNUSED void
+tst_confdir_cleanup(void)
+{
+	if (tst_confdir != NULL && tst_confdir_pid == getpid())
+		tst_confdir_remove(tst_confdir);
+}
+
+static UNUSED void
+tst_confdir_abort(int sig)
+{
+	tst_confdir_cleanup();
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+/* Returns 0, or -1 after printing why */
+static UNUSED int
+tst_confdir_create(const char *dir)
+{
+	tst_confdir_remove(dir);
+	if (mkdir(dir, 0755) != 0) {
+		perror(dir);
+		return -1;
+	}
+	if (tst_confdir == NULL) {
+		atexit(tst_confdir_cleanup);
+		signal(SIGABRT, tst_confdir_abort);
+	}
+	tst_confdir = dir;
+	tst_confdir_pid = getpid();
+	return 0;
+}
+
+/* Open the file name in dir for writing, NULL after printing why */
+static UNUSED FILE *
+tst_confdir_open(const char *dir, const char *name)
+{
+	char path[4096];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if ((fp = fopen(path, "w")) == NULL)
+		perror(path);
+	return fp;
+}
+
+/* Write the file name in dir, returns 0 or -1 */
+static UNUSED int
+tst_confdir_write(const char *dir, const char *name, const char *fmt, ...)
+	__attribute__ ((format (printf, 3, 4)));
+
+static UNUSED int
+tst_confdir_write(const char *dir, const char *name, const char *fmt, ...)
+{
+	va_list ap;
+	FILE *fp;
+	int rc;
+
+	if ((fp = tst_confdir_open(dir, name)) == NULL)
+		return -1;
+	va_start(ap, fmt);
+	rc = vfprintf(fp, fmt, ap);
+	va_end(ap);
+	if (fclose(fp) != 0 || rc < 0)
+		return -1;
+	return 0;
+}
+
+#endif /* TST_CONFDIR_H */
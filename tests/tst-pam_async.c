@@ -0,0 +1,122 @@
+/*
+ * Check pam_authenticate_start() and pam_authenticate_continue() with
+ * a module that asks for the user and the password.
+ */
+
+#include "test_assert.h"
+#include "tst-confdir.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <security/pam_appl.h>
+#include <security/pam_ext.h>
+
+#define TEST_NAME "tst-pam_async"
+#define MODULE ".libs/tst-pam_async_module.so"
+
+static const char confdir[] = TEST_NAME ".d";
+static const char service[] = "service";
+
+static int conv_calls;
+
+static int
+tst_conv(int num_msg UNUSED, const struct pam_message **msg UNUSED,
+	 struct pam_response **resp UNUSED, void *appdata_ptr UNUSED)
+{
+	conv_calls++;
+	return PAM_CONV_ERR;
+}
+
+static struct pam_conv conv = { tst_conv, &conv_calls };
+
+static struct pam_response *
+answer(const char *text)
+{
+	struct pam_response *resp;
+
+	ASSERT_NE(NULL, resp = calloc(1, sizeof(*resp)));
+	ASSERT_NE(NULL, resp->resp = strdup(text));
+	return resp;
+}
+
+int
+main(void)
+{
+	const struct pam_message **msg;
+	pam_handle_t *pamh = NULL;
+	const void *item;
+	char *path;
+	int num_msg;
+
+	if (access(MODULE, R_OK) != 0)
+		return 77;
+	ASSERT_NE(NULL, path = realpath(MODULE, NULL));
+	ASSERT_EQ(0, tst_confdir_create(confdir));
+	ASSERT_EQ(0, tst_confdir_write(confdir, service, "auth required %s\n",
+				       path));
+	free(path);
+
+	ASSERT_EQ(PAM_SUCCESS,
+		  pam_start_confdir(service, NULL, &conv, confdir, &pamh));
+	ASSERT_EQ(PAM_SYSTEM_ERR,
+		  pam_authenticate_continue(pamh, NULL, &num_msg, &msg));
+
+	/* 1: the user and the password are asked one after the other */
+	ASSERT_EQ(PAM_INCOMPLETE,
+		  pam_authenticate_start(pamh, 0, &num_msg, &msg));
+	ASSERT_EQ(1, num_msg);
+	ASSERT_EQ(PAM_PROMPT_ECHO_ON, msg[0]->msg_style);
+	ASSERT_EQ(PAM_SYSTEM_ERR,
+		  pam_authenticate_start(pamh, 0, &num_msg, &msg));
+	ASSERT_EQ(PAM_INCOMPLETE,
+		  pam_authenticate_continue(pamh, answer("alice"),
+					    &num_msg, &msg));
+	ASSERT_EQ(1, num_msg);
+	ASSERT_EQ(PAM_PROMPT_ECHO_OFF, msg[0]->msg_style);
+	ASSERT_EQ(PAM_SUCCESS, pam_get_item(pamh, PAM_USER, &item));
+	ASSERT_EQ(0, strcmp(item, "alice"));
+	ASSERT_EQ(PAM_SUCCESS,
+		  pam_authenticate_continue(pamh, answer("secret"),
+					    &num_msg, &msg));
+	ASSERT_EQ(0, num_msg);
+	ASSERT_EQ(NULL, msg);
+
+	/* 2: the conversation of the application is back */
+	ASSERT_EQ(PAM_SUCCESS, pam_get_item(pamh, PAM_CONV, &item));
+	ASSERT_EQ(&conv_calls, ((const struct pam_conv *) item)->appdata_ptr);
+	ASSERT_EQ(0, conv_calls);
+
+	/* 3: a wrong password */
+	ASSERT_EQ(PAM_SUCCESS, pam_reset(pamh, "alice", PAM_SUCCESS));
+	ASSERT_EQ(PAM_INCOMPLETE,
+		  pam_authenticate_start(pamh, 0, &num_msg, &msg));
+	ASSERT_EQ(1, num_msg);
+	ASSERT_EQ(PAM_PROMPT_ECHO_OFF, msg[0]->msg_style);
+	ASSERT_EQ(PAM_AUTH_ERR,
+		  pam_authenticate_continue(pamh, answer("guess"),
+					    &num_msg, &msg));
+
+	/* 4: setting PAM_CONV while waiting */
+	ASSERT_EQ(PAM_INCOMPLETE,
+		  pam_authenticate_start(pamh, 0, &num_msg, &msg));
+	ASSERT_EQ(PAM_SUCCESS, pam_set_item(pamh, PAM_CONV, &conv));
+	ASSERT_EQ(PAM_SUCCESS,
+		  pam_authenticate_continue(pamh, answer("secret"),
+					    &num_msg, &msg));
+	ASSERT_EQ(PAM_SUCCESS, pam_get_item(pamh, PAM_CONV, &item));
+	ASSERT_EQ(&conv_calls, ((const struct pam_conv *) item)->appdata_ptr);
+
+	/* 5: the handle is freed while waiting */
+	ASSERT_EQ(PAM_SUCCESS, pam_reset(pamh, NULL, PAM_SUCCESS));
+	ASSERT_EQ(PAM_INCOMPLETE,
+		  pam_authenticate_start(pamh, 0, &num_msg, &msg));
+	ASSERT_EQ(PAM_SUCCESS, pam_reset(pamh, NULL, PAM_SUCCESS));
+	ASSERT_EQ(PAM_INCOMPLETE,
+		  pam_authenticate_start(pamh, 0, &num_msg, &msg));
+	ASSERT_EQ(PAM_SUCCESS, pam_end(pamh, PAM_SUCCESS));
+	ASSERT_EQ(0, conv_calls);
+
+	return 0;
+}
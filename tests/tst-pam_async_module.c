@@ -0,0 +1,125 @@
+/*
+ * A module for tst-pam_async: it asks for the user and the password,
+ * and accepts the password "secret", which pam_setcred() checks.  Its
+ * session functions are for tst-pam_parallel, see session() below.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <security/pam_modules.h>
+#include <security/pam_ext.h>
+
+int
+pam_sm_authenticate(pam_handle_t *pamh, int flags UNUSED,
+		    int argc UNUSED, const char **argv UNUSED)
+{
+	const char *user, *authtok;
+	int rc;
+
+	if ((rc = pam_get_user(pamh, &user, NULL)) != PAM_SUCCESS ||
+	    (rc = pam_get_authtok(pamh, PAM_AUTHTOK, &authtok,
+				  NULL)) != PAM_SUCCESS)
+		return rc == PAM_CONV_AGAIN ? PAM_INCOMPLETE : rc;
+
+	if (strcmp(authtok, "secret") != 0)
+		return PAM_AUTH_ERR;
+
+	return pam_set_data(pamh, "tst-pam_async_module", NULL, NULL);
+}
+
+/* the data of a successful pam_authenticate() has to be there */
+int
+pam_sm_setcred(pam_handle_t *pamh, int flags UNUSED,
+	       int argc UNUSED, const char **argv UNUSED)
+{
+	const void *data;
+
+	return pam_get_data(pamh, "tst-pam_async_module",
+			    &data) == PAM_SUCCESS ? PAM_SUCCESS : PAM_CRED_ERR;
+}
+
+/* modules that called meet() so far */
+static int arrived;
+
+/*
+ * Wait until n modules, this one included, are in meet() at once, which
+ * they only are if they are called at the same time.  Fails after ten
+ * seconds.
+ */
+static int
+meet(int n)
+{
+	struct timespec pause = { 0, 1000000 };
+	int round = (__atomic_add_fetch(&arrived, 1, __ATOMIC_SEQ_CST) - 1) / n;
+	int i;
+
+	for (i = 0; i < 10000; i++) {
+		if (__atomic_load_n(&arrived, __ATOMIC_SEQ_CST) >= (round + 1) * n)
+			return 0;
+		nanosleep(&pause, NULL);
+	}
+	return -1;
+}
+
+/*
+ * Wait delay=<ms>, or for meet=<n> modules to run at once, with
+ * authtok get the password with the options of pam_get_authtok() given,
+ * leave name=<name> in the environment, the data and a message of the
+ * handle, and return ret=<n>.
+ */
+static int
+session(pam_handle_t *pamh, int argc, const char **argv)
+{
+	struct timespec delay = { 0, 0 };
+	const char *name = "session", *authtok;
+	int ret = PAM_SUCCESS, together = 0, password = 0, i;
+	char env[64];
+	long ms;
+
+	for (i = 0; i < argc; i++) {
+		if (strncmp(argv[i], "delay=", 6) == 0) {
+			ms = atol(argv[i] + 6);
+			delay.tv_sec = ms / 1000;
+			delay.tv_nsec = ms % 1000 * 1000000;
+		} else if (strncmp(argv[i], "ret=", 4) == 0) {
+			ret = atoi(argv[i] + 4);
+		} else if (strncmp(argv[i], "name=", 5) == 0) {
+			name = argv[i] + 5;
+		} else if (strncmp(argv[i], "meet=", 5) == 0) {
+			together = atoi(argv[i] + 5);
+		} else if (strcmp(argv[i], "authtok") == 0) {
+			password = 1;
+		}
+	}
+
+	nanosleep(&delay, NULL);
+	if (together > 0 && meet(together) != 0)
+		return PAM_SYSTEM_ERR;
+	if (password)
+		(void) pam_get_authtok(pamh, PAM_AUTHTOK, &authtok, NULL);
+	snprintf(env, sizeof(env), "%s=1", name);
+	if (pam_putenv(pamh, env) != PAM_SUCCESS
+	    || pam_set_data(pamh, name, NULL, NULL) != PAM_SUCCESS
+	    || pam_info(pamh, "%s", name) != PAM_SUCCESS)
+		return PAM_SYSTEM_ERR;
+
+	return ret;
+}
+
+int
+pam_sm_open_session(pam_handle_t *pamh, int flags UNUSED,
+		    int argc, const char **argv)
+{
+	return session(pamh, argc, argv);
+}
+
+int
+pam_sm_close_session(pam_handle_t *pamh, int flags UNUSED,
+		     int argc, const char **argv)
+{
+	return session(pamh, argc, argv);
+}
@@ -0,0 +1,196 @@
+/*
+ * Check that a handle runs its stacks in the broker once one is
+ * enabled, that the modules find their data there from pam_setcred(),
+ * that a handle deferring the fail delay authenticates on its own, that
+ * a call the broker hangs up on fails instead of running the stack
+ * again, and that the handle runs them on its own without a broker.
+ */
+
+#include "test_assert.h"
+#include "tst-confdir.h"
+
+#include <dlfcn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <security/pam_appl.h>
+#include <security/pam_ext.h>
+
+#define TEST_NAME "tst-pam_broker"
+#define MODULE ".libs/tst-pam_async_module.so"
+
+static const char confdir[] = TEST_NAME ".d";
+static const char service[] = "service";
+static const char socket_path[] = TEST_NAME ".d/socket";
+
+/* answers the prompts with the user, then with the passwords in turn */
+static const char *passwords[] = { "wrong", "secret" };
+static int prompts;
+
+static int
+conv_func(int num_msg, const struct pam_message **msg,
+	  struct pam_response **resp, void *appdata_ptr)
+{
+	struct pam_response *reply;
+	int i;
+
+	(void) appdata_ptr;
+	if ((reply = calloc(num_msg, sizeof(*reply))) == NULL)
+		return PAM_BUF_ERR;
+	for (i = 0; i < num_msg; i++) {
+		if (msg[i]->msg_style == PAM_PROMPT_ECHO_ON)
+			reply[i].resp = strdup("user");
+		else
+			reply[i].resp = strdup(passwords[prompts++ % 2]);
+	}
+	*resp = reply;
+
+	return PAM_SUCCESS;
+}
+
+static struct pam_conv conv = { conv_func, NULL };
+
+static int
+loaded(const char *path)
+{
+	void *handle = dlopen(path, RTLD_NOW | RTLD_NOLOAD);
+
+	if (handle == NULL)
+		return 0;
+	dlclose(handle);
+	return 1;
+}
+
+/*
+ * A broker serving one connection, or, if lose is set, one that starts
+ * the transaction and hangs up once the call has come
+ */
+static pid_t
+start_broker(int lose)
+{
+	static const uint32_t started[3] = { 7, 4, PAM_SUCCESS };
+	char buf[4096];
+	struct sockaddr_un sa;
+	int lfd, fd;
+	pid_t pid;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, socket_path);
+	unlink(socket_path);
+	ASSERT_LT(-1, lfd = socket(AF_UNIX, SOCK_STREAM, 0));
+	ASSERT_EQ(0, bind(lfd, (struct sockaddr *) &sa, sizeof(sa)));
+	ASSERT_EQ(0, listen(lfd, 1));
+
+	ASSERT_LT(-1, pid = fork());
+	if (pid == 0) {
+		if ((fd = accept(lfd, NULL, NULL)) < 0)
+			_exit(2);
+		close(lfd);
+		if (lose)
+			_exit(read(fd, buf, sizeof(buf)) <= 0 ||
+			      write(fd, started, sizeof(started)) < 0 ||
+			      read(fd, buf, sizeof(buf)) <= 0);
+		_exit(pam_broker_serve(fd) == PAM_SUCCESS ? 0 : 1);
+	}
+	close(lfd);
+
+	return pid;
+}
+
+static void
+authenticate(pam_handle_t *pamh)
+{
+	const void *item;
+
+	prompts = 0;
+	ASSERT_EQ(PAM_AUTH_ERR, pam_authenticate(pamh, 0));
+	ASSERT_EQ(1, prompts);
+	ASSERT_EQ(PAM_SUCCESS, pam_set_item(pamh, PAM_USER, NULL));
+	ASSERT_EQ(PAM_SUCCESS, pam_authenticate(pamh, 0));
+	ASSERT_EQ(2, prompts);
+	ASSERT_EQ(PAM_SUCCESS, pam_get_item(pamh, PAM_USER, &item));
+	ASSERT_EQ(0, strcmp(item, "user"));
+	ASSERT_EQ(PAM_MODULE_UNKNOWN, pam_acct_mgmt(pamh, 0));
+}
+
+int
+main(void)
+{
+	pam_handle_t *pamh = NULL;
+	struct timespec deadline;
+	char *path;
+	pid_t pid;
+	int status;
+
+	/* the broker only takes a confdir from root */
+	if (access(MODULE, F_OK) != 0 || geteuid() != 0)
+		return 77;
+	ASSERT_NE(NULL, path = realpath(MODULE, NULL));
+
+	ASSERT_EQ(0, tst_confdir_create(confdir));
+	ASSERT_EQ(0, tst_confdir_write(confdir, service,
+				       "auth required %s\naccount required %s\n",
+				       path, path));
+
+	/* 1: the stacks run in the broker and the handle learns the user */
+	pid = start_broker(0);
+	ASSERT_EQ(PAM_SUCCESS, pam_broker_enable(1, socket_path));
+	ASSERT_EQ(PAM_SUCCESS,
+		  pam_start_confdir(service, NULL, &conv, confdir, &pamh));
+	authenticate(pamh);
+	ASSERT_EQ(0, loaded(path));
+	/* the module finds the data it left in the broker */
+	ASSERT_EQ(PAM_SUCCESS, pam_setcred(pamh, PAM_ESTABLISH_CRED));
+	ASSERT_EQ(PAM_SUCCESS, pam_end(pamh, PAM_SUCCESS));
+	ASSERT_EQ(pid, waitpid(pid, &status, 0));
+	ASSERT_NE(0, WIFEXITED(status));
+	ASSERT_EQ(0, WEXITSTATUS(status));
+
+	/* 2: the fail delay is deferred by the handle, not the broker */
+	pid = start_broker(0);
+	ASSERT_EQ(PAM_SUCCESS,
+		  pam_start_confdir(service, NULL, &conv, confdir, &pamh));
+	ASSERT_EQ(PAM_SUCCESS, pam_fail_delay_defer(pamh, 1));
+	ASSERT_EQ(PAM_SUCCESS, pam_fail_delay(pamh, 2000000));
+	prompts = 0;
+	ASSERT_EQ(PAM_AUTH_ERR, pam_authenticate(pamh, 0));
+	ASSERT_EQ(1, loaded(path));
+	ASSERT_EQ(PAM_SUCCESS, pam_fail_delay_deadline(pamh, &deadline));
+	ASSERT_NE(0, deadline.tv_sec);
+	ASSERT_EQ(PAM_SUCCESS, pam_end(pamh, PAM_SUCCESS));
+	ASSERT_EQ(pid, waitpid(pid, &status, 0));
+	ASSERT_EQ(0, loaded(path));
+
+	/* 3: a broker lost during the call fails it */
+	pid = start_broker(1);
+	ASSERT_EQ(PAM_SUCCESS,
+		  pam_start_confdir(service, NULL, &conv, confdir, &pamh));
+	prompts = 0;
+	ASSERT_EQ(PAM_SYSTEM_ERR, pam_authenticate(pamh, 0));
+	ASSERT_EQ(0, prompts);
+	ASSERT_EQ(0, loaded(path));
+	ASSERT_EQ(PAM_SUCCESS, pam_end(pamh, PAM_SUCCESS));
+	ASSERT_EQ(pid, waitpid(pid, &status, 0));
+	ASSERT_EQ(0, WEXITSTATUS(status));
+
+	/* 4: without a broker the handle runs them itself */
+	ASSERT_EQ(0, unlink(socket_path));
+	ASSERT_EQ(PAM_SUCCESS,
+		  pam_start_confdir(service, NULL, &conv, confdir, &pamh));
+	authenticate(pamh);
+	ASSERT_EQ(1, loaded(path));
+	ASSERT_EQ(PAM_SUCCESS, pam_setcred(pamh, PAM_ESTABLISH_CRED));
+	ASSERT_EQ(PAM_SUCCESS, pam_end(pamh, PAM_SUCCESS));
+	ASSERT_EQ(PAM_SUCCESS, pam_broker_enable(0, NULL));
+
+	free(path);
+
+	return 0;
+}
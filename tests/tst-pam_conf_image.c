@@ -0,0 +1,132 @@
+/*
+ * Check that pam_conf_image_write() compiles a configuration directory
+ * and that libpam uses the image only while the files are unchanged.
+ */
+
+#include "test_assert.h"
+#include "tst-confdir.h"
+
+#include <dlfcn.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <security/pam_appl.h>
+#include <security/pam_ext.h>
+
+#define TEST_NAME "tst-pam_conf_image"
+
+static const char confdir[] = TEST_NAME ".d";
+static const char image[] = TEST_NAME ".d/.image";
+static const char service[] = "service";
+static const char service2[] = "service2";
+static struct pam_conv conv;
+static int opened, interposed = 1;
+
+/* count the configuration files libpam reads */
+FILE *
+fopen(const char *path, const char *mode)
+{
+	static FILE *(*real_fopen)(const char *, const char *);
+
+	if (real_fopen == NULL)
+		real_fopen = (FILE *(*)(const char *, const char *))
+			dlsym(RTLD_NEXT, "fopen");
+	if (strncmp(path, confdir, sizeof(confdir) - 1) == 0)
+		opened++;
+	return real_fopen(path, mode);
+}
+
+static void
+write_file(const char *name, const char *content)
+{
+	ASSERT_EQ(0, tst_confdir_write(confdir, name, "#%%PAM-1.0\n%s",
+				       content));
+}
+
+static void
+remove_file(const char *name)
+{
+	char path[sizeof(confdir) + 32];
+
+	sprintf(path, "%s/%s", confdir, name);
+	ASSERT_EQ(0, unlink(path));
+}
+
+/* start a transaction, 1 if its files were parsed, -1 if unknown */
+static int
+start(const char *name, pam_handle_t **pamh)
+{
+	opened = 0;
+	ASSERT_EQ(PAM_SUCCESS,
+		  pam_start_confdir(name, NULL, &conv, confdir, pamh));
+	return interposed ? opened != 0 : -1;
+}
+
+int
+main(void)
+{
+	pam_handle_t *pamh = NULL;
+	FILE *fp;
+	long off;
+	int c;
+
+	ASSERT_EQ(0, tst_confdir_create(confdir));
+	write_file(service, "auth include included\n"
+		   "account substack sub\n");
+	write_file("included", "auth requisite\n");
+	write_file("sub", "account required /nonexistent/pam_none.so a b\n");
+	write_file("other", "password requisite\n");
+
+	/* 1: without an image the files are parsed, if fopen() is ours */
+	interposed = start(service, &pamh);
+	ASSERT_EQ(PAM_PERM_DENIED, pam_authenticate(pamh, 0));
+	ASSERT_EQ(PAM_SUCCESS, pam_end(pamh, 0));
+
+	/* 2: with an image nothing is, and the result is the same */
+	ASSERT_EQ(PAM_SUCCESS, pam_conf_image_write(confdir));
+	ASSERT_EQ(0, access(image, R_OK));
+	ASSERT_NE(1, start(service, &pamh));
+	ASSERT_EQ(PAM_PERM_DENIED, pam_authenticate(pamh, 0));
+	ASSERT_EQ(PAM_PERM_DENIED, pam_setcred(pamh, 0));
+	ASSERT_EQ(PAM_MODULE_UNKNOWN, pam_acct_mgmt(pamh, 0));
+	ASSERT_EQ(PAM_PERM_DENIED, pam_chauthtok(pamh, 0));
+	ASSERT_EQ(PAM_SUCCESS, pam_end(pamh, 0));
+
+	/* 3: a changed include file makes libpam parse again */
+	write_file("included", "auth required /nonexistent/pam_none.so\n");
+	ASSERT_NE(0, start(service, &pamh));
+	ASSERT_EQ(PAM_MODULE_UNKNOWN, pam_authenticate(pamh, 0));
+	ASSERT_EQ(PAM_SUCCESS, pam_end(pamh, 0));
+
+	/* 4: until the image is written again */
+	ASSERT_EQ(PAM_SUCCESS, pam_conf_image_write(confdir));
+	ASSERT_NE(1, start(service, &pamh));
+	ASSERT_EQ(PAM_MODULE_UNKNOWN, pam_authenticate(pamh, 0));
+	ASSERT_EQ(PAM_SUCCESS, pam_end(pamh, 0));
+
+	/* 5: a service without a file is parsed and falls back to "other" */
+	ASSERT_NE(0, start(service2, &pamh));
+	ASSERT_EQ(PAM_PERM_DENIED, pam_chauthtok(pamh, 0));
+	ASSERT_EQ(PAM_SUCCESS, pam_end(pamh, 0));
+
+	/* 6: a service added after the image was written is parsed */
+	write_file(service2, "password required /nonexistent/pam_none.so\n");
+	ASSERT_NE(0, start(service2, &pamh));
+	ASSERT_EQ(PAM_MODULE_UNKNOWN, pam_chauthtok(pamh, 0));
+	ASSERT_EQ(PAM_SUCCESS, pam_end(pamh, 0));
+	remove_file(service2);
+
+	/* 7: a corrupt image is ignored */
+	ASSERT_NE(NULL, fp = fopen(image, "r+"));
+	for (off = 8; fseek(fp, off, SEEK_SET) == 0
+		      && (c = fgetc(fp)) != EOF; off += 61) {
+		ASSERT_EQ(0, fseek(fp, off, SEEK_SET));
+		ASSERT_EQ(c ^ 0x5a, fputc(c ^ 0x5a, fp));
+	}
+	ASSERT_EQ(0, fclose(fp));
+	ASSERT_NE(0, start(service, &pamh));
+	ASSERT_EQ(PAM_MODULE_UNKNOWN, pam_authenticate(pamh, 0));
+	ASSERT_EQ(PAM_SUCCESS, pam_end(pamh, 0));
+
+	return 0;
+}
@@ -0,0 +1,71 @@
+/*
+ * Check that pam_fail_delay_defer() makes a failing pam_authenticate()
+ * return at once, with the end of the delay in pam_fail_delay_deadline().
+ */
+
+#include "test_assert.h"
+#include "tst-confdir.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <security/pam_appl.h>
+#include <security/pam_ext.h>
+
+#define TEST_NAME "tst-pam_fail_delay_defer"
+#define DELAY 2000000     /* usec, waited for between 1 and 3 seconds */
+
+static const char confdir[] = TEST_NAME ".d";
+static const char service[] = "service";
+static struct pam_conv conv;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	ASSERT_EQ(0, clock_gettime(CLOCK_MONOTONIC, &ts));
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(void)
+{
+	pam_handle_t *pamh = NULL;
+	struct timespec deadline;
+	double start, end;
+
+	ASSERT_EQ(0, tst_confdir_create(confdir));
+	ASSERT_EQ(0, tst_confdir_write(confdir, service,
+				       "auth required /nonexistent/pam_none.so\n"));
+
+	ASSERT_EQ(PAM_SUCCESS,
+		  pam_start_confdir(service, "alice", &conv, confdir, &pamh));
+
+	/* 1: nothing to wait for yet */
+	ASSERT_EQ(PAM_SUCCESS, pam_fail_delay_deadline(pamh, &deadline));
+	ASSERT_EQ(0, deadline.tv_sec);
+	ASSERT_EQ(0, deadline.tv_nsec);
+
+	/* 2: the failure returns at once, with the deadline */
+	ASSERT_EQ(PAM_SUCCESS, pam_fail_delay_defer(pamh, 1));
+	ASSERT_EQ(PAM_SUCCESS, pam_fail_delay(pamh, DELAY));
+	start = now();
+	ASSERT_NE(PAM_SUCCESS, pam_authenticate(pamh, 0));
+	end = now();
+	ASSERT_LT(end - start, 0.9);
+	ASSERT_EQ(PAM_SUCCESS, pam_fail_delay_deadline(pamh, &deadline));
+	ASSERT_LT(start + 0.9, deadline.tv_sec + deadline.tv_nsec / 1e9);
+	ASSERT_LT(deadline.tv_sec + deadline.tv_nsec / 1e9, end + 3.1);
+
+	/* 3: without a delay requested, there is no deadline */
+	ASSERT_NE(PAM_SUCCESS, pam_authenticate(pamh, 0));
+	ASSERT_EQ(PAM_SUCCESS, pam_fail_delay_deadline(pamh, &deadline));
+	ASSERT_EQ(0, deadline.tv_sec);
+
+	ASSERT_EQ(PAM_SUCCESS, pam_end(pamh, PAM_SUCCESS));
+	ASSERT_EQ(PAM_SYSTEM_ERR, pam_fail_delay_defer(NULL, 1));
+
+	return 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * Check that the modules of a service are only loaded when a chain
+ * that lists them is dispatched, and that a module which could not be
+ * loaded is tried again by the next handle.
+ */
+
+#include "test_assert.h"
+#include "tst-confdir.h"
+
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <security/pam_appl.h>
+
+#define TEST_NAME "tst-pam_lazy_load"
+#define MODULE ".libs/tst-pam_async_module.so"
+
+static const char confdir[] = TEST_NAME ".d";
+static const char service[] = "service";
+static struct pam_conv conv;
+
+static int
+loaded(const char *path)
+{
+	void *handle = dlopen(path, RTLD_NOW | RTLD_NOLOAD);
+
+	if (handle == NULL)
+		return 0;
+	dlclose(handle);
+	return 1;
+}
+
+int
+main(void)
+{
+	pam_handle_t *pamh = NULL, *pamh2 = NULL;
+	char *path, *dir, later[4096];
+
+	if (access(MODULE, F_OK) != 0)
+		return 77;
+	ASSERT_NE(NULL, path = realpath(MODULE, NULL));
+
+	ASSERT_EQ(0, tst_confdir_create(confdir));
+	ASSERT_EQ(0, tst_confdir_write(confdir, service,
+				       "auth required %s\naccount required %s\n"
+				       "password required /nonexistent/pam_none.so\n",
+				       path, path));
+
+	/* 1: pam_start() only reads the configuration */
+	ASSERT_EQ(PAM_SUCCESS,
+		  pam_start_confdir(service, NULL, &conv, confdir, &pamh));
+	ASSERT_EQ(0, loaded(path));
+
+	/* 2: a missing module fails when its chain is dispatched */
+	ASSERT_EQ(PAM_MODULE_UNKNOWN, pam_chauthtok(pamh, 0));
+	ASSERT_EQ(0, loaded(path));
+
+	/* 3: the first chain listing the module loads it */
+	ASSERT_EQ(PAM_MODULE_UNKNOWN, pam_acct_mgmt(pamh, 0));
+	ASSERT_EQ(1, loaded(path));
+	ASSERT_EQ(PAM_MODULE_UNKNOWN, pam_acct_mgmt(pamh, 0));
+
+	/* 4: and it is unloaded with the last handle */
+	ASSERT_EQ(PAM_SUCCESS, pam_end(pamh, 0));
+	ASSERT_EQ(0, loaded(path));
+
+	/* 5: a module installed after it failed to load */
+	ASSERT_NE(NULL, dir = realpath(confdir, NULL));
+	ASSERT_LT(0, snprintf(later, sizeof(later), "%s/later.so", dir));
+	ASSERT_EQ(0, tst_confdir_write(confdir, "later",
+				       "account required %s\n", later));
+	ASSERT_EQ(PAM_SUCCESS,
+		  pam_start_confdir("later", NULL, &conv, confdir, &pamh));
+	ASSERT_EQ(PAM_MODULE_UNKNOWN, pam_acct_mgmt(pamh, 0));
+	ASSERT_EQ(0, symlink(path, later));
+	ASSERT_EQ(PAM_SUCCESS,
+		  pam_start_confdir("later", NULL, &conv, confdir, &pamh2));
+	ASSERT_EQ(PAM_MODULE_UNKNOWN, pam_acct_mgmt(pamh2, 0));
+	ASSERT_EQ(1, loaded(path));
+	ASSERT_EQ(PAM_SUCCESS, pam_end(pamh2, 0));
+	ASSERT_EQ(PAM_SUCCESS, pam_end(pamh, 0));
+	ASSERT_EQ(0, loaded(path));
+
+	free(dir);
+	free(path);
+
+	return 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * Check the module call statistics of pam_module_stats_enable().
+ */
+
+#include "test_assert.h"
+#include "tst-confdir.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <security/pam_appl.h>
+#include <security/pam_ext.h>
+
+#define TEST_NAME "tst-pam_module_stats"
+#define MODULE ".libs/tst-pam_async_module.so"
+
+static const char confdir[] = TEST_NAME ".d";
+static const char service[] = "service";
+static const char dump_file[] = TEST_NAME ".d/stats";
+static const char *password;
+
+static int
+tst_conv(int num_msg, const struct pam_message **msg UNUSED,
+	 struct pam_response **resp, void *appdata_ptr UNUSED)
+{
+	ASSERT_EQ(1, num_msg);
+	ASSERT_NE(NULL, *resp = calloc(1, sizeof(**resp)));
+	ASSERT_NE(NULL, (*resp)->resp = strdup(password));
+	return PAM_SUCCESS;
+}
+
+static struct pam_conv conv = { tst_conv, NULL };
+
+static int
+count(const struct pam_module_stats *stats, void *arg)
+{
+	const struct pam_module_stats **found = arg;
+
+	if (!strcmp(stats->function, "authenticate"))
+		found[0] = stats;
+	else
+		found[1] = stats;
+	return 0;
+}
+
+static void
+authenticate(pam_handle_t *pamh, const char *authtok, int expected)
+{
+	password = authtok;
+	ASSERT_EQ(expected, pam_authenticate(pamh, 0));
+}
+
+int
+main(void)
+{
+	const struct pam_module_stats *found[2];
+	pam_handle_t *pamh = NULL;
+	unsigned long calls;
+	char *path, line[64];
+	int i;
+	FILE *fp;
+
+	if (access(MODULE, R_OK) != 0)
+		return 77;
+	ASSERT_NE(NULL, path = realpath(MODULE, NULL));
+	ASSERT_EQ(0, tst_confdir_create(confdir));
+	ASSERT_EQ(0, tst_confdir_write(confdir, service, "auth required %s\n",
+				       path));
+
+	ASSERT_EQ(PAM_SUCCESS,
+		  pam_start_confdir(service, "alice", &conv, confdir, &pamh));
+
+	/* 1: nothing is counted before the statistics are enabled */
+	authenticate(pamh, "secret", PAM_SUCCESS);
+	memset(found, 0, sizeof(found));
+	ASSERT_EQ(PAM_SUCCESS, pam_module_stats_walk(count, found));
+	ASSERT_EQ(NULL, found[0]);
+
+	/* 2: calls are counted by function and result */
+	ASSERT_EQ(PAM_SUCCESS, pam_module_stats_enable(1));
+	authenticate(pamh, "guess", PAM_AUTH_ERR);
+	authenticate(pamh, "secret", PAM_SUCCESS);
+	ASSERT_EQ(PAM_SUCCESS, pam_setcred(pamh, 0));
+	memset(found, 0, sizeof(found));
+	ASSERT_EQ(PAM_SUCCESS, pam_module_stats_walk(count, found));
+	ASSERT_NE(NULL, found[0]);
+	ASSERT_EQ(0, strcmp(found[0]->service, service));
+	ASSERT_EQ(0, strcmp(found[0]->module, "tst-pam_async_module"));
+	ASSERT_EQ(2UL, found[0]->calls);
+	ASSERT_EQ(1UL, found[0]->retval[PAM_SUCCESS]);
+	ASSERT_EQ(1UL, found[0]->retval[PAM_AUTH_ERR]);
+	ASSERT_LE(found[0]->max_usec, found[0]->total_usec);
+	for (calls = 0, i = 0; i < PAM_MODULE_STATS_BUCKETS; i++)
+		calls += found[0]->histogram[i];
+	ASSERT_EQ(2UL, calls);
+	ASSERT_NE(NULL, found[1]);
+	ASSERT_EQ(0, strcmp(found[1]->function, "setcred"));
+	ASSERT_EQ(1UL, found[1]->calls);
+
+	/* 3: the dump has a line per entry */
+	ASSERT_EQ(PAM_SUCCESS, pam_module_stats_dump(dump_file, 0));
+	ASSERT_NE(NULL, fp = fopen(dump_file, "r"));
+	for (i = 0; fgets(line, sizeof(line), fp) != NULL; ) {
+		if (strchr(line, '\n') != NULL)
+			i++;
+	}
+	ASSERT_EQ(0, fclose(fp));
+	ASSERT_EQ(2, i);
+
+	/* 4: disabled and reset */
+	ASSERT_EQ(PAM_SUCCESS, pam_module_stats_enable(0));
+	authenticate(pamh, "secret", PAM_SUCCESS);
+	memset(found, 0, sizeof(found));
+	ASSERT_EQ(PAM_SUCCESS, pam_module_stats_walk(count, found));
+	ASSERT_EQ(2UL, found[0]->calls);
+	pam_module_stats_reset();
+	memset(found, 0, sizeof(found));
+	ASSERT_EQ(PAM_SUCCESS, pam_module_stats_walk(count, found));
+	ASSERT_EQ(NULL, found[0]);
+
+	ASSERT_EQ(PAM_SUCCESS, pam_end(pamh, PAM_SUCCESS));
+	free(path);
+
+	return 0;
+}
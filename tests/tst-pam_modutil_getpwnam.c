@@ -0,0 +1,50 @@
+/*
+ * Check that the pam_modutil_get*() functions return the entry looked
+ * up before by the same handle.
+ */
+
+#include "test_assert.h"
+
+#include <grp.h>
+#include <pwd.h>
+#include <string.h>
+#include <security/pam_appl.h>
+#include <security/pam_modutil.h>
+
+static struct pam_conv conv;
+
+int
+main(void)
+{
+	pam_handle_t *pamh = NULL, *pamh2 = NULL;
+	struct passwd *pwd;
+	struct group *grp;
+
+	ASSERT_EQ(PAM_SUCCESS, pam_start("dummy", "root", &conv, &pamh));
+	ASSERT_EQ(PAM_SUCCESS, pam_start("dummy", "root", &conv, &pamh2));
+
+	/* 1: the same handle gets the same entry */
+	ASSERT_NE(NULL, pwd = pam_modutil_getpwnam(pamh, "root"));
+	ASSERT_EQ(0U, pwd->pw_uid);
+	ASSERT_EQ(pwd, pam_modutil_getpwnam(pamh, "root"));
+	ASSERT_NE(pwd, pam_modutil_getpwnam(pamh2, "root"));
+
+	/* 2: lookups by id are kept apart from lookups by name */
+	ASSERT_NE(NULL, pwd = pam_modutil_getpwuid(pamh, 0));
+	ASSERT_EQ(0, strcmp(pwd->pw_name, "root"));
+	ASSERT_EQ(pwd, pam_modutil_getpwuid(pamh, 0));
+
+	ASSERT_NE(NULL, grp = pam_modutil_getgrgid(pamh, 0));
+	ASSERT_EQ(grp, pam_modutil_getgrgid(pamh, 0));
+	ASSERT_NE(NULL, grp = pam_modutil_getgrnam(pamh, grp->gr_name));
+	ASSERT_EQ(grp, pam_modutil_getgrnam(pamh, grp->gr_name));
+
+	/* 3: failed lookups are not remembered */
+	ASSERT_EQ(NULL, pam_modutil_getpwnam(pamh, "tst-pam_modutil-nouser"));
+	ASSERT_EQ(NULL, pam_modutil_getpwnam(pamh, "tst-pam_modutil-nouser"));
+
+	ASSERT_EQ(PAM_SUCCESS, pam_end(pamh2, 0));
+	ASSERT_EQ(PAM_SUCCESS, pam_end(pamh, 0));
+
+	return 0;
+}
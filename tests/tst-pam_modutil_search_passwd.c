@@ -0,0 +1,123 @@
+/*
+ * Check that pam_modutil_search_passwd() finds the first line of a user,
+ * sees a passwd file replaced or rewritten in place, and scans a file
+ * that is not regular.
+ */
+
+#include "test_assert.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <security/pam_appl.h>
+#include <security/pam_modutil.h>
+
+#define TEST_NAME "tst-pam_modutil_search_passwd"
+#define USERS 10000
+
+static const char passwd_file[] = TEST_NAME ".passwd";
+static const char tmp_file[] = TEST_NAME ".tmp";
+static const char fifo_file[] = TEST_NAME ".fifo";
+
+static struct pam_conv conv;
+
+/* USERS users, user0 twice, and a last line without a newline */
+static void
+write_passwd(const char *path, const char *shell)
+{
+	FILE *fp;
+	int i;
+
+	ASSERT_NE(NULL, fp = fopen(path, "w"));
+	ASSERT_LT(0, fprintf(fp, "# not a user\n\nuser0:x:0:0::/:%s\n",
+			     shell));
+	for (i = 0; i < USERS; i++)
+		ASSERT_LT(0, fprintf(fp, "user%d:x:%d:%d::/home/user%d:%s\n",
+				     i, i, i, i, shell));
+	ASSERT_LT(0, fprintf(fp, "last:x:1:1::/:%s", shell));
+	ASSERT_EQ(0, fclose(fp));
+}
+
+int
+main(void)
+{
+	pam_handle_t *pamh = NULL;
+	char line[256], expected[256], small[8];
+	int i;
+
+	ASSERT_EQ(PAM_SUCCESS, pam_start("dummy", "root", &conv, &pamh));
+	write_passwd(passwd_file, "/bin/sh");
+
+	/* 1: every user is found, with its first line */
+	for (i = 1; i < USERS; i++) {
+		char name[32];
+
+		sprintf(name, "user%d", i);
+		sprintf(expected, "user%d:x:%d:%d::/home/user%d:/bin/sh",
+			i, i, i, i);
+		ASSERT_EQ(PAM_SUCCESS,
+			  pam_modutil_search_passwd(pamh, name, passwd_file,
+						    line, sizeof(line)));
+		ASSERT_EQ(0, strcmp(line, expected));
+	}
+	ASSERT_EQ(PAM_SUCCESS, pam_modutil_search_passwd(pamh, "user0",
+			passwd_file, line, sizeof(line)));
+	ASSERT_EQ(0, strcmp(line, "user0:x:0:0::/:/bin/sh"));
+	ASSERT_EQ(PAM_SUCCESS, pam_modutil_search_passwd(pamh, "last",
+			passwd_file, line, sizeof(line)));
+	ASSERT_EQ(0, strcmp(line, "last:x:1:1::/:/bin/sh"));
+	ASSERT_EQ(PAM_SUCCESS, pam_modutil_search_passwd(pamh, "user1",
+			passwd_file, NULL, 0));
+
+	/* 2: no prefixes, no colons, no comments, a buffer too small */
+	ASSERT_EQ(PAM_USER_UNKNOWN, pam_modutil_search_passwd(pamh, "user",
+			passwd_file, NULL, 0));
+	ASSERT_EQ(PAM_USER_UNKNOWN, pam_modutil_search_passwd(pamh, "user10000",
+			passwd_file, NULL, 0));
+	ASSERT_EQ(PAM_USER_UNKNOWN, pam_modutil_search_passwd(pamh, "user1:x",
+			passwd_file, NULL, 0));
+	ASSERT_EQ(PAM_USER_UNKNOWN, pam_modutil_search_passwd(pamh, "# not a user",
+			passwd_file, NULL, 0));
+	ASSERT_EQ(PAM_USER_UNKNOWN, pam_modutil_search_passwd(pamh, "",
+			passwd_file, NULL, 0));
+	ASSERT_EQ(PAM_BUF_ERR, pam_modutil_search_passwd(pamh, "user1",
+			passwd_file, small, sizeof(small)));
+
+	/* 3: a new file is seen at once */
+	write_passwd(tmp_file, "/bin/bash");
+	ASSERT_EQ(0, rename(tmp_file, passwd_file));
+	ASSERT_EQ(PAM_SUCCESS, pam_modutil_search_passwd(pamh, "user7",
+			passwd_file, line, sizeof(line)));
+	ASSERT_EQ(0, strcmp(line, "user7:x:7:7::/home/user7:/bin/bash"));
+
+	/* 4: and so is the same file rewritten */
+	write_passwd(passwd_file, "/bin/zsh");
+	ASSERT_EQ(PAM_SUCCESS, pam_modutil_search_passwd(pamh, "user7",
+			passwd_file, line, sizeof(line)));
+	ASSERT_EQ(0, strcmp(line, "user7:x:7:7::/home/user7:/bin/zsh"));
+
+	/* 5: a missing file */
+	ASSERT_EQ(0, unlink(passwd_file));
+	ASSERT_EQ(PAM_SERVICE_ERR, pam_modutil_search_passwd(pamh, "user7",
+			passwd_file, NULL, 0));
+
+	/* 6: a file that is not regular is scanned */
+	ASSERT_EQ(0, mkfifo(fifo_file, 0600));
+	if (fork() == 0) {
+		FILE *fp = fopen(fifo_file, "w");
+
+		if (fp == NULL || fputs("a:x:1:1::/:\nb:x:2:2::/:\n", fp) < 0)
+			_exit(1);
+		_exit(fclose(fp) != 0);
+	}
+	ASSERT_EQ(PAM_SUCCESS, pam_modutil_search_passwd(pamh, "b",
+			fifo_file, line, sizeof(line)));
+	ASSERT_EQ(0, strcmp(line, "b:x:2:2::/:"));
+	ASSERT_EQ(0, unlink(fifo_file));
+
+	ASSERT_EQ(PAM_SUCCESS, pam_end(pamh, 0));
+
+	return 0;
+}
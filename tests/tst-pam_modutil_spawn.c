@@ -0,0 +1,130 @@
+/*
+ * Check that pam_modutil_spawn_helper() gives the helper the standard
+ * descriptors it is asked for and no others, starts a new session when
+ * asked to, and tells a helper that cannot be run from a process that
+ * cannot be started.
+ */
+
+#include "test_assert.h"
+#include "pam_cc_compat.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <security/pam_appl.h>
+#include <security/pam_modutil.h>
+
+#define SH "/bin/sh"
+
+static struct pam_conv conv;
+static char *envp[] = { NULL };
+
+/* run sh -c script, with its stdout on a pipe, and return the exit status */
+static int
+run(pam_handle_t *pamh, const char *script, unsigned int flags,
+    char *out, size_t size)
+{
+	struct pam_modutil_spawn_attr attr;
+	const char *argv[] = { SH, "-c", script, NULL };
+	int p[2], status, n;
+	pid_t pid;
+
+	ASSERT_EQ(0, pipe(p));
+	memset(&attr, 0, sizeof(attr));
+	attr.stdfd[0] = attr.stdfd[2] = -1;
+	attr.stdfd[1] = p[1];
+	attr.redirect[0] = PAM_MODUTIL_PIPE_FD;
+	attr.redirect[2] = PAM_MODUTIL_NULL_FD;
+	attr.flags = flags;
+
+	DIAG_PUSH_IGNORE_CAST_QUAL;
+	pid = pam_modutil_spawn_helper(pamh, SH, (char *const *) argv, envp,
+				       &attr);
+	DIAG_POP_IGNORE_CAST_QUAL;
+	ASSERT_LT(0, pid);
+	ASSERT_EQ(0, close(p[1]));
+	ASSERT_LT(-1, n = pam_modutil_read(p[0], out, size - 1));
+	out[n] = '\0';
+	ASSERT_EQ(0, close(p[0]));
+	ASSERT_EQ(pid, waitpid(pid, &status, 0));
+	ASSERT_NE(0, WIFEXITED(status));
+
+	return WEXITSTATUS(status);
+}
+
+int
+main(void)
+{
+	pam_handle_t *pamh = NULL;
+	struct pam_modutil_spawn_attr attr;
+	const char *argv[] = { "/nonexistent", NULL };
+	const char *sh_argv[] = { SH, "-c", "exit 0", NULL };
+	struct passwd *pw;
+	struct rlimit rlim;
+	char out[256];
+	int fd, status;
+	pid_t pid;
+
+	if (access(SH, X_OK) != 0 || access("/proc/self/fd", F_OK) != 0)
+		return 77;
+
+	ASSERT_EQ(PAM_SUCCESS, pam_start("dummy", "root", &conv, &pamh));
+
+	/* a descriptor the helper must not get */
+	ASSERT_LT(STDERR_FILENO, fd = open("/dev/null", O_RDONLY));
+
+	/* 1: only the standard descriptors are open, stdin is at EOF */
+	ASSERT_EQ(0, run(pamh, "ls /proc/$$/fd; ! read x", 0, out, sizeof(out)));
+	ASSERT_EQ(0, strcmp(out, "0\n1\n2\n"));
+
+	/* 2: a new session, or the one of the caller */
+	ASSERT_EQ(0, run(pamh, "test $(cut -d' ' -f6 /proc/$$/stat) = $$",
+			 PAM_MODUTIL_SPAWN_SETSID, out, sizeof(out)));
+	ASSERT_NE(0, run(pamh, "test $(cut -d' ' -f6 /proc/$$/stat) = $$",
+			 0, out, sizeof(out)));
+
+	/* 3: a helper that is not there */
+	memset(&attr, 0, sizeof(attr));
+	attr.stdfd[0] = attr.stdfd[1] = attr.stdfd[2] = -1;
+	errno = 0;
+	DIAG_PUSH_IGNORE_CAST_QUAL;
+	ASSERT_EQ(-2, pam_modutil_spawn_helper(pamh, argv[0],
+						 (char *const *) argv, envp,
+						 &attr));
+	DIAG_POP_IGNORE_CAST_QUAL;
+	ASSERT_EQ(ENOENT, errno);
+
+	/* 4: no process for a user at the limit, root has none */
+	ASSERT_LE(0, pid = fork());
+	if (pid == 0) {
+		if (getuid() == 0) {
+			if ((pw = getpwnam("nobody")) == NULL)
+				_exit(0);
+			ASSERT_EQ(0, setgid(pw->pw_gid));
+			ASSERT_EQ(0, setuid(pw->pw_uid));
+		}
+		ASSERT_EQ(0, getrlimit(RLIMIT_NPROC, &rlim));
+		rlim.rlim_cur = 0;
+		ASSERT_EQ(0, setrlimit(RLIMIT_NPROC, &rlim));
+		errno = 0;
+		DIAG_PUSH_IGNORE_CAST_QUAL;
+		ASSERT_EQ(-1, pam_modutil_spawn_helper(pamh, SH,
+							 (char *const *) sh_argv,
+							 envp, &attr));
+		DIAG_POP_IGNORE_CAST_QUAL;
+		ASSERT_EQ(EAGAIN, errno);
+		_exit(0);
+	}
+	ASSERT_EQ(pid, waitpid(pid, &status, 0));
+	ASSERT_EQ(0, status);
+
+	ASSERT_EQ(0, close(fd));
+	ASSERT_EQ(PAM_SUCCESS, pam_end(pamh, 0));
+
+	return 0;
+}
@@ -0,0 +1,81 @@
+/*
+ * Check the process-wide cache of passwd and group entries.
+ */
+
+#include "test_assert.h"
+
+#include <grp.h>
+#include <pwd.h>
+#include <string.h>
+#include <security/pam_appl.h>
+#include <security/pam_ext.h>
+#include <security/pam_modutil.h>
+
+#define NOUSER "tst-pam_nss_cache-nouser"
+
+static struct pam_conv conv;
+
+int
+main(void)
+{
+	pam_handle_t *pamh = NULL, *pamh2 = NULL;
+	struct pam_nss_cache_stats st;
+	struct passwd *pwd, *pwd2;
+	struct group *grp;
+
+	ASSERT_EQ(PAM_SUCCESS, pam_nss_cache_enable(2, 60, 60));
+	ASSERT_EQ(PAM_SUCCESS, pam_start("dummy", "root", &conv, &pamh));
+	ASSERT_EQ(PAM_SUCCESS, pam_start("dummy", "root", &conv, &pamh2));
+
+	/* 1: the second handle gets a copy of the cached entry */
+	ASSERT_NE(NULL, pwd = pam_modutil_getpwnam(pamh, "root"));
+	ASSERT_NE(NULL, pwd2 = pam_modutil_getpwnam(pamh2, "root"));
+	ASSERT_NE(pwd, pwd2);
+	ASSERT_EQ(0U, pwd2->pw_uid);
+	ASSERT_EQ(0, strcmp(pwd->pw_name, pwd2->pw_name));
+	ASSERT_EQ(0, strcmp(pwd->pw_dir, pwd2->pw_dir));
+	ASSERT_EQ(0, strcmp(pwd->pw_shell, pwd2->pw_shell));
+	ASSERT_EQ(PAM_SUCCESS, pam_nss_cache_stats(&st));
+	ASSERT_EQ(1UL, st.entries);
+	ASSERT_EQ(1UL, st.misses);
+	ASSERT_EQ(1UL, st.hits);
+
+	/* 2: the entry outlives the handle that looked it up */
+	ASSERT_EQ(PAM_SUCCESS, pam_end(pamh, 0));
+	ASSERT_EQ(PAM_SUCCESS, pam_start("dummy", "root", &conv, &pamh));
+	ASSERT_NE(NULL, pwd = pam_modutil_getpwnam(pamh, "root"));
+	ASSERT_EQ(0, strcmp(pwd->pw_name, "root"));
+
+	/* 3: unknown names are remembered */
+	ASSERT_EQ(NULL, pam_modutil_getpwnam(pamh, NOUSER));
+	ASSERT_EQ(NULL, pam_modutil_getpwnam(pamh2, NOUSER));
+	ASSERT_EQ(PAM_SUCCESS, pam_nss_cache_stats(&st));
+	ASSERT_EQ(2UL, st.entries);
+	ASSERT_EQ(1UL, st.negative_hits);
+
+	/* 4: group entries with their member lists are copied */
+	ASSERT_NE(NULL, grp = pam_modutil_getgrgid(pamh, 0));
+	ASSERT_NE(NULL, grp = pam_modutil_getgrgid(pamh2, 0));
+	ASSERT_EQ(0U, grp->gr_gid);
+	ASSERT_NE(NULL, grp->gr_mem);
+
+	/* 5: the least recently used entry was dropped */
+	ASSERT_EQ(PAM_SUCCESS, pam_nss_cache_stats(&st));
+	ASSERT_EQ(2UL, st.entries);
+	ASSERT_EQ(1UL, st.evicted);
+
+	/* 6: flushing and disabling the cache */
+	pam_nss_cache_flush();
+	ASSERT_EQ(PAM_SUCCESS, pam_nss_cache_stats(&st));
+	ASSERT_EQ(0UL, st.entries);
+	ASSERT_EQ(PAM_SUCCESS, pam_nss_cache_enable(0, 0, 0));
+	ASSERT_NE(NULL, pam_modutil_getpwuid(pamh2, 0));
+	ASSERT_EQ(PAM_SUCCESS, pam_nss_cache_stats(&st));
+	ASSERT_EQ(0UL, st.entries);
+	ASSERT_EQ(PAM_SYSTEM_ERR, pam_nss_cache_stats(NULL));
+
+	ASSERT_EQ(PAM_SUCCESS, pam_end(pamh2, 0));
+	ASSERT_EQ(PAM_SUCCESS, pam_end(pamh, 0));
+
+	return 0;
+}
@@ -0,0 +1,118 @@
+/*
+ * Check that consecutive "parallel" session modules are called at once,
+ * that their results are taken in stack order, that the conversation
+ * function is not entered by two of them at a time, and that
+ * pam_get_authtok() sees the arguments of the module calling it.
+ */
+
+#include "test_assert.h"
+#include "tst-confdir.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <security/pam_appl.h>
+
+#define TEST_NAME "tst-pam_parallel"
+#define MODULE ".libs/tst-pam_async_module.so"
+#define DELAY 200            /* milliseconds the first module waits */
+
+static const char confdir[] = TEST_NAME ".d";
+
+static int inside, messages;
+
+static int
+conv_func(int num_msg, const struct pam_message **msg,
+	  struct pam_response **resp, void *appdata_ptr)
+{
+	struct timespec pause = { 0, 1000000 };
+
+	(void) msg;
+	(void) appdata_ptr;
+	ASSERT_EQ(1, __atomic_add_fetch(&inside, 1, __ATOMIC_SEQ_CST));
+	nanosleep(&pause, NULL);
+	__atomic_add_fetch(&messages, num_msg, __ATOMIC_SEQ_CST);
+	__atomic_sub_fetch(&inside, 1, __ATOMIC_SEQ_CST);
+
+	*resp = calloc(num_msg, sizeof(**resp));
+	return *resp != NULL ? PAM_SUCCESS : PAM_BUF_ERR;
+}
+
+static struct pam_conv conv = { conv_func, NULL };
+
+int
+main(void)
+{
+	pam_handle_t *pamh = NULL;
+	static const char *names[] = { "first", "A", "B", "C", "last" };
+	char *path, lines[2048];
+	int i;
+
+	if (access(MODULE, F_OK) != 0)
+		return 77;
+	ASSERT_NE(NULL, path = realpath(MODULE, NULL));
+
+	ASSERT_EQ(0, tst_confdir_create(confdir));
+
+	snprintf(lines, sizeof(lines),
+		 "session required %s name=first\n"
+		 "session parallel %s meet=3 name=A\n"
+		 "session parallel %s meet=3 name=B ret=%d\n"
+		 "session parallel %s meet=3 name=C\n"
+		 "session required %s name=last\n",
+		 path, path, path, PAM_SESSION_ERR, path, path);
+	ASSERT_EQ(0, tst_confdir_write(confdir, "together", "%s", lines));
+
+	/* the first module succeeds last, but its result counts */
+	snprintf(lines, sizeof(lines),
+		 "session parallel %s delay=%d ret=%d\n"
+		 "session parallel %s\n",
+		 path, DELAY, PAM_NEW_AUTHTOK_REQD, path);
+	ASSERT_EQ(0, tst_confdir_write(confdir, "order", "%s", lines));
+
+	/* with use_first_pass and no password, nothing is asked */
+	snprintf(lines, sizeof(lines),
+		 "session parallel %s meet=2 authtok use_first_pass\n"
+		 "session parallel %s meet=2 authtok use_first_pass\n",
+		 path, path);
+	ASSERT_EQ(0, tst_confdir_write(confdir, "args", "%s", lines));
+
+	/*
+	 * 1: the parallel modules are called at once: each of them waits
+	 * for the other two, and only sets its variable once they met
+	 */
+	ASSERT_EQ(PAM_SUCCESS,
+		  pam_start_confdir("together", "user", &conv, confdir, &pamh));
+	ASSERT_EQ(PAM_SUCCESS, pam_open_session(pamh, 0));
+	ASSERT_EQ(5, messages);
+	for (i = 0; i < 5; i++)
+		ASSERT_NE(NULL, pam_getenv(pamh, names[i]));
+
+	for (i = 0; i < 5; i++)
+		ASSERT_EQ(PAM_SUCCESS, pam_putenv(pamh, names[i]));
+	ASSERT_EQ(PAM_SUCCESS, pam_close_session(pamh, 0));
+	ASSERT_EQ(10, messages);
+	for (i = 0; i < 5; i++)
+		ASSERT_NE(NULL, pam_getenv(pamh, names[i]));
+	ASSERT_EQ(PAM_SUCCESS, pam_end(pamh, PAM_SUCCESS));
+
+	/* 2: the results are taken in the order of the lines */
+	ASSERT_EQ(PAM_SUCCESS,
+		  pam_start_confdir("order", "user", &conv, confdir, &pamh));
+	ASSERT_EQ(PAM_NEW_AUTHTOK_REQD, pam_open_session(pamh, 0));
+	ASSERT_EQ(PAM_SUCCESS, pam_end(pamh, PAM_SUCCESS));
+
+	/* 3: each module has its own arguments, only the two infos come */
+	messages = 0;
+	ASSERT_EQ(PAM_SUCCESS,
+		  pam_start_confdir("args", "user", &conv, confdir, &pamh));
+	ASSERT_EQ(PAM_SUCCESS, pam_open_session(pamh, 0));
+	ASSERT_EQ(2, messages);
+	ASSERT_EQ(PAM_SUCCESS, pam_end(pamh, PAM_SUCCESS));
+
+	free(path);
+
+	return 0;
+}
@@ -0,0 +1,102 @@
+/*
+ * Check that pam_reset() leaves a handle as pam_start() returns it,
+ * except for the service and the loaded handlers.
+ */
+
+#include "test_assert.h"
+#include "tst-confdir.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <security/pam_appl.h>
+#include <security/pam_ext.h>
+#include <security/pam_modules.h>
+#include <pam_private.h>
+
+#define TEST_NAME "tst-pam_reset"
+
+static const char confdir[] = TEST_NAME ".d";
+static const char service[] = "service";
+static struct pam_conv conv;
+
+static int cleanup_status = -1;
+static char cleanup_data[] = "data";
+
+static void
+tst_cleanup(pam_handle_t *pamh UNUSED, void *data UNUSED, int error_status)
+{
+	cleanup_status = error_status;
+}
+
+int
+main(void)
+{
+	pam_handle_t *pamh = NULL;
+	const void *item;
+	struct handler *h;
+	struct handler_state *st;
+	char **env;
+
+	ASSERT_EQ(0, tst_confdir_create(confdir));
+	ASSERT_EQ(0, tst_confdir_write(confdir, service,
+				       "auth required /nonexistent/pam_none.so\n"));
+
+	ASSERT_EQ(PAM_SUCCESS,
+		  pam_start_confdir(service, "alice", &conv, confdir, &pamh));
+	ASSERT_EQ(PAM_MODULE_UNKNOWN, pam_authenticate(pamh, 0));
+	ASSERT_EQ(PAM_SUCCESS, pam_set_item(pamh, PAM_TTY, "tty1"));
+	ASSERT_EQ(PAM_SUCCESS, pam_set_item(pamh, PAM_RHOST, "host"));
+	ASSERT_EQ(PAM_SUCCESS, pam_putenv(pamh, "A=1"));
+	ASSERT_EQ(PAM_SUCCESS, pam_putenv(pamh, "B=2"));
+	__PAM_TO_MODULE(pamh);
+	ASSERT_EQ(PAM_SUCCESS,
+		  pam_set_data(pamh, "data", cleanup_data, tst_cleanup));
+	ASSERT_EQ(PAM_SUCCESS, pam_set_item(pamh, PAM_AUTHTOK, "secret"));
+	ASSERT_EQ(PAM_SYSTEM_ERR, pam_reset(pamh, "bob", 0));
+	__PAM_TO_APP(pamh);
+
+	h = pamh->handlers.conf.authenticate.handlers;
+	st = pamh->handlers.conf.authenticate.state;
+	ASSERT_NE(NULL, h);
+	ASSERT_NE(NULL, st);
+	ASSERT_NE(_PAM_INVALID_RETVAL, st->cached_retval);
+
+	/* 1: the transaction is gone */
+	ASSERT_EQ(PAM_SUCCESS, pam_reset(pamh, "bob", PAM_SUCCESS));
+	ASSERT_EQ(PAM_SUCCESS, cleanup_status);
+	ASSERT_EQ(PAM_SUCCESS, pam_get_item(pamh, PAM_USER, &item));
+	ASSERT_EQ(0, strcmp(item, "bob"));
+	ASSERT_EQ(PAM_SUCCESS, pam_get_item(pamh, PAM_TTY, &item));
+	ASSERT_EQ(NULL, item);
+	ASSERT_EQ(PAM_SUCCESS, pam_get_item(pamh, PAM_RHOST, &item));
+	ASSERT_EQ(NULL, item);
+	ASSERT_EQ(NULL, pamh->authtok);
+	ASSERT_EQ(NULL, pam_getenv(pamh, "A"));
+	ASSERT_NE(NULL, env = pam_getenvlist(pamh));
+	ASSERT_EQ(NULL, env[0]);
+	free(env);
+	__PAM_TO_MODULE(pamh);
+	ASSERT_EQ(PAM_NO_MODULE_DATA, pam_get_data(pamh, "data", &item));
+	__PAM_TO_APP(pamh);
+
+	/* 2: the handlers are kept, without their results */
+	ASSERT_EQ(h, pamh->handlers.conf.authenticate.handlers);
+	ASSERT_EQ(_PAM_INVALID_RETVAL, st->cached_retval);
+	ASSERT_EQ(PAM_SUCCESS, pam_get_item(pamh, PAM_SERVICE, &item));
+	ASSERT_EQ(0, strcmp(item, service));
+	ASSERT_EQ(PAM_SUCCESS, pam_get_item(pamh, PAM_CONV, &item));
+	ASSERT_NE(NULL, item);
+
+	/* 3: the handle is good for the next transaction */
+	ASSERT_EQ(PAM_SUCCESS, pam_putenv(pamh, "C=3"));
+	ASSERT_EQ(0, strcmp(pam_getenv(pamh, "C"), "3"));
+	ASSERT_EQ(PAM_MODULE_UNKNOWN, pam_authenticate(pamh, 0));
+	ASSERT_EQ(PAM_SUCCESS, pam_reset(pamh, NULL, PAM_SUCCESS));
+	ASSERT_EQ(PAM_SUCCESS, pam_get_item(pamh, PAM_USER, &item));
+	ASSERT_EQ(NULL, item);
+	ASSERT_EQ(PAM_SUCCESS, pam_end(pamh, PAM_SUCCESS));
+
+	return 0;
+}
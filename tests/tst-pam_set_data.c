@@ -54,6 +54,10 @@ static int cleanup7b_was_called = 0;
 static int cleanup7b_retval = 0;
 static int cleanup8_was_called = 0;
 static int cleanup8_retval = 0;
+static int cleanup9_next = 0;
+static int cleanup9_retval = 0;
+
+#define TEST9_ENTRIES 5000
 
 static void
 tst_cleanup (pam_handle_t *pamh UNUSED, void *data, int error_status)
@@ -270,6 +274,18 @@ tst_cleanup_8 (pam_handle_t *pamh UNUSED, void *data, int error_status)
     }
 }
 
+static void
+tst_cleanup_9 (pam_handle_t *pamh UNUSED, void *data, int error_status UNUSED)
+{
+  /* newest entries are cleaned up first */
+  if (*(int *)data != --cleanup9_next)
+    {
+      fprintf (stderr, "tst_cleanup_9 called for %d, expected %d\n",
+	       *(int *)data, cleanup9_next);
+      cleanup9_retval = 1;
+    }
+}
+
 int
 main (void)
 {
@@ -278,7 +294,10 @@ main (void)
   struct pam_conv conv;
   pam_handle_t *pamh;
   void *dataptr;
-  int retval;
+  const void *constdataptr;
+  static int test9_data[TEST9_ENTRIES];
+  char name[64];
+  int retval, i;
 
   /* 1: Call with NULL as pam handle */
   dataptr = strdup ("test1");
@@ -484,5 +503,71 @@ main (void)
   if (cleanup8_retval != 0)
     return 1;
 
+  /* 9: many entries, check lookups and the order of the cleanup calls */
+  retval = pam_start (service, user, &conv, &pamh);
+  if (retval != PAM_SUCCESS)
+    {
+      fprintf (stderr, "pam_start (%s, %s, &conv, &pamh) returned %d\n",
+               service, user, retval);
+      return 1;
+    }
+
+  __PAM_TO_MODULE(pamh);
+  for (i = 0; i < TEST9_ENTRIES; i++)
+    {
+      test9_data[i] = i;
+      sprintf (name, "tst-pam_set_data-9-%d", i);
+      retval = pam_set_data (pamh, name, &test9_data[i], tst_cleanup_9);
+      if (retval != PAM_SUCCESS)
+	{
+	  fprintf (stderr, "test9: pam_set_data (%s) failed: %d\n",
+		   name, retval);
+	  return 1;
+	}
+    }
+  /* replacing an entry keeps its place */
+  cleanup9_next = 1;
+  sprintf (name, "tst-pam_set_data-9-%d", 0);
+  retval = pam_set_data (pamh, name, &test9_data[0], tst_cleanup_9);
+  if (retval != PAM_SUCCESS || cleanup9_next != 0)
+    {
+      fprintf (stderr, "test9: replacing %s failed: %d\n", name, retval);
+      return 1;
+    }
+  cleanup9_next = TEST9_ENTRIES;
+
+  for (i = TEST9_ENTRIES - 1; i >= 0; i--)
+    {
+      sprintf (name, "tst-pam_set_data-9-%d", i);
+      retval = pam_get_data (pamh, name, &constdataptr);
+      if (retval != PAM_SUCCESS || constdataptr != &test9_data[i])
+	{
+	  fprintf (stderr, "test9: pam_get_data (%s) failed: %d\n",
+		   name, retval);
+	  return 1;
+	}
+    }
+  retval = pam_get_data (pamh, "tst-pam_set_data-9-x", &constdataptr);
+  if (retval != PAM_NO_MODULE_DATA)
+    {
+      fprintf (stderr, "test9: pam_get_data for unknown entry returned %d\n",
+	       retval);
+      return 1;
+    }
+
+  __PAM_TO_APP(pamh);
+
+  retval = pam_end (pamh, 0);
+  if (retval != PAM_SUCCESS)
+    {
+      fprintf (stderr,
+	       "pam_end reported an error: %d\n",
+	       retval);
+      return 1;
+    }
+
+  if (cleanup9_next != 0 || cleanup9_retval != 0)
+    return 1;
+
   return 0;
 }
@@ -0,0 +1,93 @@
+/*
+ * Check the process-wide cache of parsed service stacks.
+ */
+
+#include "test_assert.h"
+#include "tst-confdir.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <security/pam_appl.h>
+#include <security/pam_ext.h>
+
+#define TEST_NAME "tst-pam_stack_cache"
+
+static const char confdir[] = TEST_NAME ".d";
+static const char service[] = "service";
+static const char service2[] = "service2";
+static struct pam_conv conv;
+
+static void
+write_file(const char *name, const char *content)
+{
+	ASSERT_EQ(0, tst_confdir_write(confdir, name, "#%%PAM-1.0\n%s",
+				       content));
+}
+
+static void
+remove_file(const char *name)
+{
+	char path[sizeof(confdir) + 32];
+
+	sprintf(path, "%s/%s", confdir, name);
+	ASSERT_EQ(0, unlink(path));
+}
+
+int
+main(void)
+{
+	pam_handle_t *pamh1 = NULL, *pamh2 = NULL, *pamh3 = NULL;
+
+	ASSERT_EQ(0, tst_confdir_create(confdir));
+	write_file(service, "auth include included\n"
+		   "account required /nonexistent/pam_none.so\n");
+	write_file("included", "auth required /nonexistent/pam_none.so\n");
+	write_file(service2, "auth requisite\n");
+
+	ASSERT_EQ(PAM_SUCCESS, pam_stack_cache_enable(1));
+
+	/* 1: the first handle parses, the second one uses the cache */
+	ASSERT_EQ(PAM_SUCCESS,
+		  pam_start_confdir(service, NULL, &conv, confdir, &pamh1));
+	ASSERT_EQ(PAM_MODULE_UNKNOWN, pam_authenticate(pamh1, 0));
+	ASSERT_EQ(PAM_SUCCESS,
+		  pam_start_confdir(service, NULL, &conv, confdir, &pamh2));
+	ASSERT_EQ(PAM_MODULE_UNKNOWN, pam_authenticate(pamh2, 0));
+	ASSERT_EQ(PAM_MODULE_UNKNOWN, pam_acct_mgmt(pamh2, 0));
+
+	/* 2: the shared stack outlives the handle that parsed it */
+	ASSERT_EQ(PAM_SUCCESS, pam_end(pamh1, 0));
+	ASSERT_EQ(PAM_MODULE_UNKNOWN, pam_authenticate(pamh2, 0));
+	ASSERT_EQ(PAM_MODULE_UNKNOWN, pam_setcred(pamh2, 0));
+
+	/* 3: a changed include file invalidates the stack */
+	write_file("included", "auth requisite\n");
+	ASSERT_EQ(PAM_SUCCESS,
+		  pam_start_confdir(service, NULL, &conv, confdir, &pamh3));
+	ASSERT_EQ(PAM_PERM_DENIED, pam_authenticate(pamh3, 0));
+	ASSERT_EQ(PAM_MODULE_UNKNOWN, pam_authenticate(pamh2, 0));
+	ASSERT_EQ(PAM_SUCCESS, pam_end(pamh2, 0));
+
+	/* 4: switching the service of a handle */
+	ASSERT_EQ(PAM_SUCCESS, pam_set_item(pamh3, PAM_SERVICE, service2));
+	ASSERT_EQ(PAM_PERM_DENIED, pam_authenticate(pamh3, 0));
+	ASSERT_EQ(PAM_PERM_DENIED, pam_acct_mgmt(pamh3, 0));
+	ASSERT_EQ(PAM_SUCCESS, pam_set_item(pamh3, PAM_SERVICE, service));
+	ASSERT_EQ(PAM_MODULE_UNKNOWN, pam_acct_mgmt(pamh3, 0));
+	ASSERT_EQ(PAM_SUCCESS, pam_end(pamh3, 0));
+
+	/* 5: a removed service file is noticed */
+	remove_file(service2);
+	ASSERT_NE(PAM_SUCCESS,
+		  pam_start_confdir(service2, NULL, &conv, confdir, &pamh1));
+
+	/* 6: the cache can be turned off again */
+	ASSERT_EQ(PAM_SUCCESS, pam_stack_cache_enable(0));
+	ASSERT_EQ(PAM_SUCCESS,
+		  pam_start_confdir(service, NULL, &conv, confdir, &pamh1));
+	ASSERT_EQ(PAM_PERM_DENIED, pam_authenticate(pamh1, 0));
+	ASSERT_EQ(PAM_SUCCESS, pam_end(pamh1, 0));
+
+	return 0;
+}
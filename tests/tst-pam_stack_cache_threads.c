@@ -0,0 +1,233 @@
+/*
+ * Run transactions in 1 to 64 threads on cached stacks, in both cache
+ * modes, while another thread keeps changing the configuration and
+ * reloading it.  Every handle has to see one version of the stack
+ * for the whole transaction.  The transactions per second are printed
+ * for every number of threads.
+ */
+
+#include "test_assert.h"
+#include "tst-confdir.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <security/pam_appl.h>
+#include <security/pam_ext.h>
+
+#define TEST_NAME "tst-pam_stack_cache_threads"
+#define PERMIT "../modules/pam_permit/.libs/pam_permit.so"
+#define DEBUG "../modules/pam_debug/.libs/pam_debug.so"
+#define TRANSACTIONS 3200         /* for every number of threads */
+#define MAX_THREADS 64
+
+static const char confdir[] = TEST_NAME ".d";
+static const char service[] = "service";
+static char service_file[sizeof(confdir) + sizeof(service)];
+static char tmp_file[sizeof(confdir) + sizeof(service) + 4];
+static char *permit, *debug;
+
+static int running;
+
+static int
+conv_func(int num_msg, const struct pam_message **msg,
+	  struct pam_response **resp, void *appdata_ptr)
+{
+	(void) msg;
+	(void) appdata_ptr;
+	*resp = calloc(num_msg, sizeof(**resp));
+	return *resp != NULL ? PAM_SUCCESS : PAM_BUF_ERR;
+}
+
+static struct pam_conv conv = { conv_func, NULL };
+
+/*
+ * Version 0 grants everything, version 1 denies everything.  setcred
+ * follows the results authenticate has frozen in the handle, so it
+ * fails if the state of handles gets mixed up.
+ */
+static void
+write_version(int version)
+{
+	FILE *fp;
+
+	ASSERT_NE(NULL, fp = fopen(tmp_file, "w"));
+	if (version == 0)
+		ASSERT_LT(0, fprintf(fp,
+			"auth sufficient %s auth=success cred=success\n"
+			"auth required %s auth=auth_err cred=cred_err\n"
+			"account required %s acct=success\n"
+			"session required %s\n",
+			debug, debug, debug, permit));
+	else
+		ASSERT_LT(0, fprintf(fp,
+			"auth required %s auth=auth_err\n"
+			"auth optional %s\n"
+			"account required %s acct=perm_denied\n"
+			"session required %s\n",
+			debug, permit, debug, permit));
+	ASSERT_EQ(0, fclose(fp));
+	/* a new inode, the old one may still have the same mtime */
+	ASSERT_EQ(0, rename(tmp_file, service_file));
+}
+
+/* the version the handle has seen, -1 if it was inconsistent */
+static int
+transaction(void)
+{
+	pam_handle_t *pamh;
+	int version;
+
+	if (pam_start_confdir(service, "user", &conv, confdir,
+			      &pamh) != PAM_SUCCESS)
+		return -1;
+
+	switch (pam_authenticate(pamh, 0)) {
+	case PAM_SUCCESS:
+		version = 0;
+		if (pam_acct_mgmt(pamh, 0) != PAM_SUCCESS
+		    || pam_setcred(pamh, PAM_ESTABLISH_CRED) != PAM_SUCCESS
+		    || pam_open_session(pamh, 0) != PAM_SUCCESS
+		    || pam_close_session(pamh, 0) != PAM_SUCCESS)
+			version = -1;
+		break;
+	case PAM_AUTH_ERR:
+		version = 1;
+		if (pam_acct_mgmt(pamh, 0) != PAM_PERM_DENIED)
+			version = -1;
+		break;
+	default:
+		version = -1;
+	}
+
+	if (pam_end(pamh, PAM_SUCCESS) != PAM_SUCCESS)
+		return -1;
+	return version;
+}
+
+struct worker {
+	pthread_t thread;
+	unsigned int n;
+	unsigned int seen[2];
+	int failed;
+};
+
+static void *
+run_worker(void *arg)
+{
+	struct worker *w = arg;
+	unsigned int i;
+	int version;
+
+	for (i = 0; i < w->n; i++) {
+		if ((version = transaction()) < 0) {
+			w->failed = 1;
+			break;
+		}
+		w->seen[version]++;
+	}
+	return NULL;
+}
+
+static void *
+run_reloader(void *arg)
+{
+	struct timespec pause = { 0, 200000 };
+	int version = 0;
+
+	(void) arg;
+	while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+		version = !version;
+		write_version(version);
+		ASSERT_EQ(PAM_SUCCESS, pam_stack_cache_reload());
+		nanosleep(&pause, NULL);
+	}
+	return NULL;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+run(unsigned int threads)
+{
+	struct worker w[MAX_THREADS];
+	pthread_t reloader;
+	unsigned int i, seen[2] = { 0, 0 };
+	double start, elapsed;
+
+	memset(w, 0, sizeof(w));
+	__atomic_store_n(&running, 1, __ATOMIC_RELAXED);
+	start = now();
+	ASSERT_EQ(0, pthread_create(&reloader, NULL, run_reloader, NULL));
+	for (i = 0; i < threads; i++) {
+		w[i].n = TRANSACTIONS / threads;
+		ASSERT_EQ(0, pthread_create(&w[i].thread, NULL, run_worker,
+					    &w[i]));
+	}
+	for (i = 0; i < threads; i++) {
+		ASSERT_EQ(0, pthread_join(w[i].thread, NULL));
+		ASSERT_EQ(0, w[i].failed);
+		seen[0] += w[i].seen[0];
+		seen[1] += w[i].seen[1];
+	}
+	elapsed = now() - start;
+	__atomic_store_n(&running, 0, __ATOMIC_RELAXED);
+	ASSERT_EQ(0, pthread_join(reloader, NULL));
+	ASSERT_EQ(TRANSACTIONS / threads * threads, seen[0] + seen[1]);
+
+	return (seen[0] + seen[1]) / elapsed;
+}
+
+int
+main(void)
+{
+	static const int modes[2] = { 1, PAM_STACK_CACHE_SHARED };
+	double rate[2];
+	unsigned int threads;
+	size_t m;
+
+	if (access(PERMIT, F_OK) != 0 || access(DEBUG, F_OK) != 0)
+		return 77;
+	ASSERT_NE(NULL, permit = realpath(PERMIT, NULL));
+	ASSERT_NE(NULL, debug = realpath(DEBUG, NULL));
+
+	sprintf(service_file, "%s/%s", confdir, service);
+	sprintf(tmp_file, "%s.tmp", service_file);
+	ASSERT_EQ(0, tst_confdir_create(confdir));
+
+	/* 1: shared stacks only change with pam_stack_cache_reload() */
+	ASSERT_EQ(PAM_SUCCESS, pam_stack_cache_enable(PAM_STACK_CACHE_SHARED));
+	write_version(0);
+	ASSERT_EQ(0, transaction());
+	write_version(1);
+	ASSERT_EQ(0, transaction());
+	ASSERT_EQ(PAM_SUCCESS, pam_stack_cache_reload());
+	ASSERT_EQ(1, transaction());
+	ASSERT_EQ(PAM_SUCCESS, pam_stack_cache_enable(0));
+
+	/* 2: transactions in threads see one version each */
+	printf("threads  copied/s  shared/s\n");
+	for (threads = 1; threads <= MAX_THREADS; threads *= 2) {
+		for (m = 0; m < 2; m++) {
+			ASSERT_EQ(PAM_SUCCESS, pam_stack_cache_enable(modes[m]));
+			rate[m] = run(threads);
+			ASSERT_EQ(PAM_SUCCESS, pam_stack_cache_enable(0));
+		}
+		printf("%7u  %8.0f  %8.0f\n", threads, rate[0], rate[1]);
+	}
+
+	free(permit);
+	free(debug);
+
+	return 0;
+}
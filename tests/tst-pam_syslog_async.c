@@ -0,0 +1,64 @@
+/*
+ * Log from several threads through the queue of pam_syslog_async(),
+ * with lines that are queued and lines too long for it.  What reaches
+ * syslog cannot be checked here; the test makes sure that the queue
+ * is drained and stopped, and is meant to be run under sanitizers too.
+ */
+
+#include "test_assert.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <security/pam_appl.h>
+#include <security/pam_ext.h>
+
+#define THREADS 4
+#define LINES   500
+
+static char long_line[4096];
+
+static void *
+logger(void *arg)
+{
+	long n = (long) arg;
+	int i;
+
+	for (i = 0; i < LINES; i++) {
+		if (i % 100 == 99)
+			pam_syslog(NULL, LOG_DEBUG, "tst-pam_syslog_async %s",
+				   long_line);
+		else
+			pam_syslog(NULL, LOG_DEBUG,
+				   "tst-pam_syslog_async thread %ld line %d",
+				   n, i);
+	}
+	return NULL;
+}
+
+int
+main(void)
+{
+	pthread_t thread[THREADS];
+	long i;
+
+	memset(long_line, 'x', sizeof(long_line) - 1);
+
+	ASSERT_EQ(PAM_SUCCESS, pam_syslog_async(1));
+	ASSERT_EQ(PAM_SUCCESS, pam_syslog_async(1));
+	for (i = 0; i < THREADS; i++)
+		ASSERT_EQ(0, pthread_create(&thread[i], NULL, logger,
+					    (void *) i));
+	for (i = 0; i < THREADS; i++)
+		ASSERT_EQ(0, pthread_join(thread[i], NULL));
+	ASSERT_EQ(PAM_SUCCESS, pam_syslog_async(0));
+	ASSERT_EQ(PAM_SUCCESS, pam_syslog_async(0));
+
+	/* synchronous again, then queued until the process exits */
+	logger((void *) i);
+	ASSERT_EQ(PAM_SUCCESS, pam_syslog_async(1));
+	logger((void *) i);
+
+	return 0;
+}